@@ -0,0 +1,11 @@
+#include <xapian.h>
+
+int main()
+{
+    Xapian::Compactor compactor;
+
+    compactor.set_renumber (false);
+    compactor.add_source ("source");
+    compactor.set_destdir ("destination");
+    compactor.compact ();
+}
@@ -0,0 +1,662 @@
+/* cold.cc - Moving rarely modified messages out of the database
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define ARRAY_SIZE(arr) (sizeof (arr) / sizeof (arr[0]))
+
+/* Old messages are almost never modified, but every message in the
+ * database makes each modification of it a little more expensive. So
+ * notmuch_database_freeze moves old messages, (by year), into "cold
+ * shards", which are separate Xapian databases at:
+ *
+ *	<path>/.notmuch/cold/<year>
+ *
+ * Each frozen message keeps its document ID within its shard, along
+ * with copies of the directory documents named by its file terms, so
+ * that the shards can be combined with the database, (with
+ * _notmuch_database_add_subdb), when it is opened read-only, and
+ * searched as though nothing had moved.
+ *
+ * Xapian cannot combine a database opened for writing with others, so
+ * the database keeps a "stub" in place of each frozen message, with
+ * the terms needed to find the message by its ID, thread, references
+ * or filenames, and a type of "frozen" rather than "mail", (so the
+ * stub never matches a search of the combined database). The name of
+ * the shard of the message is kept in the NOTMUCH_VALUE_COLD_SHARD
+ * value of the stub, so that a stub is told from a message without
+ * reading its terms, along with the date and message ID of the message
+ * for sorting.
+ *
+ * When the database is opened read-write, a query is executed against
+ * the shards as well, and each message matching there is mapped to its
+ * stub, (see _notmuch_query_add_frozen in query.cc). A message read
+ * from a stub is read from its shard, (see _notmuch_cold_read). Only
+ * writing the message, (when it is modified or deleted), moves it back
+ * into the database, (thaws it).
+ *
+ * Documents are written to the shards, (and the shards flushed),
+ * before they are replaced by stubs, so that no message is ever lost.
+ *
+ * A shard which notmuch_database_freeze has moved many messages into
+ * is compacted afterwards, (where Xapian supports it), into
+ * <path>/.notmuch/cold/.compact-<year>, which then replaces the shard.
+ * Otherwise the space of thawed messages is only reused by messages
+ * frozen later.
+ */
+
+/* The number of messages moved between flushes of the database by
+ * notmuch_database_freeze. */
+#define FREEZE_CHUNK_SIZE 1000
+
+/* A shard is compacted after a freeze which moved at least
+ * 1/COMPACT_FRACTION of its messages into it, (so that refreezing a
+ * few thawed messages does not rewrite a whole shard). */
+#define COMPACT_FRACTION 8
+
+/* The prefixes of the terms of a message kept in its stub. */
+static const char *stub_prefixes[] = {
+    "id",
+    "thread",
+    "reference",
+    "file-direntry"
+};
+
+static char *
+_cold_shard_path (void *ctx, const char *path, const char *name)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/cold/%s", path, name);
+}
+
+static int
+_compare_strings (const void *a, const void *b)
+{
+    return strcmp (*(const char **) a, *(const char **) b);
+}
+
+/* Return the (sorted) names of the cold shards of the database at
+ * 'path', with 'ctx' as the talloc context, and set *count to their
+ * number. */
+static const char **
+_cold_shard_names (void *ctx, const char *path, unsigned int *count)
+{
+    char *cold_path;
+    const char **names = NULL;
+    DIR *dir;
+    struct dirent *entry;
+
+    *count = 0;
+
+    cold_path = talloc_asprintf (ctx, "%s/.notmuch/cold", path);
+    dir = opendir (cold_path);
+    talloc_free (cold_path);
+    if (dir == NULL)
+	return NULL;
+
+    while ((entry = readdir (dir)) != NULL) {
+	if (entry->d_name[0] == '.')
+	    continue;
+
+	names = talloc_realloc (ctx, names, const char *, *count + 1);
+	if (unlikely (names == NULL))
+	    INTERNAL_ERROR ("Out of memory listing cold shards");
+	names[(*count)++] = talloc_strdup (names, entry->d_name);
+    }
+
+    closedir (dir);
+
+    if (*count)
+	qsort (names, *count, sizeof (const char *), _compare_strings);
+
+    return names;
+}
+
+/* Replace the view of the cold shards of the database opened
+ * read-write, (so that it includes any shard created, and every
+ * change flushed, since it was opened). */
+static void
+_cold_view_reopen (notmuch_database_t *notmuch)
+{
+    unsigned int i;
+
+    delete notmuch->cold_view;
+    notmuch->cold_view = NULL;
+
+    if (notmuch->num_cold_shards == 0)
+	return;
+
+    notmuch->cold_view = new Xapian::Database ();
+    for (i = 0; i < notmuch->num_cold_shards; i++) {
+	char *shard_path = _cold_shard_path (notmuch, notmuch->path,
+					     notmuch->cold_shard_names[i]);
+	notmuch->cold_view->add_database (Xapian::Database (shard_path));
+	talloc_free (shard_path);
+    }
+}
+
+void
+_notmuch_cold_open_shards (notmuch_database_t *notmuch, const char *path,
+			   unsigned int thread_space)
+{
+    const char **names;
+    unsigned int i, count;
+
+    names = _cold_shard_names (notmuch, path, &count);
+    if (count == 0)
+	return;
+
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY) {
+	for (i = 0; i < count; i++) {
+	    char *shard_path = _cold_shard_path (names, path, names[i]);
+	    _notmuch_database_add_subdb (notmuch, path, shard_path,
+					 thread_space);
+	}
+	talloc_free (names);
+	return;
+    }
+
+    notmuch->cold_shard_names = names;
+    notmuch->num_cold_shards = count;
+    notmuch->cold_shards = talloc_zero_array (notmuch,
+					      Xapian::WritableDatabase *,
+					      count);
+    if (unlikely (notmuch->cold_shards == NULL))
+	INTERNAL_ERROR ("Out of memory opening cold shards");
+
+    _cold_view_reopen (notmuch);
+}
+
+/* Return the shard named 'name' of the database opened read-write,
+ * opened for writing, and set *index to its index. The shard is
+ * created if it does not exist. */
+static Xapian::WritableDatabase *
+_cold_shard_writable (notmuch_database_t *notmuch, const char *name,
+		      unsigned int *index)
+{
+    Xapian::WritableDatabase *shard;
+    unsigned int i;
+    char *shard_path;
+
+    for (i = 0; i < notmuch->num_cold_shards; i++) {
+	if (strcmp (notmuch->cold_shard_names[i], name) == 0)
+	    break;
+    }
+
+    if (i == notmuch->num_cold_shards) {
+	char *cold_path = talloc_asprintf (notmuch, "%s/.notmuch/cold",
+					   notmuch->path);
+	mkdir (cold_path, 0755);
+	talloc_free (cold_path);
+
+	notmuch->cold_shard_names = talloc_realloc (notmuch,
+						    notmuch->cold_shard_names,
+						    const char *, i + 1);
+	notmuch->cold_shards = talloc_realloc (notmuch, notmuch->cold_shards,
+					       Xapian::WritableDatabase *,
+					       i + 1);
+	if (unlikely (notmuch->cold_shard_names == NULL ||
+		      notmuch->cold_shards == NULL))
+	    INTERNAL_ERROR ("Out of memory creating cold shard");
+
+	notmuch->cold_shard_names[i] = talloc_strdup (notmuch, name);
+	notmuch->cold_shards[i] = NULL;
+	notmuch->num_cold_shards++;
+    }
+
+    *index = i;
+    if (notmuch->cold_shards[i])
+	return notmuch->cold_shards[i];
+
+    shard_path = _cold_shard_path (notmuch, notmuch->path, name);
+    shard = new Xapian::WritableDatabase (shard_path,
+					  Xapian::DB_CREATE_OR_OPEN);
+    talloc_free (shard_path);
+
+    if (shard->get_metadata ("version").empty ())
+	shard->set_metadata ("version",
+			     notmuch->xapian_db->get_metadata ("version"));
+
+    notmuch->cold_shards[i] = shard;
+
+    return shard;
+}
+
+void
+_notmuch_cold_close_shards (notmuch_database_t *notmuch,
+			    notmuch_bool_t remove_thawed)
+{
+    unsigned int i;
+
+    try {
+	for (i = 0; remove_thawed && i < notmuch->num_cold_thawed; i++) {
+	    notmuch_cold_thawed_t *thawed = &notmuch->cold_thawed[i];
+	    notmuch_bool_t refrozen;
+
+	    /* A thawed message may have been frozen again since, in
+	     * which case its stub is back in the database, (or removed
+	     * from the database altogether). */
+	    try {
+		refrozen = _notmuch_cold_is_stub (
+		    notmuch->xapian_db->get_document (thawed->doc_id));
+	    } catch (const Xapian::DocNotFoundError &error) {
+		refrozen = FALSE;
+	    }
+
+	    if (! refrozen)
+		notmuch->cold_shards[thawed->shard]->delete_document (
+		    thawed->doc_id);
+	}
+    } catch (const Xapian::Error &error) {
+	if (! notmuch->exception_reported) {
+	    fprintf (stderr, "Error: A Xapian exception occurred removing thawed messages: %s\n",
+		     error.get_msg().c_str());
+	}
+    }
+
+    talloc_free (notmuch->cold_thawed);
+    notmuch->cold_thawed = NULL;
+    notmuch->num_cold_thawed = 0;
+
+    for (i = 0; i < notmuch->num_cold_shards; i++) {
+	Xapian::WritableDatabase *shard = notmuch->cold_shards[i];
+
+	if (shard == NULL)
+	    continue;
+
+	try {
+	    shard->flush ();
+	    shard->close ();
+	} catch (const Xapian::Error &error) {
+	    if (! notmuch->exception_reported) {
+		fprintf (stderr, "Error: A Xapian exception occurred flushing cold shard %s: %s\n",
+			 notmuch->cold_shard_names[i],
+			 error.get_msg().c_str());
+	    }
+	}
+
+	delete shard;
+	notmuch->cold_shards[i] = NULL;
+    }
+}
+
+notmuch_bool_t
+_notmuch_cold_is_stub (const Xapian::Document &doc)
+{
+    return ! doc.get_value (NOTMUCH_VALUE_COLD_SHARD).empty ();
+}
+
+/* Return the stub to be kept in the database in place of 'doc', which
+ * is moved to the shard named 'name'. */
+static Xapian::Document
+_cold_stub_create (const Xapian::Document &doc, const char *name)
+{
+    Xapian::Document stub;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE (stub_prefixes); i++) {
+	const char *prefix = _find_prefix (stub_prefixes[i]);
+	Xapian::TermIterator t = doc.termlist_begin ();
+
+	for (t.skip_to (prefix); t != doc.termlist_end (); t++) {
+	    if ((*t).compare (0, strlen (prefix), prefix) != 0)
+		break;
+	    stub.add_term (*t);
+	}
+    }
+
+    stub.add_term (std::string (_find_prefix ("type")) + "frozen");
+    stub.add_value (NOTMUCH_VALUE_COLD_SHARD, name);
+    stub.add_value (NOTMUCH_VALUE_TIMESTAMP,
+		    doc.get_value (NOTMUCH_VALUE_TIMESTAMP));
+    stub.add_value (NOTMUCH_VALUE_MESSAGE_ID,
+		    doc.get_value (NOTMUCH_VALUE_MESSAGE_ID));
+
+    return stub;
+}
+
+/* Copy to 'shard' each directory document named by a file term of
+ * 'doc', (at the same document ID), which it does not yet hold. */
+static void
+_cold_copy_directories (notmuch_database_t *notmuch,
+			Xapian::WritableDatabase *shard,
+			const Xapian::Document &doc)
+{
+    const char *prefix = _find_prefix ("file-direntry");
+    Xapian::TermIterator t = doc.termlist_begin ();
+    unsigned int directory_id;
+    char *colon;
+
+    for (t.skip_to (prefix); t != doc.termlist_end (); t++) {
+	if ((*t).compare (0, strlen (prefix), prefix) != 0)
+	    break;
+
+	directory_id = strtoul ((*t).c_str () + strlen (prefix), &colon, 10);
+	if (*colon != ':')
+	    INTERNAL_ERROR ("malformed direntry");
+
+	try {
+	    shard->get_document (directory_id);
+	} catch (const Xapian::DocNotFoundError &error) {
+	    shard->replace_document (directory_id,
+				     notmuch->xapian_db->get_document (directory_id));
+	}
+    }
+}
+
+#if HAVE_XAPIAN_COMPACT
+/* Remove the directory at 'path' and the files within it, (a Xapian
+ * database has no subdirectories), if it exists. */
+static void
+_cold_remove_directory (void *ctx, const char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+
+    dir = opendir (path);
+    if (dir == NULL)
+	return;
+
+    while ((entry = readdir (dir)) != NULL) {
+	char *file_path;
+
+	if (strcmp (entry->d_name, ".") == 0 ||
+	    strcmp (entry->d_name, "..") == 0)
+	    continue;
+
+	file_path = talloc_asprintf (ctx, "%s/%s", path, entry->d_name);
+	unlink (file_path);
+	talloc_free (file_path);
+    }
+
+    closedir (dir);
+    rmdir (path);
+}
+
+/* Replace the shard with the given index by a compacted copy of it,
+ * (keeping its document IDs). The shard is closed first, so it must
+ * have no thawed messages left to remove. */
+static notmuch_status_t
+_cold_shard_compact (notmuch_database_t *notmuch, void *ctx,
+		     unsigned int index)
+{
+    const char *name = notmuch->cold_shard_names[index];
+    char *shard_path, *compact_path, *old_path;
+    Xapian::Compactor compactor;
+
+    if (notmuch->cold_shards[index]) {
+	notmuch->cold_shards[index]->flush ();
+	notmuch->cold_shards[index]->close ();
+	delete notmuch->cold_shards[index];
+	notmuch->cold_shards[index] = NULL;
+    }
+
+    /* The names of the copies start with a '.', so that they are
+     * never taken for shards. */
+    shard_path = _cold_shard_path (ctx, notmuch->path, name);
+    compact_path = talloc_asprintf (ctx, "%s/.notmuch/cold/.compact-%s",
+				    notmuch->path, name);
+    old_path = talloc_asprintf (ctx, "%s/.notmuch/cold/.old-%s",
+				notmuch->path, name);
+
+    /* Left behind by an interrupted compaction. */
+    _cold_remove_directory (ctx, compact_path);
+    _cold_remove_directory (ctx, old_path);
+
+    compactor.set_renumber (false);
+    compactor.add_source (shard_path);
+    compactor.set_destdir (compact_path);
+    compactor.compact ();
+
+    if (rename (shard_path, old_path)) {
+	fprintf (stderr, "Error: Cannot replace cold shard %s: %s\n",
+		 name, strerror (errno));
+	_cold_remove_directory (ctx, compact_path);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    if (rename (compact_path, shard_path)) {
+	fprintf (stderr, "Error: Cannot replace cold shard %s: %s\n",
+		 name, strerror (errno));
+	rename (old_path, shard_path);
+	_cold_remove_directory (ctx, compact_path);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    _cold_remove_directory (ctx, old_path);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+#endif
+
+/* Update everything kept about the message with document ID 'doc_id'
+ * besides its document, (which has just been moved between the
+ * database and a cold shard), as for _notmuch_message_sync. */
+static void
+_cold_message_moved (notmuch_database_t *notmuch, void *ctx,
+		     unsigned int doc_id)
+{
+    notmuch_message_t *message;
+
+    _notmuch_columns_touch (notmuch, doc_id);
+    _notmuch_tag_bitmaps_touch (notmuch, doc_id);
+
+    message = _notmuch_message_create (ctx, notmuch, doc_id, NULL);
+    if (message) {
+	_notmuch_thread_summary_add_message (notmuch, message, FALSE);
+	notmuch_message_destroy (message);
+    }
+}
+
+notmuch_status_t
+notmuch_database_freeze (notmuch_database_t *notmuch,
+			 time_t before,
+			 void (*progress_notify) (void *closure,
+						  double progress),
+			 void *closure)
+{
+    Xapian::WritableDatabase *db;
+    Xapian::docid *doc_ids = NULL;
+    std::vector<unsigned int> moved;
+    unsigned int i, j, count;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    void *local;
+
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY) {
+	fprintf (stderr, "Cannot write to a read-only database.\n");
+	return NOTMUCH_STATUS_READ_ONLY_DATABASE;
+    }
+
+    if (notmuch->atomic_nesting > 0)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    local = talloc_new (notmuch);
+
+    try {
+	Xapian::Enquire enquire (*db);
+	Xapian::MSet mset;
+	Xapian::MSetIterator iter;
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_query (Xapian::Query (
+	    Xapian::Query::OP_FILTER,
+	    Xapian::Query (std::string (_find_prefix ("type")) + "mail"),
+	    Xapian::Query (Xapian::Query::OP_VALUE_LE, NOTMUCH_VALUE_TIMESTAMP,
+			   Xapian::sortable_serialise (before - 1))));
+
+	mset = enquire.get_mset (0, db->get_doccount ());
+
+	/* The matches are collected first, since the stubs replacing
+	 * them would change the results of the query. */
+	count = mset.size ();
+	doc_ids = talloc_array (local, Xapian::docid, count + 1);
+	for (i = 0, iter = mset.begin (); iter != mset.end (); i++, iter++)
+	    doc_ids[i] = *iter;
+
+	for (i = 0; i < count; i += FREEZE_CHUNK_SIZE) {
+	    unsigned int chunk_end = i + FREEZE_CHUNK_SIZE;
+	    std::vector<Xapian::Document> stubs;
+	    std::string last_mod;
+
+	    if (chunk_end > count)
+		chunk_end = count;
+
+	    last_mod = Xapian::sortable_serialise (
+		_notmuch_database_new_revision (notmuch));
+
+	    for (j = i; j < chunk_end; j++) {
+		Xapian::Document doc = db->get_document (doc_ids[j]);
+		Xapian::WritableDatabase *shard;
+		unsigned int index;
+		time_t timestamp;
+		struct tm tm;
+		char name[16];
+
+		timestamp = Xapian::sortable_unserialise (
+		    doc.get_value (NOTMUCH_VALUE_TIMESTAMP));
+		if (gmtime_r (&timestamp, &tm) == NULL)
+		    tm.tm_year = 70;
+		snprintf (name, sizeof (name), "%04d", tm.tm_year + 1900);
+
+		shard = _cold_shard_writable (notmuch, name, &index);
+		_cold_copy_directories (notmuch, shard, doc);
+		doc.add_value (NOTMUCH_VALUE_LAST_MOD, last_mod);
+		shard->replace_document (doc_ids[j], doc);
+
+		if (index >= moved.size ())
+		    moved.resize (index + 1, 0);
+		moved[index]++;
+
+		stubs.push_back (_cold_stub_create (doc, name));
+	    }
+
+	    for (j = 0; j < notmuch->num_cold_shards; j++) {
+		if (notmuch->cold_shards[j])
+		    notmuch->cold_shards[j]->flush ();
+	    }
+	    _cold_view_reopen (notmuch);
+
+	    for (j = i; j < chunk_end; j++) {
+		db->replace_document (doc_ids[j], stubs[j - i]);
+		_cold_message_moved (notmuch, local, doc_ids[j]);
+	    }
+	    db->flush ();
+
+	    if (progress_notify)
+		progress_notify (closure, (double) chunk_end / count);
+	}
+
+#if HAVE_XAPIAN_COMPACT
+	for (i = 0; i < moved.size () && status == NOTMUCH_STATUS_SUCCESS;
+	     i++) {
+	    notmuch_bool_t thawed = FALSE;
+
+	    if (moved[i] == 0 ||
+		moved[i] < notmuch->cold_shards[i]->get_doccount () /
+			   COMPACT_FRACTION)
+		continue;
+
+	    /* The messages thawed from a shard are only removed from
+	     * it when the database is closed. */
+	    for (j = 0; j < notmuch->num_cold_thawed; j++) {
+		if (notmuch->cold_thawed[j].shard == i)
+		    thawed = TRUE;
+	    }
+	    if (thawed)
+		continue;
+
+	    status = _cold_shard_compact (notmuch, local, i);
+	}
+
+	_cold_view_reopen (notmuch);
+#endif
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred freezing messages: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (local);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (local);
+
+    return status;
+}
+
+int
+_notmuch_cold_read (notmuch_database_t *notmuch, unsigned int doc_id,
+		    Xapian::Document &doc)
+{
+    std::string name;
+    unsigned int i;
+
+    if (notmuch->cold_view == NULL)
+	return -1;
+
+    name = doc.get_value (NOTMUCH_VALUE_COLD_SHARD);
+    if (name.empty ())
+	return -1;
+    for (i = 0; i < notmuch->num_cold_shards; i++) {
+	if (name == notmuch->cold_shard_names[i])
+	    break;
+    }
+
+    if (i == notmuch->num_cold_shards)
+	return -1;
+
+    /* Document IDs of the view are interleaved as for the combined
+     * database, (see notmuch_database_open_multi). */
+    try {
+	doc = notmuch->cold_view->get_document (
+	    (doc_id - 1) * notmuch->num_cold_shards + i + 1);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred reading a frozen message: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return -1;
+    }
+
+    return i;
+}
+
+void
+_notmuch_cold_thaw (notmuch_database_t *notmuch, unsigned int doc_id,
+		    unsigned int shard)
+{
+    notmuch_cold_thawed_t *thawed;
+    unsigned int index;
+
+    /* Opening the shard for writing holds its lock until the thawed
+     * message is removed from it, (see _notmuch_cold_close_shards). */
+    _cold_shard_writable (notmuch, notmuch->cold_shard_names[shard], &index);
+
+    notmuch->cold_thawed = talloc_realloc (notmuch, notmuch->cold_thawed,
+					   notmuch_cold_thawed_t,
+					   notmuch->num_cold_thawed + 1);
+    if (unlikely (notmuch->cold_thawed == NULL))
+	INTERNAL_ERROR ("Out of memory thawing message");
+
+    thawed = &notmuch->cold_thawed[notmuch->num_cold_thawed++];
+    thawed->shard = index;
+    thawed->doc_id = doc_id;
+}
@@ -0,0 +1,432 @@
+/* columns.cc - A columnar side index of fixed per-message fields
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+/* Reading a field of a message from Xapian means fetching its
+ * document, so anything that needs a field of every match of a large
+ * query, (such as the thread of each match, to count threads), costs
+ * a document fetch per match.
+ *
+ * The columnar side index instead holds a few fixed-size fields of
+ * every message, each as an array indexed by document ID, in the file
+ * NOTMUCH_COLUMNS_FILENAME within the .notmuch directory, which
+ * readers map into memory:
+ *
+ *	header		A columns_header_t.
+ *	thread IDs	For each thread ordinal, (from 1), the thread ID,
+ *			as a uint64_t.
+ *	timestamps	The TIMESTAMP value of each message, as an
+ *			int64_t.
+ *	threads		The thread ordinal of each message, as a
+ *			uint32_t, (or 0 if there is no message with
+ *			that document ID).
+ *
+ * Only the fields read by the library are kept: the threads, (for
+ * counting threads), and the timestamps, (for sorting the matches
+ * found from the tag bitmaps, see tag-bitmaps.cc, which answer tag
+ * predicates themselves).
+ *
+ * Each column has one entry per document ID, from 0 up to the largest
+ * document ID of a message, in native byte order, (the file is only a
+ * cache, and is never copied between machines).
+ *
+ * The file is a side index, (see side-index.cc), so it is only used
+ * while it reflects the current revision of the database, and is
+ * brought up to date when the database is closed. It is only
+ * maintained once it has been enabled with
+ * notmuch_database_set_columns. Any failure to read or write it is
+ * silently ignored, and the fields are read from Xapian as usual.
+ */
+#define NOTMUCH_COLUMNS_FILENAME "columns"
+
+#define NOTMUCH_COLUMNS_MAGIC "NMCOLS2"
+
+typedef struct {
+    notmuch_side_index_header_t index;
+    uint32_t num_rows;
+    uint32_t num_threads;
+} columns_header_t;
+
+/* The columns of a file, (see _columns_parse). */
+typedef struct {
+    const columns_header_t *header;
+    const uint64_t *thread_ids;
+    const int64_t *timestamps;
+    const uint32_t *threads;
+} columns_view_t;
+
+struct visible _notmuch_columns {
+    notmuch_side_index_t *index;
+
+    /* The columns of the mapped file of index, (if header is not
+     * NULL). */
+    columns_view_t view;
+};
+
+/* The columns while they are being brought up to date by a writer. */
+typedef struct {
+    notmuch_database_t *notmuch;
+    std::vector<uint64_t> thread_ids;
+    std::map<uint64_t, uint32_t> thread_ordinals;
+    std::vector<int64_t> timestamps;
+    std::vector<uint32_t> threads;
+} columns_table_t;
+
+/* Fill 'view' with the columns of the 'size' bytes of the file at
+ * 'data', (beginning with the magic string of the columns). Returns
+ * FALSE if the file is malformed. */
+static notmuch_bool_t
+_columns_parse (const void *data, size_t size, columns_view_t *view)
+{
+    const columns_header_t *header = (const columns_header_t *) data;
+    const char *pos;
+    size_t rows;
+
+    if (size < sizeof (columns_header_t))
+	return FALSE;
+
+    rows = header->num_rows;
+    if (size != sizeof (columns_header_t) +
+	header->num_threads * sizeof (uint64_t) +
+	rows * (sizeof (int64_t) + sizeof (uint32_t)))
+	return FALSE;
+
+    pos = (const char *) data + sizeof (columns_header_t);
+    view->thread_ids = (const uint64_t *) pos;
+    pos += header->num_threads * sizeof (uint64_t);
+    view->timestamps = (const int64_t *) pos;
+    pos += rows * sizeof (int64_t);
+    view->threads = (const uint32_t *) pos;
+
+    view->header = header;
+
+    return TRUE;
+}
+
+void
+_notmuch_columns_open (notmuch_database_t *notmuch)
+{
+    notmuch_columns_t *columns;
+
+    columns = talloc_zero (notmuch, notmuch_columns_t);
+    if (unlikely (columns == NULL))
+	return;
+
+    columns->index = _notmuch_side_index_create (columns, notmuch,
+						 NOTMUCH_COLUMNS_FILENAME);
+    if (unlikely (columns->index == NULL)) {
+	talloc_free (columns);
+	return;
+    }
+
+    notmuch->columns = columns;
+}
+
+notmuch_status_t
+notmuch_database_set_columns (notmuch_database_t *notmuch,
+			      notmuch_bool_t enable)
+{
+    return _notmuch_side_index_set_enabled (
+	notmuch, notmuch->columns ? notmuch->columns->index : NULL, enable);
+}
+
+void
+_notmuch_columns_touch (notmuch_database_t *notmuch, unsigned int doc_id)
+{
+    if (notmuch->columns)
+	_notmuch_side_index_touch (notmuch->columns->index, doc_id);
+}
+
+/* Return the ordinal of the thread with ID 'thread_id' in 'table',
+ * (assigning it one if necessary). */
+static uint32_t
+_table_thread_ordinal (columns_table_t &table, uint64_t thread_id)
+{
+    std::map<uint64_t, uint32_t>::iterator i;
+
+    i = table.thread_ordinals.find (thread_id);
+    if (i != table.thread_ordinals.end ())
+	return i->second;
+
+    table.thread_ids.push_back (thread_id);
+    table.thread_ordinals[thread_id] = table.thread_ids.size ();
+
+    return table.thread_ids.size ();
+}
+
+/* Set the row of 'table' for 'doc_id' from the document of the
+ * database, (clearing it if there is no such message). Returns FALSE
+ * if the message cannot be represented.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static notmuch_bool_t
+_table_set_row (void *closure, unsigned int doc_id)
+{
+    columns_table_t &table = *(columns_table_t *) closure;
+    notmuch_database_t *notmuch = table.notmuch;
+    notmuch_private_status_t status;
+    notmuch_message_t *message;
+    const char *thread_id;
+    char *end;
+
+    if (doc_id >= table.threads.size ()) {
+	table.timestamps.resize (doc_id + 1, 0);
+	table.threads.resize (doc_id + 1, 0);
+    }
+
+    message = _notmuch_message_create (notmuch, notmuch, doc_id, &status);
+    if (message == NULL) {
+	table.timestamps[doc_id] = 0;
+	table.threads[doc_id] = 0;
+	return TRUE;
+    }
+
+    thread_id = notmuch_message_get_thread_id (message);
+    table.threads[doc_id] = _table_thread_ordinal (
+	table, strtoull (thread_id, &end, 16));
+    if (*thread_id == '\0' || *end != '\0') {
+	notmuch_message_destroy (message);
+	return FALSE;
+    }
+
+    table.timestamps[doc_id] = notmuch_message_get_date (message);
+
+    notmuch_message_destroy (message);
+
+    return TRUE;
+}
+
+/* Fill 'table' from the 'size' bytes of the file at 'data'. */
+static notmuch_bool_t
+_table_load (void *closure, const void *data, size_t size)
+{
+    columns_table_t &table = *(columns_table_t *) closure;
+    columns_view_t view;
+    uint32_t i, rows;
+
+    if (! _columns_parse (data, size, &view))
+	return FALSE;
+
+    for (i = 0; i < view.header->num_threads; i++)
+	_table_thread_ordinal (table, view.thread_ids[i]);
+
+    rows = view.header->num_rows;
+    table.timestamps.assign (view.timestamps, view.timestamps + rows);
+    table.threads.assign (view.threads, view.threads + rows);
+
+    return TRUE;
+}
+
+/* Fill 'table' from every message of the database.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static notmuch_bool_t
+_table_build (void *closure)
+{
+    columns_table_t &table = *(columns_table_t *) closure;
+    notmuch_database_t *notmuch = table.notmuch;
+    Xapian::PostingIterator p, p_end;
+    std::string term = std::string (_find_prefix ("type")) + "mail";
+
+    table.thread_ids.clear ();
+    table.thread_ordinals.clear ();
+    table.timestamps.clear ();
+    table.threads.clear ();
+
+    p_end = notmuch->xapian_db->postlist_end (term);
+    for (p = notmuch->xapian_db->postlist_begin (term); p != p_end; p++) {
+	if (! _table_set_row (closure, *p))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Write 'table' to 'file' as the columns at 'revision'. */
+static notmuch_bool_t
+_table_save (void *closure, FILE *file, unsigned long revision)
+{
+    columns_table_t &table = *(columns_table_t *) closure;
+    columns_header_t header;
+    size_t rows;
+    notmuch_bool_t ok;
+
+    rows = table.threads.size ();
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.index.magic, NOTMUCH_COLUMNS_MAGIC,
+	    sizeof (header.index.magic));
+    header.index.revision = revision;
+    header.num_rows = rows;
+    header.num_threads = table.thread_ids.size ();
+
+    ok = fwrite (&header, sizeof (header), 1, file) == 1;
+    if (ok && header.num_threads)
+	ok = fwrite (&table.thread_ids[0], sizeof (uint64_t),
+		     header.num_threads, file) == header.num_threads;
+    if (ok && rows) {
+	ok = (fwrite (&table.timestamps[0], sizeof (int64_t), rows,
+		      file) == rows &&
+	      fwrite (&table.threads[0], sizeof (uint32_t), rows,
+		      file) == rows);
+    }
+
+    return ok;
+}
+
+static const notmuch_side_index_writer_t columns_writer = {
+    _table_load,
+    _table_set_row,
+    _table_build,
+    _table_save
+};
+
+void
+_notmuch_columns_close (notmuch_database_t *notmuch, notmuch_bool_t flushed)
+{
+    columns_table_t table;
+
+    if (notmuch->columns == NULL)
+	return;
+
+    notmuch->columns->view.header = NULL;
+
+    table.notmuch = notmuch;
+    _notmuch_side_index_close (notmuch, notmuch->columns->index,
+			       NOTMUCH_COLUMNS_MAGIC, flushed,
+			       &columns_writer, &table);
+}
+
+/* Return the columns of 'notmuch' if they can be read, (and reflect
+ * the current revision of the database), or NULL otherwise. */
+static const columns_view_t *
+_notmuch_columns_get (notmuch_database_t *notmuch)
+{
+    notmuch_columns_t *columns = notmuch->columns;
+    notmuch_side_index_t *index;
+
+    if (columns == NULL)
+	return NULL;
+
+    index = columns->index;
+    if (_notmuch_side_index_get (notmuch, index,
+				 NOTMUCH_COLUMNS_MAGIC) == NULL)
+	return NULL;
+
+    if (columns->view.header != (const void *) index->map &&
+	! _columns_parse (index->map, index->map_size, &columns->view))
+    {
+	columns->view.header = NULL;
+	return NULL;
+    }
+
+    return &columns->view;
+}
+
+notmuch_bool_t
+_notmuch_columns_available (notmuch_database_t *notmuch)
+{
+    return _notmuch_columns_get (notmuch) != NULL;
+}
+
+notmuch_bool_t
+_notmuch_columns_count_threads (notmuch_database_t *notmuch,
+				const unsigned int *doc_ids,
+				unsigned int num_doc_ids,
+				unsigned int *count)
+{
+    const columns_view_t *columns;
+    notmuch_doc_id_set_t *seen;
+    unsigned int i, ordinal;
+
+    columns = _notmuch_columns_get (notmuch);
+    if (columns == NULL)
+	return FALSE;
+
+    seen = _notmuch_doc_id_set_create (notmuch);
+    if (unlikely (seen == NULL))
+	return FALSE;
+
+    for (i = 0; i < num_doc_ids; i++) {
+	if (doc_ids[i] >= columns->header->num_rows)
+	    break;
+	ordinal = columns->threads[doc_ids[i]];
+	if (ordinal == 0)
+	    break;
+	_notmuch_doc_id_set_add (seen, ordinal);
+    }
+
+    *count = _notmuch_doc_id_set_count (seen);
+    talloc_free (seen);
+
+    /* A match missing from the columns means they are not what they
+     * claim to be, so let the caller count from the database. */
+    return i == num_doc_ids;
+}
+
+/* Orders document IDs by the timestamps of their messages. */
+class ColumnsDateOrder {
+    const int64_t *timestamps;
+    bool newest_first;
+
+  public:
+    ColumnsDateOrder (const int64_t *timestamps_arg, bool newest_first_arg)
+	: timestamps (timestamps_arg), newest_first (newest_first_arg) { }
+
+    bool operator() (unsigned int a, unsigned int b) const
+    {
+	if (newest_first)
+	    return timestamps[a] > timestamps[b];
+	return timestamps[a] < timestamps[b];
+    }
+};
+
+notmuch_bool_t
+_notmuch_columns_sort_by_date (notmuch_database_t *notmuch,
+			       unsigned int *doc_ids,
+			       unsigned int num_doc_ids,
+			       notmuch_bool_t newest_first)
+{
+    const columns_view_t *columns;
+    unsigned int i;
+
+    columns = _notmuch_columns_get (notmuch);
+    if (columns == NULL)
+	return FALSE;
+
+    for (i = 0; i < num_doc_ids; i++) {
+	if (doc_ids[i] >= columns->header->num_rows ||
+	    columns->threads[doc_ids[i]] == 0)
+	    return FALSE;
+    }
+
+    /* A stable sort keeps messages with the same date in order of
+     * document ID, as Xapian does. */
+    std::stable_sort (doc_ids, doc_ids + num_doc_ids,
+		      ColumnsDateOrder (columns->timestamps, newest_first));
+
+    return TRUE;
+}
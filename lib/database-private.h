@@ -34,6 +34,13 @@
 
 #include <xapian.h>
 
+/* A message moved back from the cold shard with index 'shard', (see
+ * cold.cc). */
+typedef struct _notmuch_cold_thawed {
+    unsigned int shard;
+    unsigned int doc_id;
+} notmuch_cold_thawed_t;
+
 #pragma GCC visibility push(hidden)
 
 struct _notmuch_database {
@@ -42,16 +49,82 @@ struct _notmuch_database {
     char *path;
 
     notmuch_bool_t needs_upgrade;
+    /* Whether the database maintains thread summary records, (see
+     * thread-summary.cc). */
+    notmuch_bool_t has_thread_summaries;
     notmuch_database_mode_t mode;
     int atomic_nesting;
+    /* Whether the revision has already been incremented for the
+     * current (outermost) atomic section. */
+    notmuch_bool_t atomic_dirty;
     Xapian::Database *xapian_db;
 
+    /* The number of databases combined in xapian_db, (see
+     * notmuch_database_open_multi and cold.cc), and the path of the
+     * notmuch database each belongs to, or NULL if only the database
+     * at 'path' is open. Document IDs of the combined database are
+     * interleaved, so the document with ID 'doc_id' belongs to the
+     * database with index (doc_id - 1) % num_subdbs. */
+    unsigned int num_subdbs;
+    const char **subdb_paths;
+    /* A separate handle on the Xapian database of each combined
+     * database, (or NULL if only the database at 'path' is open),
+     * which shares the revision read by xapian_db, for the threads of
+     * parallel.cc. */
+    Xapian::Database **subdb_xapian_dbs;
+    /* The thread ID space of each combined database, (or NULL if only
+     * the database at 'path' is open). Thread IDs are allocated
+     * independently by each notmuch database, but are shared by a
+     * database and its cold shards. */
+    unsigned int *subdb_thread_spaces;
+    unsigned int num_thread_spaces;
+
+    /* For a database opened read-write, a read-only view of its cold
+     * shards, (see cold.cc), in the order of cold_shard_names, or
+     * NULL if it has none, and each shard opened for writing, (or
+     * NULL until a message of that shard is modified). */
+    Xapian::Database *cold_view;
+    const char **cold_shard_names;
+    Xapian::WritableDatabase **cold_shards;
+    unsigned int num_cold_shards;
+    /* The messages moved back from the cold shards, which are only
+     * removed from their shards once the database has been flushed. */
+    notmuch_cold_thawed_t *cold_thawed;
+    unsigned int num_cold_thawed;
+
     unsigned int last_doc_id;
     uint64_t last_thread_id;
+    unsigned long revision;
+    /* The revision of the database when it was opened, which is the
+     * last committed revision until this handle modifies it. */
+    unsigned long open_revision;
 
     Xapian::QueryParser *query_parser;
     Xapian::TermGenerator *term_gen;
     Xapian::ValueRangeProcessor *value_range_processor;
+    Xapian::ValueRangeProcessor *last_mod_range_processor;
+
+    /* The persistent query-result cache, (see query-cache.cc), or
+     * NULL if it has not been enabled. */
+    notmuch_query_cache_t *query_cache;
+
+    /* The number of threads searching the combined databases, (see
+     * parallel.cc). */
+    unsigned int search_threads;
+
+    /* The columnar side index, (see columns.cc). */
+    notmuch_columns_t *columns;
+
+    /* The set of messages with each tag, (see tag-bitmaps.cc). */
+    notmuch_tag_bitmaps_t *tag_bitmaps;
+
+    /* The interned names of tags, (see tag-table.c). */
+    notmuch_tag_table_t *tag_table;
+
+    /* The headers, (in lowercase), stored in the HEADERS value of
+     * each message added, (see notmuch_database_set_stored_headers). */
+    const char **stored_headers;
+    unsigned int num_stored_headers;
 };
 
 /* Return the list of terms from the given iterator matching a prefix.
@@ -65,6 +138,155 @@ _notmuch_database_get_terms_with_prefix (void *ctx, Xapian::TermIterator &i,
 					 Xapian::TermIterator &end,
 					 const char *prefix);
 
+/* database.cc */
+
+/* Add the Xapian database at 'xapian_path', which belongs to the
+ * notmuch database at 'path', to the databases combined in xapian_db,
+ * with thread IDs in the given 'thread_space'.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+void
+_notmuch_database_add_subdb (notmuch_database_t *notmuch,
+			     const char *path,
+			     const char *xapian_path,
+			     unsigned int thread_space);
+
+/* cold.cc */
+
+/* Add each cold shard of the notmuch database at 'path' to the
+ * databases combined in xapian_db, (for a read-only database), or to
+ * cold_view, (for the database at notmuch->path opened read-write).
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+void
+_notmuch_cold_open_shards (notmuch_database_t *notmuch, const char *path,
+			   unsigned int thread_space);
+
+/* Is 'doc' the stub left in the hot database by a message that was
+ * moved to a cold shard? */
+notmuch_bool_t
+_notmuch_cold_is_stub (const Xapian::Document &doc);
+
+/* Flush the changes to the cold shards opened for writing and close
+ * them. The messages thawed from the shards are first removed from
+ * them if 'remove_thawed' is TRUE, which must only be the case once
+ * the database itself has been flushed. */
+void
+_notmuch_cold_close_shards (notmuch_database_t *notmuch,
+			    notmuch_bool_t remove_thawed);
+
+/* If 'doc', (the document with ID 'doc_id' of the database opened
+ * read-write), is the stub of a frozen message, replace it with the
+ * message as read from its cold shard, (which is left in place), and
+ * return the index of the shard. Otherwise, return -1. */
+int
+_notmuch_cold_read (notmuch_database_t *notmuch, unsigned int doc_id,
+		    Xapian::Document &doc);
+
+/* Record that the message with document ID 'doc_id', (read from the
+ * cold shard with index 'shard' by _notmuch_cold_read), is being
+ * written to the database opened read-write, (which thaws it), so
+ * that it is removed from the shard once the database is flushed.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+void
+_notmuch_cold_thaw (notmuch_database_t *notmuch, unsigned int doc_id,
+		    unsigned int shard);
+
+/* parallel.cc */
+
+/* Is 'notmuch' to be searched by several threads at once? This is only
+ * the case for combined databases, when more than one search thread
+ * has been requested, (see notmuch_database_set_search_threads). */
+notmuch_bool_t
+_notmuch_parallel_enabled (notmuch_database_t *notmuch);
+
+/* Return the document IDs of the matches of 'query' in 'sort' order,
+ * from position 'offset' and at most 'limit' of them, (with 'ctx' as
+ * the talloc context), and set *count to their number.
+ *
+ * The query is run over each combined database by a separate thread,
+ * and the sorted matches of each are merged.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+unsigned int *
+_notmuch_parallel_search (void *ctx, notmuch_database_t *notmuch,
+			  const Xapian::Query &query, notmuch_sort_t sort,
+			  unsigned int offset, unsigned int limit,
+			  unsigned int *count);
+
+/* Return the number of matches of 'query', counted by a separate
+ * thread for each combined database.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+Xapian::doccount
+_notmuch_parallel_count (notmuch_database_t *notmuch,
+			 const Xapian::Query &query);
+
+/* message.cc */
+
+/* Return the thread ID held by the metadata record 'record', (the
+ * NOTMUCH_VALUE_METADATA value of a message document), allocated with
+ * 'ctx' as the talloc context, or NULL if the document has no usable
+ * record. */
+char *
+_notmuch_message_record_thread_id (void *ctx, const std::string &record);
+
+/* query.cc */
+
+/* Return the replacement of the term value of 'length' characters at
+ * 'value', (allocated with 'ctx' as the talloc context), or NULL to
+ * leave the term as it is. */
+typedef char *
+(*notmuch_term_expander_t) (void *ctx, const char *value, size_t length,
+			    void *closure);
+
+/* Return a copy of 'query_string', (allocated with 'ctx' as the
+ * talloc context), in which the value of each term with 'prefix',
+ * (such as "date:"), outside of any quoted phrase is replaced by the
+ * parenthesized expression returned by 'expand'.
+ *
+ * A value normally ends at the next space or closing parenthesis,
+ * but a value beginning with '{' extends to the matching '}', (so
+ * that it may hold a whole query).
+ *
+ * This may throw a Xapian::Error if 'expand' does, so must be called
+ * from within a try block. */
+char *
+_notmuch_query_string_expand (void *ctx, const char *query_string,
+			      const char *prefix,
+			      notmuch_term_expander_t expand, void *closure);
+
+/* date.cc */
+
+/* Add the year, month and day bucket terms of 'time' to 'doc'. */
+void
+_notmuch_date_add_bucket_terms (Xapian::Document &doc, time_t time);
+
+/* Return a copy of 'query_string', (allocated with 'ctx' as the
+ * talloc context), in which each range of the "date:" prefix is
+ * replaced by the union of the bucket terms covering it.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+char *
+_notmuch_date_expand_ranges (void *ctx, notmuch_database_t *notmuch,
+			     const char *query_string);
+
+/* facets.cc */
+
+notmuch_facets_t *
+_notmuch_facets_count (void *ctx,
+		       notmuch_database_t *notmuch,
+		       const Xapian::Query &query,
+		       const notmuch_facet_t *facet_list,
+		       unsigned int num_facets);
+
 #pragma GCC visibility pop
 
 #endif
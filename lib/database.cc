@@ -39,7 +39,7 @@ typedef struct {
     const char *prefix;
 } prefix_t;
 
-#define NOTMUCH_DATABASE_VERSION 1
+#define NOTMUCH_DATABASE_VERSION 5
 
 #define STRINGIFY(s) _SUB_STRINGIFY(s)
 #define _SUB_STRINGIFY(s) #s
@@ -77,13 +77,19 @@ typedef struct {
  *
  *	tag:	   Any tags associated with this message by the user.
  *
+ *	date:	   The year, month and day of the Date header (in
+ *		   UTC), as three terms such as "2011", "2011-03" and
+ *		   "2011-03-15". These "buckets" answer date: range
+ *		   queries, (see date.cc). They were introduced with
+ *		   database version 4.
+ *
  *	file-direntry:  A colon-separated pair of values
  *		        (INTEGER:STRING), where INTEGER is the
  *		        document ID of a directory document, and
  *		        STRING is the name of a file within that
  *		        directory for this mail message.
  *
- *    A mail document also has four values:
+ *    A mail document also has seven values:
  *
  *	TIMESTAMP:	The time_t value corresponding to the message's
  *			Date header.
@@ -94,6 +100,18 @@ typedef struct {
  *
  *	SUBJECT:	The value of the "Subject" header
  *
+ *	LAST_MOD:	The revision of the database (see "revision"
+ *			below) at which the document was last modified.
+ *
+ *	METADATA:	The thread, tag, id, file-direntry and replyto
+ *			terms, as a compact record which is cheaper to
+ *			read than the terms (see message.cc).
+ *
+ *	HEADERS:	The name and raw value of each of the headers
+ *			stored when the message was added (see
+ *			notmuch_database_set_stored_headers). It was
+ *			introduced with database version 5.
+ *
  * In addition, terms from the content of the message are added with
  * "from", "to", "attachment", and "subject" prefixes for use by the
  * user in searching. Similarly, terms from the path of the mail
@@ -154,6 +172,11 @@ typedef struct {
  *			generated is 1 and the value will be
  *			incremented for each thread ID.
  *
+ *	revision	The revision of the database, incremented for
+ *			each modification of the database (or once for
+ *			all modifications within an atomic section).
+ *			This is stored as a base-10 ASCII integer.
+ *
  *	thread_id_*	A pre-allocated thread ID for a particular
  *			message. This is actually an arbitrarily large
  *			family of metadata name. Any particular name is
@@ -175,6 +198,20 @@ typedef struct {
  *			descendant messages that reference this common
  *			parent can be recognized as belonging to the
  *			same thread.
+ *
+ *	thread_summary_*
+ *			A summary record for a particular thread. Any
+ *			particular name is formed by concatenating
+ *			"thread_summary_" with a thread ID. The value
+ *			lists the document ID, date, author, subject
+ *			and tags of every message in the thread, (see
+ *			thread-summary.cc for the format), so that
+ *			thread summaries can be produced without
+ *			reading every message in the thread.
+ *
+ *			These records are updated whenever a message
+ *			document is written or deleted. They were
+ *			introduced with database version 2.
  */
 
 /* With these prefix values we follow the conventions published here:
@@ -205,7 +242,8 @@ static prefix_t BOOLEAN_PREFIX_EXTERNAL[] = {
     { "thread",			"G" },
     { "tag",			"K" },
     { "is",			"K" },
-    { "id",			"Q" }
+    { "id",			"Q" },
+    { "date",			"XDATE" }
 };
 
 static prefix_t PROBABILISTIC_PREFIX[]= {
@@ -241,6 +279,18 @@ _find_prefix (const char *name)
     return "";
 }
 
+/* The headers stored for each message unless the client chooses
+ * others, (see notmuch_database_set_stored_headers): those needed to
+ * show a message and to reply to it. */
+static const char *default_stored_headers[] = {
+    "date",
+    "to",
+    "cc",
+    "reply-to",
+    "in-reply-to",
+    "references"
+};
+
 const char *
 notmuch_status_to_string (notmuch_status_t status)
 {
@@ -311,6 +361,17 @@ _notmuch_database_find_unique_doc_id (notmuch_database_t *notmuch,
 
     find_doc_ids (notmuch, prefix_name, value, &i, &end);
 
+    /* A read-only database combined with its cold shards also holds
+     * the stubs of the frozen messages, (see cold.cc), which are only
+     * of use to the database opened read-write. */
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY &&
+	notmuch->num_subdbs > 1)
+    {
+	while (i != end &&
+	       _notmuch_cold_is_stub (notmuch->xapian_db->get_document (*i)))
+	    i++;
+    }
+
     if (i == end) {
 	*doc_id = 0;
 	return NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND;
@@ -653,8 +714,28 @@ notmuch_database_open (const char *path,
     notmuch->needs_upgrade = FALSE;
     notmuch->mode = mode;
     notmuch->atomic_nesting = 0;
+    notmuch->atomic_dirty = FALSE;
+    notmuch->query_cache = NULL;
+    notmuch->columns = NULL;
+    notmuch->tag_bitmaps = NULL;
+    notmuch->search_threads = 1;
+    notmuch->tag_table = _notmuch_tag_table_create (notmuch);
+    notmuch->stored_headers = default_stored_headers;
+    notmuch->num_stored_headers = ARRAY_SIZE (default_stored_headers);
+    notmuch->num_subdbs = 1;
+    notmuch->subdb_paths = NULL;
+    notmuch->subdb_xapian_dbs = NULL;
+    notmuch->subdb_thread_spaces = NULL;
+    notmuch->num_thread_spaces = 1;
+    notmuch->cold_view = NULL;
+    notmuch->cold_shard_names = NULL;
+    notmuch->cold_shards = NULL;
+    notmuch->num_cold_shards = 0;
+    notmuch->cold_thawed = NULL;
+    notmuch->num_cold_thawed = 0;
     try {
 	string last_thread_id;
+	string revision;
 
 	if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE) {
 	    notmuch->xapian_db = new Xapian::WritableDatabase (xapian_path,
@@ -692,6 +773,10 @@ notmuch_database_open (const char *path,
 	    }
 	}
 
+	/* Thread summary records are only maintained (and so can only
+	 * be trusted) from database version 2 on. */
+	notmuch->has_thread_summaries = (version >= 2);
+
 	notmuch->last_doc_id = notmuch->xapian_db->get_lastdocid ();
 	last_thread_id = notmuch->xapian_db->get_metadata ("last_thread_id");
 	if (last_thread_id.empty ()) {
@@ -706,15 +791,33 @@ notmuch_database_open (const char *path,
 		INTERNAL_ERROR ("Malformed database last_thread_id: %s", str);
 	}
 
+	revision = notmuch->xapian_db->get_metadata ("revision");
+	if (revision.empty ()) {
+	    notmuch->revision = 0;
+	} else {
+	    const char *str;
+	    char *end;
+
+	    str = revision.c_str ();
+	    notmuch->revision = strtoul (str, &end, 10);
+	    if (*end != '\0')
+		INTERNAL_ERROR ("Malformed database revision: %s", str);
+	}
+	notmuch->open_revision = notmuch->revision;
+
 	notmuch->query_parser = new Xapian::QueryParser;
 	notmuch->term_gen = new Xapian::TermGenerator;
 	notmuch->term_gen->set_stemmer (Xapian::Stem ("english"));
 	notmuch->value_range_processor = new Xapian::NumberValueRangeProcessor (NOTMUCH_VALUE_TIMESTAMP);
+	notmuch->last_mod_range_processor = new Xapian::NumberValueRangeProcessor (NOTMUCH_VALUE_LAST_MOD, "lastmod:");
 
 	notmuch->query_parser->set_default_op (Xapian::Query::OP_AND);
 	notmuch->query_parser->set_database (*notmuch->xapian_db);
 	notmuch->query_parser->set_stemmer (Xapian::Stem ("english"));
 	notmuch->query_parser->set_stemming_strategy (Xapian::QueryParser::STEM_SOME);
+	/* The prefixed "lastmod:" processor must be tried before the
+	 * unprefixed timestamp processor, which accepts any range. */
+	notmuch->query_parser->add_valuerangeprocessor (notmuch->last_mod_range_processor);
 	notmuch->query_parser->add_valuerangeprocessor (notmuch->value_range_processor);
 
 	for (i = 0; i < ARRAY_SIZE (BOOLEAN_PREFIX_EXTERNAL); i++) {
@@ -727,6 +830,10 @@ notmuch_database_open (const char *path,
 	    prefix_t *prefix = &PROBABILISTIC_PREFIX[i];
 	    notmuch->query_parser->add_prefix (prefix->name, prefix->prefix);
 	}
+
+	_notmuch_cold_open_shards (notmuch, notmuch->path, 0);
+	_notmuch_columns_open (notmuch);
+	_notmuch_tag_bitmaps_open (notmuch);
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred opening database: %s\n",
 		 error.get_msg().c_str());
@@ -745,9 +852,88 @@ notmuch_database_open (const char *path,
     return status;
 }
 
+notmuch_status_t
+notmuch_database_open_multi (const char *path,
+			     const char **extra_paths,
+			     unsigned int num_extra_paths,
+			     notmuch_database_t **database)
+{
+    notmuch_status_t status;
+    notmuch_database_t *notmuch = NULL;
+    unsigned int i;
+
+    status = notmuch_database_open (path, NOTMUCH_DATABASE_MODE_READ_ONLY,
+				    &notmuch);
+    if (status)
+	goto DONE;
+
+    for (i = 0; i < num_extra_paths; i++) {
+	char *subdb_path, *xapian_path;
+	unsigned int version;
+
+	if (extra_paths[i] == NULL) {
+	    fprintf (stderr, "Error: Cannot open a database for a NULL path.\n");
+	    status = NOTMUCH_STATUS_NULL_POINTER;
+	    goto DONE;
+	}
+
+	subdb_path = talloc_strdup (notmuch, extra_paths[i]);
+	if (subdb_path[0] && subdb_path[strlen (subdb_path) - 1] == '/')
+	    subdb_path[strlen (subdb_path) - 1] = '\0';
+
+	xapian_path = talloc_asprintf (notmuch, "%s/.notmuch/xapian",
+				       subdb_path);
+
+	try {
+	    Xapian::Database subdb (xapian_path);
+
+	    version = strtoul (subdb.get_metadata ("version").c_str (),
+			       NULL, 10);
+	    if (version != NOTMUCH_DATABASE_VERSION) {
+		fprintf (stderr,
+			 "Error: Notmuch database at %s\n"
+			 "       has database format version %u rather than %u. Run\n"
+			 "       \"notmuch new\" for that database before searching it\n"
+			 "       along with others.\n",
+			 subdb_path, version, NOTMUCH_DATABASE_VERSION);
+		status = NOTMUCH_STATUS_FILE_ERROR;
+		goto DONE;
+	    }
+
+	    _notmuch_database_add_subdb (notmuch, subdb_path, xapian_path,
+					 notmuch->num_thread_spaces);
+	    _notmuch_cold_open_shards (notmuch, subdb_path,
+				       notmuch->num_thread_spaces);
+	    notmuch->num_thread_spaces++;
+	} catch (const Xapian::Error &error) {
+	    fprintf (stderr, "A Xapian exception occurred opening database %s: %s\n",
+		     subdb_path, error.get_msg().c_str());
+	    status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	    goto DONE;
+	}
+
+	talloc_free (xapian_path);
+    }
+
+  DONE:
+    if (status && notmuch) {
+	notmuch_database_destroy (notmuch);
+	notmuch = NULL;
+    }
+
+    if (database)
+	*database = notmuch;
+    else if (notmuch)
+	notmuch_database_destroy (notmuch);
+    return status;
+}
+
 void
 notmuch_database_close (notmuch_database_t *notmuch)
 {
+    notmuch_bool_t flushed = TRUE;
+    unsigned int i;
+
     try {
 	if (notmuch->xapian_db != NULL &&
 	    notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
@@ -757,8 +943,14 @@ notmuch_database_close (notmuch_database_t *notmuch)
 	    fprintf (stderr, "Error: A Xapian exception occurred flushing database: %s\n",
 		     error.get_msg().c_str());
 	}
+	flushed = FALSE;
     }
 
+    _notmuch_query_cache_close (notmuch, flushed);
+    _notmuch_cold_close_shards (notmuch, flushed);
+    _notmuch_columns_close (notmuch, flushed);
+    _notmuch_tag_bitmaps_close (notmuch, flushed);
+
     /* Many Xapian objects (and thus notmuch objects) hold references to
      * the database, so merely deleting the database may not suffice to
      * close it.  Thus, we explicitly close it here. */
@@ -776,8 +968,16 @@ notmuch_database_close (notmuch_database_t *notmuch)
     notmuch->query_parser = NULL;
     delete notmuch->xapian_db;
     notmuch->xapian_db = NULL;
+    for (i = 0; notmuch->subdb_xapian_dbs && i < notmuch->num_subdbs; i++) {
+	delete notmuch->subdb_xapian_dbs[i];
+	notmuch->subdb_xapian_dbs[i] = NULL;
+    }
     delete notmuch->value_range_processor;
     notmuch->value_range_processor = NULL;
+    delete notmuch->last_mod_range_processor;
+    notmuch->last_mod_range_processor = NULL;
+    delete notmuch->cold_view;
+    notmuch->cold_view = NULL;
 }
 
 void
@@ -816,6 +1016,44 @@ notmuch_database_get_version (notmuch_database_t *notmuch)
     return version;
 }
 
+unsigned long
+notmuch_database_get_revision (notmuch_database_t *notmuch)
+{
+    return notmuch->revision;
+}
+
+notmuch_status_t
+notmuch_database_set_stored_headers (notmuch_database_t *notmuch,
+				     const char **headers,
+				     unsigned int count)
+{
+    const char **stored_headers;
+    unsigned int i;
+    char *s;
+
+    stored_headers = talloc_array (notmuch, const char *, count + 1);
+    if (unlikely (stored_headers == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    for (i = 0; i < count; i++) {
+	stored_headers[i] = s = talloc_strdup (stored_headers, headers[i]);
+	if (unlikely (s == NULL)) {
+	    talloc_free (stored_headers);
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	}
+	for (; *s; s++)
+	    *s = tolower ((unsigned char) *s);
+    }
+    stored_headers[count] = NULL;
+
+    if (notmuch->stored_headers != default_stored_headers)
+	talloc_free (notmuch->stored_headers);
+    notmuch->stored_headers = stored_headers;
+    notmuch->num_stored_headers = count;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 notmuch_bool_t
 notmuch_database_needs_upgrade (notmuch_database_t *notmuch)
 {
@@ -963,6 +1201,137 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 	}
     }
 
+    /* Version 2 introduced a summary record for each thread. Build
+     * one for every existing thread. */
+    if (version < 2) {
+	Xapian::TermIterator t, t_end;
+	const char *prefix = _find_prefix ("thread");
+
+	notmuch->has_thread_summaries = TRUE;
+
+	count = 0;
+	total = notmuch->xapian_db->get_doccount ();
+
+	t_end = notmuch->xapian_db->allterms_end (prefix);
+
+	for (t = notmuch->xapian_db->allterms_begin (prefix);
+	     t != t_end;
+	     t++)
+	{
+	    std::string term = *t;
+
+	    if (do_progress_notify) {
+		progress_notify (closure, (double) count / total);
+		do_progress_notify = 0;
+	    }
+
+	    count += _notmuch_thread_summary_rebuild (notmuch,
+						      term.c_str () + strlen (prefix));
+	}
+    }
+
+    /* Version 3 introduced the database revision and the LAST_MOD
+     * value of each message. Stamp every existing message with a
+     * single, initial revision. */
+    if (version < 3) {
+	Xapian::PostingIterator p, p_end;
+	std::string term = std::string (_find_prefix ("type")) + "mail";
+	std::string last_mod;
+
+	count = 0;
+	total = notmuch->xapian_db->get_termfreq (term);
+
+	last_mod = Xapian::sortable_serialise (
+	    _notmuch_database_new_revision (notmuch));
+
+	p_end = notmuch->xapian_db->postlist_end (term);
+
+	for (p = notmuch->xapian_db->postlist_begin (term);
+	     p != p_end;
+	     p++)
+	{
+	    Xapian::Document document;
+
+	    if (do_progress_notify) {
+		progress_notify (closure, (double) count / total);
+		do_progress_notify = 0;
+	    }
+
+	    document = find_document_for_doc_id (notmuch, *p);
+	    document.add_value (NOTMUCH_VALUE_LAST_MOD, last_mod);
+	    db->replace_document (*p, document);
+
+	    count++;
+	}
+    }
+
+    /* Version 4 introduced the date bucket terms of each message,
+     * which are derived from its TIMESTAMP value. */
+    if (version < 4) {
+	Xapian::PostingIterator p, p_end;
+	std::string term = std::string (_find_prefix ("type")) + "mail";
+
+	count = 0;
+	total = notmuch->xapian_db->get_termfreq (term);
+
+	p_end = notmuch->xapian_db->postlist_end (term);
+
+	for (p = notmuch->xapian_db->postlist_begin (term);
+	     p != p_end;
+	     p++)
+	{
+	    Xapian::Document document;
+
+	    if (do_progress_notify) {
+		progress_notify (closure, (double) count / total);
+		do_progress_notify = 0;
+	    }
+
+	    document = find_document_for_doc_id (notmuch, *p);
+	    _notmuch_date_add_bucket_terms (
+		document, Xapian::sortable_unserialise (
+		    document.get_value (NOTMUCH_VALUE_TIMESTAMP)));
+	    db->replace_document (*p, document);
+
+	    count++;
+	}
+    }
+
+    /* Version 5 introduced the stored headers of each message, which
+     * are read from its file, (along with its metadata record, which
+     * is otherwise only written as messages are modified). */
+    if (version < 5) {
+	Xapian::PostingIterator p, p_end;
+	std::string term = std::string (_find_prefix ("type")) + "mail";
+
+	count = 0;
+	total = notmuch->xapian_db->get_termfreq (term);
+
+	p_end = notmuch->xapian_db->postlist_end (term);
+
+	for (p = notmuch->xapian_db->postlist_begin (term);
+	     p != p_end;
+	     p++)
+	{
+	    notmuch_private_status_t private_status;
+	    notmuch_message_t *message;
+
+	    if (do_progress_notify) {
+		progress_notify (closure, (double) count / total);
+		do_progress_notify = 0;
+	    }
+
+	    message = _notmuch_message_create (notmuch, notmuch, *p,
+					       &private_status);
+	    if (message) {
+		_notmuch_message_backfill (message);
+		notmuch_message_destroy (message);
+	    }
+
+	    count++;
+	}
+    }
+
     db->set_metadata ("version", STRINGIFY (NOTMUCH_DATABASE_VERSION));
     db->flush ();
 
@@ -1051,6 +1420,7 @@ notmuch_database_begin_atomic (notmuch_database_t *notmuch)
 
     try {
 	(static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db))->begin_transaction (false);
+	notmuch->atomic_dirty = FALSE;
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred beginning transaction: %s.\n",
 		 error.get_msg().c_str());
@@ -1231,6 +1601,95 @@ _notmuch_database_find_directory_id (notmuch_database_t *notmuch,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+void
+_notmuch_database_add_subdb (notmuch_database_t *notmuch,
+			     const char *path,
+			     const char *xapian_path,
+			     unsigned int thread_space)
+{
+    unsigned int n = notmuch->num_subdbs;
+
+    if (notmuch->subdb_paths == NULL) {
+	notmuch->subdb_paths = talloc_array (notmuch, const char *, 1);
+	notmuch->subdb_xapian_dbs = talloc_array (notmuch,
+						  Xapian::Database *, 1);
+	notmuch->subdb_thread_spaces = talloc_array (notmuch, unsigned int, 1);
+	if (unlikely (notmuch->subdb_paths == NULL ||
+		      notmuch->subdb_xapian_dbs == NULL ||
+		      notmuch->subdb_thread_spaces == NULL))
+	    INTERNAL_ERROR ("Out of memory combining databases");
+	notmuch->subdb_paths[0] = notmuch->path;
+	/* A copy of a database shares its revision. */
+	notmuch->subdb_xapian_dbs[0] = new Xapian::Database (*notmuch->xapian_db);
+	notmuch->subdb_thread_spaces[0] = 0;
+    }
+
+    notmuch->subdb_paths = talloc_realloc (notmuch, notmuch->subdb_paths,
+					   const char *, n + 1);
+    notmuch->subdb_xapian_dbs = talloc_realloc (notmuch,
+						notmuch->subdb_xapian_dbs,
+						Xapian::Database *, n + 1);
+    notmuch->subdb_thread_spaces = talloc_realloc (notmuch,
+						   notmuch->subdb_thread_spaces,
+						   unsigned int, n + 1);
+    if (unlikely (notmuch->subdb_paths == NULL ||
+		  notmuch->subdb_xapian_dbs == NULL ||
+		  notmuch->subdb_thread_spaces == NULL))
+	INTERNAL_ERROR ("Out of memory combining databases");
+
+    notmuch->subdb_xapian_dbs[n] = new Xapian::Database (xapian_path);
+    notmuch->xapian_db->add_database (*notmuch->subdb_xapian_dbs[n]);
+
+    notmuch->subdb_paths[n] = talloc_strdup (notmuch, path);
+    notmuch->subdb_thread_spaces[n] = thread_space;
+    notmuch->num_subdbs = n + 1;
+    notmuch->last_doc_id = notmuch->xapian_db->get_lastdocid ();
+
+    /* The query parser holds its own reference to the databases, for
+     * expanding wildcards, which must include the added ones. */
+    notmuch->query_parser->set_database (*notmuch->xapian_db);
+
+    /* Thread summary records only describe the messages of the
+     * database holding them. */
+    notmuch->has_thread_summaries = FALSE;
+}
+
+unsigned int
+_notmuch_database_subdb (notmuch_database_t *notmuch, unsigned int doc_id)
+{
+    return (doc_id - 1) % notmuch->num_subdbs;
+}
+
+unsigned int
+_notmuch_database_thread_space (notmuch_database_t *notmuch,
+				unsigned int doc_id)
+{
+    if (notmuch->subdb_thread_spaces == NULL)
+	return 0;
+
+    return notmuch->subdb_thread_spaces[_notmuch_database_subdb (notmuch,
+								 doc_id)];
+}
+
+unsigned int
+_notmuch_database_subdb_doc_id (notmuch_database_t *notmuch,
+				unsigned int doc_id,
+				unsigned int subdb_doc_id)
+{
+    return ((subdb_doc_id - 1) * notmuch->num_subdbs +
+	    _notmuch_database_subdb (notmuch, doc_id) + 1);
+}
+
+const char *
+_notmuch_database_subdb_path (notmuch_database_t *notmuch,
+			      unsigned int doc_id)
+{
+    if (notmuch->subdb_paths == NULL)
+	return notmuch->path;
+
+    return notmuch->subdb_paths[_notmuch_database_subdb (notmuch, doc_id)];
+}
+
 const char *
 _notmuch_database_get_directory_path (void *ctx,
 				      notmuch_database_t *notmuch,
@@ -1365,6 +1824,33 @@ _notmuch_database_generate_doc_id (notmuch_database_t *notmuch)
     return notmuch->last_doc_id;
 }
 
+/* Return the revision to record for a modification of the database
+ * that is about to be made, incrementing the revision of the database
+ * unless this has already been done within the current atomic
+ * section. */
+unsigned long
+_notmuch_database_new_revision (notmuch_database_t *notmuch)
+{
+    Xapian::WritableDatabase *db;
+    char *revision;
+
+    if (notmuch->atomic_nesting > 0 && notmuch->atomic_dirty)
+	return notmuch->revision;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    notmuch->revision++;
+
+    revision = talloc_asprintf (notmuch, "%lu", notmuch->revision);
+    db->set_metadata ("revision", revision);
+    talloc_free (revision);
+
+    if (notmuch->atomic_nesting > 0)
+	notmuch->atomic_dirty = TRUE;
+
+    return notmuch->revision;
+}
+
 static const char *
 _notmuch_database_generate_thread_id (notmuch_database_t *notmuch)
 {
@@ -1484,6 +1970,8 @@ _merge_threads (notmuch_database_t *notmuch,
 	message = NULL;
     }
 
+    _notmuch_thread_summary_remove (notmuch, loser_thread_id);
+
   DONE:
     if (message)
 	notmuch_message_destroy (message);
@@ -1703,6 +2191,7 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
     const char *date, *header;
     const char *from, *to, *subject;
     char *message_id = NULL;
+    unsigned int i;
 
     if (message_ret)
 	*message_ret = NULL;
@@ -1730,6 +2219,9 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
 					   "subject",
 					   "to",
 					   (char *) NULL);
+    for (i = 0; i < notmuch->num_stored_headers; i++)
+	notmuch_message_file_restrict_header (message_file,
+					      notmuch->stored_headers[i]);
 
     try {
 	/* Before we do any real work, (especially before doing a
@@ -1815,6 +2307,7 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
 
 	    date = notmuch_message_file_get_header (message_file, "date");
 	    _notmuch_message_set_header_values (message, date, from, subject);
+	    _notmuch_message_set_stored_headers (message, message_file);
 
 	    _notmuch_message_index_file (message, filename);
 	} else {
@@ -0,0 +1,285 @@
+/* date.cc - Date bucket terms and date: range queries
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+/* Each mail document is indexed with three "date" terms for the day,
+ * the month and the year of its Date header, (in UTC), such as
+ * "2011-03-15", "2011-03" and "2011".
+ *
+ * A range query such as "date:2011-03-15..2012" is then answered by
+ * the union of the fewest whole buckets covering the range, (here the
+ * 17 days to the end of March 2011, the 9 months to the end of 2011
+ * and the year 2012), so that the search only reads a few posting
+ * lists rather than checking the timestamp value of every message in
+ * the database. Since the bounds of a range are whole days, the
+ * buckets at its edges match exactly, and no value checks are
+ * needed.
+ *
+ * The expansion is done on the query string, before it is given to
+ * the Xapian query parser, since the parser offers no way to turn a
+ * range into anything other than a value range.
+ */
+
+typedef struct {
+    int year;
+    int month;
+    int day;
+} date_t;
+
+static int
+_days_in_month (int year, int month)
+{
+    static const int days[] = {
+	31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+    };
+
+    if (month == 2 &&
+	(year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)))
+	return 29;
+
+    return days[month - 1];
+}
+
+static int
+_date_compare (const date_t *a, const date_t *b)
+{
+    if (a->year != b->year)
+	return a->year - b->year;
+    if (a->month != b->month)
+	return a->month - b->month;
+    return a->day - b->day;
+}
+
+/* Set 'date' to the (UTC) day of 'time'. Returns FALSE if the time
+ * cannot be represented. */
+static notmuch_bool_t
+_date_from_time (date_t *date, time_t time)
+{
+    struct tm tm;
+
+    if (gmtime_r (&time, &tm) == NULL)
+	return FALSE;
+
+    date->year = tm.tm_year + 1900;
+    date->month = tm.tm_mon + 1;
+    date->day = tm.tm_mday;
+
+    return TRUE;
+}
+
+void
+_notmuch_date_add_bucket_terms (Xapian::Document &doc, time_t time)
+{
+    const char *prefix = _find_prefix ("date");
+    date_t date;
+    char bucket[32];
+
+    if (! _date_from_time (&date, time))
+	return;
+
+    snprintf (bucket, sizeof (bucket), "%s%04d", prefix, date.year);
+    doc.add_term (bucket);
+    snprintf (bucket, sizeof (bucket), "%s%04d-%02d", prefix,
+	      date.year, date.month);
+    doc.add_term (bucket);
+    snprintf (bucket, sizeof (bucket), "%s%04d-%02d-%02d", prefix,
+	      date.year, date.month, date.day);
+    doc.add_term (bucket);
+}
+
+/* Parse a bound of a date range, of the form YYYY, YYYY-MM or
+ * YYYY-MM-DD, of 'length' characters at 'str'.
+ *
+ * The first day covered by the bound is stored in 'date' if
+ * 'is_start' is TRUE, and the last day otherwise.
+ *
+ * Returns FALSE if the bound is malformed.
+ */
+static notmuch_bool_t
+_parse_date_bound (const char *str, size_t length, notmuch_bool_t is_start,
+		   date_t *date)
+{
+    char buf[16];
+    int consumed = 0;
+
+    if (length == 0 || length >= sizeof (buf))
+	return FALSE;
+
+    memcpy (buf, str, length);
+    buf[length] = '\0';
+
+    if (sscanf (buf, "%4d-%2d-%2d%n",
+		&date->year, &date->month, &date->day, &consumed) == 3 &&
+	consumed == (int) length)
+    {
+	if (date->month < 1 || date->month > 12 ||
+	    date->day < 1 ||
+	    date->day > _days_in_month (date->year, date->month))
+	    return FALSE;
+    } else if (sscanf (buf, "%4d-%2d%n",
+		       &date->year, &date->month, &consumed) == 2 &&
+	       consumed == (int) length)
+    {
+	if (date->month < 1 || date->month > 12)
+	    return FALSE;
+	date->day = is_start ? 1 : _days_in_month (date->year, date->month);
+    } else if (sscanf (buf, "%4d%n", &date->year, &consumed) == 1 &&
+	       consumed == (int) length)
+    {
+	date->month = is_start ? 1 : 12;
+	date->day = is_start ? 1 : 31;
+    } else {
+	return FALSE;
+    }
+
+    return date->year >= 0;
+}
+
+static std::string
+_timestamp_bound (Xapian::Database *db, notmuch_bool_t is_start)
+{
+    if (is_start)
+	return db->get_value_lower_bound (NOTMUCH_VALUE_TIMESTAMP);
+    else
+	return db->get_value_upper_bound (NOTMUCH_VALUE_TIMESTAMP);
+}
+
+/* Set 'date' to the first day (if 'is_start' is TRUE) or the last day
+ * of the years spanned by the dates of the messages in the database,
+ * (including its cold shards), for a range with no bound on that
+ * side. */
+static void
+_open_date_bound (notmuch_database_t *notmuch, notmuch_bool_t is_start,
+		  date_t *date)
+{
+    std::string bound;
+
+    bound = _timestamp_bound (notmuch->xapian_db, is_start);
+
+    /* Serialised timestamps sort as the timestamps do. */
+    if (notmuch->cold_view) {
+	std::string cold = _timestamp_bound (notmuch->cold_view, is_start);
+
+	if (bound.empty () ||
+	    (! cold.empty () && (is_start ? cold < bound : cold > bound)))
+	    bound = cold;
+    }
+
+    if (bound.empty () ||
+	! _date_from_time (date, Xapian::sortable_unserialise (bound)))
+    {
+	_date_from_time (date, 0);
+    }
+
+    date->month = is_start ? 1 : 12;
+    date->day = is_start ? 1 : 31;
+}
+
+/* Append to 'expansion' the union of the fewest year, month and day
+ * buckets covering the days from 'start' to 'end', (inclusive). */
+static char *
+_expand_date_range (char *expansion, date_t start, const date_t *end)
+{
+    const char *separator = "";
+
+    expansion = talloc_strdup_append (expansion, "(");
+
+    /* A range that is empty still needs a term matching nothing. */
+    if (_date_compare (&start, end) > 0)
+	return talloc_strdup_append (expansion, "date:none)");
+
+    while (_date_compare (&start, end) <= 0) {
+	int last_day = _days_in_month (start.year, start.month);
+
+	if (start.month == 1 && start.day == 1 &&
+	    (end->year > start.year ||
+	     (end->month == 12 && end->day == 31)))
+	{
+	    expansion = talloc_asprintf_append (expansion, "%sdate:%04d",
+						separator, start.year);
+	    start.year++;
+	} else if (start.day == 1 &&
+		   (end->year > start.year || end->month > start.month ||
+		    end->day == last_day))
+	{
+	    expansion = talloc_asprintf_append (expansion, "%sdate:%04d-%02d",
+						separator,
+						start.year, start.month);
+	    if (++start.month > 12) {
+		start.month = 1;
+		start.year++;
+	    }
+	} else {
+	    expansion = talloc_asprintf_append (expansion,
+						"%sdate:%04d-%02d-%02d",
+						separator, start.year,
+						start.month, start.day);
+	    if (++start.day > last_day) {
+		start.day = 1;
+		if (++start.month > 12) {
+		    start.month = 1;
+		    start.year++;
+		}
+	    }
+	}
+
+	separator = " OR ";
+    }
+
+    return talloc_strdup_append (expansion, ")");
+}
+
+/* Expand the value of a "date:" term, (see
+ * _notmuch_query_string_expand), if it is a range. */
+static char *
+_expand_date_term (void *ctx, const char *value, size_t length,
+		   void *closure)
+{
+    notmuch_database_t *notmuch = (notmuch_database_t *) closure;
+    const char *dots, *end = value + length;
+    date_t start, last;
+
+    for (dots = value; dots + 1 < end; dots++) {
+	if (dots[0] == '.' && dots[1] == '.')
+	    break;
+    }
+    if (dots + 1 >= end)
+	return NULL;
+
+    if (dots == value)
+	_open_date_bound (notmuch, TRUE, &start);
+    else if (! _parse_date_bound (value, dots - value, TRUE, &start))
+	return NULL;
+
+    if (dots + 2 == end)
+	_open_date_bound (notmuch, FALSE, &last);
+    else if (! _parse_date_bound (dots + 2, end - (dots + 2), FALSE, &last))
+	return NULL;
+
+    return _expand_date_range (talloc_strdup (ctx, ""), start, &last);
+}
+
+char *
+_notmuch_date_expand_ranges (void *ctx, notmuch_database_t *notmuch,
+			     const char *query_string)
+{
+    return _notmuch_query_string_expand (ctx, query_string, "date:",
+					 _expand_date_term, notmuch);
+}
@@ -0,0 +1,710 @@
+/* doc-id-set.c - Compressed sets of Xapian document IDs
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+
+#include <stdint.h>
+#include <limits.h>
+
+/* A doc ID set is stored in the manner of a "roaring bitmap": the
+ * 32-bit document IDs are partitioned by their high 16 bits into
+ * containers, each holding the low 16 bits of its members.
+ *
+ * A container with few members stores them as a sorted array of
+ * 16-bit values. Once a container has more than
+ * CONTAINER_ARRAY_MAX members, (at which point the array would take
+ * more space than a bitmap), it switches to a bitmap of all 65536
+ * possible members.
+ *
+ * So the size of a set depends on the number of its members rather
+ * than on the largest document ID in the database, while a dense set
+ * costs no more than a plain bitmap.
+ */
+
+#define CONTAINER_BITS 16
+#define CONTAINER_SIZE (1 << CONTAINER_BITS)
+#define CONTAINER_KEY(doc_id) ((doc_id) >> CONTAINER_BITS)
+#define CONTAINER_LOW(doc_id) ((doc_id) & (CONTAINER_SIZE - 1))
+
+#define CONTAINER_ARRAY_MAX 4096
+
+#define BITMAP_WORDS (CONTAINER_SIZE / 64)
+#define BITMAP_WORD(low) ((low) / 64)
+#define BITMAP_BIT(low) ((uint64_t) 1 << ((low) % 64))
+
+typedef struct _container {
+    unsigned int key;
+    unsigned int count;
+
+    /* Exactly one of 'array' and 'bitmap' is non-NULL. */
+    uint16_t *array;
+    unsigned int array_size;
+    uint64_t *bitmap;
+} container_t;
+
+struct _notmuch_doc_id_set {
+    /* Containers in increasing order of key. */
+    container_t *containers;
+    unsigned int num_containers;
+    unsigned int size;
+
+    unsigned int count;
+};
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_create (void *ctx)
+{
+    notmuch_doc_id_set_t *doc_ids;
+
+    doc_ids = talloc (ctx, notmuch_doc_id_set_t);
+    if (unlikely (doc_ids == NULL))
+	return NULL;
+
+    doc_ids->containers = NULL;
+    doc_ids->num_containers = 0;
+    doc_ids->size = 0;
+    doc_ids->count = 0;
+
+    return doc_ids;
+}
+
+static int
+_compare_doc_ids (const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+
+    return (x > y) - (x < y);
+}
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_create_from_array (void *ctx,
+				       const unsigned int *doc_id_array,
+				       unsigned int count)
+{
+    notmuch_doc_id_set_t *doc_ids;
+    unsigned int *sorted;
+    unsigned int i;
+
+    doc_ids = _notmuch_doc_id_set_create (ctx);
+    if (unlikely (doc_ids == NULL))
+	return NULL;
+
+    if (count == 0)
+	return doc_ids;
+
+    /* Adding the members in increasing order means that each one is
+     * appended to the last container, so no array ever needs to be
+     * shifted to make room. */
+    sorted = talloc_array (doc_ids, unsigned int, count);
+    if (unlikely (sorted == NULL)) {
+	talloc_free (doc_ids);
+	return NULL;
+    }
+    memcpy (sorted, doc_id_array, count * sizeof (unsigned int));
+    qsort (sorted, count, sizeof (unsigned int), _compare_doc_ids);
+
+    for (i = 0; i < count; i++) {
+	if (! _notmuch_doc_id_set_add (doc_ids, sorted[i])) {
+	    talloc_free (doc_ids);
+	    return NULL;
+	}
+    }
+
+    talloc_free (sorted);
+
+    return doc_ids;
+}
+
+/* Return the index of the container with the given key or, if there
+ * is none, the index at which it would be inserted. */
+static unsigned int
+_find_container (notmuch_doc_id_set_t *doc_ids, unsigned int key)
+{
+    unsigned int lo = 0, hi = doc_ids->num_containers, mid;
+
+    /* Members are most often added in increasing order. */
+    if (hi > 0 && doc_ids->containers[hi - 1].key < key)
+	return hi;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (doc_ids->containers[mid].key < key)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+static container_t *
+_get_container (notmuch_doc_id_set_t *doc_ids, unsigned int key)
+{
+    unsigned int i = _find_container (doc_ids, key);
+
+    if (i < doc_ids->num_containers && doc_ids->containers[i].key == key)
+	return &doc_ids->containers[i];
+
+    return NULL;
+}
+
+/* Return the index of 'low' within the array of 'container' or, if
+ * it is not present, the index at which it would be inserted. */
+static unsigned int
+_find_in_array (container_t *container, uint16_t low)
+{
+    unsigned int lo = 0, hi = container->count, mid;
+
+    if (hi > 0 && container->array[hi - 1] < low)
+	return hi;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (container->array[mid] < low)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+/* Convert the (full) array of 'container' into a bitmap. */
+static notmuch_bool_t
+_container_to_bitmap (notmuch_doc_id_set_t *doc_ids, container_t *container)
+{
+    uint64_t *bitmap;
+    unsigned int i;
+
+    bitmap = talloc_zero_array (doc_ids, uint64_t, BITMAP_WORDS);
+    if (unlikely (bitmap == NULL))
+	return FALSE;
+
+    for (i = 0; i < container->count; i++)
+	bitmap[BITMAP_WORD (container->array[i])] |= BITMAP_BIT (container->array[i]);
+
+    talloc_free (container->array);
+    container->array = NULL;
+    container->array_size = 0;
+    container->bitmap = bitmap;
+
+    return TRUE;
+}
+
+/* Insert a new, empty container with the given key at index 'i'.
+ * Returns NULL if memory allocation fails. */
+static container_t *
+_insert_container (notmuch_doc_id_set_t *doc_ids, unsigned int i,
+		   unsigned int key)
+{
+    container_t *container;
+
+    if (doc_ids->num_containers == doc_ids->size) {
+	unsigned int size = doc_ids->size ? 2 * doc_ids->size : 4;
+	container_t *containers;
+
+	containers = talloc_realloc (doc_ids, doc_ids->containers,
+				     container_t, size);
+	if (unlikely (containers == NULL))
+	    return NULL;
+	doc_ids->containers = containers;
+	doc_ids->size = size;
+    }
+
+    memmove (&doc_ids->containers[i + 1], &doc_ids->containers[i],
+	     (doc_ids->num_containers - i) * sizeof (container_t));
+    doc_ids->num_containers++;
+
+    container = &doc_ids->containers[i];
+    container->key = key;
+    container->count = 0;
+    container->array = NULL;
+    container->array_size = 0;
+    container->bitmap = NULL;
+
+    return container;
+}
+
+notmuch_bool_t
+_notmuch_doc_id_set_add (notmuch_doc_id_set_t *doc_ids,
+			 unsigned int doc_id)
+{
+    unsigned int key = CONTAINER_KEY (doc_id);
+    uint16_t low = CONTAINER_LOW (doc_id);
+    container_t *container;
+    unsigned int i;
+
+    i = _find_container (doc_ids, key);
+    if (i == doc_ids->num_containers || doc_ids->containers[i].key != key) {
+	if (_insert_container (doc_ids, i, key) == NULL)
+	    return FALSE;
+    }
+
+    container = &doc_ids->containers[i];
+
+    if (container->bitmap) {
+	if (container->bitmap[BITMAP_WORD (low)] & BITMAP_BIT (low))
+	    return TRUE;
+	container->bitmap[BITMAP_WORD (low)] |= BITMAP_BIT (low);
+	container->count++;
+	doc_ids->count++;
+	return TRUE;
+    }
+
+    i = _find_in_array (container, low);
+    if (i < container->count && container->array[i] == low)
+	return TRUE;
+
+    if (container->count == CONTAINER_ARRAY_MAX) {
+	if (! _container_to_bitmap (doc_ids, container))
+	    return FALSE;
+	container->bitmap[BITMAP_WORD (low)] |= BITMAP_BIT (low);
+	container->count++;
+	doc_ids->count++;
+	return TRUE;
+    }
+
+    if (container->count == container->array_size) {
+	unsigned int size = container->array_size ? 2 * container->array_size : 4;
+	uint16_t *array;
+
+	if (size > CONTAINER_ARRAY_MAX)
+	    size = CONTAINER_ARRAY_MAX;
+	array = talloc_realloc (doc_ids, container->array, uint16_t, size);
+	if (unlikely (array == NULL))
+	    return FALSE;
+	container->array = array;
+	container->array_size = size;
+    }
+
+    memmove (&container->array[i + 1], &container->array[i],
+	     (container->count - i) * sizeof (uint16_t));
+    container->array[i] = low;
+    container->count++;
+    doc_ids->count++;
+
+    return TRUE;
+}
+
+notmuch_bool_t
+_notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
+			      unsigned int doc_id)
+{
+    uint16_t low = CONTAINER_LOW (doc_id);
+    container_t *container;
+    unsigned int i;
+
+    container = _get_container (doc_ids, CONTAINER_KEY (doc_id));
+    if (container == NULL)
+	return FALSE;
+
+    if (container->bitmap)
+	return (container->bitmap[BITMAP_WORD (low)] & BITMAP_BIT (low)) != 0;
+
+    i = _find_in_array (container, low);
+    return i < container->count && container->array[i] == low;
+}
+
+void
+_notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
+			    unsigned int doc_id)
+{
+    uint16_t low = CONTAINER_LOW (doc_id);
+    container_t *container;
+    unsigned int i;
+
+    container = _get_container (doc_ids, CONTAINER_KEY (doc_id));
+    if (container == NULL)
+	return;
+
+    if (container->bitmap) {
+	if (container->bitmap[BITMAP_WORD (low)] & BITMAP_BIT (low)) {
+	    container->bitmap[BITMAP_WORD (low)] &= ~BITMAP_BIT (low);
+	    container->count--;
+	    doc_ids->count--;
+	}
+	return;
+    }
+
+    i = _find_in_array (container, low);
+    if (i < container->count && container->array[i] == low) {
+	memmove (&container->array[i], &container->array[i + 1],
+		 (container->count - i - 1) * sizeof (uint16_t));
+	container->count--;
+	doc_ids->count--;
+    }
+}
+
+unsigned int
+_notmuch_doc_id_set_count (notmuch_doc_id_set_t *doc_ids)
+{
+    return doc_ids->count;
+}
+
+/* Find the smallest member of 'doc_ids' greater than *doc_id and
+ * store it in *doc_id. Returns FALSE if there is no such member.
+ *
+ * So all members can be visited in increasing order with:
+ *
+ *	doc_id = 0;
+ *	while (_notmuch_doc_id_set_next (doc_ids, &doc_id))
+ *	    ...
+ *
+ * (since 0 is never a valid document ID).
+ */
+notmuch_bool_t
+_notmuch_doc_id_set_next (notmuch_doc_id_set_t *doc_ids,
+			  unsigned int *doc_id)
+{
+    unsigned int start, i, j, word;
+    container_t *container;
+    uint64_t bits;
+
+    if (*doc_id == UINT_MAX)
+	return FALSE;
+
+    start = *doc_id + 1;
+
+    for (i = _find_container (doc_ids, CONTAINER_KEY (start));
+	 i < doc_ids->num_containers;
+	 i++)
+    {
+	unsigned int low = 0;
+
+	container = &doc_ids->containers[i];
+	if (container->key == CONTAINER_KEY (start))
+	    low = CONTAINER_LOW (start);
+
+	if (container->count == 0)
+	    continue;
+
+	if (container->bitmap) {
+	    word = BITMAP_WORD (low);
+	    bits = container->bitmap[word] & (~(uint64_t) 0 << (low % 64));
+	    while (bits == 0 && ++word < BITMAP_WORDS)
+		bits = container->bitmap[word];
+	    if (bits) {
+		*doc_id = (container->key << CONTAINER_BITS) |
+		    (word * 64 + __builtin_ctzll (bits));
+		return TRUE;
+	    }
+	} else {
+	    j = _find_in_array (container, low);
+	    if (j < container->count) {
+		*doc_id = (container->key << CONTAINER_BITS) | container->array[j];
+		return TRUE;
+	    }
+	}
+    }
+
+    return FALSE;
+}
+
+/* Store the members of 'container', (which may be NULL for an empty
+ * container), as a bitmap in 'bits'. */
+static void
+_container_get_bits (container_t *container, uint64_t *bits)
+{
+    unsigned int i;
+
+    if (container && container->bitmap) {
+	memcpy (bits, container->bitmap, BITMAP_WORDS * sizeof (uint64_t));
+	return;
+    }
+
+    memset (bits, 0, BITMAP_WORDS * sizeof (uint64_t));
+    if (container == NULL)
+	return;
+
+    for (i = 0; i < container->count; i++)
+	bits[BITMAP_WORD (container->array[i])] |= BITMAP_BIT (container->array[i]);
+}
+
+/* Append a container with the given key, (which must be greater than
+ * that of any container of 'doc_ids'), holding the members in 'bits',
+ * as an array or a bitmap depending on their number. */
+static notmuch_bool_t
+_append_container_bits (notmuch_doc_id_set_t *doc_ids, unsigned int key,
+			const uint64_t *bits)
+{
+    container_t *container;
+    unsigned int count = 0, word, i;
+    uint64_t word_bits;
+
+    for (word = 0; word < BITMAP_WORDS; word++)
+	count += __builtin_popcountll (bits[word]);
+
+    if (count == 0)
+	return TRUE;
+
+    container = _insert_container (doc_ids, doc_ids->num_containers, key);
+    if (unlikely (container == NULL))
+	return FALSE;
+
+    if (count > CONTAINER_ARRAY_MAX) {
+	container->bitmap = talloc_array (doc_ids, uint64_t, BITMAP_WORDS);
+	if (unlikely (container->bitmap == NULL))
+	    return FALSE;
+	memcpy (container->bitmap, bits, BITMAP_WORDS * sizeof (uint64_t));
+    } else {
+	container->array = talloc_array (doc_ids, uint16_t, count);
+	if (unlikely (container->array == NULL))
+	    return FALSE;
+	container->array_size = count;
+
+	i = 0;
+	for (word = 0; word < BITMAP_WORDS; word++) {
+	    for (word_bits = bits[word]; word_bits; word_bits &= word_bits - 1)
+		container->array[i++] = word * 64 + __builtin_ctzll (word_bits);
+	}
+    }
+
+    container->count = count;
+    doc_ids->count += count;
+
+    return TRUE;
+}
+
+typedef enum {
+    DOC_ID_SET_UNION,
+    DOC_ID_SET_INTERSECTION,
+    DOC_ID_SET_DIFFERENCE
+} doc_id_set_op_t;
+
+/* Combine 'a' and 'b' into a new set, allocated with 'ctx'.
+ *
+ * Each pair of containers with the same key is combined as a pair of
+ * bitmaps, a word at a time, in a loop simple enough for the compiler
+ * to vectorize. */
+static notmuch_doc_id_set_t *
+_notmuch_doc_id_set_combine (void *ctx, notmuch_doc_id_set_t *a,
+			     notmuch_doc_id_set_t *b, doc_id_set_op_t op)
+{
+    notmuch_doc_id_set_t *result;
+    container_t *container_a, *container_b;
+    uint64_t bits_a[BITMAP_WORDS], bits_b[BITMAP_WORDS];
+    unsigned int i = 0, j = 0, key, word;
+
+    result = _notmuch_doc_id_set_create (ctx);
+    if (unlikely (result == NULL))
+	return NULL;
+
+    while (i < a->num_containers || j < b->num_containers) {
+	container_a = NULL;
+	container_b = NULL;
+
+	if (i < a->num_containers &&
+	    (j == b->num_containers ||
+	     a->containers[i].key <= b->containers[j].key))
+	{
+	    container_a = &a->containers[i];
+	}
+	if (j < b->num_containers &&
+	    (i == a->num_containers ||
+	     b->containers[j].key <= a->containers[i].key))
+	{
+	    container_b = &b->containers[j];
+	}
+
+	key = container_a ? container_a->key : container_b->key;
+	if (container_a)
+	    i++;
+	if (container_b)
+	    j++;
+
+	if (op == DOC_ID_SET_INTERSECTION && (! container_a || ! container_b))
+	    continue;
+	if (op == DOC_ID_SET_DIFFERENCE && ! container_a)
+	    continue;
+
+	_container_get_bits (container_a, bits_a);
+	_container_get_bits (container_b, bits_b);
+
+	switch (op) {
+	case DOC_ID_SET_UNION:
+	    for (word = 0; word < BITMAP_WORDS; word++)
+		bits_a[word] |= bits_b[word];
+	    break;
+	case DOC_ID_SET_INTERSECTION:
+	    for (word = 0; word < BITMAP_WORDS; word++)
+		bits_a[word] &= bits_b[word];
+	    break;
+	case DOC_ID_SET_DIFFERENCE:
+	    for (word = 0; word < BITMAP_WORDS; word++)
+		bits_a[word] &= ~bits_b[word];
+	    break;
+	}
+
+	if (! _append_container_bits (result, key, bits_a)) {
+	    talloc_free (result);
+	    return NULL;
+	}
+    }
+
+    return result;
+}
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_union (void *ctx, notmuch_doc_id_set_t *a,
+			   notmuch_doc_id_set_t *b)
+{
+    return _notmuch_doc_id_set_combine (ctx, a, b, DOC_ID_SET_UNION);
+}
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_intersection (void *ctx, notmuch_doc_id_set_t *a,
+				  notmuch_doc_id_set_t *b)
+{
+    return _notmuch_doc_id_set_combine (ctx, a, b, DOC_ID_SET_INTERSECTION);
+}
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_difference (void *ctx, notmuch_doc_id_set_t *a,
+				notmuch_doc_id_set_t *b)
+{
+    return _notmuch_doc_id_set_combine (ctx, a, b, DOC_ID_SET_DIFFERENCE);
+}
+
+/* A serialised set is its number of containers, and then for each
+ * container its key and its number of members, followed by either
+ * its bitmap, (if it has more than CONTAINER_ARRAY_MAX members), or
+ * its members, as 16-bit values in increasing order. All numbers are
+ * in native byte order, and need not be aligned. */
+char *
+_notmuch_doc_id_set_serialise (void *ctx, notmuch_doc_id_set_t *doc_ids,
+			       size_t *size)
+{
+    container_t *container;
+    uint64_t bits[BITMAP_WORDS], word_bits;
+    uint32_t header[2];
+    uint16_t low;
+    unsigned int i, word;
+    char *buffer, *pos;
+
+    *size = sizeof (uint32_t);
+    for (i = 0; i < doc_ids->num_containers; i++) {
+	container = &doc_ids->containers[i];
+	*size += sizeof (header);
+	if (container->count > CONTAINER_ARRAY_MAX)
+	    *size += BITMAP_WORDS * sizeof (uint64_t);
+	else
+	    *size += container->count * sizeof (uint16_t);
+    }
+
+    buffer = talloc_size (ctx, *size);
+    if (unlikely (buffer == NULL))
+	return NULL;
+
+    pos = buffer;
+    header[0] = doc_ids->num_containers;
+    memcpy (pos, header, sizeof (uint32_t));
+    pos += sizeof (uint32_t);
+
+    for (i = 0; i < doc_ids->num_containers; i++) {
+	container = &doc_ids->containers[i];
+
+	header[0] = container->key;
+	header[1] = container->count;
+	memcpy (pos, header, sizeof (header));
+	pos += sizeof (header);
+
+	if (container->count > CONTAINER_ARRAY_MAX) {
+	    _container_get_bits (container, bits);
+	    memcpy (pos, bits, sizeof (bits));
+	    pos += sizeof (bits);
+	} else if (container->bitmap) {
+	    for (word = 0; word < BITMAP_WORDS; word++) {
+		for (word_bits = container->bitmap[word]; word_bits;
+		     word_bits &= word_bits - 1)
+		{
+		    low = word * 64 + __builtin_ctzll (word_bits);
+		    memcpy (pos, &low, sizeof (low));
+		    pos += sizeof (low);
+		}
+	    }
+	} else {
+	    memcpy (pos, container->array, container->count * sizeof (uint16_t));
+	    pos += container->count * sizeof (uint16_t);
+	}
+    }
+
+    return buffer;
+}
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_deserialise (void *ctx, const char *buffer, size_t size)
+{
+    notmuch_doc_id_set_t *doc_ids;
+    const char *pos = buffer, *end = buffer + size;
+    uint64_t bits[BITMAP_WORDS];
+    uint32_t num_containers, header[2];
+    uint16_t low;
+    unsigned int i, j;
+
+    doc_ids = _notmuch_doc_id_set_create (ctx);
+    if (unlikely (doc_ids == NULL))
+	return NULL;
+
+    if ((size_t) (end - pos) < sizeof (uint32_t))
+	goto FAIL;
+    memcpy (&num_containers, pos, sizeof (uint32_t));
+    pos += sizeof (uint32_t);
+
+    for (i = 0; i < num_containers; i++) {
+	if ((size_t) (end - pos) < sizeof (header))
+	    goto FAIL;
+	memcpy (header, pos, sizeof (header));
+	pos += sizeof (header);
+
+	if (header[0] >= CONTAINER_SIZE || header[1] > CONTAINER_SIZE ||
+	    (doc_ids->num_containers &&
+	     doc_ids->containers[doc_ids->num_containers - 1].key >= header[0]))
+	{
+	    goto FAIL;
+	}
+
+	if (header[1] > CONTAINER_ARRAY_MAX) {
+	    if ((size_t) (end - pos) < sizeof (bits))
+		goto FAIL;
+	    memcpy (bits, pos, sizeof (bits));
+	    pos += sizeof (bits);
+	} else {
+	    if ((size_t) (end - pos) < header[1] * sizeof (uint16_t))
+		goto FAIL;
+	    memset (bits, 0, sizeof (bits));
+	    for (j = 0; j < header[1]; j++) {
+		memcpy (&low, pos, sizeof (low));
+		pos += sizeof (low);
+		bits[BITMAP_WORD (low)] |= BITMAP_BIT (low);
+	    }
+	}
+
+	if (! _append_container_bits (doc_ids, header[0], bits))
+	    goto FAIL;
+    }
+
+    if (pos != end)
+	goto FAIL;
+
+    return doc_ids;
+
+  FAIL:
+    talloc_free (doc_ids);
+    return NULL;
+}
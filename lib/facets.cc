@@ -0,0 +1,331 @@
+/* facets.cc - Counts of the values of message properties for a query
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <glib.h> /* GHashTable */
+
+/* A facet is a property of messages, (such as the folder holding a
+ * message, or the month in which it was sent), and its histogram for
+ * a query is the number of matching messages with each value of the
+ * property.
+ *
+ * All requested histograms are computed in a single pass over the
+ * matches of the query, by a Xapian::MatchSpy which is shown each
+ * matching document in turn. Values are read from the value slots of
+ * the document wherever possible, (which is much cheaper than reading
+ * its terms), so only the folder facet needs the terms.
+ */
+
+struct _notmuch_facets {
+    notmuch_database_t *notmuch;
+
+    /* For each facet, a hash from each value of the facet to its
+     * count, (stored with GUINT_TO_POINTER), or NULL if the facet was
+     * not requested. */
+    GHashTable *counts[NOTMUCH_FACET_LAST_FACET];
+
+    /* The path of each directory seen by the folder facet, by
+     * directory document ID, (within the combined database, see
+     * notmuch_database_open_multi). */
+    GHashTable *directories;
+};
+
+static int
+_notmuch_facets_destructor (notmuch_facets_t *facets)
+{
+    unsigned int i;
+
+    for (i = 0; i < NOTMUCH_FACET_LAST_FACET; i++) {
+	if (facets->counts[i])
+	    g_hash_table_unref (facets->counts[i]);
+    }
+
+    if (facets->directories)
+	g_hash_table_unref (facets->directories);
+
+    return 0;
+}
+
+/* Add one to the count of 'value' within the histogram of 'facet'. */
+static void
+_facet_count (notmuch_facets_t *facets, notmuch_facet_t facet,
+	      const char *value)
+{
+    gpointer key, count;
+
+    if (g_hash_table_lookup_extended (facets->counts[facet], value,
+				      &key, &count))
+    {
+	g_hash_table_insert (facets->counts[facet], key,
+			     GUINT_TO_POINTER (GPOINTER_TO_UINT (count) + 1));
+    } else {
+	g_hash_table_insert (facets->counts[facet],
+			     talloc_strdup (facets, value),
+			     GUINT_TO_POINTER (1));
+    }
+}
+
+/* Return the domain of the first address in the From header 'from',
+ * (converted to lowercase), allocated with 'ctx' as the talloc
+ * context, or an empty string if there is no address. */
+static char *
+_from_domain (void *ctx, const char *from)
+{
+    const char *at, *end;
+    char *domain, *s;
+
+    at = strchr (from, '@');
+    if (at == NULL)
+	return talloc_strdup (ctx, "");
+
+    at++;
+    for (end = at; *end && *end != '>' && *end != ',' &&
+	     ! isspace ((unsigned char) *end); end++)
+	;
+
+    domain = talloc_strndup (ctx, at, end - at);
+    for (s = domain; *s; s++)
+	*s = tolower ((unsigned char) *s);
+
+    return domain;
+}
+
+class FacetSpy : public Xapian::MatchSpy {
+    notmuch_facets_t *facets;
+    std::string direntry_prefix;
+
+    void count_folders (const Xapian::Document &doc);
+
+  public:
+    FacetSpy (notmuch_facets_t *facets_arg)
+	: facets (facets_arg), direntry_prefix (_find_prefix ("file-direntry"))
+    {
+    }
+
+    void operator() (const Xapian::Document &doc, double weight);
+};
+
+/* Count each folder holding a file of the message once, (so a message
+ * with two files in the same folder only counts once). */
+void
+FacetSpy::count_folders (const Xapian::Document &doc)
+{
+    GHashTable *seen;
+    Xapian::TermIterator i, end;
+    unsigned int directory_id;
+    const char *path;
+    char *colon;
+
+    seen = g_hash_table_new (NULL, NULL);
+
+    i = doc.termlist_begin ();
+    end = doc.termlist_end ();
+    for (i.skip_to (direntry_prefix); i != end; i++) {
+	const std::string &term = *i;
+
+	if (term.compare (0, direntry_prefix.size (), direntry_prefix) != 0)
+	    break;
+
+	directory_id = strtoul (term.c_str () + direntry_prefix.size (),
+				&colon, 10);
+	if (*colon != ':')
+	    INTERNAL_ERROR ("malformed direntry");
+	directory_id = _notmuch_database_subdb_doc_id (facets->notmuch,
+						       doc.get_docid (),
+						       directory_id);
+
+	if (g_hash_table_lookup_extended (seen,
+					  GUINT_TO_POINTER (directory_id),
+					  NULL, NULL))
+	    continue;
+	g_hash_table_insert (seen, GUINT_TO_POINTER (directory_id), NULL);
+
+	path = (const char *) g_hash_table_lookup (
+	    facets->directories, GUINT_TO_POINTER (directory_id));
+	if (path == NULL) {
+	    path = _notmuch_database_get_directory_path (facets,
+							 facets->notmuch,
+							 directory_id);
+	    g_hash_table_insert (facets->directories,
+				 GUINT_TO_POINTER (directory_id),
+				 (gpointer) path);
+	}
+
+	_facet_count (facets, NOTMUCH_FACET_FOLDER, path);
+    }
+
+    g_hash_table_unref (seen);
+}
+
+void
+FacetSpy::operator() (const Xapian::Document &doc, unused (double weight))
+{
+    void *local = talloc_new (facets);
+    struct tm tm;
+    time_t timestamp;
+    char bucket[16];
+
+    if (facets->counts[NOTMUCH_FACET_FOLDER])
+	count_folders (doc);
+
+    if (facets->counts[NOTMUCH_FACET_DOMAIN]) {
+	_facet_count (facets, NOTMUCH_FACET_DOMAIN,
+		      _from_domain (local,
+				    doc.get_value (NOTMUCH_VALUE_FROM).c_str ()));
+    }
+
+    if (facets->counts[NOTMUCH_FACET_YEAR] ||
+	facets->counts[NOTMUCH_FACET_MONTH])
+    {
+	timestamp = Xapian::sortable_unserialise (
+	    doc.get_value (NOTMUCH_VALUE_TIMESTAMP));
+	gmtime_r (&timestamp, &tm);
+
+	if (facets->counts[NOTMUCH_FACET_YEAR]) {
+	    strftime (bucket, sizeof (bucket), "%Y", &tm);
+	    _facet_count (facets, NOTMUCH_FACET_YEAR, bucket);
+	}
+
+	if (facets->counts[NOTMUCH_FACET_MONTH]) {
+	    strftime (bucket, sizeof (bucket), "%Y-%m", &tm);
+	    _facet_count (facets, NOTMUCH_FACET_MONTH, bucket);
+	}
+    }
+
+    talloc_free (local);
+}
+
+/* Compute the histograms of the 'num_facets' facets in 'facet_list'
+ * over the matches of 'query', (with 'ctx' as the talloc context for
+ * the result).
+ *
+ * This function returns NULL in the case of any error.
+ */
+notmuch_facets_t *
+_notmuch_facets_count (void *ctx,
+		       notmuch_database_t *notmuch,
+		       const Xapian::Query &query,
+		       const notmuch_facet_t *facet_list,
+		       unsigned int num_facets)
+{
+    notmuch_facets_t *facets;
+    unsigned int i;
+
+    facets = talloc_zero (ctx, notmuch_facets_t);
+    if (unlikely (facets == NULL))
+	return NULL;
+
+    talloc_set_destructor (facets, _notmuch_facets_destructor);
+
+    facets->notmuch = notmuch;
+    facets->directories = g_hash_table_new (NULL, NULL);
+
+    for (i = 0; i < num_facets; i++) {
+	if (facet_list[i] >= NOTMUCH_FACET_LAST_FACET) {
+	    talloc_free (facets);
+	    return NULL;
+	}
+	if (facets->counts[facet_list[i]] == NULL)
+	    facets->counts[facet_list[i]] = g_hash_table_new (g_str_hash,
+							      g_str_equal);
+    }
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	FacetSpy spy (facets);
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_query (query);
+	enquire.add_matchspy (&spy);
+
+	/* No matches need to be returned, but every one of them must
+	 * be shown to the spy. */
+	enquire.get_mset (0, 0, notmuch->xapian_db->get_doccount ());
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred counting facets: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (facets);
+	return NULL;
+    }
+
+    return facets;
+}
+
+static int
+_compare_strings (const void *a, const void *b)
+{
+    return strcmp (*(const char **) a, *(const char **) b);
+}
+
+notmuch_tags_t *
+notmuch_facets_get_values (notmuch_facets_t *facets, notmuch_facet_t facet)
+{
+    notmuch_string_list_t *list;
+    notmuch_tags_t *tags;
+    unsigned int *counts, i, length;
+    const char **values;
+    GHashTableIter iter;
+    gpointer key, count;
+    void *local;
+
+    if (facet >= NOTMUCH_FACET_LAST_FACET || facets->counts[facet] == NULL)
+	return NULL;
+
+    local = talloc_new (facets);
+    if (unlikely (local == NULL))
+	return NULL;
+
+    length = g_hash_table_size (facets->counts[facet]);
+
+    values = talloc_array (local, const char *, length + 1);
+    counts = talloc_array (local, unsigned int, length + 1);
+    list = _notmuch_string_list_create (local);
+    if (unlikely (values == NULL || counts == NULL || list == NULL))
+	goto FAIL;
+
+    i = 0;
+    g_hash_table_iter_init (&iter, facets->counts[facet]);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+	values[i++] = (const char *) key;
+
+    qsort (values, length, sizeof (const char *), _compare_strings);
+
+    for (i = 0; i < length; i++) {
+	count = g_hash_table_lookup (facets->counts[facet], values[i]);
+	counts[i] = GPOINTER_TO_UINT (count);
+	_notmuch_string_list_append (list, talloc_strdup (list, values[i]));
+    }
+
+    tags = _notmuch_tags_create_with_counts (facets, list, counts);
+    talloc_free (local);
+
+    return tags;
+
+  FAIL:
+    talloc_free (local);
+    return NULL;
+}
+
+void
+notmuch_facets_destroy (notmuch_facets_t *facets)
+{
+    talloc_free (facets);
+}
@@ -150,13 +150,25 @@ notmuch_message_file_restrict_headersv (notmuch_message_file_t *message,
 	header = va_arg (va_headers, char*);
 	if (header == NULL)
 	    break;
-	g_hash_table_insert (message->headers,
-			     xstrdup (header), NULL);
+	notmuch_message_file_restrict_header (message, header);
     }
 
     message->restrict_headers = 1;
 }
 
+void
+notmuch_message_file_restrict_header (notmuch_message_file_t *message,
+				      const char *header)
+{
+    if (message->parsing_started)
+	INTERNAL_ERROR ("notmuch_message_file_restrict_header called after parsing has started");
+
+    if (! g_hash_table_lookup_extended (message->headers, header, NULL, NULL))
+	g_hash_table_insert (message->headers, xstrdup (header), NULL);
+
+    message->restrict_headers = 1;
+}
+
 void
 notmuch_message_file_restrict_headers (notmuch_message_file_t *message, ...)
 {
@@ -25,6 +25,8 @@
 
 #include <gmime/gmime.h>
 
+#include <set>
+
 struct visible _notmuch_message {
     notmuch_database_t *notmuch;
     Xapian::docid doc_id;
@@ -32,6 +34,8 @@ struct visible _notmuch_message {
     char *message_id;
     char *thread_id;
     char *in_reply_to;
+    /* The tags of the message, each of which is the interned name of
+     * the tag in the tag table of the database, (never a copy). */
     notmuch_string_list_t *tag_list;
     notmuch_string_list_t *filename_term_list;
     notmuch_string_list_t *filename_list;
@@ -39,6 +43,17 @@ struct visible _notmuch_message {
     notmuch_message_file_t *message_file;
     notmuch_message_list_t *replies;
     unsigned long flags;
+    /* Whether terms have been added to or removed from doc since it
+     * was read or synchronized, so that its metadata record, (see
+     * _notmuch_message_ensure_metadata), may be out of date. */
+    notmuch_bool_t terms_modified;
+    /* Whether the date, author or subject of the message have been
+     * set since it was read or synchronized, (so that its entry in
+     * the summary of its thread must be formatted again). */
+    notmuch_bool_t headers_modified;
+    /* The index of the cold shard from which doc was read in place of
+     * the stub of a frozen message, (see cold.cc), or -1. */
+    int cold_shard;
 
     Xapian::Document doc;
     Xapian::termcount termpos;
@@ -99,6 +114,9 @@ _notmuch_message_create_for_document (const void *talloc_owner,
 
     message->frozen = 0;
     message->flags = 0;
+    message->terms_modified = FALSE;
+    message->headers_modified = FALSE;
+    message->cold_shard = _notmuch_cold_read (notmuch, doc_id, doc);
 
     /* Each of these will be lazily created as needed. */
     message->message_id = NULL;
@@ -292,6 +310,242 @@ _notmuch_message_get_term (notmuch_message_t *message,
     return value;
 }
 
+/* The metadata of a message, (its thread ID, tags, message ID,
+ * file-direntry terms and In-Reply-To), is kept in the terms of its
+ * document. Reading the terms means decompressing the whole term
+ * list, including every term of the body of the message, so the same
+ * metadata is also stored as a compact record in the
+ * NOTMUCH_VALUE_METADATA value of the document by
+ * _notmuch_message_sync.
+ *
+ * The record is a version byte followed by the thread ID, message ID
+ * and In-Reply-To, the number of tags and each tag, and the number of
+ * file-direntry terms and each of those, (without their prefixes).
+ * Every number, including the length preceding each string, is
+ * stored 7 bits per byte, lowest first, with the top bit set on all
+ * but the last byte.
+ *
+ * Documents written before the record was introduced have no such
+ * value, and are read from their terms as before.
+ *
+ * The record is only rebuilt from the terms when they have been
+ * modified, (see _notmuch_message_sync), except that a change to the
+ * tags alone by _notmuch_message_apply_tag_terms patches the tag list
+ * of the record in place.
+ */
+#define NOTMUCH_METADATA_RECORD_VERSION 1
+
+static void
+_record_append_number (std::string &record, size_t number)
+{
+    while (number >= 0x80) {
+	record += (char) ((number & 0x7f) | 0x80);
+	number >>= 7;
+    }
+    record += (char) number;
+}
+
+static void
+_record_append_string (std::string &record, const char *string)
+{
+    size_t length = string ? strlen (string) : 0;
+
+    _record_append_number (record, length);
+    record.append (string ? string : "", length);
+}
+
+static void
+_record_append_list (std::string &record, notmuch_string_list_t *list)
+{
+    notmuch_string_node_t *node;
+
+    _record_append_number (record, list->length);
+    for (node = list->head; node; node = node->next)
+	_record_append_string (record, node->string);
+}
+
+static notmuch_bool_t
+_record_is_current (const std::string &record)
+{
+    return ! record.empty () && record[0] == NOTMUCH_METADATA_RECORD_VERSION;
+}
+
+static notmuch_bool_t
+_record_read_number (const char **pos, const char *end, size_t *number)
+{
+    unsigned int shift;
+
+    *number = 0;
+    for (shift = 0; *pos < end && shift < 32; shift += 7) {
+	unsigned char byte = *(*pos)++;
+
+	*number |= (size_t) (byte & 0x7f) << shift;
+	if (! (byte & 0x80))
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Return the string at *pos, (with 'ctx' as the talloc context), or
+ * NULL if the record is malformed. */
+static char *
+_record_read_string (void *ctx, const char **pos, const char *end)
+{
+    size_t length;
+    char *string;
+
+    if (! _record_read_number (pos, end, &length) ||
+	length > (size_t) (end - *pos))
+	return NULL;
+
+    string = talloc_strndup (ctx, *pos, length);
+    *pos += length;
+
+    return string;
+}
+
+char *
+_notmuch_message_record_thread_id (void *ctx, const std::string &record)
+{
+    const char *pos, *end;
+
+    if (! _record_is_current (record))
+	return NULL;
+
+    /* The thread ID is the first field of the record. */
+    pos = record.data () + 1;
+    end = record.data () + record.size ();
+
+    return _record_read_string (ctx, &pos, end);
+}
+
+/* Return the list at *pos, (with 'ctx' as the talloc context), or
+ * NULL if the record is malformed. If 'tag_table' is not NULL, the
+ * strings of the list are its interned names rather than copies. */
+static notmuch_string_list_t *
+_record_read_list (void *ctx, const char **pos, const char *end,
+		   notmuch_tag_table_t *tag_table)
+{
+    notmuch_string_list_t *list;
+    size_t count, i;
+    const char *string;
+
+    if (! _record_read_number (pos, end, &count))
+	return NULL;
+
+    list = _notmuch_string_list_create (ctx);
+    for (i = 0; i < count; i++) {
+	string = _record_read_string (list, pos, end);
+	if (string && tag_table) {
+	    const char *copy = string;
+
+	    string = _notmuch_tag_table_intern (tag_table, copy, NULL);
+	    talloc_free ((char *) copy);
+	}
+	if (string == NULL) {
+	    talloc_free (list);
+	    return NULL;
+	}
+	_notmuch_string_list_append_shared (list, string);
+    }
+
+    return list;
+}
+
+/* Return the list of tags of 'message' from the term iterator 'i',
+ * as _notmuch_database_get_terms_with_prefix would, but sharing the
+ * interned names of the tag table of the database.
+ *
+ * Every tag list of a message must be built from interned names, (as
+ * here, or by _record_read_list with the tag table), since
+ * notmuch_messages_collect_tags and the tags of threads compare tags
+ * by address rather than by their strings. */
+static notmuch_string_list_t *
+_notmuch_message_get_tag_terms (notmuch_message_t *message,
+				Xapian::TermIterator &i,
+				Xapian::TermIterator &end)
+{
+    const char *prefix = _find_prefix ("tag");
+    int prefix_len = strlen (prefix);
+    notmuch_string_list_t *list;
+    const char *tag;
+
+    list = _notmuch_string_list_create (message);
+    if (unlikely (list == NULL))
+	return NULL;
+
+    for (i.skip_to (prefix); i != end; i++) {
+	std::string term = *i;
+
+	/* Terminate loop at first term without desired prefix. */
+	if (strncmp (term.c_str (), prefix, prefix_len))
+	    break;
+
+	tag = _notmuch_tag_table_intern (message->notmuch->tag_table,
+					 term.c_str () + prefix_len, NULL);
+	if (unlikely (tag == NULL))
+	    INTERNAL_ERROR ("Could not allocate memory for tag %s",
+			    term.c_str () + prefix_len);
+	_notmuch_string_list_append_shared (list, tag);
+    }
+
+    return list;
+}
+
+/* Read the metadata of 'message' that is not already known from its
+ * metadata record. Returns FALSE, (leaving 'message' unchanged), if
+ * the document has no usable record. */
+static notmuch_bool_t
+_notmuch_message_read_metadata_record (notmuch_message_t *message)
+{
+    std::string record;
+    const char *pos, *end;
+    void *local;
+    char *thread_id, *message_id, *in_reply_to;
+    notmuch_string_list_t *tag_list, *filename_term_list;
+
+    if (message->terms_modified)
+	return FALSE;
+
+    record = message->doc.get_value (NOTMUCH_VALUE_METADATA);
+    if (! _record_is_current (record))
+	return FALSE;
+
+    pos = record.data () + 1;
+    end = record.data () + record.size ();
+
+    local = talloc_new (message);
+    thread_id = _record_read_string (local, &pos, end);
+    message_id = _record_read_string (local, &pos, end);
+    in_reply_to = _record_read_string (local, &pos, end);
+    tag_list = _record_read_list (local, &pos, end,
+				  message->notmuch->tag_table);
+    filename_term_list = _record_read_list (local, &pos, end, NULL);
+    if (! thread_id || ! message_id || ! in_reply_to ||
+	! tag_list || ! filename_term_list || pos != end)
+    {
+	talloc_free (local);
+	return FALSE;
+    }
+
+    if (!message->thread_id)
+	message->thread_id = talloc_steal (message, thread_id);
+    if (!message->tag_list)
+	message->tag_list = talloc_steal (message, tag_list);
+    if (!message->message_id)
+	message->message_id = talloc_steal (message, message_id);
+    if (!message->filename_term_list && !message->filename_list)
+	message->filename_term_list = talloc_steal (message,
+						    filename_term_list);
+    if (!message->in_reply_to)
+	message->in_reply_to = talloc_steal (message, in_reply_to);
+
+    talloc_free (local);
+
+    return TRUE;
+}
+
 void
 _notmuch_message_ensure_metadata (notmuch_message_t *message)
 {
@@ -302,6 +556,9 @@ _notmuch_message_ensure_metadata (notmuch_message_t *message)
 	*filename_prefix = _find_prefix ("file-direntry"),
 	*replyto_prefix = _find_prefix ("replyto");
 
+    if (_notmuch_message_read_metadata_record (message))
+	return;
+
     /* We do this all in a single pass because Xapian decompresses the
      * term list every time you iterate over it.  Thus, while this is
      * slightly more costly than looking up individual fields if only
@@ -319,9 +576,7 @@ _notmuch_message_ensure_metadata (notmuch_message_t *message)
     /* Get tags */
     assert (strcmp (thread_prefix, tag_prefix) < 0);
     if (!message->tag_list) {
-	message->tag_list =
-	    _notmuch_database_get_terms_with_prefix (message, i, end,
-						     tag_prefix);
+	message->tag_list = _notmuch_message_get_tag_terms (message, i, end);
 	_notmuch_string_list_sort (message->tag_list);
     }
 
@@ -351,10 +606,54 @@ _notmuch_message_ensure_metadata (notmuch_message_t *message)
 	message->in_reply_to = talloc_strdup (message, "");
 }
 
+/* Return the metadata record of 'message', (see
+ * _notmuch_message_ensure_metadata), read from its terms. */
+static std::string
+_notmuch_message_metadata_record (notmuch_message_t *message)
+{
+    Xapian::TermIterator i, end;
+    void *local = talloc_new (message);
+    std::string record;
+    char *thread_id, *message_id, *in_reply_to;
+    notmuch_string_list_t *tag_list, *filename_term_list;
+
+    i = message->doc.termlist_begin ();
+    end = message->doc.termlist_end ();
+
+    /* In the order of the prefixes, as for
+     * _notmuch_message_ensure_metadata. */
+    thread_id = _notmuch_message_get_term (message, i, end,
+					   _find_prefix ("thread"));
+    tag_list = _notmuch_database_get_terms_with_prefix (local, i, end,
+							_find_prefix ("tag"));
+    message_id = _notmuch_message_get_term (message, i, end,
+					    _find_prefix ("id"));
+    filename_term_list = _notmuch_database_get_terms_with_prefix (
+	local, i, end, _find_prefix ("file-direntry"));
+    in_reply_to = _notmuch_message_get_term (message, i, end,
+					     _find_prefix ("replyto"));
+
+    record += (char) NOTMUCH_METADATA_RECORD_VERSION;
+    _record_append_string (record, thread_id);
+    _record_append_string (record, message_id);
+    _record_append_string (record, in_reply_to);
+    _record_append_list (record, tag_list);
+    _record_append_list (record, filename_term_list);
+
+    talloc_free (thread_id);
+    talloc_free (message_id);
+    talloc_free (in_reply_to);
+    talloc_free (local);
+
+    return record;
+}
+
 static void
 _notmuch_message_invalidate_metadata (notmuch_message_t *message,
 				      const char *prefix_name)
 {
+    message->terms_modified = TRUE;
+
     if (strcmp ("thread", prefix_name) == 0) {
 	talloc_free (message->thread_id);
 	message->thread_id = NULL;
@@ -409,10 +708,52 @@ _notmuch_message_ensure_message_file (notmuch_message_t *message)
     message->message_file = _notmuch_message_file_open_ctx (message, filename);
 }
 
+/* Return the value of 'header' from the HEADERS value of 'message',
+ * (see _notmuch_message_set_stored_headers), or NULL if it was not
+ * stored for this message. */
+static const char *
+_notmuch_message_get_stored_header (notmuch_message_t *message,
+				    const char *header)
+{
+    std::string stored;
+    const char *pos, *end, *found = NULL;
+    void *local;
+    char *name, *value;
+    size_t count, i;
+
+    stored = message->doc.get_value (NOTMUCH_VALUE_HEADERS);
+    if (stored.empty ())
+	return NULL;
+
+    pos = stored.data ();
+    end = stored.data () + stored.size ();
+
+    local = talloc_new (message);
+    if (! _record_read_number (&pos, end, &count))
+	count = 0;
+
+    for (i = 0; i < count; i++) {
+	name = _record_read_string (local, &pos, end);
+	value = _record_read_string (local, &pos, end);
+	if (name == NULL || value == NULL)
+	    break;
+
+	if (strcasecmp (name, header) == 0) {
+	    found = talloc_steal (message, value);
+	    break;
+	}
+    }
+
+    talloc_free (local);
+
+    return found;
+}
+
 const char *
 notmuch_message_get_header (notmuch_message_t *message, const char *header)
 {
     std::string value;
+    const char *stored;
 
     /* Fetch header from the appropriate xapian value field if
      * available */
@@ -426,6 +767,11 @@ notmuch_message_get_header (notmuch_message_t *message, const char *header)
     if (!value.empty())
 	return talloc_strdup (message, value.c_str ());
 
+    /* Then from the headers stored when the message was added. */
+    stored = _notmuch_message_get_stored_header (message, header);
+    if (stored)
+	return stored;
+
     /* Otherwise fall back to parsing the file */
     _notmuch_message_ensure_message_file (message);
     if (message->message_file == NULL)
@@ -694,11 +1040,13 @@ _notmuch_message_ensure_filename_list (notmuch_message_t *message)
 
 	*colon = '\0';
 
-	db_path = notmuch_database_get_path (message->notmuch);
+	db_path = _notmuch_database_subdb_path (message->notmuch,
+						message->doc_id);
 
-	directory = _notmuch_database_get_directory_path (local,
-							  message->notmuch,
-							  directory_id);
+	directory = _notmuch_database_get_directory_path (
+	    local, message->notmuch,
+	    _notmuch_database_subdb_doc_id (message->notmuch, message->doc_id,
+					    directory_id));
 
 	if (strlen (directory))
 	    filename = talloc_asprintf (message, "%s/%s/%s",
@@ -825,8 +1173,80 @@ _notmuch_message_set_header_values (notmuch_message_t *message,
 
     message->doc.add_value (NOTMUCH_VALUE_TIMESTAMP,
 			    Xapian::sortable_serialise (time_value));
+    _notmuch_date_add_bucket_terms (message->doc, time_value);
     message->doc.add_value (NOTMUCH_VALUE_FROM, from);
     message->doc.add_value (NOTMUCH_VALUE_SUBJECT, subject);
+    message->headers_modified = TRUE;
+}
+
+/* Store the headers of 'message_file' chosen with
+ * notmuch_database_set_stored_headers in the HEADERS value of
+ * 'message', so that notmuch_message_get_header need not open the
+ * file again.
+ *
+ * The value is the number of headers followed by the name and value
+ * of each, encoded as for the metadata record, (see
+ * _notmuch_message_ensure_metadata). A header missing from the file
+ * is stored with an empty value, as notmuch_message_get_header would
+ * return from the file.
+ */
+void
+_notmuch_message_set_stored_headers (notmuch_message_t *message,
+				     notmuch_message_file_t *message_file)
+{
+    notmuch_database_t *notmuch = message->notmuch;
+    std::string stored;
+    unsigned int i;
+
+    _record_append_number (stored, notmuch->num_stored_headers);
+    for (i = 0; i < notmuch->num_stored_headers; i++) {
+	_record_append_string (stored, notmuch->stored_headers[i]);
+	_record_append_string (stored,
+			       notmuch_message_file_get_header (
+				   message_file, notmuch->stored_headers[i]));
+    }
+
+    message->doc.add_value (NOTMUCH_VALUE_HEADERS, stored);
+}
+
+/* Add the stored headers, (from its file, if it can be read), and the
+ * metadata record to the document of a message added by an earlier
+ * version of notmuch, (see notmuch_database_upgrade).
+ *
+ * Unlike _notmuch_message_sync, this does not give the message a new
+ * revision, since nothing visible to the user has changed. */
+void
+_notmuch_message_backfill (notmuch_message_t *message)
+{
+    Xapian::WritableDatabase *db;
+
+    if (message->doc.get_value (NOTMUCH_VALUE_HEADERS).empty ()) {
+	_notmuch_message_ensure_message_file (message);
+	if (message->message_file)
+	    _notmuch_message_set_stored_headers (message,
+						 message->message_file);
+    }
+
+    message->doc.add_value (NOTMUCH_VALUE_METADATA,
+			    _notmuch_message_metadata_record (message));
+    message->terms_modified = FALSE;
+
+    db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
+    db->replace_document (message->doc_id, message->doc);
+}
+
+/* Record that 'message', if it was read from a cold shard, is moved
+ * back into the database by the write about to be made, (see
+ * cold.cc). */
+static void
+_notmuch_message_thaw_document (notmuch_message_t *message)
+{
+    if (message->cold_shard < 0)
+	return;
+
+    _notmuch_cold_thaw (message->notmuch, message->doc_id,
+			message->cold_shard);
+    message->cold_shard = -1;
 }
 
 /* Synchronize changes made to message->doc out into the database. */
@@ -838,8 +1258,27 @@ _notmuch_message_sync (notmuch_message_t *message)
     if (message->notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
 	return;
 
+    _notmuch_message_thaw_document (message);
+
+    message->doc.add_value (NOTMUCH_VALUE_LAST_MOD,
+			    Xapian::sortable_serialise (
+				_notmuch_database_new_revision (message->notmuch)));
+    if (message->terms_modified ||
+	! _record_is_current (message->doc.get_value (NOTMUCH_VALUE_METADATA)))
+    {
+	message->doc.add_value (NOTMUCH_VALUE_METADATA,
+				_notmuch_message_metadata_record (message));
+	message->terms_modified = FALSE;
+    }
+
     db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
     db->replace_document (message->doc_id, message->doc);
+
+    _notmuch_columns_touch (message->notmuch, message->doc_id);
+    _notmuch_tag_bitmaps_touch (message->notmuch, message->doc_id);
+    _notmuch_thread_summary_add_message (message->notmuch, message,
+					 message->headers_modified);
+    message->headers_modified = FALSE;
 }
 
 /* Delete a message document from the database. */
@@ -853,8 +1292,15 @@ _notmuch_message_delete (notmuch_message_t *message)
     if (status)
 	return status;
 
+    _notmuch_message_thaw_document (message);
+    _notmuch_thread_summary_remove_message (message->notmuch, message);
+    _notmuch_database_new_revision (message->notmuch);
+
     db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
     db->delete_document (message->doc_id);
+    _notmuch_columns_touch (message->notmuch, message->doc_id);
+    _notmuch_tag_bitmaps_touch (message->notmuch, message->doc_id);
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
@@ -1027,6 +1473,120 @@ notmuch_message_remove_tag (notmuch_message_t *message, const char *tag)
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* Return the tag list of the metadata record 'record', (with 'ctx' as
+ * the talloc context), and set *start and *length to the position and
+ * size of the list within the record. Returns NULL if the record is
+ * not current, (or is malformed). */
+static notmuch_string_list_t *
+_record_read_tags (void *ctx, const std::string &record,
+		   size_t *start, size_t *length)
+{
+    notmuch_string_list_t *tag_list;
+    const char *pos, *end;
+    unsigned int i;
+
+    if (! _record_is_current (record))
+	return NULL;
+
+    pos = record.data () + 1;
+    end = record.data () + record.size ();
+
+    /* Skip the thread ID, message ID and In-Reply-To. */
+    for (i = 0; i < 3; i++) {
+	if (_record_read_string (ctx, &pos, end) == NULL)
+	    return NULL;
+    }
+
+    *start = pos - record.data ();
+    tag_list = _record_read_list (ctx, &pos, end, NULL);
+    *length = pos - record.data () - *start;
+
+    return tag_list;
+}
+
+notmuch_bool_t
+_notmuch_message_apply_tag_terms (notmuch_message_t *message,
+				  const notmuch_tag_operation_t *ops,
+				  unsigned int num_ops)
+{
+    Xapian::TermIterator i;
+    notmuch_bool_t present, changed = FALSE;
+    notmuch_string_list_t *tag_list = NULL;
+    notmuch_string_node_t *node;
+    std::set<std::string> tag_set;
+    std::set<std::string>::iterator t;
+    std::string record, term, tags;
+    size_t tags_start = 0, tags_length = 0;
+    unsigned int op;
+    void *local;
+
+    local = talloc_new (message);
+
+    /* Whether each tag is present is read from the tag list of the
+     * metadata record, (which is current unless the terms have been
+     * modified since it was built), and only read from the term list
+     * of the document when there is no such record. */
+    if (! message->terms_modified) {
+	record = message->doc.get_value (NOTMUCH_VALUE_METADATA);
+	tag_list = _record_read_tags (local, record,
+				      &tags_start, &tags_length);
+    }
+    if (tag_list) {
+	for (node = tag_list->head; node; node = node->next)
+	    tag_set.insert (node->string);
+    }
+
+    for (op = 0; op < num_ops; op++) {
+	term = _find_prefix ("tag");
+	term += ops[op].tag;
+
+	if (tag_list) {
+	    present = tag_set.count (ops[op].tag) > 0;
+	} else {
+	    i = message->doc.termlist_begin ();
+	    i.skip_to (term);
+	    present = (i != message->doc.termlist_end () && *i == term);
+	}
+
+	/* A change which would do nothing is skipped, (so that the
+	 * message is not synchronized at all). */
+	if (present == ! ops[op].remove)
+	    continue;
+
+	if (ops[op].remove) {
+	    message->doc.remove_term (term);
+	    tag_set.erase (ops[op].tag);
+	} else {
+	    message->doc.add_term (term, 0);
+	    tag_set.insert (ops[op].tag);
+	}
+	changed = TRUE;
+    }
+
+    if (changed && tag_list) {
+	/* The tag list of the record is patched in place, leaving the
+	 * rest of the record as it is, so that it need not be rebuilt
+	 * from the whole term list. The record holds the tags in the
+	 * order of their terms, as does the set. */
+	_record_append_number (tags, tag_set.size ());
+	for (t = tag_set.begin (); t != tag_set.end (); t++)
+	    _record_append_string (tags, t->c_str ());
+
+	record.replace (tags_start, tags_length, tags);
+	message->doc.add_value (NOTMUCH_VALUE_METADATA, record);
+
+	/* The tags are read again from the record when next needed. */
+	talloc_unlink (message, message->tag_list);
+	message->tag_list = NULL;
+    } else if (changed) {
+	_notmuch_message_invalidate_metadata (message, "tag");
+    }
+
+    talloc_free (local);
+
+    return changed;
+}
+
 notmuch_status_t
 notmuch_message_maildir_flags_to_tags (notmuch_message_t *message)
 {
@@ -158,12 +158,16 @@ notmuch_messages_collect_tags (notmuch_messages_t *messages)
     tags = _notmuch_string_list_create (messages);
     if (tags == NULL) return NULL;
 
-    htable = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+    /* The tags of messages are the interned names of the tag table of
+     * the database, (see tag-table.c, and the tag_list of a message in
+     * message.cc), so each distinct tag has a single address, which
+     * outlives the messages. */
+    htable = g_hash_table_new (NULL, NULL);
 
     while ((msg = notmuch_messages_get (messages))) {
 	msg_tags = notmuch_message_get_tags (msg);
 	while ((tag = notmuch_tags_get (msg_tags))) {
-	    g_hash_table_insert (htable, xstrdup (tag), NULL);
+	    g_hash_table_insert (htable, (gpointer) tag, NULL);
 	    notmuch_tags_move_to_next (msg_tags);
 	}
 	notmuch_tags_destroy (msg_tags);
@@ -173,7 +177,7 @@ notmuch_messages_collect_tags (notmuch_messages_t *messages)
 
     keys = g_hash_table_get_keys (htable);
     for (l = keys; l; l = l->next) {
-	_notmuch_string_list_append (tags, (char *)l->data);
+	_notmuch_string_list_append_shared (tags, (char *)l->data);
     }
 
     g_list_free (keys);
@@ -34,6 +34,7 @@ NOTMUCH_BEGIN_DECLS
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -95,7 +96,11 @@ typedef enum {
     NOTMUCH_VALUE_TIMESTAMP = 0,
     NOTMUCH_VALUE_MESSAGE_ID,
     NOTMUCH_VALUE_FROM,
-    NOTMUCH_VALUE_SUBJECT
+    NOTMUCH_VALUE_SUBJECT,
+    NOTMUCH_VALUE_LAST_MOD,
+    NOTMUCH_VALUE_METADATA,
+    NOTMUCH_VALUE_HEADERS,
+    NOTMUCH_VALUE_COLD_SHARD
 } notmuch_value_t;
 
 /* Xapian (with flint backend) complains if we provide a term longer
@@ -104,6 +109,7 @@ typedef enum {
 #define NOTMUCH_TERM_MAX 245
 
 #define NOTMUCH_METADATA_THREAD_ID_PREFIX "thread_id_"
+#define NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX "thread_summary_"
 
 /* For message IDs we have to be even more restrictive. Beyond fitting
  * into the term limit, we also use message IDs to construct
@@ -173,6 +179,9 @@ _find_prefix (const char *name);
 notmuch_status_t
 _notmuch_database_ensure_writable (notmuch_database_t *notmuch);
 
+unsigned long
+_notmuch_database_new_revision (notmuch_database_t *notmuch);
+
 const char *
 _notmuch_database_relative_path (notmuch_database_t *notmuch,
 				 const char *path);
@@ -201,6 +210,32 @@ _notmuch_database_find_directory_id (notmuch_database_t *database,
 				     notmuch_find_flags_t flags,
 				     unsigned int *directory_id);
 
+/* Return the index of the database holding the document with ID
+ * 'doc_id', (see notmuch_database_open_multi). */
+unsigned int
+_notmuch_database_subdb (notmuch_database_t *notmuch, unsigned int doc_id);
+
+/* Return the thread ID space of the database holding the document
+ * with ID 'doc_id'. Documents with the same thread ID belong to the
+ * same thread only if they are in the same thread ID space. */
+unsigned int
+_notmuch_database_thread_space (notmuch_database_t *notmuch,
+				unsigned int doc_id);
+
+/* Return the ID, within the combined database, of the document with
+ * ID 'subdb_doc_id' within the database holding the document with ID
+ * 'doc_id', (such as a directory named by a term of a message). */
+unsigned int
+_notmuch_database_subdb_doc_id (notmuch_database_t *notmuch,
+				unsigned int doc_id,
+				unsigned int subdb_doc_id);
+
+/* Return the path of the database holding the document with ID
+ * 'doc_id'. */
+const char *
+_notmuch_database_subdb_path (notmuch_database_t *notmuch,
+			      unsigned int doc_id);
+
 const char *
 _notmuch_database_get_directory_path (void *ctx,
 				      notmuch_database_t *notmuch,
@@ -226,13 +261,68 @@ _notmuch_directory_get_document_id (notmuch_directory_t *directory);
 
 /* thread.cc */
 
-notmuch_thread_t *
-_notmuch_thread_create (void *ctx,
-			notmuch_database_t *notmuch,
-			unsigned int seed_doc_id,
-			notmuch_doc_id_set_t *match_set,
-			notmuch_string_list_t *excluded_terms,
-			notmuch_sort_t sort);
+notmuch_status_t
+_notmuch_thread_create_batch (void *ctx,
+			      notmuch_database_t *notmuch,
+			      const unsigned int *seed_doc_ids,
+			      unsigned int count,
+			      notmuch_doc_id_set_t *match_set,
+			      notmuch_string_list_t *excluded_terms,
+			      notmuch_sort_t sort,
+			      notmuch_thread_t **threads);
+
+char *
+_notmuch_thread_term_for_doc_id (void *ctx,
+				 notmuch_database_t *notmuch,
+				 unsigned int doc_id);
+
+notmuch_status_t
+_notmuch_thread_add_to_set (notmuch_database_t *notmuch,
+			    unsigned int seed_doc_id,
+			    notmuch_doc_id_set_t *doc_ids);
+
+char *
+_notmuch_thread_author_from_header (void *ctx, const char *from);
+
+/* thread-summary.cc */
+
+/* One message of a thread, as described by the thread's summary
+ * record. */
+typedef struct _notmuch_thread_member {
+    unsigned int doc_id;
+    time_t timestamp;
+    const char *author;
+    const char *subject;
+    notmuch_string_list_t *tags;
+
+    /* Not stored in the record. These are filled in by the thread
+     * built from the record. */
+    notmuch_bool_t matched;
+    notmuch_bool_t excluded;
+} notmuch_thread_member_t;
+
+notmuch_thread_member_t *
+_notmuch_thread_summary_get (void *ctx,
+			     notmuch_database_t *notmuch,
+			     const char *thread_id,
+			     unsigned int *count);
+
+unsigned int
+_notmuch_thread_summary_rebuild (notmuch_database_t *notmuch,
+				 const char *thread_id);
+
+void
+_notmuch_thread_summary_add_message (notmuch_database_t *notmuch,
+				     notmuch_message_t *message,
+				     notmuch_bool_t headers_changed);
+
+void
+_notmuch_thread_summary_remove_message (notmuch_database_t *notmuch,
+					notmuch_message_t *message);
+
+void
+_notmuch_thread_summary_remove (notmuch_database_t *notmuch,
+				const char *thread_id);
 
 /* message.cc */
 
@@ -291,9 +381,28 @@ _notmuch_message_set_header_values (notmuch_message_t *message,
 				    const char *date,
 				    const char *from,
 				    const char *subject);
+
+void
+_notmuch_message_backfill (notmuch_message_t *message);
+
 void
 _notmuch_message_sync (notmuch_message_t *message);
 
+/* Apply the 'num_ops' tag changes in 'ops' to the tag terms of
+ * 'message', (as for notmuch_query_apply_tags). Returns TRUE if any
+ * tag was changed, in which case the message must be synchronized
+ * with _notmuch_message_sync. The tag list of the metadata record of
+ * the message is patched along with the terms, (and is where the
+ * presence of each tag is read from), so that neither applying the
+ * changes nor synchronizing the message reads its term list or its
+ * headers, unless it has no current record.
+ *
+ * This may throw a Xapian::Error. */
+notmuch_bool_t
+_notmuch_message_apply_tag_terms (notmuch_message_t *message,
+				  const notmuch_tag_operation_t *ops,
+				  unsigned int num_ops);
+
 notmuch_status_t
 _notmuch_message_delete (notmuch_message_t *message);
 
@@ -381,6 +490,13 @@ void
 notmuch_message_file_restrict_headersv (notmuch_message_file_t *message,
 					va_list va_headers);
 
+/* Add a single header to those that notmuch_message_get_header will
+ * return for this message, (as for notmuch_message_restrict_headers,
+ * and with the same restrictions). */
+void
+notmuch_message_file_restrict_header (notmuch_message_file_t *message,
+				      const char *header);
+
 /* Get the value of the specified header from the message.
  *
  * The header name is case insensitive.
@@ -399,6 +515,12 @@ const char *
 notmuch_message_file_get_header (notmuch_message_file_t *message,
 				 const char *header);
 
+/* Declared here, rather than with the rest of message.cc, since it
+ * needs notmuch_message_file_t. */
+void
+_notmuch_message_set_stored_headers (notmuch_message_t *message,
+				     notmuch_message_file_t *message_file);
+
 /* messages.c */
 
 typedef struct _notmuch_message_node {
@@ -446,6 +568,20 @@ _notmuch_mset_messages_get (notmuch_messages_t *messages);
 void
 _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages);
 
+/* doc-id-set.c */
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_create (void *ctx);
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_create_from_array (void *ctx,
+				       const unsigned int *doc_id_array,
+				       unsigned int count);
+
+notmuch_bool_t
+_notmuch_doc_id_set_add (notmuch_doc_id_set_t *doc_ids,
+			 unsigned int doc_id);
+
 notmuch_bool_t
 _notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
                               unsigned int doc_id);
@@ -454,6 +590,268 @@ void
 _notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
                             unsigned int doc_id);
 
+unsigned int
+_notmuch_doc_id_set_count (notmuch_doc_id_set_t *doc_ids);
+
+notmuch_bool_t
+_notmuch_doc_id_set_next (notmuch_doc_id_set_t *doc_ids,
+			  unsigned int *doc_id);
+
+/* Return a new set, allocated with 'ctx', of the members of either,
+ * both, or only the first of 'a' and 'b', (or NULL if memory
+ * allocation fails). */
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_union (void *ctx, notmuch_doc_id_set_t *a,
+			   notmuch_doc_id_set_t *b);
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_intersection (void *ctx, notmuch_doc_id_set_t *a,
+				  notmuch_doc_id_set_t *b);
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_difference (void *ctx, notmuch_doc_id_set_t *a,
+				notmuch_doc_id_set_t *b);
+
+/* Return 'doc_ids' serialised into a buffer allocated with 'ctx',
+ * storing its length in *size, (or NULL if memory allocation fails). */
+char *
+_notmuch_doc_id_set_serialise (void *ctx, notmuch_doc_id_set_t *doc_ids,
+			       size_t *size);
+
+/* Return the set serialised in the 'size' bytes of 'buffer', (or NULL
+ * if they are malformed, or memory allocation fails). */
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_deserialise (void *ctx, const char *buffer, size_t size);
+
+/* side-index.cc */
+
+/* The start of the file of each side index, (see side-index.cc). */
+typedef struct {
+    char magic[8];
+    uint64_t revision;
+} notmuch_side_index_header_t;
+
+typedef struct _notmuch_side_index {
+    char *filename;
+
+    /* For a database opened read-write, whether the file is to be
+     * brought up to date on close, the revision of the database when
+     * it was opened, and the document IDs of the messages modified or
+     * deleted since. */
+    notmuch_bool_t maintain;
+    unsigned long open_revision;
+    notmuch_doc_id_set_t *touched;
+
+    /* The file as mapped into memory, (once mapped is TRUE), and its
+     * header, (or NULL if it could not be mapped, or has the wrong
+     * magic string). */
+    notmuch_bool_t mapped;
+    void *map;
+    size_t map_size;
+    const notmuch_side_index_header_t *header;
+} notmuch_side_index_t;
+
+/* How _notmuch_side_index_close brings the file of a side index up to
+ * date, each function being passed the closure given to it. The
+ * load, update and build functions may throw a Xapian::Error. */
+typedef struct {
+    /* Load the 'size' bytes of the file at 'data', (which is only
+     * mapped until the update is done). Returns FALSE if they are
+     * malformed, in which case build is called instead. */
+    notmuch_bool_t (*load) (void *closure, const void *data, size_t size);
+    /* Update the entries of the message with 'doc_id', (which may no
+     * longer exist), after a load. */
+    notmuch_bool_t (*update) (void *closure, unsigned int doc_id);
+    /* Build the entries of every message from scratch. */
+    notmuch_bool_t (*build) (void *closure);
+    /* Write the whole file as reflecting 'revision'. */
+    notmuch_bool_t (*save) (void *closure, FILE *file,
+			    unsigned long revision);
+} notmuch_side_index_writer_t;
+
+/* Return the side index kept in the file 'name' of the .notmuch
+ * directory of 'notmuch', (allocated with 'ctx'), or NULL if memory
+ * allocation fails. */
+notmuch_side_index_t *
+_notmuch_side_index_create (void *ctx, notmuch_database_t *notmuch,
+			    const char *name);
+
+/* Start or stop maintaining the file of 'index', (removing it in the
+ * latter case). */
+notmuch_status_t
+_notmuch_side_index_set_enabled (notmuch_database_t *notmuch,
+				 notmuch_side_index_t *index,
+				 notmuch_bool_t enable);
+
+/* Note that the message with 'doc_id' has been modified or deleted. */
+void
+_notmuch_side_index_touch (notmuch_side_index_t *index, unsigned int doc_id);
+
+/* Map the file of 'index' into memory, (unless this has already been
+ * attempted), and return its header, or NULL if it cannot be mapped
+ * or does not begin with 'magic'. */
+const notmuch_side_index_header_t *
+_notmuch_side_index_map (notmuch_side_index_t *index, const char *magic);
+
+void
+_notmuch_side_index_unmap (notmuch_side_index_t *index);
+
+/* Return the header of the mapped file of 'index', (as for
+ * _notmuch_side_index_map), if it can be used by 'notmuch', and
+ * reflects its current revision, or NULL otherwise. */
+const notmuch_side_index_header_t *
+_notmuch_side_index_get (notmuch_database_t *notmuch,
+			 notmuch_side_index_t *index, const char *magic);
+
+/* Bring the file of 'index' up to date with 'notmuch' using 'writer',
+ * if it is maintained and the database was 'flushed', before the
+ * database is closed. */
+void
+_notmuch_side_index_close (notmuch_database_t *notmuch,
+			   notmuch_side_index_t *index, const char *magic,
+			   notmuch_bool_t flushed,
+			   const notmuch_side_index_writer_t *writer,
+			   void *closure);
+
+/* columns.cc */
+
+/* This is a member of the (visible) database structure, so must be
+ * visible itself. */
+struct visible _notmuch_columns;
+typedef struct _notmuch_columns notmuch_columns_t;
+
+void
+_notmuch_columns_open (notmuch_database_t *notmuch);
+
+/* Bring the columns up to date with the database, if they are
+ * maintained and the database was 'flushed', before it is closed. */
+void
+_notmuch_columns_close (notmuch_database_t *notmuch, notmuch_bool_t flushed);
+
+/* Note that the message with 'doc_id' has been modified or deleted. */
+void
+_notmuch_columns_touch (notmuch_database_t *notmuch, unsigned int doc_id);
+
+notmuch_bool_t
+_notmuch_columns_available (notmuch_database_t *notmuch);
+
+/* Store in *count the number of distinct threads of the messages
+ * with the given document IDs, as read from the columns.
+ *
+ * Returns FALSE, (leaving *count unspecified), if the columns cannot
+ * be used, in which case the caller must count the threads itself.
+ */
+notmuch_bool_t
+_notmuch_columns_count_threads (notmuch_database_t *notmuch,
+				const unsigned int *doc_ids,
+				unsigned int num_doc_ids,
+				unsigned int *count);
+
+/* Sort the given document IDs, (which must be in increasing order),
+ * by the date of their messages, as read from the columns, keeping
+ * messages with the same date in increasing order of document ID.
+ *
+ * Returns FALSE, (leaving the document IDs unchanged), if the columns
+ * cannot be used.
+ */
+notmuch_bool_t
+_notmuch_columns_sort_by_date (notmuch_database_t *notmuch,
+			       unsigned int *doc_ids,
+			       unsigned int num_doc_ids,
+			       notmuch_bool_t newest_first);
+
+/* tag-bitmaps.cc */
+
+/* This is a member of the (visible) database structure, so must be
+ * visible itself. */
+struct visible _notmuch_tag_bitmaps;
+typedef struct _notmuch_tag_bitmaps notmuch_tag_bitmaps_t;
+
+void
+_notmuch_tag_bitmaps_open (notmuch_database_t *notmuch);
+
+/* Bring the tag bitmaps up to date with the database, if they are
+ * maintained and the database was 'flushed', before it is closed. */
+void
+_notmuch_tag_bitmaps_close (notmuch_database_t *notmuch,
+			    notmuch_bool_t flushed);
+
+/* Note that the message with 'doc_id' has been modified or deleted. */
+void
+_notmuch_tag_bitmaps_touch (notmuch_database_t *notmuch, unsigned int doc_id);
+
+/* Return the set of messages with 'tag', (or of all messages if 'tag'
+ * is NULL), as read from the tag bitmaps, or NULL if they cannot be
+ * used. The set belongs to the tag bitmaps, and must not be modified.
+ */
+notmuch_doc_id_set_t *
+_notmuch_tag_bitmaps_get (notmuch_database_t *notmuch, const char *tag);
+
+/* Return the set of messages matching 'query_string', (allocated with
+ * 'ctx'), as computed from the tag bitmaps, or NULL if the query is
+ * not made of nothing but tag and thread terms, or the tag bitmaps
+ * cannot be used. */
+notmuch_doc_id_set_t *
+_notmuch_tag_bitmaps_match (void *ctx, notmuch_database_t *notmuch,
+			    const char *query_string);
+
+/* tag-table.c */
+
+/* This is a member of the (visible) database structure, so must be
+ * visible itself. */
+struct visible _notmuch_tag_table;
+typedef struct _notmuch_tag_table notmuch_tag_table_t;
+
+notmuch_tag_table_t *
+_notmuch_tag_table_create (const void *ctx);
+
+/* Return the interned copy of 'tag' from 'table', adding it if
+ * necessary, and store its ID in *id, (unless 'id' is NULL).
+ *
+ * Returns NULL if memory allocation fails.
+ */
+const char *
+_notmuch_tag_table_intern (notmuch_tag_table_t *table, const char *tag,
+			   unsigned int *id);
+
+/* Return the interned name with ID 'id', or NULL if there is none. */
+const char *
+_notmuch_tag_table_get_name (notmuch_tag_table_t *table, unsigned int id);
+
+/* Return the sorted list of the interned names of the tag IDs in
+ * 'tag_ids', (allocated with 'ctx' as the talloc context, but sharing
+ * the names of the table).
+ *
+ * Returns NULL if memory allocation fails.
+ */
+notmuch_string_list_t *
+_notmuch_tag_table_get_names (notmuch_tag_table_t *table, const void *ctx,
+			      notmuch_doc_id_set_t *tag_ids);
+
+/* query-cache.cc */
+
+/* This is a member of the (visible) database structure, so must be
+ * visible itself. */
+struct visible _notmuch_query_cache;
+typedef struct _notmuch_query_cache notmuch_query_cache_t;
+
+notmuch_bool_t
+_notmuch_query_cache_get (void *ctx,
+			  notmuch_database_t *notmuch,
+			  const char *description,
+			  unsigned int *count,
+			  unsigned int **doc_ids);
+
+void
+_notmuch_query_cache_put (notmuch_database_t *notmuch,
+			  const char *description,
+			  unsigned int count,
+			  const unsigned int *doc_ids);
+
+void
+_notmuch_query_cache_close (notmuch_database_t *notmuch,
+			    notmuch_bool_t flushed);
+
 /* message.cc */
 
 void
@@ -492,6 +890,15 @@ void
 _notmuch_string_list_append (notmuch_string_list_t *list,
 			     const char *string);
 
+/* Add 'string' to 'list' without copying it.
+ *
+ * The caller must ensure that 'string' outlives the list and is never
+ * modified, (as for the names of a notmuch_tag_table_t).
+ */
+void
+_notmuch_string_list_append_shared (notmuch_string_list_t *list,
+				    const char *string);
+
 void
 _notmuch_string_list_sort (notmuch_string_list_t *list);
 
@@ -500,6 +907,11 @@ _notmuch_string_list_sort (notmuch_string_list_t *list);
 notmuch_tags_t *
 _notmuch_tags_create (const void *ctx, notmuch_string_list_t *list);
 
+notmuch_tags_t *
+_notmuch_tags_create_with_counts (const void *ctx,
+				  notmuch_string_list_t *list,
+				  unsigned int *counts);
+
 /* filenames.c */
 
 /* The notmuch_filenames_t iterates over a notmuch_string_list_t of
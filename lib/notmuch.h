@@ -123,6 +123,7 @@ typedef struct _notmuch_message notmuch_message_t;
 typedef struct _notmuch_tags notmuch_tags_t;
 typedef struct _notmuch_directory notmuch_directory_t;
 typedef struct _notmuch_filenames notmuch_filenames_t;
+typedef struct _notmuch_facets notmuch_facets_t;
 
 /* Create a new, empty notmuch database located at 'path'.
  *
@@ -201,6 +202,52 @@ notmuch_database_open (const char *path,
 		       notmuch_database_mode_t mode,
 		       notmuch_database_t **database);
 
+/* Open several existing notmuch databases as a single, read-only
+ * database.
+ *
+ * The database at 'path' is opened as with notmuch_database_open in
+ * NOTMUCH_DATABASE_MODE_READ_ONLY mode, and the 'num_extra_paths'
+ * databases at 'extra_paths' are added to it, (each path being the
+ * top-level directory of a database, as for 'path'). Each query is
+ * then run once over the combined index, and the filenames of each
+ * message are those within the database holding the message.
+ *
+ * Thread IDs are only unique within a single database, so each
+ * thread is made of messages of a single database. However a
+ * "thread:" search term matches the threads with that ID in every
+ * database.
+ *
+ * With no extra paths, this is equivalent to notmuch_database_open.
+ *
+ * The caller should call notmuch_database_destroy when finished with
+ * this database.
+ *
+ * In case of any failure, this function returns an error status and
+ * sets *database to NULL (after printing an error message on stderr).
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Successfully opened the databases.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: The given 'path' argument, or one of
+ *	the 'extra_paths', is NULL.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: An error occurred trying to open one of
+ *	the database files (such as permission denied, or file not
+ *	found, etc.), or one of the databases has a different database
+ *	version than this version of notmuch, (in which case "notmuch
+ *	new" should be run for that database first).
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ */
+notmuch_status_t
+notmuch_database_open_multi (const char *path,
+			     const char **extra_paths,
+			     unsigned int num_extra_paths,
+			     notmuch_database_t **database);
+
 /* Close the given notmuch database.
  *
  * After notmuch_database_close has been called, calls to other
@@ -231,6 +278,151 @@ notmuch_database_get_path (notmuch_database_t *database);
 unsigned int
 notmuch_database_get_version (notmuch_database_t *database);
 
+/* Return the current revision of the given database.
+ *
+ * The revision is incremented every time the database is modified,
+ * (such as by adding or removing a message, or by changing the tags
+ * or filenames of a message). All modifications made within a single
+ * atomic section (see notmuch_database_begin_atomic) share one
+ * revision.
+ *
+ * Each message records the revision at which it was last modified,
+ * which can be searched with the "lastmod:<initial-revision>..<final-revision>"
+ * query syntax. So a client that remembers the revision of its
+ * previous query can find exactly those messages that have changed
+ * since.
+ */
+unsigned long
+notmuch_database_get_revision (notmuch_database_t *database);
+
+/* Enable the persistent cache of query results for the given database.
+ *
+ * With the cache enabled, the results of notmuch_query_count_messages,
+ * notmuch_query_count_threads and notmuch_query_search_threads are
+ * remembered, (in a file within the .notmuch directory, so that they
+ * are shared with later processes), along with the revision of the
+ * database. As long as the database is not modified, repeating the
+ * same query returns the cached result without searching the
+ * database.
+ *
+ * At most 'size' results are kept, discarding the least recently used
+ * ones first. A 'size' of 0 disables the cache, (which is the
+ * default).
+ *
+ * The cache is never enabled for a database opened with
+ * notmuch_database_open_multi, since the revision of the first
+ * database does not reflect changes to the others.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The cache size was set.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ */
+notmuch_status_t
+notmuch_database_set_query_cache_size (notmuch_database_t *database,
+				       unsigned int size);
+
+/* Enable or disable the columnar side index of 'database'.
+ *
+ * Once enabled, a few fixed-size fields of every message, (its thread
+ * and date), are kept in the file .notmuch/columns, which is brought
+ * up to date whenever the database is closed after being modified.
+ * notmuch_query_count_threads and notmuch_threads_count read the
+ * threads of the matched messages from it rather than from each
+ * message document, and the matches found from the tag bitmaps, (see
+ * notmuch_database_set_tag_bitmaps), are sorted by their dates from
+ * it.
+ *
+ * The index is only used while it reflects the current revision of
+ * the database, and never by a database opened with
+ * notmuch_database_open_multi or with cold shards. Disabling it
+ * removes the file.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The index was enabled or disabled.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so the index cannot be maintained.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ */
+notmuch_status_t
+notmuch_database_set_columns (notmuch_database_t *database,
+			      notmuch_bool_t enable);
+
+/* Enable or disable the tag bitmaps of 'database'.
+ *
+ * Once enabled, the set of messages with each tag is kept in the file
+ * .notmuch/tag-bitmaps, which is brought up to date whenever the
+ * database is closed after being modified. A query made of nothing
+ * but "tag:" and "thread:" terms joined by "and", "or" and "not",
+ * (with any parentheses), is then answered from the sets by
+ * notmuch_query_count_messages and notmuch_query_search_threads,
+ * rather than by searching the database. Its threads are only
+ * returned in date order, (rather than by searching the database),
+ * if the columnar side index is enabled too, (see
+ * notmuch_database_set_columns).
+ *
+ * As for the columnar side index, the tag bitmaps are only used while
+ * they reflect the current revision of the database, and never by a
+ * database opened with notmuch_database_open_multi or with cold
+ * shards. Disabling them removes the file.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The tag bitmaps were enabled or disabled.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so the tag bitmaps cannot be maintained.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ */
+notmuch_status_t
+notmuch_database_set_tag_bitmaps (notmuch_database_t *database,
+				  notmuch_bool_t enable);
+
+/* Set the number of threads searching a combined database, (see
+ * notmuch_database_open_multi and notmuch_database_freeze).
+ *
+ * With more than one thread, notmuch_query_count_messages and the
+ * searches of notmuch_query_search_threads run the query over each of
+ * the combined databases in parallel, (by at most 'threads' threads at
+ * once), and merge the results. The default of 1 searches all the
+ * databases together in the calling thread.
+ *
+ * The threads only read the databases, and have finished when the
+ * search function returns.
+ */
+void
+notmuch_database_set_search_threads (notmuch_database_t *database,
+				     unsigned int threads);
+
+/* Set the headers stored in the database for each message added to
+ * it, (or backfilled by notmuch_database_upgrade), so that
+ * notmuch_message_get_header can return them without reading the
+ * message file.
+ *
+ * Header names are case insensitive. The default set is "date",
+ * "to", "cc", "reply-to", "in-reply-to" and "references". The From,
+ * Subject and Message-Id headers are always stored.
+ *
+ * Changing the set only affects messages added afterwards. Headers
+ * not stored for a message are read from its file, as before.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The set was replaced.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed, (the
+ *	previous set is unchanged).
+ */
+notmuch_status_t
+notmuch_database_set_stored_headers (notmuch_database_t *database,
+				     const char **headers,
+				     unsigned int count);
+
 /* Does this database need to be upgraded before writing to it?
  *
  * If this function returns TRUE then no functions that modify the
@@ -258,6 +450,61 @@ notmuch_database_upgrade (notmuch_database_t *database,
 						   double progress),
 			  void *closure);
 
+/* Move the messages dated before 'before' into the cold shards of the
+ * database.
+ *
+ * Each message is moved to the shard for the year of its Date header,
+ * (in UTC), which is a separate Xapian database under .notmuch/cold
+ * in the database directory. Keeping messages which are rarely
+ * modified out of the database itself keeps it small, which makes
+ * modifying it much cheaper.
+ *
+ * Frozen messages are still found by searches, (since a database
+ * opened read-only includes its cold shards), and a frozen message is
+ * moved back into the database, (thawed), when it is modified. A
+ * query of a database opened read-write is also executed against the
+ * cold shards, so it finds frozen messages by any of their terms, at
+ * the cost of a second search.
+ *
+ * Each shard into which at least an eighth of its messages were moved
+ * is then compacted, (where Xapian supports it, and unless messages
+ * thawed from it are yet to be removed). The space of a thawed message
+ * is otherwise only reused by messages frozen later.
+ *
+ * The query cache, the columnar side index, the tag bitmaps and the
+ * thread summaries are not used by a database with cold shards, since
+ * none of them describes the messages of the shards.
+ *
+ * The optional progress_notify callback is called as for
+ * notmuch_database_upgrade.
+ *
+ * This function must not be called within an atomic section, (see
+ * notmuch_database_begin_atomic).
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Messages moved successfully, (or there were
+ *	no messages to move).
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no message can be moved.
+ *
+ * NOTMUCH_STATUS_UNBALANCED_ATOMIC: The database is within an atomic
+ *	section.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: A compacted shard could not replace the
+ *	shard, (which is kept, with every message moved into it).
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *	Messages moved before the exception remain in the cold shards.
+ */
+notmuch_status_t
+notmuch_database_freeze (notmuch_database_t *database,
+			 time_t before,
+			 void (*progress_notify) (void *closure,
+						  double progress),
+			 void *closure);
+
 /* Begin an atomic database operation.
  *
  * Any modifications performed between a successful begin and a
@@ -528,12 +775,88 @@ notmuch_query_set_sort (notmuch_query_t *query, notmuch_sort_t sort);
 notmuch_sort_t
 notmuch_query_get_sort (notmuch_query_t *query);
 
+/* Restrict the results of notmuch_query_search_messages to at most
+ * 'limit' messages, starting with the message at position 'offset'
+ * (counting from 0) in the sort order of the query. A negative
+ * 'limit' means no limit. By default, all results are returned.
+ *
+ * The range is applied within the database search itself, so the
+ * messages outside of it are never retrieved, (and when sorting, only
+ * the messages within the range need to be put in order). So asking
+ * for the first few results of a large search is much cheaper than
+ * retrieving all of them and discarding the rest.
+ *
+ * The range has no effect on notmuch_query_search_threads or on the
+ * count functions.
+ */
+void
+notmuch_query_set_range (notmuch_query_t *query,
+			 unsigned int offset, int limit);
+
 /* Add a tag that will be excluded from the query results by default.
  * This exclusion will be overridden if this tag appears explicitly in
  * the query. */
 void
 notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag);
 
+/* Compile the query string of 'query' into its internal form.
+ *
+ * The query string is parsed only once for the lifetime of the query,
+ * no matter how many times the query is executed, (the first
+ * execution compiles the query automatically if this function has not
+ * been called). This function makes it possible to detect errors in
+ * the query string before executing the query.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The query was compiled successfully.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: The query string could not be
+ *	parsed.
+ */
+notmuch_status_t
+notmuch_query_compile (notmuch_query_t *query);
+
+/* Restrict the results of 'query' to the messages of the thread with
+ * the given thread ID, (as returned by notmuch_thread_get_thread_id),
+ * replacing any thread previously bound to the query.
+ *
+ * This is equivalent to adding "and thread:<thread-id>" to the query
+ * string, but does not require the query string to be parsed again.
+ * So a query can be compiled once and then executed for many
+ * threads. Passing NULL for 'thread_id' removes the restriction.
+ */
+void
+notmuch_query_bind_thread (notmuch_query_t *query, const char *thread_id);
+
+/* Restrict the results of 'query' to messages dated from 'begin' to
+ * 'end', (inclusive), replacing any date range previously bound to
+ * the query.
+ *
+ * This is equivalent to adding "and <begin>..<end>" to the query
+ * string, but does not require the query string to be parsed again.
+ */
+void
+notmuch_query_bind_date_range (notmuch_query_t *query,
+			       time_t begin, time_t end);
+
+/* Restrict the results of 'query' to messages whose tags would be
+ * changed by adding 'tag', (or by removing it, if 'remove' is TRUE).
+ *
+ * When called several times, a message matches if any one of the
+ * bound tag changes would change its tags. This allows an
+ * application to search efficiently for just those messages that
+ * need to be modified by a set of tag changes.
+ */
+void
+notmuch_query_bind_tag_change (notmuch_query_t *query,
+			       const char *tag, notmuch_bool_t remove);
+
+/* Remove all restrictions bound to 'query' by the
+ * notmuch_query_bind_* functions. */
+void
+notmuch_query_clear_bindings (notmuch_query_t *query);
+
 /* Execute a query for threads, returning a notmuch_threads_t object
  * which can be used to iterate over the results. The returned threads
  * object is owned by the query and as such, will only be valid until
@@ -570,6 +893,11 @@ notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag);
  * notmuch_threads_destroy function, but there's no good reason
  * to call it if the query is about to be destroyed).
  *
+ * The matching messages are fetched from the database incrementally,
+ * as the iterator advances, so the first threads are available
+ * without waiting for all of the matches of a large search. (The
+ * matches of a search are fetched in full by notmuch_threads_count.)
+ *
  * If a Xapian exception occurs this function will return NULL.
  */
 notmuch_threads_t *
@@ -616,6 +944,77 @@ notmuch_query_search_threads (notmuch_query_t *query);
 notmuch_messages_t *
 notmuch_query_search_messages (notmuch_query_t *query);
 
+/* A change to the tags of a message: the addition of 'tag', or its
+ * removal if 'remove' is TRUE. */
+typedef struct {
+    const char *tag;
+    notmuch_bool_t remove;
+} notmuch_tag_operation_t;
+
+/* Apply the 'num_ops' tag changes in 'ops', in order, to every
+ * message matching 'query'.
+ *
+ * This is equivalent to calling notmuch_message_add_tag and
+ * notmuch_message_remove_tag, (between notmuch_message_freeze and
+ * notmuch_message_thaw), for each message of
+ * notmuch_query_search_messages, but much cheaper for a great many
+ * messages: the matches are visited in document order, messages whose
+ * tags would not change are skipped, and the changes are made to the
+ * tag terms of each message directly, without reading its message ID,
+ * filenames or other metadata.
+ *
+ * If 'synchronize_flags' is TRUE, the maildir flags of each changed
+ * message are then updated as by notmuch_message_tags_to_maildir_flags,
+ * (which reads its filenames).
+ *
+ * The changes are made within an atomic section, (see
+ * notmuch_database_begin_atomic), which is committed after every
+ * 'transaction_size' changed messages, (or after 1000 if it is 0), and
+ * at the end. If the caller is already within an atomic section, no
+ * section of its own is begun and 'transaction_size' is ignored: the
+ * changes are committed along with the caller's section, which the
+ * caller may end and begin again from progress_notify, (such as to
+ * commit the changes of several queries together).
+ *
+ * The optional progress_notify callback is called after each matching
+ * message is visited, with 'changed' TRUE if its tags were changed. If
+ * it returns FALSE, no further message is changed, and the changes
+ * made so far are committed as at the end, (so that the caller can
+ * stop tagging when interrupted).
+ *
+ * The range and sort order of 'query' are ignored.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The tags of every matching message were
+ *	changed, (or of those visited before progress_notify returned
+ *	FALSE).
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: A tag in 'ops' is NULL. No message was
+ *	changed.
+ *
+ * NOTMUCH_STATUS_TAG_TOO_LONG: A tag in 'ops' is too long (exceeds
+ *	NOTMUCH_TAG_MAX). No message was changed.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no message can be modified.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred. The
+ *	changes committed before the exception are kept.
+ *
+ * Any status of notmuch_message_tags_to_maildir_flags, which stops
+ * the changes after the message whose flags could not be updated.
+ */
+notmuch_status_t
+notmuch_query_apply_tags (notmuch_query_t *query,
+			  const notmuch_tag_operation_t *ops,
+			  unsigned int num_ops,
+			  notmuch_bool_t synchronize_flags,
+			  unsigned int transaction_size,
+			  notmuch_bool_t (*progress_notify) (void *closure,
+							      notmuch_bool_t changed),
+			  void *closure);
+
 /* Destroy a notmuch_query_t along with any associated resources.
  *
  * This will in turn destroy any notmuch_threads_t and
@@ -666,6 +1065,34 @@ notmuch_threads_get (notmuch_threads_t *threads);
 void
 notmuch_threads_move_to_next (notmuch_threads_t *threads);
 
+/* Move the 'threads' iterator past the next 'count' threads.
+ *
+ * This has the same effect as calling notmuch_threads_get,
+ * notmuch_thread_destroy and notmuch_threads_move_to_next 'count'
+ * times, but the skipped threads are never created, (only the
+ * messages belonging to them are found), so it is much faster. This
+ * makes it cheap to start iterating at an offset into the results.
+ *
+ * Returns the number of threads actually skipped, which is less than
+ * 'count' if the iterator reached the end of the threads, (or if a
+ * Xapian exception occurred).
+ */
+unsigned int
+notmuch_threads_skip (notmuch_threads_t *threads, unsigned int count);
+
+/* Return the total number of threads in 'threads'.
+ *
+ * This is the same number as notmuch_query_count_threads would
+ * return for the query, (regardless of the current position of the
+ * iterator), but it is computed from the messages already matched by
+ * the search rather than by searching again. The result is computed
+ * once, on the first call.
+ *
+ * If an error occurs, this function returns 0.
+ */
+unsigned int
+notmuch_threads_count (notmuch_threads_t *threads);
+
 /* Destroy a notmuch_threads_t object.
  *
  * It's not strictly necessary to call this function. All memory from
@@ -700,6 +1127,87 @@ notmuch_query_count_messages (notmuch_query_t *query);
 unsigned
 notmuch_query_count_threads (notmuch_query_t *query);
 
+/* Return the tags of the messages matching a search, along with the
+ * number of matching messages with each tag.
+ *
+ * The tags are returned in sorted order, and a tag is only returned
+ * if at least one matching message has it. Use notmuch_tags_get_count
+ * to get the number of matching messages with the current tag.
+ *
+ * Rather than reading the tags of every matching message, this finds
+ * the matches of the query once, and counts those in the list of
+ * messages with each tag in the database, (or in its tag bitmap, see
+ * notmuch_database_set_tag_bitmaps), so it is much faster than
+ * collecting the tags of the messages of notmuch_query_search_messages
+ * for a large search.
+ *
+ * Messages with excluded tags are omitted from the counts unless
+ * notmuch_query_set_omit_excluded has been called with FALSE.
+ *
+ * If a Xapian exception occurs, this function will return NULL.
+ */
+notmuch_tags_t *
+notmuch_query_count_tags (notmuch_query_t *query);
+
+/* The properties of messages for which notmuch_query_count_facets
+ * can count the matching messages with each value. */
+typedef enum {
+    /* The directory holding a file of the message, relative to the
+     * top-level directory of the database, (such as "inbox/cur"). A
+     * message with files in several directories counts once for
+     * each of them. */
+    NOTMUCH_FACET_FOLDER,
+    /* The domain of the first address in the From header of the
+     * message, (such as "example.com"), in lowercase. */
+    NOTMUCH_FACET_DOMAIN,
+    /* The year of the date of the message, (such as "2012"), in UTC. */
+    NOTMUCH_FACET_YEAR,
+    /* The month of the date of the message, (such as "2012-03"), in
+     * UTC. */
+    NOTMUCH_FACET_MONTH,
+
+    /* Not an actual facet. Just the number of facets. */
+    NOTMUCH_FACET_LAST_FACET
+} notmuch_facet_t;
+
+/* Count the messages matching a search by each of the 'num_facets'
+ * facets in 'facets', (see notmuch_facet_t).
+ *
+ * All of the facets are counted together, in a single pass over the
+ * matching messages, (which reads the values stored with each
+ * message, and the terms of each message only for
+ * NOTMUCH_FACET_FOLDER). Use notmuch_facets_get_values to retrieve
+ * the counts for each facet.
+ *
+ * Messages with excluded tags are omitted from the counts unless
+ * notmuch_query_set_omit_excluded has been called with FALSE.
+ *
+ * The returned object is owned by the query. Call
+ * notmuch_facets_destroy to free it sooner.
+ *
+ * If a Xapian exception occurs, or 'facets' holds an invalid facet,
+ * this function will return NULL.
+ */
+notmuch_facets_t *
+notmuch_query_count_facets (notmuch_query_t *query,
+			    const notmuch_facet_t *facets,
+			    unsigned int num_facets);
+
+/* Return the values of 'facet' for the messages counted by 'facets',
+ * in sorted order, as a notmuch_tags_t iterator, (whose
+ * notmuch_tags_get returns each value and notmuch_tags_get_count its
+ * number of messages).
+ *
+ * Returns NULL if 'facet' was not one of the facets counted, (or if
+ * out of memory).
+ */
+notmuch_tags_t *
+notmuch_facets_get_values (notmuch_facets_t *facets, notmuch_facet_t facet);
+
+/* Destroy a notmuch_facets_t object. */
+void
+notmuch_facets_destroy (notmuch_facets_t *facets);
+
 /* Get the thread ID of 'thread'.
  *
  * The returned string belongs to 'thread' and as such, should not be
@@ -1256,6 +1764,15 @@ notmuch_tags_valid (notmuch_tags_t *tags);
 const char *
 notmuch_tags_get (notmuch_tags_t *tags);
 
+/* Get the count of the current tag from 'tags'.
+ *
+ * This is the number of matching messages with the tag, for tags
+ * returned by notmuch_query_count_tags. For any other tags, and when
+ * notmuch_tags_valid would return FALSE, this returns 0.
+ */
+unsigned int
+notmuch_tags_get_count (notmuch_tags_t *tags);
+
 /* Move the 'tags' iterator to the next tag.
  *
  * If 'tags' is already pointing at the last tag then the iterator
@@ -0,0 +1,323 @@
+/* parallel.cc - Searching combined databases with several threads
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <pthread.h>
+
+#include <queue>
+#include <vector>
+
+/* Xapian runs a query over combined databases in a single thread, so
+ * a search of several large databases, (such as archives or cold
+ * shards), leaves all but one processor idle.
+ *
+ * Instead, each thread opened here searches some of the combined
+ * databases on its own, one at a time, and the sorted matches of the
+ * databases are then merged by the calling thread. Xapian objects
+ * cannot be used by several threads at once, (not even a
+ * Xapian::Query, whose reference counts are not atomic), so each
+ * thread searches the separate handles of its databases, (see
+ * subdb_xapian_dbs), which no other thread uses during the search,
+ * and rebuilds the query from its serialised form.
+ *
+ * The merged matches are in the same order as for a search of the
+ * combined database: by the sort value, and then by document ID.
+ */
+
+typedef struct {
+    std::string sort_key;
+    unsigned int doc_id;
+} parallel_match_t;
+
+typedef std::vector<parallel_match_t> parallel_matches_t;
+
+struct parallel_search_t {
+    notmuch_database_t *notmuch;
+    std::string query;
+    notmuch_sort_t sort;
+    /* The number of matches wanted from each database, (or 0 if only
+     * the matches are to be counted). */
+    unsigned int max_items;
+    unsigned int num_threads;
+
+    /* The matches of each database, in sort order, and their number,
+     * (each only written by the thread searching that database). */
+    std::vector<parallel_matches_t> matches;
+    std::vector<Xapian::doccount> counts;
+};
+
+struct parallel_thread_t {
+    parallel_search_t *search;
+    unsigned int index;
+    pthread_t thread;
+    Xapian::Error *error;
+};
+
+notmuch_bool_t
+_notmuch_parallel_enabled (notmuch_database_t *notmuch)
+{
+    return notmuch->num_subdbs > 1 && notmuch->search_threads > 1;
+}
+
+void
+notmuch_database_set_search_threads (notmuch_database_t *notmuch,
+				     unsigned int threads)
+{
+    notmuch->search_threads = threads ? threads : 1;
+}
+
+/* Return the value slot by which matches are sorted for 'sort', or
+ * Xapian::BAD_VALUENO if they are in document ID order. */
+static Xapian::valueno
+_sort_slot (notmuch_sort_t sort)
+{
+    switch (sort) {
+    case NOTMUCH_SORT_OLDEST_FIRST:
+    case NOTMUCH_SORT_NEWEST_FIRST:
+	return NOTMUCH_VALUE_TIMESTAMP;
+    case NOTMUCH_SORT_MESSAGE_ID:
+	return NOTMUCH_VALUE_MESSAGE_ID;
+    case NOTMUCH_SORT_UNSORTED:
+	break;
+    }
+
+    return Xapian::BAD_VALUENO;
+}
+
+/* Search the database with index 'subdb'. */
+static void
+_parallel_search_subdb (parallel_search_t *search, unsigned int subdb)
+{
+    notmuch_database_t *notmuch = search->notmuch;
+    Xapian::Database &db = *notmuch->subdb_xapian_dbs[subdb];
+    Xapian::Enquire enquire (db);
+    Xapian::valueno slot = _sort_slot (search->sort);
+    Xapian::MSet mset;
+    Xapian::MSetIterator i;
+    parallel_matches_t &matches = search->matches[subdb];
+
+    enquire.set_weighting_scheme (Xapian::BoolWeight ());
+    enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+    if (slot != Xapian::BAD_VALUENO)
+	enquire.set_sort_by_value (slot,
+				   search->sort == NOTMUCH_SORT_NEWEST_FIRST);
+    enquire.set_query (Xapian::Query::unserialise (search->query));
+
+    if (search->max_items == 0) {
+	/* Asking for no matches while checking them all makes the
+	 * estimate exact. */
+	mset = enquire.get_mset (0, 0, db.get_doccount ());
+	search->counts[subdb] = mset.get_matches_estimated ();
+	return;
+    }
+
+    mset = enquire.get_mset (0, search->max_items);
+    search->counts[subdb] = mset.size ();
+
+    matches.resize (mset.size ());
+    for (i = mset.begin (); i != mset.end (); i++) {
+	parallel_match_t &match = matches[i.get_rank ()];
+
+	/* Document IDs of the combined database are interleaved, (see
+	 * notmuch_database_open_multi). */
+	match.doc_id = (*i - 1) * notmuch->num_subdbs + subdb + 1;
+	if (slot != Xapian::BAD_VALUENO)
+	    match.sort_key = i.get_document ().get_value (slot);
+    }
+}
+
+static void *
+_parallel_thread (void *closure)
+{
+    parallel_thread_t *thread = (parallel_thread_t *) closure;
+    parallel_search_t *search = thread->search;
+    unsigned int subdb;
+
+    try {
+	for (subdb = thread->index; subdb < search->notmuch->num_subdbs;
+	     subdb += search->num_threads)
+	{
+	    _parallel_search_subdb (search, subdb);
+	}
+    } catch (const Xapian::Error &error) {
+	thread->error = new Xapian::Error (error);
+    }
+
+    return NULL;
+}
+
+/* Search each database of 'search' with its threads, (or in the
+ * calling thread for any thread which cannot be started), and wait
+ * for them to finish. */
+static void
+_parallel_run (parallel_search_t *search)
+{
+    notmuch_database_t *notmuch = search->notmuch;
+    std::vector<parallel_thread_t> threads;
+    Xapian::Error *error = NULL;
+    unsigned int i, started;
+
+    search->num_threads = notmuch->search_threads;
+    if (search->num_threads > notmuch->num_subdbs)
+	search->num_threads = notmuch->num_subdbs;
+    search->matches.resize (notmuch->num_subdbs);
+    search->counts.resize (notmuch->num_subdbs);
+
+    threads.resize (search->num_threads);
+    for (i = 0; i < search->num_threads; i++) {
+	threads[i].search = search;
+	threads[i].index = i;
+	threads[i].error = NULL;
+    }
+
+    /* The calling thread searches its own share rather than waiting
+     * idly. */
+    for (started = 1; started < search->num_threads; started++) {
+	if (pthread_create (&threads[started].thread, NULL, _parallel_thread,
+			    &threads[started]))
+	{
+	    break;
+	}
+    }
+    _parallel_thread (&threads[0]);
+
+    for (i = 1; i < started; i++)
+	pthread_join (threads[i].thread, NULL);
+    for (i = started; i < search->num_threads; i++)
+	_parallel_thread (&threads[i]);
+
+    for (i = 0; i < search->num_threads; i++) {
+	if (threads[i].error && error == NULL)
+	    error = threads[i].error;
+	else
+	    delete threads[i].error;
+    }
+
+    if (error) {
+	Xapian::Error copy (*error);
+	delete error;
+	throw copy;
+    }
+}
+
+/* The position of the next match of a database to be merged. */
+struct parallel_cursor_t {
+    const parallel_match_t *match;
+    const parallel_match_t *end;
+};
+
+/* Orders cursors so that a std::priority_queue returns the one whose
+ * match comes first. */
+class ParallelCursorOrder {
+    notmuch_sort_t sort;
+
+  public:
+    ParallelCursorOrder (notmuch_sort_t sort_arg) : sort (sort_arg) { }
+
+    bool operator() (const parallel_cursor_t &a,
+		     const parallel_cursor_t &b) const
+    {
+	int cmp = a.match->sort_key.compare (b.match->sort_key);
+
+	if (sort == NOTMUCH_SORT_NEWEST_FIRST)
+	    cmp = -cmp;
+	if (cmp == 0)
+	    return a.match->doc_id > b.match->doc_id;
+
+	return cmp > 0;
+    }
+};
+
+unsigned int *
+_notmuch_parallel_search (void *ctx, notmuch_database_t *notmuch,
+			  const Xapian::Query &query, notmuch_sort_t sort,
+			  unsigned int offset, unsigned int limit,
+			  unsigned int *count)
+{
+    parallel_search_t search;
+    std::priority_queue<parallel_cursor_t, std::vector<parallel_cursor_t>,
+			ParallelCursorOrder> cursors ((ParallelCursorOrder (sort)));
+    unsigned int *doc_ids, position, total, i;
+
+    search.notmuch = notmuch;
+    search.query = query.serialise ();
+    search.sort = sort;
+    /* Any of the databases may hold all of the wanted matches. */
+    search.max_items = offset + limit;
+
+    _parallel_run (&search);
+
+    total = 0;
+    for (i = 0; i < notmuch->num_subdbs; i++) {
+	parallel_cursor_t cursor;
+
+	if (search.matches[i].empty ())
+	    continue;
+	total += search.matches[i].size ();
+
+	cursor.match = &search.matches[i].front ();
+	cursor.end = cursor.match + search.matches[i].size ();
+	cursors.push (cursor);
+    }
+
+    if (total > offset + limit)
+	total = offset + limit;
+
+    doc_ids = talloc_array (ctx, unsigned int,
+			    total > offset ? total - offset + 1 : 1);
+    if (unlikely (doc_ids == NULL))
+	INTERNAL_ERROR ("Out of memory merging search results");
+
+    *count = 0;
+    for (position = 0; position < total; position++)
+    {
+	parallel_cursor_t cursor = cursors.top ();
+
+	cursors.pop ();
+	if (position >= offset)
+	    doc_ids[(*count)++] = cursor.match->doc_id;
+
+	if (++cursor.match != cursor.end)
+	    cursors.push (cursor);
+    }
+
+    return doc_ids;
+}
+
+Xapian::doccount
+_notmuch_parallel_count (notmuch_database_t *notmuch,
+			 const Xapian::Query &query)
+{
+    parallel_search_t search;
+    Xapian::doccount count = 0;
+    unsigned int i;
+
+    search.notmuch = notmuch;
+    search.query = query.serialise ();
+    search.sort = NOTMUCH_SORT_UNSORTED;
+    search.max_items = 0;
+
+    _parallel_run (&search);
+
+    for (i = 0; i < notmuch->num_subdbs; i++)
+	count += search.counts[i];
+
+    return count;
+}
@@ -0,0 +1,460 @@
+/* query-cache.cc - Persistent cache of query results
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+/* The query cache remembers the results of recent queries, (message
+ * and thread counts, and the matching documents of thread searches),
+ * along with the database revision at which each was computed. A
+ * cached result is only used while the database is still at that
+ * revision, so it is always identical to what the query would
+ * compute.
+ *
+ * The cache is stored in the file NOTMUCH_QUERY_CACHE_FILENAME within
+ * the .notmuch directory, with one entry per line, most recently used
+ * first:
+ *
+ *	<key> <revision> <count> [<doc-id>...]
+ *
+ * where <key> is the SHA-1 of a description of the query (see
+ * _notmuch_query_cache_get), and all numbers are in decimal. Doc IDs
+ * are only present for entries that hold the result of a thread
+ * search, in which case there are <count> of them.
+ *
+ * The file is rewritten whenever a result is stored. A lookup only
+ * reorders or drops entries in memory, and the file is rewritten with
+ * the new order when the database is closed, (see
+ * _notmuch_query_cache_close), so that a read-only command rewrites
+ * it at most once. It is only a cache, so any failure to read or
+ * write it is silently ignored.
+ */
+#define NOTMUCH_QUERY_CACHE_FILENAME "query-cache"
+
+/* The result of a query matching more messages than this is not
+ * cached, to keep the cache file reasonably small. */
+#define NOTMUCH_QUERY_CACHE_MAX_DOC_IDS 10000
+
+typedef struct _notmuch_query_cache_entry {
+    char *key;
+    unsigned long revision;
+    unsigned int count;
+    unsigned int *doc_ids;
+    struct _notmuch_query_cache_entry *next;
+} notmuch_query_cache_entry_t;
+
+struct visible _notmuch_query_cache {
+    char *filename;
+    unsigned int size;
+    notmuch_bool_t loaded;
+    /* Whether the entries have changed since the file was last
+     * written. */
+    notmuch_bool_t dirty;
+
+    /* Entries in most-recently-used order. */
+    notmuch_query_cache_entry_t *head;
+    unsigned int length;
+};
+
+/* Return a copy of the 'count' doc IDs in 'doc_ids', allocated with
+ * 'ctx' as the talloc context, (and never NULL merely because count
+ * is 0). */
+static unsigned int *
+_copy_doc_ids (void *ctx, const unsigned int *doc_ids, unsigned int count)
+{
+    unsigned int *copy;
+
+    copy = talloc_array (ctx, unsigned int, count + 1);
+    if (copy && count)
+	memcpy (copy, doc_ids, count * sizeof (unsigned int));
+
+    return copy;
+}
+
+notmuch_status_t
+notmuch_database_set_query_cache_size (notmuch_database_t *notmuch,
+				       unsigned int size)
+{
+    notmuch_query_cache_t *cache;
+
+    /* The cached results of combined databases could not be
+     * invalidated by changes to any but the first of them. */
+    if (notmuch->num_subdbs > 1)
+	size = 0;
+
+    if (size == 0) {
+	talloc_free (notmuch->query_cache);
+	notmuch->query_cache = NULL;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    if (notmuch->query_cache) {
+	notmuch->query_cache->size = size;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    cache = talloc_zero (notmuch, notmuch_query_cache_t);
+    if (unlikely (cache == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    cache->filename = talloc_asprintf (cache, "%s/%s/%s", notmuch->path,
+				       ".notmuch", NOTMUCH_QUERY_CACHE_FILENAME);
+    if (unlikely (cache->filename == NULL)) {
+	talloc_free (cache);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    cache->size = size;
+    cache->loaded = FALSE;
+    cache->dirty = FALSE;
+    cache->head = NULL;
+    cache->length = 0;
+
+    notmuch->query_cache = cache;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Parse one line of the cache file into a new entry, allocated with
+ * 'cache' as the talloc context. Returns NULL if the line is
+ * malformed. */
+static notmuch_query_cache_entry_t *
+_parse_entry (notmuch_query_cache_t *cache, char *line)
+{
+    notmuch_query_cache_entry_t *entry;
+    char *key, *s, *end;
+    unsigned int i;
+
+    key = line;
+    s = strchr (line, ' ');
+    if (s == NULL || s - key != 40)
+	return NULL;
+    *s++ = '\0';
+
+    entry = talloc_zero (cache, notmuch_query_cache_entry_t);
+    if (unlikely (entry == NULL))
+	return NULL;
+
+    entry->key = talloc_strdup (entry, key);
+
+    entry->revision = strtoul (s, &end, 10);
+    if (end == s || *end != ' ')
+	goto FAIL;
+    s = end;
+
+    entry->count = strtoul (s, &end, 10);
+    if (end == s || (*end != ' ' && *end != '\n' && *end != '\0'))
+	goto FAIL;
+    s = end;
+
+    if (*s == ' ') {
+	if (entry->count > NOTMUCH_QUERY_CACHE_MAX_DOC_IDS)
+	    goto FAIL;
+
+	entry->doc_ids = talloc_array (entry, unsigned int,
+				       entry->count + 1);
+	if (unlikely (entry->doc_ids == NULL))
+	    goto FAIL;
+
+	for (i = 0; i < entry->count; i++) {
+	    entry->doc_ids[i] = strtoul (s, &end, 10);
+	    if (end == s)
+		goto FAIL;
+	    s = end;
+	}
+    }
+
+    return entry;
+
+  FAIL:
+    talloc_free (entry);
+    return NULL;
+}
+
+static void
+_query_cache_load (notmuch_query_cache_t *cache)
+{
+    notmuch_query_cache_entry_t *entry, **tail;
+    FILE *file;
+    char *line = NULL;
+    size_t line_size = 0;
+
+    cache->loaded = TRUE;
+
+    file = fopen (cache->filename, "r");
+    if (file == NULL)
+	return;
+
+    tail = &cache->head;
+    while (cache->length < cache->size &&
+	   getline (&line, &line_size, file) != -1)
+    {
+	entry = _parse_entry (cache, line);
+	if (entry == NULL)
+	    continue;
+
+	*tail = entry;
+	tail = &entry->next;
+	cache->length++;
+    }
+
+    free (line);
+    fclose (file);
+}
+
+/* Write the cache to its file, (via a temporary file, so that a
+ * concurrent reader never sees a partially-written cache). */
+static void
+_query_cache_save (notmuch_query_cache_t *cache)
+{
+    notmuch_query_cache_entry_t *entry;
+    char *tmp_filename;
+    unsigned int i;
+    FILE *file;
+
+    tmp_filename = talloc_asprintf (cache, "%s.%d", cache->filename,
+				    (int) getpid ());
+    if (unlikely (tmp_filename == NULL))
+	return;
+
+    file = fopen (tmp_filename, "w");
+    if (file == NULL)
+	goto DONE;
+
+    for (entry = cache->head; entry; entry = entry->next) {
+	fprintf (file, "%s %lu %u", entry->key, entry->revision, entry->count);
+	if (entry->doc_ids) {
+	    if (entry->count == 0)
+		fputc (' ', file);
+	    for (i = 0; i < entry->count; i++)
+		fprintf (file, " %u", entry->doc_ids[i]);
+	}
+	fputc ('\n', file);
+    }
+
+    if (fclose (file) != 0 || rename (tmp_filename, cache->filename) != 0)
+	unlink (tmp_filename);
+    else
+	cache->dirty = FALSE;
+
+  DONE:
+    talloc_free (tmp_filename);
+}
+
+/* Return the query cache of 'notmuch', (loading it if necessary), or
+ * NULL if cached results cannot currently be used (or stored).
+ *
+ * Within an atomic section, all modifications share one revision, so
+ * a result computed part way through the section could be stale by
+ * the end of it while the revision stays the same. */
+static notmuch_query_cache_t *
+_query_cache_usable (notmuch_database_t *notmuch)
+{
+    notmuch_query_cache_t *cache = notmuch->query_cache;
+
+    if (cache == NULL)
+	return NULL;
+
+    if (notmuch->atomic_nesting > 0 && notmuch->atomic_dirty)
+	return NULL;
+
+    if (! cache->loaded)
+	_query_cache_load (cache);
+
+    return cache;
+}
+
+/* Unlink the entry with the given key from the cache and return it,
+ * or return NULL if there is no such entry. */
+static notmuch_query_cache_entry_t *
+_query_cache_take (notmuch_query_cache_t *cache, const char *key)
+{
+    notmuch_query_cache_entry_t *entry, **prev;
+
+    for (prev = &cache->head; *prev; prev = &(*prev)->next) {
+	entry = *prev;
+	if (strcmp (entry->key, key) == 0) {
+	    *prev = entry->next;
+	    entry->next = NULL;
+	    cache->length--;
+	    return entry;
+	}
+    }
+
+    return NULL;
+}
+
+/* Look up the cached result of the query described by 'description'.
+ *
+ * The description must identify everything that affects the result
+ * of the query, (such as the normalized query string, the excluded
+ * tags and the sort order), and the kind of result, (such as a count
+ * of messages, or the matched messages of a thread search).
+ *
+ * If 'doc_ids' is non-NULL, only an entry holding matched doc IDs
+ * will be used, and *doc_ids is set to an array of *count doc IDs,
+ * allocated with 'ctx' as the talloc context.
+ *
+ * Returns TRUE if a result was found, (in which case it is stored in
+ * *count and possibly *doc_ids), and FALSE otherwise.
+ */
+notmuch_bool_t
+_notmuch_query_cache_get (void *ctx,
+			  notmuch_database_t *notmuch,
+			  const char *description,
+			  unsigned int *count,
+			  unsigned int **doc_ids)
+{
+    notmuch_query_cache_t *cache;
+    notmuch_query_cache_entry_t *entry;
+    notmuch_bool_t was_head;
+    char *key;
+
+    cache = _query_cache_usable (notmuch);
+    if (cache == NULL)
+	return FALSE;
+
+    key = notmuch_sha1_of_string (description);
+    if (unlikely (key == NULL))
+	return FALSE;
+
+    was_head = (cache->head && strcmp (cache->head->key, key) == 0);
+    entry = _query_cache_take (cache, key);
+    free (key);
+
+    if (entry == NULL)
+	return FALSE;
+
+    if (entry->revision != notmuch->revision ||
+	(doc_ids && entry->doc_ids == NULL))
+    {
+	talloc_free (entry);
+	cache->dirty = TRUE;
+	return FALSE;
+    }
+
+    entry->next = cache->head;
+    cache->head = entry;
+    cache->length++;
+
+    if (! was_head)
+	cache->dirty = TRUE;
+
+    *count = entry->count;
+    if (doc_ids) {
+	*doc_ids = _copy_doc_ids (ctx, entry->doc_ids, entry->count);
+	if (unlikely (*doc_ids == NULL))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Store the result of the query described by 'description', (see
+ * _notmuch_query_cache_get), as computed at the current revision of
+ * the database.
+ *
+ * Nothing is stored once the database has been modified through this
+ * handle, since the result would then reflect changes which are not
+ * committed, (and might never be, if the database is not flushed),
+ * while another handle could later commit different changes with the
+ * same revision.
+ *
+ * If 'doc_ids' is non-NULL, it is an array of 'count' matched doc
+ * IDs.
+ *
+ * The least recently used entries are evicted to keep the cache
+ * within its configured size.
+ */
+void
+_notmuch_query_cache_put (notmuch_database_t *notmuch,
+			  const char *description,
+			  unsigned int count,
+			  const unsigned int *doc_ids)
+{
+    notmuch_query_cache_t *cache;
+    notmuch_query_cache_entry_t *entry, **prev;
+    char *key;
+    unsigned int i;
+
+    cache = _query_cache_usable (notmuch);
+    if (cache == NULL)
+	return;
+
+    if (notmuch->revision != notmuch->open_revision)
+	return;
+
+    if (doc_ids && count > NOTMUCH_QUERY_CACHE_MAX_DOC_IDS)
+	return;
+
+    key = notmuch_sha1_of_string (description);
+    if (unlikely (key == NULL))
+	return;
+
+    talloc_free (_query_cache_take (cache, key));
+
+    entry = talloc_zero (cache, notmuch_query_cache_entry_t);
+    if (unlikely (entry == NULL)) {
+	free (key);
+	return;
+    }
+
+    entry->key = talloc_strdup (entry, key);
+    free (key);
+    entry->revision = notmuch->revision;
+    entry->count = count;
+    if (doc_ids) {
+	entry->doc_ids = _copy_doc_ids (entry, doc_ids, count);
+	if (unlikely (entry->doc_ids == NULL)) {
+	    talloc_free (entry);
+	    return;
+	}
+    }
+
+    entry->next = cache->head;
+    cache->head = entry;
+    cache->length++;
+
+    /* Evict the least recently used entries. */
+    if (cache->length > cache->size) {
+	prev = &cache->head;
+	for (i = 0; i < cache->size; i++)
+	    prev = &(*prev)->next;
+	while (*prev) {
+	    entry = *prev;
+	    *prev = entry->next;
+	    talloc_free (entry);
+	    cache->length--;
+	}
+    }
+
+    _query_cache_save (cache);
+}
+
+/* Write the cache of 'notmuch' to its file if lookups have changed
+ * the order of its entries since it was last written, and the
+ * database was 'flushed', (otherwise the changes are dropped). */
+void
+_notmuch_query_cache_close (notmuch_database_t *notmuch,
+			    notmuch_bool_t flushed)
+{
+    notmuch_query_cache_t *cache = notmuch->query_cache;
+
+    if (cache && cache->dirty && flushed)
+	_query_cache_save (cache);
+}
@@ -23,12 +23,41 @@
 
 #include <glib.h> /* GHashTable, GPtrArray */
 
+#include <algorithm>
+#include <map>
+#include <set>
+
 struct _notmuch_query {
     notmuch_database_t *notmuch;
     const char *query_string;
     notmuch_sort_t sort;
     notmuch_string_list_t *exclude_terms;
     notmuch_bool_t omit_excluded;
+
+    /* The range of results returned by notmuch_query_search_messages,
+     * (see notmuch_query_set_range). */
+    unsigned int range_offset;
+    int range_limit;
+
+    /* The query string, parsed and restricted to mail documents, or
+     * NULL until the query is compiled. */
+    Xapian::Query *compiled;
+
+    /* Restrictions bound to the query, (see notmuch_query_bind_*),
+     * which are combined with the compiled query whenever it is
+     * executed. */
+    char *bound_thread_id;
+    notmuch_bool_t bound_dates;
+    time_t bound_begin;
+    time_t bound_end;
+    /* Terms of the tags to be added (prefixed with '+') and removed
+     * (prefixed with '-') by notmuch_query_bind_tag_change. */
+    notmuch_string_list_t *bound_tag_changes;
+
+    /* The posting sources of the stubs of frozen messages in the
+     * Xapian queries executed for the query, (see
+     * _notmuch_query_add_frozen), which must live as long as it. */
+    GPtrArray *frozen_sources;
 };
 
 typedef struct _notmuch_mset_messages {
@@ -36,34 +65,69 @@ typedef struct _notmuch_mset_messages {
     notmuch_database_t *notmuch;
     Xapian::MSetIterator iterator;
     Xapian::MSetIterator iterator_end;
-} notmuch_mset_messages_t;
 
-struct _notmuch_doc_id_set {
-    unsigned int *bitmap;
-    unsigned int bound;
-};
+    /* The talloc pool from which each message returned by
+     * notmuch_messages_get, (and everything allocated with the
+     * message as its context, such as its tag and filename lists),
+     * is allocated, (or the messages object itself if the pool could
+     * not be created). */
+    void *pool;
+} notmuch_mset_messages_t;
 
-#define DOCIDSET_WORD(bit) ((bit) / sizeof (unsigned int))
-#define DOCIDSET_BIT(bit) ((bit) % sizeof (unsigned int))
+/* The size of the pool of a messages object. A typical loop which
+ * destroys each message before getting the next only ever uses the
+ * start of the pool, since talloc reuses a pool once all of its
+ * objects have been freed, so messages cost no calls to malloc at
+ * all. Should the caller keep messages, they are allocated from the
+ * pool until it is full, and then as usual. All of them are freed
+ * along with the messages object. */
+#define NOTMUCH_MESSAGES_POOL_SIZE (64 * 1024)
+
+/* The maximum number of threads whose messages are fetched together
+ * by a single database search when iterating over threads. */
+#define NOTMUCH_THREADS_BATCH_SIZE 64
+
+/* The number of matches fetched by the first database search of a
+ * thread search, and the factor by which that number grows for each
+ * further search, (see _notmuch_threads_fetch). */
+#define NOTMUCH_THREADS_FIRST_FETCH 512
+#define NOTMUCH_THREADS_FETCH_GROWTH 8
 
 struct visible _notmuch_threads {
     notmuch_query_t *query;
 
-    /* The ordered list of doc ids matched by the query. */
+    /* The ordered list of doc ids matched by the query, as far as it
+     * has been fetched from the database so far. */
     GArray *doc_ids;
     /* Our iterator's current position in doc_ids. */
     unsigned int doc_id_pos;
-    /* The set of matched docid's that have not been assigned to a
-     * thread. Initially, this contains every docid in doc_ids. */
-    notmuch_doc_id_set_t match_set;
+    /* The number of matches to fetch with the next database search,
+     * or 0 once doc_ids holds every match. */
+    unsigned int fetch_size;
+    /* The description of the query in the query cache, (see
+     * _notmuch_query_cache_get), or NULL if the matches are not to be
+     * cached. */
+    char *description;
+    /* The set of matched doc ids that have been assigned to a
+     * thread, (along with any other messages of skipped threads).
+     * This grows as the iterator advances, so that a thread is only
+     * returned at the first of its matched messages. */
+    notmuch_doc_id_set_t *assigned;
+
+    /* Threads that have been created ahead of the iterator by a
+     * batched load, in order, along with the positions in doc_ids of
+     * their seed messages. Entries before batch_index have already
+     * been returned or skipped. */
+    notmuch_thread_t *batch[NOTMUCH_THREADS_BATCH_SIZE];
+    unsigned int batch_pos[NOTMUCH_THREADS_BATCH_SIZE];
+    unsigned int batch_count;
+    unsigned int batch_index;
+
+    /* The number of threads matched by the query, or -1 if it has not
+     * been computed yet, (see notmuch_threads_count). */
+    int count;
 };
 
-/* We need this in the message functions so forward declare. */
-static notmuch_bool_t
-_notmuch_doc_id_set_init (void *ctx,
-			  notmuch_doc_id_set_t *doc_ids,
-			  GArray *arr);
-
 static notmuch_bool_t
 _debug_query (void)
 {
@@ -71,6 +135,23 @@ _debug_query (void)
     return (env && strcmp (env, "") != 0);
 }
 
+static int
+_notmuch_query_destructor (notmuch_query_t *query)
+{
+    unsigned int i;
+
+    delete query->compiled;
+
+    if (query->frozen_sources) {
+	for (i = 0; i < query->frozen_sources->len; i++)
+	    delete (Xapian::PostingSource *)
+		g_ptr_array_index (query->frozen_sources, i);
+	g_ptr_array_free (query->frozen_sources, TRUE);
+    }
+
+    return 0;
+}
+
 notmuch_query_t *
 notmuch_query_create (notmuch_database_t *notmuch,
 		      const char *query_string)
@@ -84,6 +165,16 @@ notmuch_query_create (notmuch_database_t *notmuch,
     if (unlikely (query == NULL))
 	return NULL;
 
+    query->compiled = NULL;
+    query->frozen_sources = NULL;
+    talloc_set_destructor (query, _notmuch_query_destructor);
+
+    query->bound_thread_id = NULL;
+    query->bound_dates = FALSE;
+    query->bound_begin = 0;
+    query->bound_end = 0;
+    query->bound_tag_changes = _notmuch_string_list_create (query);
+
     query->notmuch = notmuch;
 
     query->query_string = talloc_strdup (query, query_string);
@@ -94,6 +185,9 @@ notmuch_query_create (notmuch_database_t *notmuch,
 
     query->omit_excluded = TRUE;
 
+    query->range_offset = 0;
+    query->range_limit = -1;
+
     return query;
 }
 
@@ -121,6 +215,14 @@ notmuch_query_get_sort (notmuch_query_t *query)
     return query->sort;
 }
 
+void
+notmuch_query_set_range (notmuch_query_t *query,
+			 unsigned int offset, int limit)
+{
+    query->range_offset = offset;
+    query->range_limit = limit;
+}
+
 void
 notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag)
 {
@@ -128,6 +230,630 @@ notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag)
     _notmuch_string_list_append (query->exclude_terms, term);
 }
 
+/* Does a term begin at 'c', (which is within 'query_string')? A term
+ * may be preceded by an operator such as '+' or '-'. */
+static notmuch_bool_t
+_is_term_start (const char *query_string, const char *c)
+{
+    if (c > query_string && (c[-1] == '+' || c[-1] == '-'))
+	c--;
+
+    return (c == query_string ||
+	    isspace ((unsigned char) c[-1]) || c[-1] == '(');
+}
+
+char *
+_notmuch_query_string_expand (void *ctx, const char *query_string,
+			      const char *prefix,
+			      notmuch_term_expander_t expand, void *closure)
+{
+    size_t prefix_len = strlen (prefix);
+    const char *s, *copied, *value, *end;
+    notmuch_bool_t quoted = FALSE;
+    char *expansion, *replacement;
+
+    expansion = talloc_strdup (ctx, "");
+    copied = query_string;
+
+    for (s = query_string; *s; s++) {
+	if (*s == '"')
+	    quoted = ! quoted;
+
+	if (quoted || strncmp (s, prefix, prefix_len) != 0 ||
+	    ! _is_term_start (query_string, s))
+	    continue;
+
+	value = s + prefix_len;
+	if (*value == '{') {
+	    notmuch_bool_t value_quoted = FALSE;
+	    int depth = 0;
+
+	    for (end = value; *end; end++) {
+		if (*end == '"')
+		    value_quoted = ! value_quoted;
+		else if (! value_quoted && *end == '{')
+		    depth++;
+		else if (! value_quoted && *end == '}' && --depth == 0)
+		    break;
+	    }
+	    if (*end == '\0')
+		continue;
+	    end++;
+	} else {
+	    for (end = value; *end && *end != ')' &&
+		     ! isspace ((unsigned char) *end); end++)
+		;
+	}
+
+	replacement = expand (ctx, value, end - value, closure);
+	if (replacement == NULL)
+	    continue;
+
+	/* The query parser only accepts '+' and '-' before a single
+	 * term, so a '+' is dropped, (since terms are combined with
+	 * AND anyway), and a '-' becomes NOT. */
+	if (s > query_string && (s[-1] == '+' || s[-1] == '-')) {
+	    expansion = talloc_strndup_append (expansion, copied,
+					       s - 1 - copied);
+	    if (s[-1] == '-')
+		expansion = talloc_strdup_append (expansion, "NOT ");
+	} else {
+	    expansion = talloc_strndup_append (expansion, copied, s - copied);
+	}
+	expansion = talloc_strdup_append (expansion, replacement);
+	talloc_free (replacement);
+
+	copied = end;
+	s = end - 1;
+    }
+
+    return talloc_strdup_append (expansion, copied);
+}
+
+static void
+_notmuch_query_parse (notmuch_query_t *query);
+
+/* The term which stands for a thread:{...} subquery while the rest of
+ * the query string is parsed, (see _notmuch_query_parse_string).
+ * Thread IDs are hexadecimal, (see
+ * _notmuch_database_generate_thread_id), so no document has it. */
+#define NOTMUCH_SUBQUERY_PLACEHOLDER "thread:subquery"
+
+typedef struct {
+    /* The text replacing the first thread:{...} subquery. */
+    const char *replacement;
+    /* The search terms of the subquery that was replaced, or NULL if
+     * the query string has none. */
+    char *subquery;
+} notmuch_subquery_expansion_t;
+
+/* Replace the value of a "thread:" term, (see
+ * _notmuch_query_string_expand), if it is the first subquery in
+ * braces, recording the subquery. */
+static char *
+_replace_thread_subquery (void *ctx, const char *value, size_t length,
+			  void *closure)
+{
+    notmuch_subquery_expansion_t *expansion =
+	(notmuch_subquery_expansion_t *) closure;
+
+    if (expansion->subquery ||
+	length < 2 || value[0] != '{' || value[length - 1] != '}')
+	return NULL;
+
+    expansion->subquery = talloc_strndup (ctx, value + 1, length - 2);
+
+    return talloc_strdup (ctx, expansion->replacement);
+}
+
+static Xapian::Query
+_notmuch_query_get_xapian_query (notmuch_query_t *query);
+
+/* Return the query matching every message of the threads in which
+ * any message matches 'subquery', (a union of thread terms), or
+ * Xapian::Query::MatchNothing if no message matches.
+ *
+ * The thread of each match is read from the metadata record of its
+ * document, (which is stored in a value, so no document is read),
+ * and only from its terms for a document without a record.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static Xapian::Query
+_thread_subquery_threads (notmuch_query_t *query, const char *subquery)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    const char *prefix = _find_prefix ("thread");
+    notmuch_query_t *matches;
+    std::set<std::string> threads;
+    char *thread_id, *thread_term;
+
+    matches = notmuch_query_create (notmuch, subquery);
+    if (unlikely (matches == NULL))
+	INTERNAL_ERROR ("Out of memory evaluating a thread subquery");
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::MSet mset;
+	Xapian::MSetIterator i, end;
+	Xapian::ValueIterator record, record_end;
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_query (_notmuch_query_get_xapian_query (matches));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	/* The matches are in document order, so a single pass over
+	 * the stream of metadata records finds all of theirs. */
+	record = notmuch->xapian_db->valuestream_begin (NOTMUCH_VALUE_METADATA);
+	record_end = notmuch->xapian_db->valuestream_end (NOTMUCH_VALUE_METADATA);
+
+	for (i = mset.begin (), end = mset.end (); i != end; i++) {
+	    thread_id = NULL;
+	    if (record != record_end) {
+		record.skip_to (*i);
+		if (record != record_end && record.get_docid () == *i)
+		    thread_id = _notmuch_message_record_thread_id (matches,
+								   *record);
+	    }
+
+	    if (thread_id) {
+		thread_term = talloc_asprintf (matches, "%s%s", prefix,
+					       thread_id);
+	    } else {
+		thread_term = _notmuch_thread_term_for_doc_id (matches, notmuch,
+							       *i);
+		if (thread_term == NULL)
+		    INTERNAL_ERROR ("Message with document ID of %u has no thread ID.\n",
+				    *i);
+	    }
+
+	    threads.insert (thread_term);
+	    talloc_free (thread_id);
+	    talloc_free (thread_term);
+	}
+    } catch (...) {
+	notmuch_query_destroy (matches);
+	throw;
+    }
+
+    notmuch_query_destroy (matches);
+
+    if (threads.empty ())
+	return Xapian::Query::MatchNothing;
+
+    return Xapian::Query (Xapian::Query::OP_OR, threads.begin (),
+			  threads.end ());
+}
+
+/* Parse 'query_string' for 'query', evaluating each thread:{...}
+ * subquery in it.
+ *
+ * The query parser cannot take a ready-made Xapian::Query in place of
+ * a term, so a subquery is replaced by a term for the parse, and the
+ * set of threads S it matches is combined with the result. Since the
+ * query string is a boolean expression, its matches are those of the
+ * string with the subquery taken as matching everything, among the
+ * messages of S, along with those of the string with it taken as
+ * matching nothing, among the other messages. The two cases are
+ * parsed with NOT NOTMUCH_SUBQUERY_PLACEHOLDER and
+ * NOTMUCH_SUBQUERY_PLACEHOLDER in place of the subquery.
+ *
+ * So a query string with n subquery terms, (not counting those
+ * nested within another subquery), is parsed 2^n times, though each
+ * subquery is only evaluated once.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static Xapian::Query
+_notmuch_query_parse_string (notmuch_query_t *query, const char *query_string,
+			     std::map<std::string, Xapian::Query> &subqueries)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
+			  Xapian::QueryParser::FLAG_PHRASE |
+			  Xapian::QueryParser::FLAG_LOVEHATE |
+			  Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
+			  Xapian::QueryParser::FLAG_WILDCARD |
+			  Xapian::QueryParser::FLAG_PURE_NOT);
+    notmuch_subquery_expansion_t expansion;
+    Xapian::Query threads, matches_none, matches_all;
+    void *local;
+    char *replaced, *expanded;
+
+    local = talloc_new (query);
+
+    expansion.replacement = NOTMUCH_SUBQUERY_PLACEHOLDER;
+    expansion.subquery = NULL;
+    replaced = _notmuch_query_string_expand (local, query_string, "thread:",
+					     _replace_thread_subquery,
+					     &expansion);
+
+    try {
+	if (expansion.subquery == NULL) {
+	    expanded = _notmuch_date_expand_ranges (local, notmuch,
+						    query_string);
+	    matches_none = notmuch->query_parser->parse_query (expanded, flags);
+	    talloc_free (local);
+	    return matches_none;
+	}
+
+	if (subqueries.find (expansion.subquery) == subqueries.end ())
+	    subqueries[expansion.subquery] =
+		_thread_subquery_threads (query, expansion.subquery);
+	threads = subqueries[expansion.subquery];
+
+	matches_none = _notmuch_query_parse_string (query, replaced,
+						    subqueries);
+
+	if (! threads.empty ()) {
+	    expansion.replacement = "(NOT " NOTMUCH_SUBQUERY_PLACEHOLDER ")";
+	    expansion.subquery = NULL;
+	    replaced = _notmuch_query_string_expand (local, query_string,
+						     "thread:",
+						     _replace_thread_subquery,
+						     &expansion);
+	    matches_all = _notmuch_query_parse_string (query, replaced,
+						       subqueries);
+	}
+    } catch (...) {
+	talloc_free (local);
+	throw;
+    }
+
+    talloc_free (local);
+
+    if (threads.empty ())
+	return matches_none;
+
+    return Xapian::Query (
+	Xapian::Query::OP_OR,
+	Xapian::Query (Xapian::Query::OP_AND, matches_all, threads),
+	Xapian::Query (Xapian::Query::OP_AND_NOT, matches_none, threads));
+}
+
+/* Parse the query string of 'query', if that has not been done yet.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static void
+_notmuch_query_parse (notmuch_query_t *query)
+{
+    const char *query_string = query->query_string;
+
+    if (query->compiled)
+	return;
+
+    Xapian::Query mail_query (std::string (_find_prefix ("type")) + "mail");
+
+    if (strcmp (query_string, "") == 0 ||
+	strcmp (query_string, "*") == 0)
+    {
+	query->compiled = new Xapian::Query (mail_query);
+    } else {
+	std::map<std::string, Xapian::Query> subqueries;
+
+	Xapian::Query string_query = _notmuch_query_parse_string (
+	    query, query_string, subqueries);
+	query->compiled = new Xapian::Query (Xapian::Query::OP_AND,
+					     mail_query, string_query);
+    }
+}
+
+notmuch_status_t
+notmuch_query_compile (notmuch_query_t *query)
+{
+    try {
+	_notmuch_query_parse (query);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred parsing query: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	query->notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+void
+notmuch_query_bind_thread (notmuch_query_t *query, const char *thread_id)
+{
+    talloc_free (query->bound_thread_id);
+    query->bound_thread_id = thread_id ? talloc_strdup (query, thread_id) : NULL;
+}
+
+void
+notmuch_query_bind_date_range (notmuch_query_t *query,
+			       time_t begin, time_t end)
+{
+    query->bound_dates = TRUE;
+    query->bound_begin = begin;
+    query->bound_end = end;
+}
+
+void
+notmuch_query_bind_tag_change (notmuch_query_t *query,
+			       const char *tag, notmuch_bool_t remove)
+{
+    char *change = talloc_asprintf (query, "%c%s%s", remove ? '-' : '+',
+				    _find_prefix ("tag"), tag);
+    _notmuch_string_list_append (query->bound_tag_changes, change);
+}
+
+void
+notmuch_query_clear_bindings (notmuch_query_t *query)
+{
+    talloc_free (query->bound_thread_id);
+    query->bound_thread_id = NULL;
+    query->bound_dates = FALSE;
+    talloc_free (query->bound_tag_changes);
+    query->bound_tag_changes = _notmuch_string_list_create (query);
+}
+
+/* Return a query matching the messages which need a change of their
+ * tags by 'changes', (a list of tag terms prefixed with '+' for those
+ * to be added and '-' for those to be removed, as in
+ * query->bound_tag_changes): those which lack any tag to be added or
+ * have any tag to be removed. */
+static Xapian::Query
+_notmuch_tag_change_query (notmuch_string_list_t *changes)
+{
+    Xapian::Query all_query (std::string (_find_prefix ("type")) + "mail");
+    Xapian::Query change_query = Xapian::Query::MatchNothing;
+    notmuch_string_node_t *node;
+
+    for (node = changes->head; node; node = node->next) {
+	Xapian::Query tag_query (node->string + 1);
+
+	if (node->string[0] == '+')
+	    tag_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
+				       all_query, tag_query);
+	change_query = Xapian::Query (Xapian::Query::OP_OR,
+				      change_query, tag_query);
+    }
+
+    return change_query;
+}
+
+/* The stubs, (see cold.cc), of the frozen messages matching a query
+ * in the cold shards, as the posting list of a query of the database
+ * opened read-write. */
+class FrozenStubSource : public Xapian::PostingSource {
+    const std::vector<Xapian::docid> doc_ids;
+    std::vector<Xapian::docid>::const_iterator pos;
+    bool started;
+
+  public:
+    FrozenStubSource (const std::vector<Xapian::docid> &doc_ids_arg)
+	: doc_ids (doc_ids_arg), started (false)
+    {
+    }
+
+    Xapian::PostingSource *clone () const
+    {
+	return new FrozenStubSource (doc_ids);
+    }
+
+    void init (unused (const Xapian::Database &db))
+    {
+	started = false;
+    }
+
+    Xapian::doccount get_termfreq_min () const { return doc_ids.size (); }
+    Xapian::doccount get_termfreq_est () const { return doc_ids.size (); }
+    Xapian::doccount get_termfreq_max () const { return doc_ids.size (); }
+
+    void next (unused (Xapian::weight min_wt))
+    {
+	if (started) {
+	    pos++;
+	} else {
+	    pos = doc_ids.begin ();
+	    started = true;
+	}
+    }
+
+    void skip_to (Xapian::docid doc_id, unused (Xapian::weight min_wt))
+    {
+	if (! started) {
+	    pos = doc_ids.begin ();
+	    started = true;
+	}
+	pos = std::lower_bound (pos, doc_ids.end (), doc_id);
+    }
+
+    bool at_end () const { return started && pos == doc_ids.end (); }
+
+    Xapian::docid get_docid () const { return *pos; }
+};
+
+/* Return 'xquery', (a query of the database opened read-write), along
+ * with the stubs of the frozen messages which it matches in the cold
+ * shards, (see cold.cc). A stub holds none of the terms of its
+ * message besides those of its ID, thread, references and filenames,
+ * so 'xquery' is executed against the cold shards themselves, and
+ * each match there is mapped to its stub. Only documents which are
+ * still stubs match, (not those of messages thawed since).
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static Xapian::Query
+_notmuch_query_add_frozen (notmuch_query_t *query, const Xapian::Query &xquery)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    std::vector<Xapian::docid> doc_ids;
+    Xapian::docid doc_id;
+    Xapian::PostingSource *source;
+
+    if (notmuch->cold_view == NULL || xquery.empty ())
+	return xquery;
+
+    Xapian::Enquire enquire (*notmuch->cold_view);
+    Xapian::MSet mset;
+    Xapian::MSetIterator i;
+
+    enquire.set_weighting_scheme (Xapian::BoolWeight ());
+    enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+    enquire.set_query (xquery);
+    mset = enquire.get_mset (0, notmuch->cold_view->get_doccount ());
+
+    /* Document IDs of the view are interleaved as for the combined
+     * database, (see _notmuch_cold_read), so the matches are in the
+     * order of their stubs. */
+    for (i = mset.begin (); i != mset.end (); i++) {
+	doc_id = (*i - 1) / notmuch->num_cold_shards + 1;
+	if (doc_ids.empty () || doc_ids.back () != doc_id)
+	    doc_ids.push_back (doc_id);
+    }
+
+    if (doc_ids.empty ())
+	return xquery;
+
+    if (query->frozen_sources == NULL)
+	query->frozen_sources = g_ptr_array_new ();
+    source = new FrozenStubSource (doc_ids);
+    g_ptr_array_add (query->frozen_sources, source);
+
+    return Xapian::Query (
+	Xapian::Query::OP_OR, xquery,
+	Xapian::Query (Xapian::Query::OP_AND, Xapian::Query (source),
+		       Xapian::Query (std::string (_find_prefix ("type")) +
+				      "frozen")));
+}
+
+/* Return the Xapian query to execute for 'query' against the database
+ * itself, (without any exclusion of tags, or the stubs of frozen
+ * messages), compiling the query string if necessary and applying any
+ * bound restrictions.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static Xapian::Query
+_notmuch_query_get_hot_query (notmuch_query_t *query)
+{
+    Xapian::Query final_query;
+
+    _notmuch_query_parse (query);
+
+    final_query = *query->compiled;
+
+    if (query->bound_thread_id) {
+	Xapian::Query thread_query (std::string (_find_prefix ("thread")) +
+				    query->bound_thread_id);
+	final_query = Xapian::Query (Xapian::Query::OP_AND,
+				     final_query, thread_query);
+    }
+
+    if (query->bound_dates) {
+	Xapian::Query date_query (Xapian::Query::OP_VALUE_RANGE,
+				  NOTMUCH_VALUE_TIMESTAMP,
+				  Xapian::sortable_serialise (query->bound_begin),
+				  Xapian::sortable_serialise (query->bound_end));
+	final_query = Xapian::Query (Xapian::Query::OP_AND,
+				     final_query, date_query);
+    }
+
+    if (query->bound_tag_changes->head)
+	final_query = Xapian::Query (Xapian::Query::OP_AND, final_query,
+				     _notmuch_tag_change_query (
+					 query->bound_tag_changes));
+
+    return final_query;
+}
+
+/* Return the Xapian query to execute for 'query', (without any
+ * exclusion of tags), as for _notmuch_query_get_hot_query, along with
+ * the stubs of any frozen messages it matches.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static Xapian::Query
+_notmuch_query_get_xapian_query (notmuch_query_t *query)
+{
+    return _notmuch_query_add_frozen (query,
+				      _notmuch_query_get_hot_query (query));
+}
+
+static int
+_compare_strings (const void *a, const void *b)
+{
+    return strcmp (*(const char * const *) a, *(const char * const *) b);
+}
+
+/* Return a description of everything that determines the result of
+ * the given kind for 'query', for use as a query cache key, (see
+ * _notmuch_query_cache_get). The query string is normalized so that
+ * queries differing only in whitespace share a description.
+ *
+ * The handling of excluded messages, (see
+ * notmuch_query_set_omit_excluded), is always included. If 'ordered'
+ * is TRUE, the description also includes the sort order, (which does
+ * not affect counts). */
+static char *
+_notmuch_query_cache_description (notmuch_query_t *query,
+				  const char *kind,
+				  notmuch_bool_t ordered)
+{
+    const char *s, **terms;
+    char *description, *normalized, *n;
+    notmuch_string_node_t *node;
+    unsigned int i, num_terms = 0;
+
+    normalized = talloc_array (query, char, strlen (query->query_string) + 2);
+    n = normalized;
+    for (s = query->query_string; *s; s++) {
+	if (isspace ((unsigned char) *s)) {
+	    if (n > normalized && n[-1] != ' ')
+		*n++ = ' ';
+	} else {
+	    *n++ = *s;
+	}
+    }
+    if (n > normalized && n[-1] == ' ')
+	n--;
+    if (n == normalized)
+	*n++ = '*';
+    *n = '\0';
+
+    description = talloc_asprintf (query, "%s\n%s\n", kind, normalized);
+    talloc_free (normalized);
+
+    if (ordered)
+	description = talloc_asprintf_append (description, "%d %d\n",
+					      query->sort,
+					      query->omit_excluded);
+    else
+	description = talloc_asprintf_append (description, "%d\n",
+					      query->omit_excluded);
+
+    /* The order in which tags are excluded does not matter. */
+    terms = talloc_array (query, const char *,
+			  query->exclude_terms->length + 1);
+    for (node = query->exclude_terms->head; node; node = node->next)
+	terms[num_terms++] = node->string;
+    qsort (terms, num_terms, sizeof (const char *), _compare_strings);
+
+    for (i = 0; i < num_terms; i++)
+	description = talloc_asprintf_append (description, "%s\n", terms[i]);
+
+    talloc_free (terms);
+
+    if (query->bound_thread_id)
+	description = talloc_asprintf_append (description, "thread %s\n",
+					      query->bound_thread_id);
+    if (query->bound_dates)
+	description = talloc_asprintf_append (description, "dates %ld %ld\n",
+					      (long) query->bound_begin,
+					      (long) query->bound_end);
+    for (node = query->bound_tag_changes->head; node; node = node->next)
+	description = talloc_asprintf_append (description, "change %s\n",
+					      node->string);
+
+    return description;
+}
+
 /* We end up having to call the destructors explicitly because we had
  * to use "placement new" in order to initialize C++ objects within a
  * block that we allocated with talloc. So C++ is making talloc
@@ -167,14 +893,38 @@ _notmuch_exclude_tags (notmuch_query_t *query, Xapian::Query xquery)
 	else
 	    term->string = talloc_strdup (query, "");
     }
-    return exclude_query;
+    return _notmuch_query_add_frozen (query, exclude_query);
 }
 
-notmuch_messages_t *
-notmuch_query_search_messages (notmuch_query_t *query)
+/* Set the order in which 'enquire' returns its matches to the sort
+ * order of 'query'. */
+static void
+_notmuch_query_set_enquire_sort (notmuch_query_t *query,
+				 Xapian::Enquire &enquire)
+{
+    switch (query->sort) {
+    case NOTMUCH_SORT_OLDEST_FIRST:
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
+	break;
+    case NOTMUCH_SORT_NEWEST_FIRST:
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, TRUE);
+	break;
+    case NOTMUCH_SORT_MESSAGE_ID:
+	enquire.set_sort_by_value (NOTMUCH_VALUE_MESSAGE_ID, FALSE);
+	break;
+    case NOTMUCH_SORT_UNSORTED:
+	break;
+    }
+}
+
+/* Search for the messages matching 'query', returning at most 'limit'
+ * of them, (or all of them if 'limit' is negative), starting at
+ * position 'offset'. */
+static notmuch_messages_t *
+_notmuch_query_search_messages_range (notmuch_query_t *query,
+				      unsigned int offset, int limit)
 {
     notmuch_database_t *notmuch = query->notmuch;
-    const char *query_string = query->query_string;
     notmuch_mset_messages_t *messages;
 
     messages = talloc (query, notmuch_mset_messages_t);
@@ -186,39 +936,25 @@ notmuch_query_search_messages (notmuch_query_t *query)
 	messages->base.is_of_list_type = FALSE;
 	messages->base.iterator = NULL;
 	messages->notmuch = notmuch;
+	messages->pool = talloc_pool (messages, NOTMUCH_MESSAGES_POOL_SIZE);
+	if (messages->pool == NULL)
+	    messages->pool = messages;
 	new (&messages->iterator) Xapian::MSetIterator ();
 	new (&messages->iterator_end) Xapian::MSetIterator ();
 
 	talloc_set_destructor (messages, _notmuch_messages_destructor);
 
 	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   "mail"));
-	Xapian::Query string_query, final_query, exclude_query;
+	Xapian::Query final_query, exclude_query;
 	Xapian::MSet mset;
 	Xapian::MSetIterator iterator;
-	unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
-			      Xapian::QueryParser::FLAG_PHRASE |
-			      Xapian::QueryParser::FLAG_LOVEHATE |
-			      Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
-			      Xapian::QueryParser::FLAG_WILDCARD |
-			      Xapian::QueryParser::FLAG_PURE_NOT);
-
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
-	} else {
-	    string_query = notmuch->query_parser->
-		parse_query (query_string, flags);
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, string_query);
-	}
+	Xapian::doccount max_items;
+
+	final_query = _notmuch_query_get_xapian_query (query);
 	messages->base.excluded_doc_ids = NULL;
 
 	if (query->exclude_terms) {
-	    exclude_query = _notmuch_exclude_tags (query, final_query);
+	    exclude_query = _notmuch_exclude_tags (query, *query->compiled);
 
 	    if (query->omit_excluded)
 		final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
@@ -238,9 +974,10 @@ notmuch_query_search_messages (notmuch_query_t *query)
 		    unsigned int doc_id = *iterator;
 		    g_array_append_val (excluded_doc_ids, doc_id);
 		}
-		messages->base.excluded_doc_ids = talloc (messages, _notmuch_doc_id_set);
-		_notmuch_doc_id_set_init (query, messages->base.excluded_doc_ids,
-					  excluded_doc_ids);
+		messages->base.excluded_doc_ids =
+		    _notmuch_doc_id_set_create_from_array (
+			messages, (unsigned int *) excluded_doc_ids->data,
+			excluded_doc_ids->len);
 		g_array_unref (excluded_doc_ids);
 	    }
 	}
@@ -248,19 +985,7 @@ notmuch_query_search_messages (notmuch_query_t *query)
 
 	enquire.set_weighting_scheme (Xapian::BoolWeight());
 
-	switch (query->sort) {
-	case NOTMUCH_SORT_OLDEST_FIRST:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
-	    break;
-	case NOTMUCH_SORT_NEWEST_FIRST:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, TRUE);
-	    break;
-	case NOTMUCH_SORT_MESSAGE_ID:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_MESSAGE_ID, FALSE);
-	    break;
-        case NOTMUCH_SORT_UNSORTED:
-	    break;
-	}
+	_notmuch_query_set_enquire_sort (query, enquire);
 
 	if (_debug_query ()) {
 	    fprintf (stderr, "Exclude query is:\n%s\n",
@@ -271,7 +996,14 @@ notmuch_query_search_messages (notmuch_query_t *query)
 
 	enquire.set_query (final_query);
 
-	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+	/* With a limit, Xapian only needs to find (and sort) the best
+	 * offset + limit matches. */
+	if (limit < 0)
+	    max_items = notmuch->xapian_db->get_doccount ();
+	else
+	    max_items = limit;
+
+	mset = enquire.get_mset (offset, max_items);
 
 	messages->iterator = mset.begin ();
 	messages->iterator_end = mset.end ();
@@ -288,6 +1020,13 @@ notmuch_query_search_messages (notmuch_query_t *query)
     }
 }
 
+notmuch_messages_t *
+notmuch_query_search_messages (notmuch_query_t *query)
+{
+    return _notmuch_query_search_messages_range (query, query->range_offset,
+						 query->range_limit);
+}
+
 notmuch_bool_t
 _notmuch_mset_messages_valid (notmuch_messages_t *messages)
 {
@@ -326,7 +1065,7 @@ _notmuch_mset_messages_get (notmuch_messages_t *messages)
 
     doc_id = *mset_messages->iterator;
 
-    message = _notmuch_message_create (mset_messages,
+    message = _notmuch_message_create (mset_messages->pool,
 				       mset_messages->notmuch, doc_id,
 				       &status);
 
@@ -353,49 +1092,6 @@ _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages)
     mset_messages->iterator++;
 }
 
-static notmuch_bool_t
-_notmuch_doc_id_set_init (void *ctx,
-			  notmuch_doc_id_set_t *doc_ids,
-			  GArray *arr)
-{
-    unsigned int max = 0;
-    unsigned int *bitmap;
-
-    for (unsigned int i = 0; i < arr->len; i++)
-	max = MAX(max, g_array_index (arr, unsigned int, i));
-    bitmap = talloc_zero_array (ctx, unsigned int, 1 + max / sizeof (*bitmap));
-
-    if (bitmap == NULL)
-	return FALSE;
-
-    doc_ids->bitmap = bitmap;
-    doc_ids->bound = max + 1;
-
-    for (unsigned int i = 0; i < arr->len; i++) {
-	unsigned int doc_id = g_array_index (arr, unsigned int, i);
-	bitmap[DOCIDSET_WORD(doc_id)] |= 1 << DOCIDSET_BIT(doc_id);
-    }
-
-    return TRUE;
-}
-
-notmuch_bool_t
-_notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
-			      unsigned int doc_id)
-{
-    if (doc_id >= doc_ids->bound)
-	return FALSE;
-    return doc_ids->bitmap[DOCIDSET_WORD(doc_id)] & (1 << DOCIDSET_BIT(doc_id));
-}
-
-void
-_notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
-                            unsigned int doc_id)
-{
-    if (doc_id < doc_ids->bound)
-	doc_ids->bitmap[DOCIDSET_WORD(doc_id)] &= ~(1 << DOCIDSET_BIT(doc_id));
-}
-
 /* Glib objects force use to use a talloc destructor as well, (but not
  * nearly as ugly as the for messages due to C++ objects). At
  * this point, I'd really like to have some talloc-friendly
@@ -409,42 +1105,261 @@ _notmuch_threads_destructor (notmuch_threads_t *threads)
     return 0;
 }
 
-notmuch_threads_t *
-notmuch_query_search_threads (notmuch_query_t *query)
+/* Return the Xapian query whose matches are the messages of 'query',
+ * omitting any excluded messages if omit_excluded is set, (as for
+ * thread searches, tag counts and facets, which cannot flag excluded
+ * messages).
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static Xapian::Query
+_notmuch_query_get_final_query (notmuch_query_t *query)
 {
-    notmuch_threads_t *threads;
-    notmuch_messages_t *messages;
+    Xapian::Query final_query;
 
-    threads = talloc (query, notmuch_threads_t);
-    if (threads == NULL)
-	return NULL;
-    threads->doc_ids = NULL;
-    talloc_set_destructor (threads, _notmuch_threads_destructor);
+    final_query = _notmuch_query_get_xapian_query (query);
 
-    threads->query = query;
+    if (query->omit_excluded)
+	final_query = Xapian::Query (Xapian::Query::OP_AND_NOT, final_query,
+				     _notmuch_exclude_tags (query,
+							    *query->compiled));
 
-    messages = notmuch_query_search_messages (query);
-    if (messages == NULL) {
-	    talloc_free (threads);
-	    return NULL;
-    }
+    return final_query;
+}
 
-    threads->doc_ids = g_array_new (FALSE, FALSE, sizeof (unsigned int));
-    while (notmuch_messages_valid (messages)) {
-	unsigned int doc_id = _notmuch_mset_messages_get_doc_id (messages);
-	g_array_append_val (threads->doc_ids, doc_id);
-	notmuch_messages_move_to_next (messages);
+/* Return the matches of 'query', (allocated with 'ctx'), as computed
+ * from the tag bitmaps, (see tag-bitmaps.cc), omitting any excluded
+ * messages if 'omit_excluded' is set, or NULL if the query cannot be
+ * answered from them. */
+static notmuch_doc_id_set_t *
+_notmuch_query_match_tag_bitmaps (void *ctx, notmuch_query_t *query,
+				  notmuch_bool_t omit_excluded)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    notmuch_doc_id_set_t *matches, *excluded;
+    notmuch_string_node_t *term;
+    size_t tag_prefix_len = strlen (_find_prefix ("tag"));
+
+    if (query->bound_thread_id || query->bound_dates ||
+	query->bound_tag_changes->head)
+	return NULL;
+
+    matches = _notmuch_tag_bitmaps_match (ctx, notmuch, query->query_string);
+    if (matches == NULL || ! omit_excluded)
+	return matches;
+
+    try {
+	_notmuch_query_parse (query);
+
+	/* As for _notmuch_exclude_tags, a tag is not excluded if the
+	 * query itself mentions it. */
+	for (term = query->exclude_terms->head; term; term = term->next) {
+	    Xapian::TermIterator it = query->compiled->get_terms_begin ();
+	    Xapian::TermIterator end = query->compiled->get_terms_end ();
+
+	    if (*term->string == '\0')
+		continue;
+	    for (; it != end; it++) {
+		if ((*it).compare (term->string) == 0)
+		    break;
+	    }
+	    if (it != end)
+		continue;
+
+	    excluded = _notmuch_tag_bitmaps_get (notmuch,
+						 term->string + tag_prefix_len);
+	    if (excluded == NULL)
+		goto FAIL;
+	    excluded = _notmuch_doc_id_set_difference (ctx, matches, excluded);
+	    if (excluded == NULL)
+		goto FAIL;
+	    talloc_free (matches);
+	    matches = excluded;
+	}
+    } catch (const Xapian::Error &error) {
+	/* The caller searches the database instead, and so reports
+	 * the error. */
+	goto FAIL;
     }
-    threads->doc_id_pos = 0;
 
-    talloc_free (messages);
+    return matches;
+
+  FAIL:
+    talloc_free (matches);
+    return NULL;
+}
+
+/* Fetch every match of the query into threads->doc_ids, in sort
+ * order, from the tag bitmaps. Returns FALSE if they cannot be used,
+ * (or cannot put the matches in sort order). */
+static notmuch_bool_t
+_notmuch_threads_fetch_from_tag_bitmaps (notmuch_threads_t *threads)
+{
+    notmuch_query_t *query = threads->query;
+    notmuch_doc_id_set_t *matches;
+    notmuch_bool_t ok = TRUE;
+    unsigned int doc_id = 0, start = threads->doc_ids->len;
+
+    if (start != 0 || query->sort == NOTMUCH_SORT_MESSAGE_ID)
+	return FALSE;
+
+    matches = _notmuch_query_match_tag_bitmaps (threads, query,
+						query->omit_excluded);
+    if (matches == NULL)
+	return FALSE;
+
+    while (_notmuch_doc_id_set_next (matches, &doc_id))
+	g_array_append_val (threads->doc_ids, doc_id);
+    talloc_free (matches);
+
+    if (query->sort != NOTMUCH_SORT_UNSORTED) {
+	ok = _notmuch_columns_sort_by_date (
+	    query->notmuch, (unsigned int *) threads->doc_ids->data,
+	    threads->doc_ids->len, query->sort == NOTMUCH_SORT_NEWEST_FIRST);
+    }
+
+    if (! ok) {
+	g_array_set_size (threads->doc_ids, 0);
+	return FALSE;
+    }
+
+    threads->fetch_size = 0;
+
+    return TRUE;
+}
+
+/* Fetch the next fetch_size matches of the query, in sort order, onto
+ * the end of threads->doc_ids.
+ *
+ * Once every match has been fetched, fetch_size becomes 0, (and the
+ * complete list of matches is stored in the query cache). Otherwise,
+ * fetch_size grows geometrically, so that the number of database
+ * searches is logarithmic in the number of matches. */
+static notmuch_status_t
+_notmuch_threads_fetch (notmuch_threads_t *threads)
+{
+    notmuch_query_t *query = threads->query;
+    notmuch_database_t *notmuch = query->notmuch;
+    unsigned int doc_id;
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+	unsigned int count;
+
+	if (_notmuch_threads_fetch_from_tag_bitmaps (threads)) {
+	    /* Every match has been fetched, (and fetch_size is 0). */
+	    count = threads->doc_ids->len;
+	} else if (_notmuch_parallel_enabled (notmuch)) {
+	    unsigned int *doc_ids;
+
+	    doc_ids = _notmuch_parallel_search (
+		threads, notmuch, _notmuch_query_get_final_query (query),
+		query->sort, threads->doc_ids->len, threads->fetch_size,
+		&count);
+	    g_array_append_vals (threads->doc_ids, doc_ids, count);
+	    talloc_free (doc_ids);
+	} else {
+	    enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	    _notmuch_query_set_enquire_sort (query, enquire);
+	    enquire.set_query (_notmuch_query_get_final_query (query));
+
+	    mset = enquire.get_mset (threads->doc_ids->len,
+				     threads->fetch_size);
+
+	    for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+		doc_id = *iterator;
+		g_array_append_val (threads->doc_ids, doc_id);
+	    }
+	    count = mset.size ();
+	}
+
+	if (count < threads->fetch_size)
+	    threads->fetch_size = 0;
+	else if (threads->fetch_size < notmuch->xapian_db->get_doccount ())
+	    threads->fetch_size *= NOTMUCH_THREADS_FETCH_GROWTH;
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred performing query: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	notmuch->exception_reported = TRUE;
+	/* Never cache the incomplete list of matches. */
+	threads->fetch_size = 0;
+	threads->description = NULL;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    if (threads->fetch_size == 0 && threads->description) {
+	_notmuch_query_cache_put (notmuch, threads->description,
+				  threads->doc_ids->len,
+				  (unsigned int *) threads->doc_ids->data);
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Fetch matches until threads->doc_ids has one at position 'pos'.
+ * Returns FALSE if there is no such match, (or if fetching fails). */
+static notmuch_bool_t
+_notmuch_threads_have_pos (notmuch_threads_t *threads, unsigned int pos)
+{
+    while (pos >= threads->doc_ids->len) {
+	if (threads->fetch_size == 0)
+	    return FALSE;
+	if (_notmuch_threads_fetch (threads))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+notmuch_threads_t *
+notmuch_query_search_threads (notmuch_query_t *query)
+{
+    notmuch_threads_t *threads;
+    unsigned int *cached_doc_ids, count;
+
+    threads = talloc (query, notmuch_threads_t);
+    if (threads == NULL)
+	return NULL;
+    threads->doc_ids = NULL;
+    threads->batch_count = 0;
+    threads->batch_index = 0;
+    threads->count = -1;
+    talloc_set_destructor (threads, _notmuch_threads_destructor);
 
-    if (! _notmuch_doc_id_set_init (threads, &threads->match_set,
-				    threads->doc_ids)) {
+    threads->query = query;
+    threads->doc_ids = g_array_new (FALSE, FALSE, sizeof (unsigned int));
+    threads->doc_id_pos = 0;
+
+    threads->assigned = _notmuch_doc_id_set_create (threads);
+    if (unlikely (threads->assigned == NULL)) {
 	talloc_free (threads);
 	return NULL;
     }
 
+    threads->description = _notmuch_query_cache_description (query, "threads",
+							     TRUE);
+    talloc_steal (threads, threads->description);
+
+    if (_notmuch_query_cache_get (threads, query->notmuch,
+				  threads->description,
+				  &count, &cached_doc_ids))
+    {
+	g_array_append_vals (threads->doc_ids, cached_doc_ids, count);
+	talloc_free (cached_doc_ids);
+	threads->fetch_size = 0;
+    } else {
+	/* Only fetch the first few matches now, so that the first
+	 * threads can be returned without waiting for every match. */
+	threads->fetch_size = NOTMUCH_THREADS_FIRST_FETCH;
+	if (_notmuch_threads_fetch (threads)) {
+	    talloc_free (threads);
+	    return NULL;
+	}
+    }
+
     return threads;
 }
 
@@ -459,34 +1374,209 @@ notmuch_threads_valid (notmuch_threads_t *threads)
 {
     unsigned int doc_id;
 
-    while (threads->doc_id_pos < threads->doc_ids->len) {
+    /* Discard any batched threads that the caller moved past without
+     * retrieving. */
+    while (threads->batch_index < threads->batch_count &&
+	   threads->batch_pos[threads->batch_index] < threads->doc_id_pos)
+    {
+	talloc_free (threads->batch[threads->batch_index]);
+	threads->batch_index++;
+    }
+
+    while (_notmuch_threads_have_pos (threads, threads->doc_id_pos)) {
+	/* The seed of a batched thread is assigned already, but its
+	 * thread has not been returned yet. */
+	if (threads->batch_index < threads->batch_count &&
+	    threads->batch_pos[threads->batch_index] == threads->doc_id_pos)
+	    return TRUE;
+
 	doc_id = g_array_index (threads->doc_ids, unsigned int,
 				threads->doc_id_pos);
-	if (_notmuch_doc_id_set_contains (&threads->match_set, doc_id))
-	    break;
+	if (! _notmuch_doc_id_set_contains (threads->assigned, doc_id))
+	    return TRUE;
 
 	threads->doc_id_pos++;
     }
 
-    return threads->doc_id_pos < threads->doc_ids->len;
+    return FALSE;
+}
+
+/* Create the threads for the next NOTMUCH_THREADS_BATCH_SIZE (or
+ * fewer) unassigned doc ids, starting at the iterator's current
+ * position.
+ *
+ * A single database search finds the matched messages of all of these
+ * threads, (which may come much later in the sort order than the
+ * matches fetched so far), and a second one fetches the messages of
+ * the threads themselves. The matched messages are then assigned, so
+ * that the iterator skips them when it reaches them. */
+static notmuch_status_t
+_notmuch_threads_load_batch (notmuch_threads_t *threads)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    unsigned int seeds[NOTMUCH_THREADS_BATCH_SIZE];
+    unsigned int positions[NOTMUCH_THREADS_BATCH_SIZE];
+    notmuch_thread_t *loaded[NOTMUCH_THREADS_BATCH_SIZE];
+    unsigned int count = 0, pos, i, doc_id;
+    notmuch_doc_id_set_t *match_set;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    GHashTable *seed_threads = NULL;
+    void *local;
+
+    for (pos = threads->doc_id_pos;
+	 count < NOTMUCH_THREADS_BATCH_SIZE &&
+	     _notmuch_threads_have_pos (threads, pos);
+	 pos++)
+    {
+	doc_id = g_array_index (threads->doc_ids, unsigned int, pos);
+	if (! _notmuch_doc_id_set_contains (threads->assigned, doc_id)) {
+	    seeds[count] = doc_id;
+	    positions[count] = pos;
+	    count++;
+	}
+    }
+
+    local = talloc_new (threads);
+    if (unlikely (local == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    match_set = _notmuch_doc_id_set_create (local);
+    if (unlikely (match_set == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    /* When several databases are combined, the thread terms of the
+     * seeds also match the messages of other threads with the same
+     * IDs in other databases, (see notmuch_database_open_multi), so
+     * the threads of the batch are also identified by thread ID
+     * space. */
+    if (notmuch->num_thread_spaces > 1)
+	seed_threads = g_hash_table_new (g_str_hash, g_str_equal);
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::Query thread_query = Xapian::Query::MatchNothing;
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+	char *term;
+
+	for (i = 0; i < count; i++) {
+	    term = _notmuch_thread_term_for_doc_id (local, notmuch, seeds[i]);
+	    if (term == NULL) {
+		status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+		goto DONE;
+	    }
+	    thread_query = Xapian::Query (Xapian::Query::OP_OR,
+					  thread_query, Xapian::Query (term));
+	    if (seed_threads) {
+		g_hash_table_insert (seed_threads,
+				     talloc_asprintf (
+					 local, "%u/%s",
+					 _notmuch_database_thread_space (notmuch,
+									  seeds[i]),
+					 term),
+				     NULL);
+	    }
+	}
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_query (Xapian::Query (Xapian::Query::OP_AND,
+					  _notmuch_query_get_final_query (
+					      threads->query),
+					  thread_query));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+	    if (seed_threads) {
+		term = _notmuch_thread_term_for_doc_id (local, notmuch,
+							*iterator);
+		if (term == NULL) {
+		    status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+		    goto DONE;
+		}
+		if (! g_hash_table_lookup_extended (
+			seed_threads,
+			talloc_asprintf (local, "%u/%s",
+					 _notmuch_database_thread_space (notmuch,
+									  *iterator),
+					 term),
+			NULL, NULL))
+		{
+		    continue;
+		}
+	    }
+
+	    if (! _notmuch_doc_id_set_add (match_set, *iterator) ||
+		! _notmuch_doc_id_set_add (threads->assigned, *iterator))
+	    {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		goto DONE;
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred loading threads: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	goto DONE;
+    }
+
+    status = _notmuch_thread_create_batch (threads, notmuch,
+					   seeds, count,
+					   match_set,
+					   threads->query->exclude_terms,
+					   threads->query->sort,
+					   loaded);
+    if (status)
+	goto DONE;
+
+    /* Seeds that share a thread with an earlier seed have no thread
+     * of their own. They were assigned along with the rest of that
+     * thread, so the iterator will skip them. */
+    threads->batch_count = 0;
+    threads->batch_index = 0;
+    for (i = 0; i < count; i++) {
+	if (loaded[i] == NULL)
+	    continue;
+	threads->batch[threads->batch_count] = loaded[i];
+	threads->batch_pos[threads->batch_count] = positions[i];
+	threads->batch_count++;
+    }
+
+  DONE:
+    if (seed_threads)
+	g_hash_table_unref (seed_threads);
+    talloc_free (local);
+
+    return status;
 }
 
 notmuch_thread_t *
 notmuch_threads_get (notmuch_threads_t *threads)
 {
-    unsigned int doc_id;
+    notmuch_thread_t *thread;
 
     if (! notmuch_threads_valid (threads))
 	return NULL;
 
-    doc_id = g_array_index (threads->doc_ids, unsigned int,
-			    threads->doc_id_pos);
-    return _notmuch_thread_create (threads->query,
-				   threads->query->notmuch,
-				   doc_id,
-				   &threads->match_set,
-				   threads->query->exclude_terms,
-				   threads->query->sort);
+    /* Any unassigned doc id before the end of the current batch is
+     * the seed of one of its threads, so a new batch is only needed
+     * once the current one is used up. */
+    if (threads->batch_index == threads->batch_count) {
+	if (_notmuch_threads_load_batch (threads))
+	    return NULL;
+    }
+
+    if (threads->batch_index < threads->batch_count &&
+	threads->batch_pos[threads->batch_index] == threads->doc_id_pos)
+    {
+	thread = threads->batch[threads->batch_index++];
+	return talloc_steal (threads->query, thread);
+    }
+
+    return NULL;
 }
 
 void
@@ -495,6 +1585,85 @@ notmuch_threads_move_to_next (notmuch_threads_t *threads)
     threads->doc_id_pos++;
 }
 
+unsigned int
+notmuch_threads_skip (notmuch_threads_t *threads, unsigned int count)
+{
+    unsigned int skipped = 0, doc_id;
+
+    while (skipped < count && notmuch_threads_valid (threads)) {
+	/* A batched thread has already assigned its messages.
+	 * notmuch_threads_valid discards it once we have moved past
+	 * it. Otherwise, assign the messages without creating the
+	 * thread. */
+	if (! (threads->batch_index < threads->batch_count &&
+	       threads->batch_pos[threads->batch_index] == threads->doc_id_pos))
+	{
+	    doc_id = g_array_index (threads->doc_ids, unsigned int,
+				    threads->doc_id_pos);
+	    if (_notmuch_thread_add_to_set (threads->query->notmuch,
+					    doc_id, threads->assigned))
+		break;
+	}
+
+	threads->doc_id_pos++;
+	skipped++;
+    }
+
+    return skipped;
+}
+
+unsigned int
+notmuch_threads_count (notmuch_threads_t *threads)
+{
+    notmuch_doc_id_set_t *counted;
+    unsigned int i, doc_id, count = 0;
+
+    if (threads->count >= 0)
+	return threads->count;
+
+    /* Every match is needed to count the threads. */
+    while (threads->fetch_size) {
+	if (_notmuch_threads_fetch (threads))
+	    return 0;
+    }
+
+    if (_notmuch_columns_count_threads (threads->query->notmuch,
+					(unsigned int *) threads->doc_ids->data,
+					threads->doc_ids->len, &count))
+    {
+	threads->count = count;
+	return count;
+    }
+    count = 0;
+
+    /* Assign the matched messages to threads in the same way as the
+     * iterator does, but in a separate set, so that each thread is
+     * counted at its first matched message. */
+    counted = _notmuch_doc_id_set_create (threads);
+    if (unlikely (counted == NULL))
+	return 0;
+
+    for (i = 0; i < threads->doc_ids->len; i++) {
+	doc_id = g_array_index (threads->doc_ids, unsigned int, i);
+	if (_notmuch_doc_id_set_contains (counted, doc_id))
+	    continue;
+
+	if (_notmuch_thread_add_to_set (threads->query->notmuch,
+					doc_id, counted))
+	{
+	    talloc_free (counted);
+	    return 0;
+	}
+	count++;
+    }
+
+    talloc_free (counted);
+
+    threads->count = count;
+
+    return count;
+}
+
 void
 notmuch_threads_destroy (notmuch_threads_t *threads)
 {
@@ -505,35 +1674,34 @@ unsigned
 notmuch_query_count_messages (notmuch_query_t *query)
 {
     notmuch_database_t *notmuch = query->notmuch;
-    const char *query_string = query->query_string;
     Xapian::doccount count = 0;
+    notmuch_doc_id_set_t *matches;
+    char *description;
+
+    description = _notmuch_query_cache_description (query, "count-messages",
+						    FALSE);
+    if (_notmuch_query_cache_get (query, notmuch, description, &count, NULL)) {
+	talloc_free (description);
+	return count;
+    }
+
+    matches = _notmuch_query_match_tag_bitmaps (query, query, TRUE);
+    if (matches) {
+	count = _notmuch_doc_id_set_count (matches);
+	talloc_free (matches);
+	_notmuch_query_cache_put (notmuch, description, count, NULL);
+	talloc_free (description);
+	return count;
+    }
 
     try {
 	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   "mail"));
-	Xapian::Query string_query, final_query, exclude_query;
+	Xapian::Query final_query, exclude_query;
 	Xapian::MSet mset;
-	unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
-			      Xapian::QueryParser::FLAG_PHRASE |
-			      Xapian::QueryParser::FLAG_LOVEHATE |
-			      Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
-			      Xapian::QueryParser::FLAG_WILDCARD |
-			      Xapian::QueryParser::FLAG_PURE_NOT);
-
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
-	} else {
-	    string_query = notmuch->query_parser->
-		parse_query (query_string, flags);
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, string_query);
-	}
 
-	exclude_query = _notmuch_exclude_tags (query, final_query);
+	final_query = _notmuch_query_get_xapian_query (query);
+
+	exclude_query = _notmuch_exclude_tags (query, *query->compiled);
 
 	final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
 					 final_query, exclude_query);
@@ -550,9 +1718,14 @@ notmuch_query_count_messages (notmuch_query_t *query)
 
 	enquire.set_query (final_query);
 
-	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+	if (_notmuch_parallel_enabled (notmuch)) {
+	    count = _notmuch_parallel_count (notmuch, final_query);
+	} else {
+	    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+	    count = mset.get_matches_estimated();
+	}
 
-	count = mset.get_matches_estimated();
+	_notmuch_query_cache_put (notmuch, description, count, NULL);
 
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred: %s\n",
@@ -560,9 +1733,56 @@ notmuch_query_count_messages (notmuch_query_t *query)
 	fprintf (stderr, "Query string was: %s\n", query->query_string);
     }
 
+    talloc_free (description);
+
     return count;
 }
 
+/* Count the threads of the matches of 'query' from the columnar side
+ * index, (see columns.cc), which avoids reading the document of each
+ * match. Returns FALSE if the index cannot be used. */
+static notmuch_bool_t
+_notmuch_query_count_threads_from_columns (notmuch_query_t *query,
+					   unsigned int *count)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    GArray *doc_ids;
+    notmuch_bool_t counted = FALSE;
+
+    if (! _notmuch_columns_available (notmuch))
+	return FALSE;
+
+    doc_ids = g_array_new (FALSE, FALSE, sizeof (unsigned int));
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_query (_notmuch_query_get_final_query (query));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+	    unsigned int doc_id = *iterator;
+	    g_array_append_val (doc_ids, doc_id);
+	}
+
+	counted = _notmuch_columns_count_threads (notmuch,
+						  (unsigned int *) doc_ids->data,
+						  doc_ids->len, count);
+    } catch (const Xapian::Error &error) {
+	/* The caller counts the threads from the database instead,
+	 * and so reports the error. */
+    }
+
+    g_array_unref (doc_ids);
+
+    return counted;
+}
+
 unsigned
 notmuch_query_count_threads (notmuch_query_t *query)
 {
@@ -570,16 +1790,35 @@ notmuch_query_count_threads (notmuch_query_t *query)
     GHashTable *hash;
     unsigned int count;
     notmuch_sort_t sort;
+    char *description;
+
+    description = _notmuch_query_cache_description (query, "count-threads",
+						    FALSE);
+    if (_notmuch_query_cache_get (query, query->notmuch, description,
+				  &count, NULL))
+    {
+	talloc_free (description);
+	return count;
+    }
+
+    if (_notmuch_query_count_threads_from_columns (query, &count)) {
+	_notmuch_query_cache_put (query->notmuch, description, count, NULL);
+	talloc_free (description);
+	return count;
+    }
 
     sort = query->sort;
     query->sort = NOTMUCH_SORT_UNSORTED;
-    messages = notmuch_query_search_messages (query);
+    messages = _notmuch_query_search_messages_range (query, 0, -1);
     query->sort = sort;
-    if (messages == NULL)
+    if (messages == NULL) {
+	talloc_free (description);
 	return 0;
+    }
 
     hash = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
     if (hash == NULL) {
+	talloc_free (description);
 	talloc_free (messages);
 	return 0;
     }
@@ -600,9 +1839,379 @@ notmuch_query_count_threads (notmuch_query_t *query)
 
     count = g_hash_table_size (hash);
 
+    _notmuch_query_cache_put (query->notmuch, description, count, NULL);
+
   DONE:
     g_hash_table_unref (hash);
     talloc_free (messages);
+    talloc_free (description);
+
+    return count;
+}
+
+/* Return the number of the matches of a query with the tag term
+ * 'term', where 'matches' is the set of the matches, and 'doc_ids' the
+ * same 'num_doc_ids' matches in ascending order, (or NULL if only the
+ * set is known). Whichever of the matches and the posting list of the
+ * term is shorter is walked, looking each member up in the other.
+ *
+ * This may throw a Xapian::Error. */
+static unsigned int
+_count_tag_matches (notmuch_database_t *notmuch, const std::string &term,
+		    Xapian::doccount termfreq, notmuch_doc_id_set_t *matches,
+		    const unsigned int *doc_ids, unsigned int num_doc_ids)
+{
+    Xapian::PostingIterator p, end;
+    unsigned int i, count = 0;
+
+    p = notmuch->xapian_db->postlist_begin (term);
+    end = notmuch->xapian_db->postlist_end (term);
+
+    if (doc_ids && num_doc_ids < termfreq) {
+	for (i = 0; i < num_doc_ids && p != end; i++) {
+	    p.skip_to (doc_ids[i]);
+	    if (p != end && *p == doc_ids[i])
+		count++;
+	}
+    } else {
+	for (; p != end; p++) {
+	    if (_notmuch_doc_id_set_contains (matches, *p))
+		count++;
+	}
+    }
 
     return count;
 }
+
+notmuch_tags_t *
+notmuch_query_count_tags (notmuch_query_t *query)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    const char *prefix = _find_prefix ("tag");
+    notmuch_string_list_t *tags;
+    notmuch_doc_id_set_t *matches, *tag_matches;
+    notmuch_tags_t *result;
+    unsigned int *counts = NULL, *doc_ids = NULL;
+    unsigned int num_doc_ids = 0;
+    void *local;
+
+    local = talloc_new (query);
+    if (unlikely (local == NULL))
+	return NULL;
+
+    tags = _notmuch_string_list_create (local);
+    if (unlikely (tags == NULL))
+	goto FAIL;
+
+    /* The matches of the query are found only once, (from the tag
+     * bitmaps if possible), and then intersected with the messages
+     * with each tag. */
+    matches = _notmuch_query_match_tag_bitmaps (local, query,
+						query->omit_excluded);
+
+    try {
+	Xapian::TermIterator i, end;
+	Xapian::doccount count;
+
+	if (matches == NULL) {
+	    Xapian::Enquire enquire (*notmuch->xapian_db);
+	    Xapian::MSet mset;
+	    Xapian::MSetIterator iterator;
+
+	    enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	    enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	    enquire.set_query (_notmuch_query_get_final_query (query));
+
+	    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	    doc_ids = talloc_array (local, unsigned int, mset.size () + 1);
+	    if (unlikely (doc_ids == NULL))
+		goto FAIL;
+	    for (iterator = mset.begin (); iterator != mset.end (); iterator++)
+		doc_ids[num_doc_ids++] = *iterator;
+
+	    matches = _notmuch_doc_id_set_create_from_array (local, doc_ids,
+							     num_doc_ids);
+	    if (unlikely (matches == NULL))
+		goto FAIL;
+	}
+
+	end = notmuch->xapian_db->allterms_end (prefix);
+	for (i = notmuch->xapian_db->allterms_begin (prefix); i != end; i++) {
+	    const char *tag = (*i).c_str () + strlen (prefix);
+
+	    tag_matches = NULL;
+	    if (doc_ids == NULL)
+		tag_matches = _notmuch_tag_bitmaps_get (notmuch, tag);
+
+	    if (tag_matches) {
+		tag_matches = _notmuch_doc_id_set_intersection (local, matches,
+								tag_matches);
+		if (unlikely (tag_matches == NULL))
+		    goto FAIL;
+		count = _notmuch_doc_id_set_count (tag_matches);
+		talloc_free (tag_matches);
+	    } else {
+		count = _count_tag_matches (notmuch, *i, i.get_termfreq (),
+					    matches, doc_ids, num_doc_ids);
+	    }
+
+	    if (count == 0)
+		continue;
+
+	    counts = talloc_realloc (local, counts, unsigned int,
+				     tags->length + 1);
+	    if (unlikely (counts == NULL))
+		goto FAIL;
+	    counts[tags->length] = count;
+
+	    _notmuch_string_list_append (tags, talloc_strdup (tags, tag));
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred counting tags: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	notmuch->exception_reported = TRUE;
+	goto FAIL;
+    }
+
+    result = _notmuch_tags_create_with_counts (query, tags, counts);
+    talloc_free (local);
+
+    return result;
+
+  FAIL:
+    talloc_free (local);
+    return NULL;
+}
+
+notmuch_facets_t *
+notmuch_query_count_facets (notmuch_query_t *query,
+			    const notmuch_facet_t *facets,
+			    unsigned int num_facets)
+{
+    Xapian::Query final_query;
+
+    try {
+	final_query = _notmuch_query_get_final_query (query);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred performing query: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	query->notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+
+    return _notmuch_facets_count (query, query->notmuch, final_query,
+				  facets, num_facets);
+}
+
+/* The number of changed messages after which notmuch_query_apply_tags
+ * commits its atomic section, unless the caller chooses another. */
+#define NOTMUCH_APPLY_TAGS_TRANSACTION_SIZE 1000
+
+typedef struct {
+    notmuch_database_t *notmuch;
+    const notmuch_tag_operation_t *ops;
+    unsigned int num_ops;
+    notmuch_bool_t synchronize_flags;
+    /* The number of changed messages after which the atomic section
+     * is committed, or 0 if the section is the caller's. */
+    unsigned int transaction_size;
+    /* The number of messages changed since the atomic section was
+     * last committed. */
+    unsigned int pending;
+    notmuch_bool_t (*progress_notify) (void *closure, notmuch_bool_t changed);
+    void *closure;
+    /* Whether progress_notify has asked for no further changes. */
+    notmuch_bool_t cancelled;
+} notmuch_apply_tags_t;
+
+/* Apply the tag changes of 'apply' to the message with 'doc_id',
+ * committing the atomic section of notmuch_query_apply_tags once
+ * enough messages have been changed, and then calling the
+ * progress_notify callback, if any.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static notmuch_status_t
+_notmuch_apply_tags_to_doc (notmuch_apply_tags_t *apply, unsigned int doc_id)
+{
+    notmuch_database_t *notmuch = apply->notmuch;
+    notmuch_message_t *message;
+    notmuch_private_status_t private_status;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    notmuch_bool_t changed = FALSE;
+
+    message = _notmuch_message_create (notmuch, notmuch, doc_id,
+				       &private_status);
+    if (message == NULL) {
+	if (private_status != NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    } else {
+	changed = _notmuch_message_apply_tag_terms (message, apply->ops,
+						    apply->num_ops);
+	if (changed) {
+	    _notmuch_message_sync (message);
+	    if (apply->synchronize_flags)
+		status = notmuch_message_tags_to_maildir_flags (message);
+	}
+	notmuch_message_destroy (message);
+    }
+
+    if (status == NOTMUCH_STATUS_SUCCESS && changed &&
+	apply->transaction_size &&
+	++apply->pending >= apply->transaction_size)
+    {
+	apply->pending = 0;
+	status = notmuch_database_end_atomic (notmuch);
+	if (status == NOTMUCH_STATUS_SUCCESS)
+	    status = notmuch_database_begin_atomic (notmuch);
+    }
+
+    if (status == NOTMUCH_STATUS_SUCCESS && apply->progress_notify &&
+	! apply->progress_notify (apply->closure, changed))
+    {
+	apply->cancelled = TRUE;
+    }
+
+    return status;
+}
+
+notmuch_status_t
+notmuch_query_apply_tags (notmuch_query_t *query,
+			  const notmuch_tag_operation_t *ops,
+			  unsigned int num_ops,
+			  notmuch_bool_t synchronize_flags,
+			  unsigned int transaction_size,
+			  notmuch_bool_t (*progress_notify) (void *closure,
+							      notmuch_bool_t changed),
+			  void *closure)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    notmuch_apply_tags_t apply;
+    notmuch_string_list_t *changes;
+    notmuch_doc_id_set_t *matches;
+    notmuch_status_t status, end_status;
+    notmuch_bool_t own_section;
+    unsigned int i, doc_id = 0;
+    void *local;
+
+    for (i = 0; i < num_ops; i++) {
+	if (ops[i].tag == NULL)
+	    return NOTMUCH_STATUS_NULL_POINTER;
+	if (strlen (ops[i].tag) > NOTMUCH_TAG_MAX)
+	    return NOTMUCH_STATUS_TAG_TOO_LONG;
+    }
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status || num_ops == 0)
+	return status;
+
+    apply.notmuch = notmuch;
+    apply.ops = ops;
+    apply.num_ops = num_ops;
+    apply.synchronize_flags = synchronize_flags;
+    apply.pending = 0;
+    apply.progress_notify = progress_notify;
+    apply.closure = closure;
+    apply.cancelled = FALSE;
+
+    /* Within the caller's atomic section, committing is left to the
+     * caller, (see notmuch.h). */
+    own_section = (notmuch->atomic_nesting == 0);
+    if (! own_section)
+	apply.transaction_size = 0;
+    else if (transaction_size)
+	apply.transaction_size = transaction_size;
+    else
+	apply.transaction_size = NOTMUCH_APPLY_TAGS_TRANSACTION_SIZE;
+
+    local = talloc_new (query);
+    if (unlikely (local == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    changes = _notmuch_string_list_create (local);
+    if (unlikely (changes == NULL)) {
+	talloc_free (local);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+    for (i = 0; i < num_ops; i++)
+	_notmuch_string_list_append (changes,
+				     talloc_asprintf (local, "%c%s%s",
+						      ops[i].remove ? '-' : '+',
+						      _find_prefix ("tag"),
+						      ops[i].tag));
+
+    if (own_section) {
+	status = notmuch_database_begin_atomic (notmuch);
+	if (status) {
+	    talloc_free (local);
+	    return status;
+	}
+    }
+
+    /* The tag bitmaps, (if they can answer the query), hold the
+     * matches in document order without any search of the database,
+     * though messages which need no change are then only skipped by
+     * _notmuch_message_apply_tag_terms. */
+    matches = _notmuch_query_match_tag_bitmaps (local, query,
+						query->omit_excluded);
+
+    try {
+	if (matches) {
+	    while (status == NOTMUCH_STATUS_SUCCESS && ! apply.cancelled &&
+		   _notmuch_doc_id_set_next (matches, &doc_id))
+	    {
+		status = _notmuch_apply_tags_to_doc (&apply, doc_id);
+	    }
+	} else {
+	    Xapian::Enquire enquire (*notmuch->xapian_db);
+	    Xapian::Query change_query;
+	    Xapian::MSet mset;
+	    Xapian::MSetIterator iterator;
+
+	    enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	    enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	    /* The messages needing a change are found before the stubs
+	     * of frozen messages are added, since a stub has no tags. */
+	    change_query = _notmuch_query_add_frozen (
+		query, Xapian::Query (Xapian::Query::OP_AND,
+				      _notmuch_query_get_hot_query (query),
+				      _notmuch_tag_change_query (changes)));
+	    if (query->omit_excluded)
+		change_query = Xapian::Query (
+		    Xapian::Query::OP_AND_NOT, change_query,
+		    _notmuch_exclude_tags (query, *query->compiled));
+	    enquire.set_query (change_query);
+
+	    /* Every match is found before any message is changed, so
+	     * that the changes cannot disturb the search. */
+	    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	    for (iterator = mset.begin ();
+		 status == NOTMUCH_STATUS_SUCCESS && ! apply.cancelled &&
+		 iterator != mset.end ();
+		 iterator++)
+	    {
+		status = _notmuch_apply_tags_to_doc (&apply, *iterator);
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred applying tags: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (local);
+
+    if (own_section) {
+	end_status = notmuch_database_end_atomic (notmuch);
+	if (status == NOTMUCH_STATUS_SUCCESS)
+	    status = end_status;
+    }
+
+    return status;
+}
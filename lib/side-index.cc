@@ -0,0 +1,246 @@
+/* side-index.cc - Files of derived data kept beside the database
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+/* A side index, (such as the columns of columns.cc or the tag bitmaps
+ * of tag-bitmaps.cc), is a file within the .notmuch directory holding
+ * data derived from the database, which readers map into memory. The
+ * file begins with a notmuch_side_index_header_t, holding the magic
+ * string of its format and the revision of the database which it
+ * reflects. Readers only use the file while the database is still at
+ * that revision, so it never gives a different answer than the
+ * database would.
+ *
+ * Writers note which messages they modify or delete, (see
+ * _notmuch_side_index_touch), and once the database has been flushed
+ * on close, bring the file up to date for those messages, (or rebuild
+ * it from scratch if it was not up to date when the database was
+ * opened), and replace it atomically, (see _notmuch_side_index_close).
+ *
+ * A file is only maintained once it exists, (or has been enabled with
+ * _notmuch_side_index_set_enabled), and is not used by combined
+ * databases or databases with cold shards, (whose messages are not
+ * all in the database itself). Any failure to read or write it is
+ * silently ignored.
+ */
+
+static int
+_notmuch_side_index_destructor (notmuch_side_index_t *index)
+{
+    _notmuch_side_index_unmap (index);
+
+    return 0;
+}
+
+notmuch_side_index_t *
+_notmuch_side_index_create (void *ctx, notmuch_database_t *notmuch,
+			    const char *name)
+{
+    notmuch_side_index_t *index;
+
+    index = talloc_zero (ctx, notmuch_side_index_t);
+    if (unlikely (index == NULL))
+	return NULL;
+
+    talloc_set_destructor (index, _notmuch_side_index_destructor);
+
+    index->filename = talloc_asprintf (index, "%s/.notmuch/%s",
+				       notmuch->path, name);
+    index->touched = _notmuch_doc_id_set_create (index);
+    if (unlikely (index->filename == NULL || index->touched == NULL)) {
+	talloc_free (index);
+	return NULL;
+    }
+
+    index->open_revision = notmuch->revision;
+    index->maintain = (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE &&
+		       access (index->filename, F_OK) == 0);
+
+    return index;
+}
+
+notmuch_status_t
+_notmuch_side_index_set_enabled (notmuch_database_t *notmuch,
+				 notmuch_side_index_t *index,
+				 notmuch_bool_t enable)
+{
+    notmuch_status_t status;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    if (index == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    index->maintain = enable;
+    if (! enable)
+	unlink (index->filename);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+void
+_notmuch_side_index_touch (notmuch_side_index_t *index, unsigned int doc_id)
+{
+    if (index && index->maintain)
+	_notmuch_doc_id_set_add (index->touched, doc_id);
+}
+
+void
+_notmuch_side_index_unmap (notmuch_side_index_t *index)
+{
+    if (index->map)
+	munmap (index->map, index->map_size);
+
+    index->mapped = FALSE;
+    index->map = NULL;
+    index->map_size = 0;
+    index->header = NULL;
+}
+
+const notmuch_side_index_header_t *
+_notmuch_side_index_map (notmuch_side_index_t *index, const char *magic)
+{
+    const notmuch_side_index_header_t *header;
+    struct stat st;
+    int fd;
+
+    if (index->mapped)
+	return index->header;
+    index->mapped = TRUE;
+
+    fd = open (index->filename, O_RDONLY);
+    if (fd < 0)
+	return NULL;
+
+    if (fstat (fd, &st) ||
+	(size_t) st.st_size < sizeof (notmuch_side_index_header_t))
+    {
+	close (fd);
+	return NULL;
+    }
+
+    index->map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (index->map == MAP_FAILED) {
+	index->map = NULL;
+	return NULL;
+    }
+    index->map_size = st.st_size;
+
+    header = (const notmuch_side_index_header_t *) index->map;
+    if (memcmp (header->magic, magic, sizeof (header->magic)) != 0)
+	return NULL;
+
+    index->header = header;
+
+    return header;
+}
+
+const notmuch_side_index_header_t *
+_notmuch_side_index_get (notmuch_database_t *notmuch,
+			 notmuch_side_index_t *index, const char *magic)
+{
+    const notmuch_side_index_header_t *header;
+
+    if (index == NULL || notmuch->num_subdbs > 1 || notmuch->cold_view)
+	return NULL;
+
+    header = _notmuch_side_index_map (index, magic);
+    if (header == NULL || header->revision != notmuch->revision)
+	return NULL;
+
+    return header;
+}
+
+/* Write the file of 'index' with 'writer' as the file at 'revision',
+ * (via a temporary file, so that a concurrent reader never sees a
+ * partially-written file). */
+static void
+_side_index_save (notmuch_side_index_t *index,
+		  const notmuch_side_index_writer_t *writer, void *closure,
+		  unsigned long revision)
+{
+    char *tmp_filename;
+    FILE *file;
+    notmuch_bool_t ok;
+
+    tmp_filename = talloc_asprintf (index, "%s.%d", index->filename,
+				    (int) getpid ());
+    if (unlikely (tmp_filename == NULL))
+	return;
+
+    file = fopen (tmp_filename, "w");
+    if (file == NULL)
+	goto DONE;
+
+    ok = writer->save (closure, file, revision);
+
+    if (fclose (file) == 0 && ok)
+	rename (tmp_filename, index->filename);
+
+  DONE:
+    unlink (tmp_filename);
+    talloc_free (tmp_filename);
+}
+
+void
+_notmuch_side_index_close (notmuch_database_t *notmuch,
+			   notmuch_side_index_t *index, const char *magic,
+			   notmuch_bool_t flushed,
+			   const notmuch_side_index_writer_t *writer,
+			   void *closure)
+{
+    const notmuch_side_index_header_t *header;
+    unsigned int doc_id;
+    notmuch_bool_t ok = TRUE;
+
+    if (index == NULL)
+	return;
+
+    _notmuch_side_index_unmap (index);
+
+    if (! index->maintain || ! flushed || notmuch->xapian_db == NULL)
+	return;
+
+    header = _notmuch_side_index_map (index, magic);
+    if (header && header->revision == notmuch->revision)
+	return;
+
+    try {
+	if (header && header->revision == index->open_revision &&
+	    writer->load (closure, index->map, index->map_size))
+	{
+	    doc_id = 0;
+	    while (ok && _notmuch_doc_id_set_next (index->touched, &doc_id))
+		ok = writer->update (closure, doc_id);
+	} else {
+	    ok = writer->build (closure);
+	}
+    } catch (const Xapian::Error &error) {
+	ok = FALSE;
+    }
+
+    _notmuch_side_index_unmap (index);
+
+    if (ok)
+	_side_index_save (index, writer, closure, notmuch->revision);
+}
@@ -58,6 +58,20 @@ _notmuch_string_list_append (notmuch_string_list_t *list,
     list->length++;
 }
 
+void
+_notmuch_string_list_append_shared (notmuch_string_list_t *list,
+				    const char *string)
+{
+    notmuch_string_node_t *node = talloc (list, notmuch_string_node_t);
+
+    node->string = (char *) string;
+    node->next = NULL;
+
+    *(list->tail) = node;
+    list->tail = &node->next;
+    list->length++;
+}
+
 static int
 cmpnode (const void *pa, const void *pb)
 {
@@ -0,0 +1,693 @@
+/* tag-bitmaps.cc - A bitmap of the messages with each tag
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <glib.h> /* GHashTable */
+
+#include <map>
+
+/* Many of the heaviest queries are nothing but tag algebra, (such as
+ * "tag:inbox and not tag:spam"), which Xapian answers by merging the
+ * posting lists of the tags, along with that of every message.
+ *
+ * The tag bitmaps instead hold the set of messages with each tag, (as
+ * a notmuch_doc_id_set_t), along with the set of all messages, in the
+ * file NOTMUCH_TAG_BITMAPS_FILENAME within the .notmuch directory:
+ *
+ *	header		A tag_bitmaps_header_t.
+ *	all messages	The size of the serialised set, as a uint32_t,
+ *			and the set, (see _notmuch_doc_id_set_serialise).
+ *	each tag	The length of its name, as a uint32_t, its name,
+ *			and then its set, as for all messages.
+ *
+ * A query made of nothing but tag and thread terms, "and", "or",
+ * "not" and parentheses, (or "*"), is then answered by combining the
+ * sets, (see _notmuch_tag_bitmaps_match).
+ *
+ * The file is a side index, (see side-index.cc), so it is only used
+ * while it reflects the current revision of the database. Writers
+ * note which messages they modify, (such as by notmuch_message_add_tag
+ * and notmuch_message_remove_tag), and update their bits once the
+ * database has been flushed on close, or rebuild every set from the
+ * posting lists of the tags if the file was not up to date when the
+ * database was opened.
+ *
+ * The file is only maintained once it has been enabled with
+ * notmuch_database_set_tag_bitmaps. Any failure to read or write it
+ * is silently ignored, and such queries are left to Xapian.
+ */
+#define NOTMUCH_TAG_BITMAPS_FILENAME "tag-bitmaps"
+
+#define NOTMUCH_TAG_BITMAPS_MAGIC "NMTAGBM1"
+
+typedef struct {
+    notmuch_side_index_header_t index;
+    uint32_t num_tags;
+    uint32_t unused;
+} tag_bitmaps_header_t;
+
+struct visible _notmuch_tag_bitmaps {
+    notmuch_side_index_t *index;
+
+    /* The sets read from the mapped file of index so far, (by tag
+     * name, with the set of all messages under ""). */
+    GHashTable *sets;
+};
+
+typedef std::map<std::string, notmuch_doc_id_set_t *> tag_sets_t;
+
+/* The sets while they are being brought up to date by a writer, (with
+ * 'ctx' as their talloc context). */
+typedef struct {
+    notmuch_database_t *notmuch;
+    void *ctx;
+    tag_sets_t sets;
+} tag_sets_writer_t;
+
+static void
+_free_set (gpointer set)
+{
+    talloc_free (set);
+}
+
+static int
+_notmuch_tag_bitmaps_destructor (notmuch_tag_bitmaps_t *bitmaps)
+{
+    g_hash_table_unref (bitmaps->sets);
+
+    return 0;
+}
+
+/* Read a uint32_t length at *pos, followed by that many bytes, which
+ * are stored in *data, and advance *pos past them. Returns FALSE if
+ * they would extend past 'end'. */
+static notmuch_bool_t
+_read_chunk (const char **pos, const char *end, const char **data,
+	     uint32_t *length)
+{
+    if ((size_t) (end - *pos) < sizeof (uint32_t))
+	return FALSE;
+    memcpy (length, *pos, sizeof (uint32_t));
+    *pos += sizeof (uint32_t);
+
+    if ((size_t) (end - *pos) < *length)
+	return FALSE;
+    *data = *pos;
+    *pos += *length;
+
+    return TRUE;
+}
+
+/* Find the serialised set of 'tag', (or of all messages if 'tag' is
+ * NULL), in the mapped file, storing it in *data and its size in
+ * *size, (or NULL if no message has the tag). Returns FALSE if the
+ * file is malformed. */
+static notmuch_bool_t
+_tag_bitmaps_find (notmuch_tag_bitmaps_t *bitmaps, const char *tag,
+		   const char **data, uint32_t *size)
+{
+    const tag_bitmaps_header_t *header;
+    const char *pos, *end, *name;
+    uint32_t i, name_length;
+    size_t tag_length = tag ? strlen (tag) : 0;
+
+    if (bitmaps->index->map_size < sizeof (tag_bitmaps_header_t))
+	return FALSE;
+
+    header = (const tag_bitmaps_header_t *) bitmaps->index->map;
+    pos = (const char *) bitmaps->index->map + sizeof (tag_bitmaps_header_t);
+    end = (const char *) bitmaps->index->map + bitmaps->index->map_size;
+
+    if (! _read_chunk (&pos, end, data, size))
+	return FALSE;
+    if (tag == NULL)
+	return TRUE;
+
+    for (i = 0; i < header->num_tags; i++) {
+	if (! _read_chunk (&pos, end, &name, &name_length) ||
+	    ! _read_chunk (&pos, end, data, size))
+	{
+	    return FALSE;
+	}
+
+	if (name_length == tag_length && memcmp (name, tag, tag_length) == 0)
+	    return TRUE;
+    }
+
+    *data = NULL;
+
+    return TRUE;
+}
+
+void
+_notmuch_tag_bitmaps_open (notmuch_database_t *notmuch)
+{
+    notmuch_tag_bitmaps_t *bitmaps;
+
+    bitmaps = talloc_zero (notmuch, notmuch_tag_bitmaps_t);
+    if (unlikely (bitmaps == NULL))
+	return;
+
+    /* Each key belongs to its set. */
+    bitmaps->sets = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   NULL, _free_set);
+    talloc_set_destructor (bitmaps, _notmuch_tag_bitmaps_destructor);
+
+    bitmaps->index = _notmuch_side_index_create (bitmaps, notmuch,
+						 NOTMUCH_TAG_BITMAPS_FILENAME);
+    if (unlikely (bitmaps->index == NULL)) {
+	talloc_free (bitmaps);
+	return;
+    }
+
+    notmuch->tag_bitmaps = bitmaps;
+}
+
+notmuch_status_t
+notmuch_database_set_tag_bitmaps (notmuch_database_t *notmuch,
+				  notmuch_bool_t enable)
+{
+    return _notmuch_side_index_set_enabled (
+	notmuch, notmuch->tag_bitmaps ? notmuch->tag_bitmaps->index : NULL,
+	enable);
+}
+
+void
+_notmuch_tag_bitmaps_touch (notmuch_database_t *notmuch, unsigned int doc_id)
+{
+    if (notmuch->tag_bitmaps)
+	_notmuch_side_index_touch (notmuch->tag_bitmaps->index, doc_id);
+}
+
+/* Return the set of 'tag' in 'sets', creating it if necessary. */
+static notmuch_doc_id_set_t *
+_tag_sets_get (void *ctx, tag_sets_t &sets, const std::string &tag)
+{
+    tag_sets_t::iterator i;
+    notmuch_doc_id_set_t *set;
+
+    i = sets.find (tag);
+    if (i != sets.end ())
+	return i->second;
+
+    set = _notmuch_doc_id_set_create (ctx);
+    if (unlikely (set == NULL))
+	return NULL;
+    sets[tag] = set;
+
+    return set;
+}
+
+/* Fill the sets of 'writer' from the 'size' bytes of a mapped file at
+ * 'map'. */
+static notmuch_bool_t
+_tag_sets_load (void *closure, const void *map, size_t size)
+{
+    tag_sets_writer_t *writer = (tag_sets_writer_t *) closure;
+    tag_sets_t &sets = writer->sets;
+    void *ctx = writer->ctx;
+    const tag_bitmaps_header_t *header;
+    const char *pos, *end, *name, *data;
+    uint32_t i, name_length, set_size;
+    notmuch_doc_id_set_t *set;
+
+    if (size < sizeof (tag_bitmaps_header_t))
+	return FALSE;
+
+    header = (const tag_bitmaps_header_t *) map;
+    pos = (const char *) map + sizeof (tag_bitmaps_header_t);
+    end = (const char *) map + size;
+
+    if (! _read_chunk (&pos, end, &data, &set_size))
+	return FALSE;
+    set = _notmuch_doc_id_set_deserialise (ctx, data, set_size);
+    if (set == NULL)
+	return FALSE;
+    sets[""] = set;
+
+    for (i = 0; i < header->num_tags; i++) {
+	if (! _read_chunk (&pos, end, &name, &name_length) ||
+	    ! _read_chunk (&pos, end, &data, &set_size))
+	{
+	    return FALSE;
+	}
+
+	set = _notmuch_doc_id_set_deserialise (ctx, data, set_size);
+	if (set == NULL)
+	    return FALSE;
+	sets[std::string (name, name_length)] = set;
+    }
+
+    return pos == end;
+}
+
+/* Update the bits of the message with 'doc_id' in the sets of
+ * 'writer', (clearing them if there is no such message).
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static notmuch_bool_t
+_tag_sets_update (void *closure, unsigned int doc_id)
+{
+    tag_sets_writer_t *writer = (tag_sets_writer_t *) closure;
+    tag_sets_t &sets = writer->sets;
+    void *ctx = writer->ctx;
+    notmuch_private_status_t status;
+    notmuch_message_t *message;
+    notmuch_doc_id_set_t *set;
+    notmuch_tags_t *tags;
+    tag_sets_t::iterator i;
+    notmuch_bool_t ok = TRUE;
+
+    for (i = sets.begin (); i != sets.end (); i++)
+	_notmuch_doc_id_set_remove (i->second, doc_id);
+
+    message = _notmuch_message_create (ctx, writer->notmuch, doc_id, &status);
+    if (message == NULL)
+	return TRUE;
+
+    ok = _notmuch_doc_id_set_add (sets[""], doc_id);
+
+    for (tags = notmuch_message_get_tags (message);
+	 ok && notmuch_tags_valid (tags);
+	 notmuch_tags_move_to_next (tags))
+    {
+	set = _tag_sets_get (ctx, sets, notmuch_tags_get (tags));
+	ok = set && _notmuch_doc_id_set_add (set, doc_id);
+    }
+
+    notmuch_message_destroy (message);
+
+    return ok;
+}
+
+/* Add the messages of the posting list of 'term' to 'set'.
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static notmuch_bool_t
+_add_postings (notmuch_database_t *notmuch, notmuch_doc_id_set_t *set,
+	       const std::string &term)
+{
+    Xapian::PostingIterator p, p_end;
+
+    p_end = notmuch->xapian_db->postlist_end (term);
+    for (p = notmuch->xapian_db->postlist_begin (term); p != p_end; p++) {
+	if (! _notmuch_doc_id_set_add (set, *p))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Fill the sets of 'writer' from the posting lists of the database,
+ * (discarding any sets loaded before).
+ *
+ * This may throw a Xapian::Error, so must be called from within a
+ * try block. */
+static notmuch_bool_t
+_tag_sets_build (void *closure)
+{
+    tag_sets_writer_t *writer = (tag_sets_writer_t *) closure;
+    notmuch_database_t *notmuch = writer->notmuch;
+    tag_sets_t &sets = writer->sets;
+    Xapian::TermIterator t, t_end;
+    std::string tag_prefix = _find_prefix ("tag");
+    notmuch_doc_id_set_t *set;
+    void *ctx;
+
+    sets.clear ();
+    talloc_free (writer->ctx);
+    ctx = writer->ctx = talloc_new (notmuch);
+    if (unlikely (ctx == NULL))
+	return FALSE;
+
+    set = _tag_sets_get (ctx, sets, "");
+    if (set == NULL ||
+	! _add_postings (notmuch, set,
+			 std::string (_find_prefix ("type")) + "mail"))
+    {
+	return FALSE;
+    }
+
+    t_end = notmuch->xapian_db->allterms_end (tag_prefix);
+    for (t = notmuch->xapian_db->allterms_begin (tag_prefix); t != t_end; t++) {
+	set = _tag_sets_get (ctx, sets, (*t).substr (tag_prefix.size ()));
+	if (set == NULL || ! _add_postings (notmuch, set, *t))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Write 'size' bytes of 'data' to 'file', preceded by their number. */
+static notmuch_bool_t
+_write_chunk (FILE *file, const void *data, uint32_t size)
+{
+    return (fwrite (&size, sizeof (size), 1, file) == 1 &&
+	    fwrite (data, 1, size, file) == size);
+}
+
+static notmuch_bool_t
+_write_set (FILE *file, void *ctx, notmuch_doc_id_set_t *set)
+{
+    notmuch_bool_t ok;
+    size_t size;
+    char *data;
+
+    data = _notmuch_doc_id_set_serialise (ctx, set, &size);
+    if (unlikely (data == NULL))
+	return FALSE;
+
+    ok = _write_chunk (file, data, size);
+    talloc_free (data);
+
+    return ok;
+}
+
+/* Write the sets of 'writer' to 'file' as the sets at 'revision'. */
+static notmuch_bool_t
+_tag_sets_save (void *closure, FILE *file, unsigned long revision)
+{
+    tag_sets_writer_t *writer = (tag_sets_writer_t *) closure;
+    tag_sets_t &sets = writer->sets;
+    tag_bitmaps_header_t header;
+    tag_sets_t::iterator i;
+    notmuch_bool_t ok;
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.index.magic, NOTMUCH_TAG_BITMAPS_MAGIC,
+	    sizeof (header.index.magic));
+    header.index.revision = revision;
+    for (i = sets.begin (); i != sets.end (); i++) {
+	if (! i->first.empty () && _notmuch_doc_id_set_count (i->second))
+	    header.num_tags++;
+    }
+
+    ok = (fwrite (&header, sizeof (header), 1, file) == 1 &&
+	  _write_set (file, writer->ctx, sets[""]));
+
+    /* Tags which no message has any more are dropped. */
+    for (i = sets.begin (); ok && i != sets.end (); i++) {
+	if (i->first.empty () || _notmuch_doc_id_set_count (i->second) == 0)
+	    continue;
+	ok = (_write_chunk (file, i->first.data (), i->first.size ()) &&
+	      _write_set (file, writer->ctx, i->second));
+    }
+
+    return ok;
+}
+
+static const notmuch_side_index_writer_t tag_sets_writer = {
+    _tag_sets_load,
+    _tag_sets_update,
+    _tag_sets_build,
+    _tag_sets_save
+};
+
+void
+_notmuch_tag_bitmaps_close (notmuch_database_t *notmuch,
+			    notmuch_bool_t flushed)
+{
+    notmuch_tag_bitmaps_t *bitmaps = notmuch->tag_bitmaps;
+    tag_sets_writer_t writer;
+
+    if (bitmaps == NULL)
+	return;
+
+    /* The cached sets were read from the mapped file. */
+    g_hash_table_remove_all (bitmaps->sets);
+
+    writer.notmuch = notmuch;
+    writer.ctx = talloc_new (notmuch);
+    if (unlikely (writer.ctx == NULL)) {
+	_notmuch_side_index_unmap (bitmaps->index);
+	return;
+    }
+
+    _notmuch_side_index_close (notmuch, bitmaps->index,
+			       NOTMUCH_TAG_BITMAPS_MAGIC, flushed,
+			       &tag_sets_writer, &writer);
+
+    talloc_free (writer.ctx);
+}
+
+notmuch_doc_id_set_t *
+_notmuch_tag_bitmaps_get (notmuch_database_t *notmuch, const char *tag)
+{
+    notmuch_tag_bitmaps_t *bitmaps = notmuch->tag_bitmaps;
+    notmuch_doc_id_set_t *set;
+    const char *data;
+    uint32_t size;
+    char *key;
+
+    if (bitmaps == NULL ||
+	! _notmuch_side_index_get (notmuch, bitmaps->index,
+				   NOTMUCH_TAG_BITMAPS_MAGIC))
+	return NULL;
+
+    set = (notmuch_doc_id_set_t *) g_hash_table_lookup (bitmaps->sets,
+							 tag ? tag : "");
+    if (set)
+	return set;
+
+    if (! _tag_bitmaps_find (bitmaps, tag, &data, &size))
+	return NULL;
+
+    if (data)
+	set = _notmuch_doc_id_set_deserialise (bitmaps, data, size);
+    else
+	set = _notmuch_doc_id_set_create (bitmaps);
+    if (set == NULL)
+	return NULL;
+
+    key = talloc_strdup (set, tag ? tag : "");
+    if (unlikely (key == NULL)) {
+	talloc_free (set);
+	return NULL;
+    }
+
+    g_hash_table_insert (bitmaps->sets, key, set);
+
+    return set;
+}
+
+/* The state of the parser of a query by _notmuch_tag_bitmaps_match. */
+typedef struct {
+    notmuch_database_t *notmuch;
+    void *ctx;
+    const char *pos;
+    /* The current token, (which is empty at the end of the query). */
+    const char *token;
+    size_t token_length;
+} tag_query_parser_t;
+
+static notmuch_doc_id_set_t *
+_parse_or (tag_query_parser_t *parser);
+
+static void
+_next_token (tag_query_parser_t *parser)
+{
+    const char *end;
+
+    while (isspace ((unsigned char) *parser->pos))
+	parser->pos++;
+
+    end = parser->pos;
+    if (*end == '(' || *end == ')') {
+	end++;
+    } else {
+	while (*end && *end != '(' && *end != ')' &&
+	       ! isspace ((unsigned char) *end))
+	    end++;
+    }
+
+    parser->token = parser->pos;
+    parser->token_length = end - parser->pos;
+    parser->pos = end;
+}
+
+static notmuch_bool_t
+_token_is (tag_query_parser_t *parser, const char *word)
+{
+    return (parser->token_length == strlen (word) &&
+	    strncasecmp (parser->token, word, parser->token_length) == 0);
+}
+
+/* If the current token is a term 'prefix':value, return the value,
+ * (allocated with the context of 'parser'), or NULL otherwise. Values
+ * which the query parser may treat specially, (such as wildcards,
+ * ranges or quoted phrases), are not accepted. */
+static char *
+_token_value (tag_query_parser_t *parser, const char *prefix)
+{
+    size_t prefix_length = strlen (prefix);
+    const char *value = parser->token + prefix_length;
+    size_t value_length = parser->token_length - prefix_length;
+    size_t i;
+
+    if (parser->token_length <= prefix_length ||
+	strncmp (parser->token, prefix, prefix_length) != 0)
+	return NULL;
+
+    for (i = 0; i < value_length; i++) {
+	if (strchr ("\"*{}", value[i]) ||
+	    (value[i] == '.' && i + 1 < value_length && value[i + 1] == '.'))
+	    return NULL;
+    }
+
+    return talloc_strndup (parser->ctx, value, value_length);
+}
+
+/* Parse a term or parenthesized query. */
+static notmuch_doc_id_set_t *
+_parse_primary (tag_query_parser_t *parser)
+{
+    notmuch_doc_id_set_t *set = NULL;
+    char *value;
+
+    if (_token_is (parser, "(")) {
+	_next_token (parser);
+	set = _parse_or (parser);
+	if (set == NULL || ! _token_is (parser, ")"))
+	    return NULL;
+	_next_token (parser);
+	return set;
+    }
+
+    if ((value = _token_value (parser, "tag:"))) {
+	set = _notmuch_tag_bitmaps_get (parser->notmuch, value);
+    } else if ((value = _token_value (parser, "thread:"))) {
+	set = _notmuch_doc_id_set_create (parser->ctx);
+	if (set && ! _add_postings (parser->notmuch, set,
+				    std::string (_find_prefix ("thread")) +
+				    value))
+	{
+	    set = NULL;
+	}
+    }
+
+    if (set)
+	_next_token (parser);
+
+    return set;
+}
+
+/* Parse a sequence of terms joined by "and", "not" and "and not",
+ * (which the query parser treats as having the same precedence, and
+ * associating to the left). A "not" at the start of the query or of a
+ * parenthesized query is relative to all messages. */
+static notmuch_doc_id_set_t *
+_parse_and (tag_query_parser_t *parser, notmuch_bool_t at_start)
+{
+    notmuch_doc_id_set_t *set, *operand;
+    notmuch_bool_t negate;
+
+    if (at_start && _token_is (parser, "not")) {
+	set = _notmuch_tag_bitmaps_get (parser->notmuch, NULL);
+    } else {
+	set = _parse_primary (parser);
+    }
+
+    while (set) {
+	if (_token_is (parser, "and")) {
+	    _next_token (parser);
+	    negate = _token_is (parser, "not");
+	} else if (_token_is (parser, "not")) {
+	    negate = TRUE;
+	} else {
+	    break;
+	}
+	if (negate)
+	    _next_token (parser);
+
+	operand = _parse_primary (parser);
+	if (operand == NULL)
+	    return NULL;
+
+	if (negate)
+	    set = _notmuch_doc_id_set_difference (parser->ctx, set, operand);
+	else
+	    set = _notmuch_doc_id_set_intersection (parser->ctx, set, operand);
+    }
+
+    return set;
+}
+
+static notmuch_doc_id_set_t *
+_parse_or (tag_query_parser_t *parser)
+{
+    notmuch_doc_id_set_t *set, *operand;
+
+    set = _parse_and (parser, TRUE);
+
+    while (set && _token_is (parser, "or")) {
+	_next_token (parser);
+	operand = _parse_and (parser, FALSE);
+	if (operand == NULL)
+	    return NULL;
+	set = _notmuch_doc_id_set_union (parser->ctx, set, operand);
+    }
+
+    return set;
+}
+
+notmuch_doc_id_set_t *
+_notmuch_tag_bitmaps_match (void *ctx, notmuch_database_t *notmuch,
+			    const char *query_string)
+{
+    tag_query_parser_t parser;
+    notmuch_doc_id_set_t *all, *set = NULL;
+
+    all = _notmuch_tag_bitmaps_get (notmuch, NULL);
+    if (all == NULL)
+	return NULL;
+
+    parser.notmuch = notmuch;
+    parser.ctx = talloc_new (ctx);
+    parser.pos = query_string;
+    _next_token (&parser);
+
+    try {
+	/* As for _notmuch_query_parse. */
+	if (strcmp (query_string, "") == 0 || strcmp (query_string, "*") == 0) {
+	    _next_token (&parser);
+	    set = all;
+	} else {
+	    set = _parse_or (&parser);
+	}
+
+	/* Anything else, (such as terms joined without an operator,
+	 * which the query parser may combine in other ways), is left
+	 * to the query parser. */
+	if (parser.token_length != 0)
+	    set = NULL;
+    } catch (const Xapian::Error &error) {
+	set = NULL;
+    }
+
+    /* As for the compiled query, only mail documents match. */
+    if (set)
+	set = _notmuch_doc_id_set_intersection (ctx, all, set);
+
+    talloc_free (parser.ctx);
+
+    return set;
+}
@@ -0,0 +1,143 @@
+/* tag-table.c - The tag names of a database, each stored once
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+
+#include <glib.h> /* GHashTable */
+
+/* A database typically has a few dozen distinct tags, each on a great
+ * many messages. Rather than every message and thread holding its own
+ * copies of the names of its tags, each name is "interned" in the tag
+ * table of the database: stored once, and given a small ID.
+ *
+ * IDs start at 1, so a set of tags can be a notmuch_doc_id_set_t, and
+ * the tags of a thread are merged by setting bits rather than by
+ * hashing and copying strings.
+ *
+ * Interned names belong to the table, (which belongs to the database),
+ * and must never be modified or freed.
+ */
+struct _notmuch_tag_table {
+    /* The ID of each interned name, (with GUINT_TO_POINTER). */
+    GHashTable *ids;
+
+    /* The interned name with each ID, (with names[0] unused). */
+    const char **names;
+    unsigned int num_names;
+    unsigned int size;
+};
+
+static int
+_notmuch_tag_table_destructor (notmuch_tag_table_t *table)
+{
+    g_hash_table_unref (table->ids);
+
+    return 0;
+}
+
+notmuch_tag_table_t *
+_notmuch_tag_table_create (const void *ctx)
+{
+    notmuch_tag_table_t *table;
+
+    table = talloc (ctx, notmuch_tag_table_t);
+    if (unlikely (table == NULL))
+	return NULL;
+
+    table->ids = g_hash_table_new (g_str_hash, g_str_equal);
+    talloc_set_destructor (table, _notmuch_tag_table_destructor);
+
+    table->size = 32;
+    table->num_names = 1;
+    table->names = talloc_array (table, const char *, table->size);
+    if (unlikely (table->names == NULL)) {
+	talloc_free (table);
+	return NULL;
+    }
+    table->names[0] = NULL;
+
+    return table;
+}
+
+const char *
+_notmuch_tag_table_intern (notmuch_tag_table_t *table, const char *tag,
+			   unsigned int *id)
+{
+    gpointer key, value;
+    char *name;
+
+    if (g_hash_table_lookup_extended (table->ids, tag, &key, &value)) {
+	if (id)
+	    *id = GPOINTER_TO_UINT (value);
+	return (const char *) key;
+    }
+
+    if (table->num_names == table->size) {
+	const char **names;
+
+	names = talloc_realloc (table, table->names, const char *,
+				2 * table->size);
+	if (unlikely (names == NULL))
+	    return NULL;
+	table->names = names;
+	table->size *= 2;
+    }
+
+    name = talloc_strdup (table, tag);
+    if (unlikely (name == NULL))
+	return NULL;
+
+    table->names[table->num_names] = name;
+    g_hash_table_insert (table->ids, name,
+			 GUINT_TO_POINTER (table->num_names));
+    if (id)
+	*id = table->num_names;
+    table->num_names++;
+
+    return name;
+}
+
+const char *
+_notmuch_tag_table_get_name (notmuch_tag_table_t *table, unsigned int id)
+{
+    if (id == 0 || id >= table->num_names)
+	return NULL;
+
+    return table->names[id];
+}
+
+notmuch_string_list_t *
+_notmuch_tag_table_get_names (notmuch_tag_table_t *table, const void *ctx,
+			      notmuch_doc_id_set_t *tag_ids)
+{
+    notmuch_string_list_t *list;
+    unsigned int id = 0;
+
+    list = _notmuch_string_list_create (ctx);
+    if (unlikely (list == NULL))
+	return NULL;
+
+    while (_notmuch_doc_id_set_next (tag_ids, &id))
+	_notmuch_string_list_append_shared (list,
+					    _notmuch_tag_table_get_name (table,
+									 id));
+
+    _notmuch_string_list_sort (list);
+
+    return list;
+}
@@ -22,6 +22,12 @@
 
 struct _notmuch_tags {
     notmuch_string_node_t *iterator;
+
+    /* For tags created with _notmuch_tags_create_with_counts, the
+     * count of each tag, (in the order of the list), and the index of
+     * the current tag. Otherwise, counts is NULL. */
+    unsigned int *counts;
+    unsigned int index;
 };
 
 /* Create a new notmuch_tags_t object, with 'ctx' as its talloc owner.
@@ -42,6 +48,32 @@ _notmuch_tags_create (const void *ctx, notmuch_string_list_t *list)
     tags->iterator = list->head;
     talloc_steal (tags, list);
 
+    tags->counts = NULL;
+    tags->index = 0;
+
+    return tags;
+}
+
+/* Create a new notmuch_tags_t object as _notmuch_tags_create does,
+ * where 'counts' is an array holding a count for each tag of 'list',
+ * (as returned by notmuch_tags_get_count). The iterator will
+ * talloc_steal 'counts' as well as 'list'.
+ *
+ * This function can return NULL in case of out-of-memory.
+ */
+notmuch_tags_t *
+_notmuch_tags_create_with_counts (const void *ctx,
+				  notmuch_string_list_t *list,
+				  unsigned int *counts)
+{
+    notmuch_tags_t *tags;
+
+    tags = _notmuch_tags_create (ctx, list);
+    if (unlikely (tags == NULL))
+	return NULL;
+
+    tags->counts = talloc_steal (tags, counts);
+
     return tags;
 }
 
@@ -60,6 +92,15 @@ notmuch_tags_get (notmuch_tags_t *tags)
     return (char *) tags->iterator->string;
 }
 
+unsigned int
+notmuch_tags_get_count (notmuch_tags_t *tags)
+{
+    if (tags->iterator == NULL || tags->counts == NULL)
+	return 0;
+
+    return tags->counts[tags->index];
+}
+
 void
 notmuch_tags_move_to_next (notmuch_tags_t *tags)
 {
@@ -67,6 +108,7 @@ notmuch_tags_move_to_next (notmuch_tags_t *tags)
 	return;
 
     tags->iterator = tags->iterator->next;
+    tags->index++;
 }
 
 void
@@ -0,0 +1,459 @@
+/* thread-summary.cc - Persistent per-thread summary records
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+/* A thread summary record holds, for each message in a thread, just
+ * enough information to produce the thread's summary (authors,
+ * subject, dates, message count and tags) without reading any of the
+ * message documents.
+ *
+ * The record is stored as a database metadata value whose name is
+ * NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX followed by the thread ID.
+ * The value is a sequence of NUL-terminated fields. The first field
+ * is the record format, (THREAD_SUMMARY_FORMAT). Then, for each
+ * message in the thread, there are the following fields:
+ *
+ *	doc ID		The message's document ID, in decimal.
+ *	timestamp	The message's date as a time_t, in decimal.
+ *	author		The message's author, as displayed in thread
+ *			summaries, (empty if there is none).
+ *	subject		The message's subject.
+ *	tag count	The number of tags of the message, in decimal.
+ *	tags		One field for each tag, in sorted order.
+ *
+ * Messages appear in oldest-first order, with ties broken by doc
+ * ID. This matches the order in which a search sorted by date
+ * returns them.
+ *
+ * The record is updated whenever a message document is written, so
+ * readers can trust a record whenever one exists (and the database
+ * version is new enough to maintain them).
+ */
+#define THREAD_SUMMARY_FORMAT "1"
+
+static std::string
+_thread_summary_key (const char *thread_id)
+{
+    return std::string (NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX) + thread_id;
+}
+
+static std::string
+_thread_summary_header (void)
+{
+    return std::string (THREAD_SUMMARY_FORMAT, sizeof (THREAD_SUMMARY_FORMAT));
+}
+
+static notmuch_bool_t
+_thread_summary_valid (const std::string &record)
+{
+    std::string header = _thread_summary_header ();
+
+    return record.compare (0, header.size (), header) == 0;
+}
+
+static void
+_append_field (std::string &record, const char *field)
+{
+    if (field)
+	record.append (field);
+    record.push_back ('\0');
+}
+
+/* Read the NUL-terminated field beginning at *pos in 'record' and
+ * advance *pos past it. Returns FALSE if the record is truncated. */
+static notmuch_bool_t
+_next_field (const std::string &record, size_t *pos, const char **field)
+{
+    size_t end = record.find ('\0', *pos);
+
+    if (end == std::string::npos)
+	return FALSE;
+
+    *field = record.c_str () + *pos;
+    *pos = end + 1;
+
+    return TRUE;
+}
+
+/* Parse the member entry beginning at *pos in 'record' and advance
+ * *pos past it.
+ *
+ * If 'ctx' is NULL, only the doc_id and timestamp of 'member' are
+ * filled in. Otherwise, the strings and tag list of 'member' are also
+ * filled in, allocated with 'ctx' as the talloc context.
+ *
+ * Returns FALSE if the entry is malformed. */
+static notmuch_bool_t
+_parse_member (void *ctx, const std::string &record, size_t *pos,
+	       notmuch_thread_member_t *member)
+{
+    const char *doc_id, *timestamp, *author, *subject, *tag_count, *tag;
+    unsigned int i, num_tags;
+    char *end;
+
+    if (! _next_field (record, pos, &doc_id) ||
+	! _next_field (record, pos, &timestamp) ||
+	! _next_field (record, pos, &author) ||
+	! _next_field (record, pos, &subject) ||
+	! _next_field (record, pos, &tag_count))
+	return FALSE;
+
+    member->doc_id = strtoul (doc_id, &end, 10);
+    if (*end != '\0')
+	return FALSE;
+    member->timestamp = strtol (timestamp, &end, 10);
+    if (*end != '\0')
+	return FALSE;
+    num_tags = strtoul (tag_count, &end, 10);
+    if (*end != '\0')
+	return FALSE;
+
+    if (ctx) {
+	member->author = *author ? talloc_strdup (ctx, author) : NULL;
+	member->subject = talloc_strdup (ctx, subject);
+	member->tags = _notmuch_string_list_create (ctx);
+	member->matched = FALSE;
+	member->excluded = FALSE;
+    }
+
+    for (i = 0; i < num_tags; i++) {
+	if (! _next_field (record, pos, &tag))
+	    return FALSE;
+	if (ctx)
+	    _notmuch_string_list_append (member->tags, tag);
+    }
+
+    return TRUE;
+}
+
+/* Append the tag count and tag fields of the member entry for
+ * 'message' to 'entry'. */
+static void
+_append_tags (void *ctx, std::string &entry, notmuch_message_t *message)
+{
+    notmuch_tags_t *tags;
+    notmuch_string_list_t *tag_list;
+    notmuch_string_node_t *node;
+
+    tag_list = _notmuch_string_list_create (ctx);
+    for (tags = notmuch_message_get_tags (message);
+	 notmuch_tags_valid (tags);
+	 notmuch_tags_move_to_next (tags))
+    {
+	_notmuch_string_list_append (tag_list, notmuch_tags_get (tags));
+    }
+
+    _append_field (entry, talloc_asprintf (ctx, "%d", tag_list->length));
+    for (node = tag_list->head; node; node = node->next)
+	_append_field (entry, node->string);
+}
+
+/* Format the member entry for 'message'. */
+static std::string
+_format_member (void *ctx, notmuch_message_t *message)
+{
+    std::string entry;
+
+    _append_field (entry, talloc_asprintf (ctx, "%u",
+					   _notmuch_message_get_doc_id (message)));
+    _append_field (entry, talloc_asprintf (ctx, "%ld",
+					   (long) notmuch_message_get_date (message)));
+    _append_field (entry, _notmuch_thread_author_from_header (
+		       ctx, notmuch_message_get_header (message, "from")));
+    _append_field (entry, notmuch_message_get_header (message, "subject"));
+    _append_tags (ctx, entry, message);
+
+    return entry;
+}
+
+/* Replace the tags in the entry for 'message' in 'record' with its
+ * current tags, leaving the rest of the record, (including the other
+ * fields of the entry), as it is.
+ *
+ * Returns FALSE if 'record' has no entry for 'message', (or is
+ * malformed). */
+static notmuch_bool_t
+_replace_member_tags (void *ctx, std::string &record,
+		      notmuch_message_t *message)
+{
+    unsigned int doc_id = _notmuch_message_get_doc_id (message);
+    notmuch_thread_member_t member;
+    const char *field;
+    size_t pos, start, tags_start;
+    unsigned int i;
+    std::string tags;
+
+    pos = _thread_summary_header ().size ();
+    while (pos < record.size ()) {
+	start = pos;
+	if (! _parse_member (NULL, record, &pos, &member))
+	    return FALSE;
+
+	if (member.doc_id != doc_id)
+	    continue;
+
+	/* Skip the doc ID, timestamp, author and subject fields. */
+	tags_start = start;
+	for (i = 0; i < 4; i++)
+	    _next_field (record, &tags_start, &field);
+
+	_append_tags (ctx, tags, message);
+	record.replace (tags_start, pos - tags_start, tags);
+
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Remove the entry for 'doc_id' from 'record' and, if 'entry' is
+ * non-empty, insert 'entry' (the entry for 'doc_id' with the given
+ * 'timestamp') at its place in the ordering.
+ *
+ * Returns FALSE if 'record' is malformed. */
+static notmuch_bool_t
+_replace_member (std::string &record, unsigned int doc_id, time_t timestamp,
+		 const std::string &entry)
+{
+    std::string updated = _thread_summary_header ();
+    notmuch_thread_member_t member;
+    notmuch_bool_t inserted = entry.empty ();
+    size_t pos, start;
+
+    pos = updated.size ();
+    while (pos < record.size ()) {
+	start = pos;
+	if (! _parse_member (NULL, record, &pos, &member))
+	    return FALSE;
+
+	if (member.doc_id == doc_id)
+	    continue;
+
+	if (! inserted &&
+	    (member.timestamp > timestamp ||
+	     (member.timestamp == timestamp && member.doc_id > doc_id)))
+	{
+	    updated.append (entry);
+	    inserted = TRUE;
+	}
+
+	updated.append (record, start, pos - start);
+    }
+
+    if (! inserted)
+	updated.append (entry);
+
+    record = updated;
+
+    return TRUE;
+}
+
+/* Rebuild the summary record for 'thread_id' from scratch by reading
+ * every message in the thread.
+ *
+ * Returns the number of messages in the thread.
+ */
+unsigned int
+_notmuch_thread_summary_rebuild (notmuch_database_t *notmuch,
+				 const char *thread_id)
+{
+    Xapian::WritableDatabase *db;
+    Xapian::PostingIterator i, end;
+    std::string record = _thread_summary_header ();
+    std::string term = std::string (_find_prefix ("thread")) + thread_id;
+    unsigned int count = 0;
+    void *local = talloc_new (notmuch);
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    end = db->postlist_end (term);
+    for (i = db->postlist_begin (term); i != end; i++) {
+	notmuch_message_t *message;
+
+	message = _notmuch_message_create (local, notmuch, *i, NULL);
+	if (message == NULL)
+	    continue;
+
+	_replace_member (record, *i, notmuch_message_get_date (message),
+			 _format_member (message, message));
+	count++;
+
+	talloc_free (message);
+    }
+
+    if (count)
+	db->set_metadata (_thread_summary_key (thread_id), record);
+    else
+	db->set_metadata (_thread_summary_key (thread_id), "");
+
+    talloc_free (local);
+
+    return count;
+}
+
+/* Update the summary record of the thread of 'message' to reflect the
+ * current state of 'message', (which has just been written to the
+ * database).
+ *
+ * Unless 'headers_changed' is TRUE, only the tags of 'message' can
+ * have changed since its entry was written, so only those are
+ * replaced, (without formatting its author again). */
+void
+_notmuch_thread_summary_add_message (notmuch_database_t *notmuch,
+				     notmuch_message_t *message,
+				     notmuch_bool_t headers_changed)
+{
+    Xapian::WritableDatabase *db;
+    const char *thread_id;
+    std::string key, record, original;
+    void *local;
+
+    if (! notmuch->has_thread_summaries)
+	return;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    thread_id = notmuch_message_get_thread_id (message);
+    key = _thread_summary_key (thread_id);
+    original = record = db->get_metadata (key);
+
+    /* Without an existing record, we cannot know what else is in the
+     * thread, (such as after two threads are merged), so build the
+     * record from the database. */
+    if (! _thread_summary_valid (record)) {
+	_notmuch_thread_summary_rebuild (notmuch, thread_id);
+	return;
+    }
+
+    local = talloc_new (notmuch);
+
+    if (! headers_changed && _replace_member_tags (local, record, message)) {
+	if (record != original)
+	    db->set_metadata (key, record);
+    } else if (! _replace_member (record, _notmuch_message_get_doc_id (message),
+				  notmuch_message_get_date (message),
+				  _format_member (local, message)))
+    {
+	_notmuch_thread_summary_rebuild (notmuch, thread_id);
+    } else if (record != original) {
+	db->set_metadata (key, record);
+    }
+
+    talloc_free (local);
+}
+
+/* Remove 'message', (which is about to be deleted from the database),
+ * from the summary record of its thread. */
+void
+_notmuch_thread_summary_remove_message (notmuch_database_t *notmuch,
+					notmuch_message_t *message)
+{
+    Xapian::WritableDatabase *db;
+    std::string key, record;
+
+    if (! notmuch->has_thread_summaries)
+	return;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    key = _thread_summary_key (notmuch_message_get_thread_id (message));
+    record = db->get_metadata (key);
+
+    if (! _thread_summary_valid (record))
+	return;
+
+    if (! _replace_member (record, _notmuch_message_get_doc_id (message),
+			   0, std::string ()))
+	record = "";
+    else if (record == _thread_summary_header ())
+	record = "";
+
+    db->set_metadata (key, record);
+}
+
+/* Remove the summary record of 'thread_id', (which no longer has any
+ * messages, such as after being merged into another thread). */
+void
+_notmuch_thread_summary_remove (notmuch_database_t *notmuch,
+				const char *thread_id)
+{
+    Xapian::WritableDatabase *db;
+
+    if (! notmuch->has_thread_summaries)
+	return;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    db->set_metadata (_thread_summary_key (thread_id), "");
+}
+
+/* Return the members of 'thread_id' as recorded in its summary
+ * record, in oldest-first order, and store their number in *count.
+ *
+ * The returned array is allocated with 'ctx' as the talloc context.
+ *
+ * Returns NULL if the thread has no (usable) summary record, in
+ * which case the caller must examine the thread's messages instead.
+ */
+notmuch_thread_member_t *
+_notmuch_thread_summary_get (void *ctx,
+			     notmuch_database_t *notmuch,
+			     const char *thread_id,
+			     unsigned int *count)
+{
+    notmuch_thread_member_t *members, member;
+    std::string record;
+    unsigned int i, num_members = 0;
+    size_t pos;
+
+    if (! notmuch->has_thread_summaries)
+	return NULL;
+
+    try {
+	record = notmuch->xapian_db->get_metadata (_thread_summary_key (thread_id));
+    } catch (const Xapian::Error &error) {
+	return NULL;
+    }
+
+    if (! _thread_summary_valid (record))
+	return NULL;
+
+    pos = _thread_summary_header ().size ();
+    while (pos < record.size ()) {
+	if (! _parse_member (NULL, record, &pos, &member))
+	    return NULL;
+	num_members++;
+    }
+
+    if (num_members == 0)
+	return NULL;
+
+    members = talloc_array (ctx, notmuch_thread_member_t, num_members);
+    if (unlikely (members == NULL))
+	return NULL;
+
+    pos = _thread_summary_header ().size ();
+    for (i = 0; i < num_members; i++)
+	_parse_member (members, record, &pos, &members[i]);
+
+    *count = num_members;
+
+    return members;
+}
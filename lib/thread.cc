@@ -33,10 +33,18 @@ struct visible _notmuch_thread {
     GHashTable *matched_authors_hash;
     GPtrArray *matched_authors_array;
     char *authors;
-    GHashTable *tags;
+    /* The IDs of the tags of the messages, (see tag-table.c). */
+    notmuch_doc_id_set_t *tag_ids;
 
     notmuch_message_list_t *message_list;
     GHashTable *message_hash;
+
+    /* For a thread created from its summary record, the members of
+     * the thread, until its messages are loaded (at which point this
+     * becomes NULL). */
+    notmuch_thread_member_t *members;
+    unsigned int num_members;
+
     int total_messages;
     int matched_messages;
     time_t oldest;
@@ -48,7 +56,6 @@ _notmuch_thread_destructor (notmuch_thread_t *thread)
 {
     g_hash_table_unref (thread->authors_hash);
     g_hash_table_unref (thread->matched_authors_hash);
-    g_hash_table_unref (thread->tags);
     g_hash_table_unref (thread->message_hash);
 
     if (thread->authors_array) {
@@ -163,7 +170,7 @@ _resolve_thread_authors_string (notmuch_thread_t *thread)
  * "Last, First MI" <first.mi.last@company.com>
  */
 static char *
-_thread_cleanup_author (notmuch_thread_t *thread,
+_thread_cleanup_author (void *ctx,
 			const char *author, const char *from)
 {
     char *clean_author,*test_author;
@@ -173,7 +180,7 @@ _thread_cleanup_author (notmuch_thread_t *thread,
 
     if (author == NULL)
 	return NULL;
-    clean_author = talloc_strdup(thread, author);
+    clean_author = talloc_strdup(ctx, author);
     if (clean_author == NULL)
 	return NULL;
     /* check if there's a comma in the name and that there's a
@@ -192,7 +199,7 @@ _thread_cleanup_author (notmuch_thread_t *thread,
 	strncpy(clean_author + fname + 1, author, lname);
 	*(clean_author+fname+1+lname) = '\0';
 	/* make a temporary copy and see if it matches the email */
-	test_author = talloc_strdup(thread,clean_author);
+	test_author = talloc_strdup(ctx,clean_author);
 
 	blank=strchr(test_author,' ');
 	while (blank != NULL) {
@@ -207,6 +214,51 @@ _thread_cleanup_author (notmuch_thread_t *thread,
     return clean_author;
 }
 
+/* Return the author of a message with the given From header, as it
+ * is to be displayed in the thread's authors string (that is, the
+ * name of the first address, or the address itself if it has no
+ * name).
+ *
+ * The result is allocated with 'ctx' as the talloc context. Returns
+ * NULL if there is no author.
+ */
+char *
+_notmuch_thread_author_from_header (void *ctx, const char *from)
+{
+    InternetAddressList *list = NULL;
+    InternetAddress *address;
+    const char *author;
+    char *clean_author = NULL;
+
+    if (from)
+	list = internet_address_list_parse_string (from);
+
+    if (list) {
+	address = internet_address_list_get_address (list, 0);
+	if (address) {
+	    author = internet_address_get_name (address);
+	    if (author == NULL) {
+		InternetAddressMailbox *mailbox;
+		mailbox = INTERNET_ADDRESS_MAILBOX (address);
+		author = internet_address_mailbox_get_addr (mailbox);
+	    }
+	    clean_author = _thread_cleanup_author (ctx, author, from);
+	}
+	g_object_unref (G_OBJECT (list));
+    }
+
+    return clean_author;
+}
+
+static void
+_thread_add_tag (notmuch_thread_t *thread, const char *tag)
+{
+    unsigned int id;
+
+    if (_notmuch_tag_table_intern (thread->notmuch->tag_table, tag, &id))
+	_notmuch_doc_id_set_add (thread->tag_ids, id);
+}
+
 /* Add 'message' as a message that belongs to 'thread'.
  *
  * The 'thread' will talloc_steal the 'message' and hold onto a
@@ -219,9 +271,6 @@ _thread_add_message (notmuch_thread_t *thread,
 {
     notmuch_tags_t *tags;
     const char *tag;
-    InternetAddressList *list = NULL;
-    InternetAddress *address;
-    const char *from, *author;
     char *clean_author;
 
     _notmuch_message_list_add_message (thread->message_list,
@@ -232,24 +281,11 @@ _thread_add_message (notmuch_thread_t *thread,
 			 xstrdup (notmuch_message_get_message_id (message)),
 			 message);
 
-    from = notmuch_message_get_header (message, "from");
-    if (from)
-	list = internet_address_list_parse_string (from);
-
-    if (list) {
-	address = internet_address_list_get_address (list, 0);
-	if (address) {
-	    author = internet_address_get_name (address);
-	    if (author == NULL) {
-		InternetAddressMailbox *mailbox;
-		mailbox = INTERNET_ADDRESS_MAILBOX (address);
-		author = internet_address_mailbox_get_addr (mailbox);
-	    }
-	    clean_author = _thread_cleanup_author (thread, author, from);
-	    _thread_add_author (thread, clean_author);
-	    notmuch_message_set_author (message, clean_author);
-	}
-	g_object_unref (G_OBJECT (list));
+    clean_author = _notmuch_thread_author_from_header (
+	thread, notmuch_message_get_header (message, "from"));
+    if (clean_author) {
+	_thread_add_author (thread, clean_author);
+	notmuch_message_set_author (message, clean_author);
     }
 
     if (! thread->subject) {
@@ -272,18 +308,16 @@ _thread_add_message (notmuch_thread_t *thread,
 		break;
 	    }
 	}
-	g_hash_table_insert (thread->tags, xstrdup (tag), NULL);
+	_thread_add_tag (thread, tag);
     }
 }
 
 static void
-_thread_set_subject_from_message (notmuch_thread_t *thread,
-				  notmuch_message_t *message)
+_thread_set_subject (notmuch_thread_t *thread,
+		     const char *subject)
 {
-    const char *subject;
     const char *cleaned_subject;
 
-    subject = notmuch_message_get_header (message, "subject");
     if (! subject)
 	return;
 
@@ -305,35 +339,45 @@ _thread_set_subject_from_message (notmuch_thread_t *thread,
     thread->subject = talloc_strdup (thread, cleaned_subject);
 }
 
-/* Add a message to this thread which is known to match the original
- * search specification. The 'sort' parameter controls whether the
- * oldest or newest matching subject is applied to the thread as a
- * whole. */
+/* Account for a message of this thread, with the given date, subject
+ * and author, which is known to match the original search
+ * specification. The 'sort' parameter controls whether the oldest or
+ * newest matching subject is applied to the thread as a whole. */
 static void
-_thread_add_matched_message (notmuch_thread_t *thread,
-			     notmuch_message_t *message,
-			     notmuch_sort_t sort)
+_thread_add_match (notmuch_thread_t *thread,
+		   time_t date,
+		   const char *subject,
+		   const char *author,
+		   notmuch_bool_t excluded,
+		   notmuch_sort_t sort)
 {
-    time_t date;
-    notmuch_message_t *hashed_message;
-
-    date = notmuch_message_get_date (message);
-
     if (date < thread->oldest || ! thread->matched_messages) {
 	thread->oldest = date;
 	if (sort == NOTMUCH_SORT_OLDEST_FIRST)
-	    _thread_set_subject_from_message (thread, message);
+	    _thread_set_subject (thread, subject);
     }
 
     if (date > thread->newest || ! thread->matched_messages) {
 	thread->newest = date;
 	if (sort != NOTMUCH_SORT_OLDEST_FIRST)
-	    _thread_set_subject_from_message (thread, message);
+	    _thread_set_subject (thread, subject);
     }
 
-    if (!notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_EXCLUDED))
+    if (! excluded)
 	thread->matched_messages++;
 
+    _thread_add_matched_author (thread, author);
+}
+
+/* Add a message to this thread which is known to match the original
+ * search specification. */
+static void
+_thread_add_matched_message (notmuch_thread_t *thread,
+			     notmuch_message_t *message,
+			     notmuch_sort_t sort)
+{
+    notmuch_message_t *hashed_message;
+
     if (g_hash_table_lookup_extended (thread->message_hash,
 			    notmuch_message_get_message_id (message), NULL,
 			    (void **) &hashed_message)) {
@@ -341,7 +385,13 @@ _thread_add_matched_message (notmuch_thread_t *thread,
 				  NOTMUCH_MESSAGE_FLAG_MATCH, 1);
     }
 
-    _thread_add_matched_author (thread, notmuch_message_get_author (hashed_message));
+    _thread_add_match (thread,
+		       notmuch_message_get_date (message),
+		       notmuch_message_get_header (message, "subject"),
+		       notmuch_message_get_author (hashed_message),
+		       notmuch_message_get_flag (message,
+						 NOTMUCH_MESSAGE_FLAG_EXCLUDED),
+		       sort);
 }
 
 static void
@@ -382,53 +432,17 @@ _resolve_thread_relationships (unused (notmuch_thread_t *thread))
      */
 }
 
-/* Create a new notmuch_thread_t object by finding the thread
- * containing the message with the given doc ID, treating any messages
- * contained in match_set as "matched".  Remove all messages in the
- * thread from match_set.
- *
- * Creating the thread will perform a database search to get all
- * messages belonging to the thread and will get the first subject
- * line, the total count of messages, and all authors in the thread.
- * Each message in the thread is checked against match_set to allow
- * for a separate count of matched messages, and to allow a viewer to
- * display these messages differently.
- *
- * Here, 'ctx' is talloc context for the resulting thread object.
+/* Allocate an empty notmuch_thread_t object for the thread with the
+ * given thread ID, ready to have messages added to it.
  *
  * This function returns NULL in the case of any error.
  */
-notmuch_thread_t *
-_notmuch_thread_create (void *ctx,
-			notmuch_database_t *notmuch,
-			unsigned int seed_doc_id,
-			notmuch_doc_id_set_t *match_set,
-			notmuch_string_list_t *exclude_terms,
-			notmuch_sort_t sort)
+static notmuch_thread_t *
+_thread_create_empty (void *ctx,
+		      notmuch_database_t *notmuch,
+		      const char *thread_id)
 {
     notmuch_thread_t *thread;
-    notmuch_message_t *seed_message;
-    const char *thread_id;
-    char *thread_id_query_string;
-    notmuch_query_t *thread_id_query;
-
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
-
-    seed_message = _notmuch_message_create (ctx, notmuch, seed_doc_id, NULL);
-    if (! seed_message)
-	INTERNAL_ERROR ("Thread seed message %u does not exist", seed_doc_id);
-
-    thread_id = notmuch_message_get_thread_id (seed_message);
-    thread_id_query_string = talloc_asprintf (ctx, "thread:%s", thread_id);
-    if (unlikely (thread_id_query_string == NULL))
-	return NULL;
-
-    thread_id_query = notmuch_query_create (notmuch, thread_id_query_string);
-    if (unlikely (thread_id_query == NULL))
-	return NULL;
-
-    talloc_free (thread_id_query_string);
 
     thread = talloc (ctx, notmuch_thread_t);
     if (unlikely (thread == NULL))
@@ -447,60 +461,454 @@ _notmuch_thread_create (void *ctx,
 							  NULL, NULL);
     thread->matched_authors_array = g_ptr_array_new ();
     thread->authors = NULL;
-    thread->tags = g_hash_table_new_full (g_str_hash, g_str_equal,
-					  free, NULL);
+    thread->tag_ids = _notmuch_doc_id_set_create (thread);
+
+    thread->message_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  free, NULL);
 
     thread->message_list = _notmuch_message_list_create (thread);
-    if (unlikely (thread->message_list == NULL))
+    if (unlikely (thread->tag_ids == NULL || thread->message_list == NULL)) {
+	talloc_free (thread);
 	return NULL;
+    }
 
-    thread->message_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-						  free, NULL);
+    thread->members = NULL;
+    thread->num_members = 0;
 
     thread->total_messages = 0;
     thread->matched_messages = 0;
     thread->oldest = 0;
     thread->newest = 0;
 
-    /* We use oldest-first order unconditionally here to obtain the
-     * proper author ordering for the thread. The 'sort' parameter
-     * passed to this function is used only to indicate whether the
-     * oldest or newest subject is desired. */
-    notmuch_query_set_sort (thread_id_query, NOTMUCH_SORT_OLDEST_FIRST);
+    return thread;
+}
 
-    for (messages = notmuch_query_search_messages (thread_id_query);
-	 notmuch_messages_valid (messages);
-	 notmuch_messages_move_to_next (messages))
-    {
-	unsigned int doc_id;
+/* Add 'message', one of the messages of 'thread', to the thread and
+ * treat it as "matched" if its document ID is in 'match_set'
+ * (removing it from match_set in that case). Messages must be added
+ * in oldest-first order to obtain the proper author ordering.
+ */
+static void
+_thread_add_member (notmuch_thread_t *thread,
+		    notmuch_message_t *message,
+		    notmuch_doc_id_set_t *match_set,
+		    notmuch_string_list_t *exclude_terms,
+		    notmuch_sort_t sort)
+{
+    unsigned int doc_id = _notmuch_message_get_doc_id (message);
 
-	message = notmuch_messages_get (messages);
-	doc_id = _notmuch_message_get_doc_id (message);
-	if (doc_id == seed_doc_id)
-	    message = seed_message;
+    _thread_add_message (thread, message, exclude_terms);
 
-	_thread_add_message (thread, message, exclude_terms);
+    if ( _notmuch_doc_id_set_contains (match_set, doc_id)) {
+	_notmuch_doc_id_set_remove (match_set, doc_id);
+	_thread_add_matched_message (thread, message, sort);
+    }
 
-	if ( _notmuch_doc_id_set_contains (match_set, doc_id)) {
-	    _notmuch_doc_id_set_remove (match_set, doc_id);
-	    _thread_add_matched_message (thread, message, sort);
-	}
+    _notmuch_message_close (message);
+}
+
+/* Create a new notmuch_thread_t object for the thread with the given
+ * thread ID from the thread's summary record, without reading any of
+ * the thread's messages, (which are only loaded if the caller asks
+ * for them). Messages contained in match_set are treated as
+ * "matched", and removed from match_set, exactly as
+ * _notmuch_thread_create_batch does.
+ *
+ * Returns NULL if the thread has no summary record, in which case
+ * the thread must be created from its messages instead.
+ */
+static notmuch_thread_t *
+_thread_create_from_summary (void *ctx,
+			     notmuch_database_t *notmuch,
+			     const char *thread_id,
+			     notmuch_doc_id_set_t *match_set,
+			     notmuch_string_list_t *exclude_terms,
+			     notmuch_sort_t sort)
+{
+    notmuch_thread_t *thread;
+    notmuch_thread_member_t *members;
+    unsigned int i, count;
+
+    members = _notmuch_thread_summary_get (ctx, notmuch, thread_id, &count);
+    if (members == NULL)
+	return NULL;
 
-	_notmuch_message_close (message);
+    thread = _thread_create_empty (ctx, notmuch, thread_id);
+    if (unlikely (thread == NULL)) {
+	talloc_free (members);
+	return NULL;
     }
 
-    notmuch_query_destroy (thread_id_query);
+    thread->members = talloc_steal (thread, members);
+    thread->num_members = count;
+
+    for (i = 0; i < count; i++) {
+	notmuch_thread_member_t *member = &members[i];
+	notmuch_string_node_t *tag, *term;
+
+	thread->total_messages++;
+
+	_thread_add_author (thread, member->author);
+
+	if (! thread->subject)
+	    thread->subject = talloc_strdup (thread, member->subject);
+
+	for (tag = member->tags->head; tag; tag = tag->next) {
+	    /* Mark excluded messages. */
+	    for (term = exclude_terms->head; term; term = term->next) {
+		/* We ignore initial 'K'. */
+		if (strcmp (tag->string, (term->string + 1)) == 0) {
+		    member->excluded = TRUE;
+		    break;
+		}
+	    }
+	    _thread_add_tag (thread, tag->string);
+	}
+
+	if (_notmuch_doc_id_set_contains (match_set, member->doc_id)) {
+	    _notmuch_doc_id_set_remove (match_set, member->doc_id);
+	    member->matched = TRUE;
+	    _thread_add_match (thread, member->timestamp, member->subject,
+			       member->author, member->excluded, sort);
+	}
+    }
 
     _resolve_thread_authors_string (thread);
 
+    return thread;
+}
+
+/* Load the messages of a thread that was created from its summary
+ * record, so that they can be returned to the caller. */
+static void
+_thread_load_members (notmuch_thread_t *thread)
+{
+    notmuch_message_t *message;
+    unsigned int i;
+
+    for (i = 0; i < thread->num_members; i++) {
+	notmuch_thread_member_t *member = &thread->members[i];
+
+	message = _notmuch_message_create (thread, thread->notmuch,
+					   member->doc_id, NULL);
+	if (unlikely (message == NULL))
+	    continue;
+
+	_notmuch_message_list_add_message (thread->message_list, message);
+	g_hash_table_insert (thread->message_hash,
+			     xstrdup (notmuch_message_get_message_id (message)),
+			     message);
+
+	notmuch_message_set_author (message, member->author);
+	if (member->excluded)
+	    notmuch_message_set_flag (message,
+				      NOTMUCH_MESSAGE_FLAG_EXCLUDED, TRUE);
+	if (member->matched)
+	    notmuch_message_set_flag (message,
+				      NOTMUCH_MESSAGE_FLAG_MATCH, TRUE);
+    }
+
+    talloc_free (thread->members);
+    thread->members = NULL;
+
     _resolve_thread_relationships (thread);
+}
 
-    return thread;
+/* Return the key identifying the thread with ID 'thread_id' that
+ * holds the document with ID 'doc_id' within a batch of threads.
+ *
+ * This is the thread ID itself, except when several databases are
+ * combined, (see notmuch_database_open_multi). Thread IDs are only
+ * unique within each database, (along with its cold shards), so the
+ * key is then qualified by the thread ID space of the document, (and
+ * allocated with 'ctx' as the talloc context).
+ */
+static const char *
+_thread_batch_key (void *ctx, notmuch_database_t *notmuch,
+		   unsigned int doc_id, const char *thread_id)
+{
+    if (notmuch->num_thread_spaces == 1)
+	return thread_id;
+
+    return talloc_asprintf (ctx, "%u/%s",
+			    _notmuch_database_thread_space (notmuch, doc_id),
+			    thread_id);
+}
+
+/* Create the threads containing each of the 'count' messages with the
+ * doc IDs in 'seed_doc_ids', treating any messages contained in
+ * match_set as "matched". Remove all messages in each thread from
+ * match_set.
+ *
+ * A thread with a summary record is created from that record, (see
+ * _thread_create_from_summary). The members of all other threads are
+ * fetched with a single database search, rather than one search per
+ * thread, to get the first subject line, the total count of messages,
+ * and all authors of each thread. Each message is checked against
+ * match_set to allow for a separate count of matched messages, and to
+ * allow a viewer to display these messages differently.
+ *
+ * On success, threads[i] is the thread of seed_doc_ids[i], or NULL if
+ * that thread is the same as the thread of an earlier seed, (in which
+ * case the earlier thread is the one that will include it).
+ *
+ * Here, 'ctx' is talloc context for the resulting thread objects.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: All threads were created successfully.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * On any error, every element of 'threads' is set to NULL.
+ */
+notmuch_status_t
+_notmuch_thread_create_batch (void *ctx,
+			      notmuch_database_t *notmuch,
+			      const unsigned int *seed_doc_ids,
+			      unsigned int count,
+			      notmuch_doc_id_set_t *match_set,
+			      notmuch_string_list_t *exclude_terms,
+			      notmuch_sort_t sort,
+			      notmuch_thread_t **threads)
+{
+    void *local = talloc_new (ctx);
+    GHashTable *thread_hash;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    unsigned int i, num_queried = 0;
+
+    for (i = 0; i < count; i++)
+	threads[i] = NULL;
+
+    if (local == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    /* Maps each thread ID in the batch to its (not yet resolved)
+     * thread object. */
+    thread_hash = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::Query thread_query = Xapian::Query::MatchNothing;
+	Xapian::Query mail_query (talloc_asprintf (local, "%s%s",
+						   _find_prefix ("type"),
+						   "mail"));
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+
+	for (i = 0; i < count; i++) {
+	    notmuch_message_t *seed_message;
+	    const char *thread_id, *key;
+
+	    seed_message = _notmuch_message_create (local, notmuch,
+						    seed_doc_ids[i], NULL);
+	    if (! seed_message)
+		INTERNAL_ERROR ("Thread seed message %u does not exist",
+				seed_doc_ids[i]);
+
+	    thread_id = notmuch_message_get_thread_id (seed_message);
+	    key = _thread_batch_key (local, notmuch, seed_doc_ids[i],
+				     thread_id);
+	    if (! g_hash_table_lookup_extended (thread_hash, key, NULL, NULL))
+	    {
+		/* Threads with a summary record are complete
+		 * already. Only the others need their messages. */
+		threads[i] = _thread_create_from_summary (local, notmuch,
+							  thread_id, match_set,
+							  exclude_terms, sort);
+		if (threads[i] == NULL) {
+		    threads[i] = _thread_create_empty (local, notmuch,
+						       thread_id);
+		    if (unlikely (threads[i] == NULL)) {
+			status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+			goto DONE;
+		    }
+		    thread_query = Xapian::Query (Xapian::Query::OP_OR,
+						  thread_query,
+						  Xapian::Query (talloc_asprintf (
+								     local, "%s%s",
+								     _find_prefix ("thread"),
+								     thread_id)));
+		    num_queried++;
+		}
+		g_hash_table_insert (thread_hash, talloc_strdup (local, key),
+				     threads[i]);
+	    }
+
+	    talloc_free (seed_message);
+	}
+
+	/* We use oldest-first order unconditionally to obtain the
+	 * proper author ordering within each thread, (the 'sort'
+	 * parameter only indicates whether the oldest or newest
+	 * subject is desired). Since each thread's members are a
+	 * subsequence of this ordering, they are added in the same
+	 * order as a per-thread search would produce. */
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
+	enquire.set_query (Xapian::Query (Xapian::Query::OP_AND,
+					  mail_query, thread_query));
+
+	if (num_queried)
+	    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+	    notmuch_message_t *message;
+	    notmuch_thread_t *thread;
+
+	    message = _notmuch_message_create (local, notmuch, *iterator, NULL);
+	    if (unlikely (message == NULL)) {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		goto DONE;
+	    }
+
+	    thread = (notmuch_thread_t *) g_hash_table_lookup (
+		thread_hash,
+		_thread_batch_key (message, notmuch, *iterator,
+				   notmuch_message_get_thread_id (message)));
+	    if (unlikely (thread == NULL)) {
+		talloc_free (message);
+		continue;
+	    }
+
+	    _thread_add_member (thread, message, match_set, exclude_terms, sort);
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred loading threads: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	goto DONE;
+    }
+
+    for (i = 0; i < count; i++) {
+	if (threads[i] == NULL)
+	    continue;
+
+	/* Threads created from their summary record are complete
+	 * already. */
+	if (! threads[i]->members) {
+	    _resolve_thread_authors_string (threads[i]);
+
+	    _resolve_thread_relationships (threads[i]);
+	}
+
+	talloc_steal (ctx, threads[i]);
+    }
+
+  DONE:
+    g_hash_table_unref (thread_hash);
+    talloc_free (local);
+
+    if (status) {
+	for (i = 0; i < count; i++)
+	    threads[i] = NULL;
+    }
+
+    return status;
+}
+
+/* Return the term of the thread containing the message with the
+ * given doc ID, (that is, the thread prefix followed by the thread
+ * ID), allocated with 'ctx' as the talloc context.
+ *
+ * This only reads the terms of the message, rather than the message
+ * itself, so it is much cheaper than creating the message to call
+ * notmuch_message_get_thread_id.
+ *
+ * Returns NULL if a Xapian exception occurs.
+ */
+char *
+_notmuch_thread_term_for_doc_id (void *ctx,
+				 notmuch_database_t *notmuch,
+				 unsigned int doc_id)
+{
+    const char *prefix = _find_prefix ("thread");
+
+    try {
+	Xapian::Document doc = notmuch->xapian_db->get_document (doc_id);
+	Xapian::TermIterator i = doc.termlist_begin ();
+
+	i.skip_to (prefix);
+	if (i == doc.termlist_end () ||
+	    strncmp ((*i).c_str (), prefix, strlen (prefix)) != 0)
+	{
+	    INTERNAL_ERROR ("Message with document ID of %u has no thread ID.\n",
+			    doc_id);
+	}
+
+	return talloc_strdup (ctx, (*i).c_str ());
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred reading a thread ID: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+}
+
+/* Add every message in the thread containing the message with the
+ * given doc ID to 'doc_ids', without creating the thread.
+ *
+ * This only reads the thread term of the seed message and the posting
+ * list of that term, so it is much cheaper than creating the thread,
+ * (which reads every message of the thread along with its tags).
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The messages were added to 'doc_ids'.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ */
+notmuch_status_t
+_notmuch_thread_add_to_set (notmuch_database_t *notmuch,
+			    unsigned int seed_doc_id,
+			    notmuch_doc_id_set_t *doc_ids)
+{
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    char *term;
+
+    term = _notmuch_thread_term_for_doc_id (notmuch, notmuch, seed_doc_id);
+    if (term == NULL)
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+
+    try {
+	Xapian::PostingIterator p, end;
+
+	end = notmuch->xapian_db->postlist_end (term);
+	for (p = notmuch->xapian_db->postlist_begin (term); p != end; p++) {
+	    /* Messages of other databases with the same thread ID
+	     * belong to other threads, (see _thread_batch_key). */
+	    if (_notmuch_database_thread_space (notmuch, *p) !=
+		_notmuch_database_thread_space (notmuch, seed_doc_id))
+		continue;
+
+	    if (! _notmuch_doc_id_set_add (doc_ids, *p)) {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		break;
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred skipping a thread: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (term);
+
+    return status;
 }
 
 notmuch_messages_t *
 notmuch_thread_get_toplevel_messages (notmuch_thread_t *thread)
 {
+    if (thread->members)
+	_thread_load_members (thread);
+
     return _notmuch_messages_create (thread->message_list);
 }
 
@@ -550,21 +958,12 @@ notmuch_tags_t *
 notmuch_thread_get_tags (notmuch_thread_t *thread)
 {
     notmuch_string_list_t *tags;
-    GList *keys, *l;
 
-    tags = _notmuch_string_list_create (thread);
+    tags = _notmuch_tag_table_get_names (thread->notmuch->tag_table, thread,
+					 thread->tag_ids);
     if (unlikely (tags == NULL))
 	return NULL;
 
-    keys = g_hash_table_get_keys (thread->tags);
-
-    for (l = keys; l; l = l->next)
-	_notmuch_string_list_append (tags, (char *) l->data);
-
-    g_list_free (keys);
-
-    _notmuch_string_list_sort (tags);
-
     return _notmuch_tags_create (thread, tags);
 }
 
@@ -206,6 +206,10 @@ void
 notmuch_config_set_database_path (notmuch_config_t *config,
 				  const char *database_path);
 
+const char **
+notmuch_config_get_database_extra_paths (notmuch_config_t *config,
+					 size_t *length);
+
 const char *
 notmuch_config_get_user_name (notmuch_config_t *config);
 
@@ -246,6 +250,10 @@ notmuch_config_set_new_ignore (notmuch_config_t *config,
 			       const char *new_ignore[],
 			       size_t length);
 
+const char **
+notmuch_config_get_new_stored_headers (notmuch_config_t *config,
+				       size_t *length);
+
 notmuch_bool_t
 notmuch_config_get_maildir_synchronize_flags (notmuch_config_t *config);
 
@@ -261,6 +269,21 @@ notmuch_config_set_search_exclude_tags (notmuch_config_t *config,
 				      const char *list[],
 				      size_t length);
 
+unsigned int
+notmuch_config_get_search_query_cache_size (notmuch_config_t *config);
+
+unsigned int
+notmuch_config_get_database_hot_years (notmuch_config_t *config);
+
+notmuch_bool_t
+notmuch_config_get_database_columns (notmuch_config_t *config);
+
+notmuch_bool_t
+notmuch_config_get_database_tag_bitmaps (notmuch_config_t *config);
+
+unsigned int
+notmuch_config_get_search_threads (notmuch_config_t *config);
+
 int
 notmuch_run_hook (const char *db_path, const char *hook);
 
@@ -32,11 +32,38 @@ static const char toplevel_config_comment[] =
 static const char database_config_comment[] =
     " Database configuration\n"
     "\n"
-    " The only value supported here is 'path' which should be the top-level\n"
-    " directory where your mail currently exists and to where mail will be\n"
-    " delivered in the future. Files should be individual email messages.\n"
-    " Notmuch will store its database within a sub-directory of the path\n"
-    " configured here named \".notmuch\".\n";
+    " The following options are supported here:\n"
+    "\n"
+    "\tpath	The top-level directory where your mail currently exists\n"
+    "\t	and to where mail will be delivered in the future. Files\n"
+    "\t	should be individual email messages. Notmuch will store\n"
+    "\t	its database within a sub-directory of the path configured\n"
+    "\t	here named \".notmuch\".\n"
+    "\n"
+    "\textra_paths\n"
+    "\t	A list (separated by ';') of the top-level directories of\n"
+    "\t	other notmuch databases, (such as archives), which are\n"
+    "\t	searched along with the database above by \"notmuch search\",\n"
+    "\t	\"notmuch count\", \"notmuch show\" and \"notmuch reply\".\n"
+    "\n"
+    "\thot_years\n"
+    "\t	The number of years, (counting the current one), of mail to\n"
+    "\t	keep in the database itself. Older mail is moved by\n"
+    "\t	\"notmuch new\" into per-year \"cold\" shards, which are\n"
+    "\t	still searched, and keep the database small and quick to\n"
+    "\t	update. The default of 0 keeps all mail in the database.\n"
+    "\n"
+    "\tcolumns	Valid values are true and false. If true, \"notmuch new\"\n"
+    "\t	keeps a compact index of the thread, date, tags and directory\n"
+    "\t	of every message within the database, which speeds up\n"
+    "\t	counting threads. The default is false.\n"
+    "\n"
+    "\ttag_bitmaps\n"
+    "\t	Valid values are true and false. If true, \"notmuch new\"\n"
+    "\t	keeps the set of messages with each tag within the database,\n"
+    "\t	so that searches made only of tag: and thread: terms with\n"
+    "\t	and, or and not are answered without searching the database.\n"
+    "\t	The default is false.\n";
 
 static const char new_config_comment[] =
     " Configuration for \"notmuch new\"\n"
@@ -50,7 +77,13 @@ static const char new_config_comment[] =
     "\t	that will not be searched for messages by \"notmuch new\".\n"
     "\n"
     "\t	NOTE: *Every* file/directory that goes by one of those names will\n"
-    "\t	be ignored, independent of its depth/location in the mail store.\n";
+    "\t	be ignored, independent of its depth/location in the mail store.\n"
+    "\n"
+    "\tstored_headers\n"
+    "\t	A list (separated by ';') of the headers stored in the database\n"
+    "\t	for each message added by \"notmuch new\", so that they can be\n"
+    "\t	shown without reading the message file. If not set, the Date,\n"
+    "\t	To, Cc, Reply-To, In-Reply-To and References headers are stored.\n";
 
 static const char user_config_comment[] =
     " User configuration\n"
@@ -93,18 +126,34 @@ static const char maildir_config_comment[] =
 static const char search_config_comment[] =
     " Search configuration\n"
     "\n"
-    " The following option is supported here:\n"
+    " The following options are supported here:\n"
     "\n"
     "\texclude_tags\n"
     "\t\tA ;-separated list of tags that will be excluded from\n"
     "\t\tsearch results by default.  Using an excluded tag in a\n"
-    "\t\tquery will override that exclusion.\n";
+    "\t\tquery will override that exclusion.\n"
+    "\n"
+    "\tquery_cache_size\n"
+    "\t\tThe number of recent search and count results to keep\n"
+    "\t\tin a cache within the database, to be reused for as long\n"
+    "\t\tas the database is unchanged.  The default of 0 disables\n"
+    "\t\tthe cache.\n"
+    "\n"
+    "\tthreads\n"
+    "\t\tThe number of threads searching the databases of\n"
+    "\t\tdatabase.extra_paths, and any cold shards, in parallel.\n"
+    "\t\tThe default of 1 searches them all in a single thread.\n";
 
 struct _notmuch_config {
     char *filename;
     GKeyFile *key_file;
 
     char *database_path;
+    const char **database_extra_paths;
+    size_t database_extra_paths_length;
+    unsigned int database_hot_years;
+    notmuch_bool_t database_columns;
+    notmuch_bool_t database_tag_bitmaps;
     char *user_name;
     char *user_primary_email;
     const char **user_other_email;
@@ -113,9 +162,13 @@ struct _notmuch_config {
     size_t new_tags_length;
     const char **new_ignore;
     size_t new_ignore_length;
+    const char **new_stored_headers;
+    size_t new_stored_headers_length;
     notmuch_bool_t maildir_synchronize_flags;
     const char **search_exclude_tags;
     size_t search_exclude_tags_length;
+    unsigned int search_query_cache_size;
+    unsigned int search_threads;
 };
 
 static int
@@ -235,6 +288,7 @@ notmuch_config_open (void *ctx,
 {
     GError *error = NULL;
     int is_new = 0;
+    int cache_size, hot_years, search_threads;
     size_t tmp;
     char *notmuch_config_env = NULL;
     int file_had_database_group;
@@ -270,13 +324,22 @@ notmuch_config_open (void *ctx,
     config->user_primary_email = NULL;
     config->user_other_email = NULL;
     config->user_other_email_length = 0;
+    config->database_extra_paths = NULL;
+    config->database_extra_paths_length = 0;
+    config->database_hot_years = 0;
+    config->database_columns = FALSE;
+    config->database_tag_bitmaps = FALSE;
     config->new_tags = NULL;
     config->new_tags_length = 0;
     config->new_ignore = NULL;
     config->new_ignore_length = 0;
+    config->new_stored_headers = NULL;
+    config->new_stored_headers_length = 0;
     config->maildir_synchronize_flags = TRUE;
     config->search_exclude_tags = NULL;
     config->search_exclude_tags_length = 0;
+    config->search_query_cache_size = 0;
+    config->search_threads = 1;
 
     if (! g_key_file_load_from_file (config->key_file,
 				     config->filename,
@@ -393,6 +456,53 @@ notmuch_config_open (void *ctx,
 	g_error_free (error);
     }
 
+    /* Unlike the options above, the query cache is off unless it is
+     * explicitly configured, so there is no default to write out. */
+    error = NULL;
+    cache_size = g_key_file_get_integer (config->key_file,
+					 "search", "query_cache_size", &error);
+    if (error) {
+	cache_size = 0;
+	g_error_free (error);
+    }
+    config->search_query_cache_size = cache_size > 0 ? cache_size : 0;
+
+    error = NULL;
+    hot_years = g_key_file_get_integer (config->key_file,
+					"database", "hot_years", &error);
+    if (error) {
+	hot_years = 0;
+	g_error_free (error);
+    }
+    config->database_hot_years = hot_years > 0 ? hot_years : 0;
+
+    error = NULL;
+    config->database_columns =
+	g_key_file_get_boolean (config->key_file,
+				"database", "columns", &error);
+    if (error) {
+	config->database_columns = FALSE;
+	g_error_free (error);
+    }
+
+    error = NULL;
+    config->database_tag_bitmaps =
+	g_key_file_get_boolean (config->key_file,
+				"database", "tag_bitmaps", &error);
+    if (error) {
+	config->database_tag_bitmaps = FALSE;
+	g_error_free (error);
+    }
+
+    error = NULL;
+    search_threads = g_key_file_get_integer (config->key_file,
+					     "search", "threads", &error);
+    if (error) {
+	search_threads = 1;
+	g_error_free (error);
+    }
+    config->search_threads = search_threads > 1 ? search_threads : 1;
+
     /* Whenever we know of configuration sections that don't appear in
      * the configuration file, we add some comments to help the user
      * understand what can be done. */
@@ -607,6 +717,15 @@ notmuch_config_set_user_primary_email (notmuch_config_t *config,
     config->user_primary_email = NULL;
 }
 
+const char **
+notmuch_config_get_database_extra_paths (notmuch_config_t *config,
+					 size_t *length)
+{
+    return _config_get_list (config, "database", "extra_paths",
+			     &(config->database_extra_paths),
+			     &(config->database_extra_paths_length), length);
+}
+
 const char **
 notmuch_config_get_user_other_email (notmuch_config_t *config,   size_t *length)
 {
@@ -631,6 +750,15 @@ notmuch_config_get_new_ignore (notmuch_config_t *config, size_t *length)
 			     &(config->new_ignore_length), length);
 }
 
+const char **
+notmuch_config_get_new_stored_headers (notmuch_config_t *config,
+				       size_t *length)
+{
+    return _config_get_list (config, "new", "stored_headers",
+			     &(config->new_stored_headers),
+			     &(config->new_stored_headers_length), length);
+}
+
 void
 notmuch_config_set_user_other_email (notmuch_config_t *config,
 				     const char *list[],
@@ -877,6 +1005,36 @@ notmuch_config_command (void *ctx, int argc, char *argv[])
     return 1;
 }
 
+unsigned int
+notmuch_config_get_search_query_cache_size (notmuch_config_t *config)
+{
+    return config->search_query_cache_size;
+}
+
+unsigned int
+notmuch_config_get_database_hot_years (notmuch_config_t *config)
+{
+    return config->database_hot_years;
+}
+
+notmuch_bool_t
+notmuch_config_get_database_columns (notmuch_config_t *config)
+{
+    return config->database_columns;
+}
+
+notmuch_bool_t
+notmuch_config_get_database_tag_bitmaps (notmuch_config_t *config)
+{
+    return config->database_tag_bitmaps;
+}
+
+unsigned int
+notmuch_config_get_search_threads (notmuch_config_t *config)
+{
+    return config->search_threads;
+}
+
 notmuch_bool_t
 notmuch_config_get_maildir_synchronize_flags (notmuch_config_t *config)
 {
@@ -32,17 +32,196 @@ enum {
     EXCLUDE_FALSE,
 };
 
+static int
+print_count (notmuch_database_t *notmuch, const char *query_str,
+	     const char **exclude_tags, size_t exclude_tags_length, int output,
+	     notmuch_bool_t print_lastmod)
+{
+    notmuch_query_t *query;
+    unsigned int count = 0;
+    size_t i;
+
+    query = notmuch_query_create (notmuch, query_str);
+    if (query == NULL) {
+	fprintf (stderr, "Out of memory\n");
+	return 1;
+    }
+
+    for (i = 0; i < exclude_tags_length; i++)
+	notmuch_query_add_tag_exclude (query, exclude_tags[i]);
+
+    switch (output) {
+    case OUTPUT_MESSAGES:
+	count = notmuch_query_count_messages (query);
+	break;
+    case OUTPUT_THREADS:
+	count = notmuch_query_count_threads (query);
+	break;
+    }
+
+    if (print_lastmod)
+	printf ("%u\t%lu\n", count, notmuch_database_get_revision (notmuch));
+    else
+	printf ("%u\n", count);
+
+    notmuch_query_destroy (query);
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    notmuch_facet_t facet;
+} facet_names[] = {
+    { "folder",	NOTMUCH_FACET_FOLDER },
+    { "domain",	NOTMUCH_FACET_DOMAIN },
+    { "year",	NOTMUCH_FACET_YEAR },
+    { "month",	NOTMUCH_FACET_MONTH },
+};
+
+/* Parse the comma-separated list of facet names in 'names' into
+ * 'facets', (which must have room for one entry per name), returning
+ * the number of facets, or -1 after printing an error if a name is
+ * unknown. */
+static int
+parse_facets (void *ctx, const char *names, notmuch_facet_t *facets)
+{
+    char *copy, *name, *saveptr = NULL;
+    int num_facets = 0;
+    size_t i;
+
+    copy = talloc_strdup (ctx, names);
+    if (copy == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return -1;
+    }
+
+    for (name = strtok_r (copy, ",", &saveptr);
+	 name;
+	 name = strtok_r (NULL, ",", &saveptr))
+    {
+	for (i = 0; i < ARRAY_SIZE (facet_names); i++) {
+	    if (strcmp (name, facet_names[i].name) == 0)
+		break;
+	}
+	if (i == ARRAY_SIZE (facet_names)) {
+	    fprintf (stderr, "Error: unknown facet: %s\n", name);
+	    talloc_free (copy);
+	    return -1;
+	}
+	facets[num_facets++] = facet_names[i].facet;
+    }
+
+    talloc_free (copy);
+
+    return num_facets;
+}
+
+static const char *
+facet_name (notmuch_facet_t facet)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE (facet_names); i++) {
+	if (facet_names[i].facet == facet)
+	    return facet_names[i].name;
+    }
+
+    return NULL;
+}
+
+/* Print the number of matching messages with each value of each of
+ * the 'num_facets' facets, one value per line. */
+static int
+print_facets (notmuch_database_t *notmuch, const char *query_str,
+	      const char **exclude_tags, size_t exclude_tags_length,
+	      const notmuch_facet_t *facets, int num_facets)
+{
+    notmuch_query_t *query;
+    notmuch_facets_t *counts;
+    notmuch_tags_t *values;
+    size_t i;
+    int j;
+
+    query = notmuch_query_create (notmuch, query_str);
+    if (query == NULL) {
+	fprintf (stderr, "Out of memory\n");
+	return 1;
+    }
+
+    for (i = 0; i < exclude_tags_length; i++)
+	notmuch_query_add_tag_exclude (query, exclude_tags[i]);
+
+    counts = notmuch_query_count_facets (query, facets, num_facets);
+    if (counts == NULL) {
+	notmuch_query_destroy (query);
+	return 1;
+    }
+
+    for (j = 0; j < num_facets; j++) {
+	for (values = notmuch_facets_get_values (counts, facets[j]);
+	     values && notmuch_tags_valid (values);
+	     notmuch_tags_move_to_next (values))
+	{
+	    printf ("%s\t%s\t%u\n", facet_name (facets[j]),
+		    notmuch_tags_get (values),
+		    notmuch_tags_get_count (values));
+	}
+    }
+
+    notmuch_query_destroy (query);
+
+    return 0;
+}
+
+/* Print one count for each line of 'input', treating each line as a
+ * separate query. */
+static int
+count_file (notmuch_database_t *notmuch, FILE *input,
+	    const char **exclude_tags, size_t exclude_tags_length, int output,
+	    notmuch_bool_t print_lastmod)
+{
+    char *line = NULL;
+    size_t line_size;
+    ssize_t line_len;
+    int ret = 0;
+
+    while (! ret && (line_len = getline (&line, &line_size, input)) != -1) {
+	chomp_newline (line);
+	ret = print_count (notmuch, line, exclude_tags, exclude_tags_length,
+			   output, print_lastmod);
+	/* Let the reader of a pipe see each count as soon as it is
+	 * available. */
+	fflush (stdout);
+    }
+
+    if (line)
+	free (line);
+
+    return ret;
+}
+
 int
 notmuch_count_command (void *ctx, int argc, char *argv[])
 {
     notmuch_config_t *config;
     notmuch_database_t *notmuch;
-    notmuch_query_t *query;
+    const char **extra_paths;
+    size_t num_extra_paths;
     char *query_str;
     int opt_index;
     int output = OUTPUT_MESSAGES;
     int exclude = EXCLUDE_TRUE;
-    unsigned int i;
+    notmuch_bool_t print_lastmod = FALSE;
+    notmuch_bool_t batch = FALSE;
+    char *input_file_name = NULL;
+    char *facet_names_arg = NULL;
+    notmuch_facet_t *facets = NULL;
+    int num_facets = 0;
+    FILE *input = stdin;
+    const char **search_exclude_tags = NULL;
+    size_t search_exclude_tags_length = 0;
+    int ret;
 
     notmuch_opt_desc_t options[] = {
 	{ NOTMUCH_OPT_KEYWORD, &output, "output", 'o',
@@ -53,6 +232,10 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
 	  (notmuch_keyword_t []){ { "true", EXCLUDE_TRUE },
 				  { "false", EXCLUDE_FALSE },
 				  { 0, 0 } } },
+	{ NOTMUCH_OPT_BOOLEAN, &print_lastmod, "lastmod", 'l', 0 },
+	{ NOTMUCH_OPT_BOOLEAN, &batch, "batch", 0, 0 },
+	{ NOTMUCH_OPT_STRING, &input_file_name, "input", 'i', 0 },
+	{ NOTMUCH_OPT_STRING, &facet_names_arg, "facet", 'f', 0 },
 	{ 0, 0, 0, 0, 0 }
     };
 
@@ -62,51 +245,86 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
 	return 1;
     }
 
-    config = notmuch_config_open (ctx, NULL, NULL);
-    if (config == NULL)
-	return 1;
+    if (facet_names_arg) {
+	if (output != OUTPUT_MESSAGES || print_lastmod ||
+	    batch || input_file_name)
+	{
+	    fprintf (stderr, "Error: notmuch count --facet cannot be combined with --output=threads, --lastmod or --batch.\n");
+	    return 1;
+	}
 
-    if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
-	return 1;
+	/* There can be no more facets than characters. */
+	facets = talloc_array (ctx, notmuch_facet_t,
+			       strlen (facet_names_arg) + 1);
+	if (facets == NULL) {
+	    fprintf (stderr, "Out of memory.\n");
+	    return 1;
+	}
 
-    query_str = query_string_from_args (ctx, argc-opt_index, argv+opt_index);
-    if (query_str == NULL) {
-	fprintf (stderr, "Out of memory.\n");
-	return 1;
+	num_facets = parse_facets (ctx, facet_names_arg, facets);
+	if (num_facets < 0)
+	    return 1;
     }
 
-    if (*query_str == '\0') {
-	query_str = talloc_strdup (ctx, "");
+    if (input_file_name) {
+	batch = TRUE;
+	input = fopen (input_file_name, "r");
+	if (input == NULL) {
+	    fprintf (stderr, "Error opening %s for reading: %s\n",
+		     input_file_name, strerror (errno));
+	    return 1;
+	}
     }
 
-    query = notmuch_query_create (notmuch, query_str);
-    if (query == NULL) {
-	fprintf (stderr, "Out of memory\n");
+    if (batch && opt_index != argc) {
+	fprintf (stderr, "Error: notmuch count --batch does not accept search terms.\n");
+	if (input != stdin)
+	    fclose (input);
 	return 1;
     }
 
-    if (exclude == EXCLUDE_TRUE) {
-	const char **search_exclude_tags;
-	size_t search_exclude_tags_length;
+    config = notmuch_config_open (ctx, NULL, NULL);
+    if (config == NULL)
+	return 1;
 
+    extra_paths = notmuch_config_get_database_extra_paths (config,
+							  &num_extra_paths);
+    if (notmuch_database_open_multi (notmuch_config_get_database_path (config),
+				     extra_paths, num_extra_paths, &notmuch))
+	return 1;
+
+    notmuch_database_set_query_cache_size (notmuch,
+	notmuch_config_get_search_query_cache_size (config));
+    notmuch_database_set_search_threads (notmuch,
+	notmuch_config_get_search_threads (config));
+
+    if (exclude == EXCLUDE_TRUE) {
 	search_exclude_tags = notmuch_config_get_search_exclude_tags
 	    (config, &search_exclude_tags_length);
-	for (i = 0; i < search_exclude_tags_length; i++)
-	    notmuch_query_add_tag_exclude (query, search_exclude_tags[i]);
     }
 
-    switch (output) {
-    case OUTPUT_MESSAGES:
-	printf ("%u\n", notmuch_query_count_messages (query));
-	break;
-    case OUTPUT_THREADS:
-	printf ("%u\n", notmuch_query_count_threads (query));
-	break;
+    if (batch) {
+	ret = count_file (notmuch, input, search_exclude_tags,
+			  search_exclude_tags_length, output, print_lastmod);
+	if (input != stdin)
+	    fclose (input);
+    } else {
+	query_str = query_string_from_args (ctx, argc-opt_index, argv+opt_index);
+	if (query_str == NULL) {
+	    fprintf (stderr, "Out of memory.\n");
+	    return 1;
+	}
+
+	if (num_facets)
+	    ret = print_facets (notmuch, query_str, search_exclude_tags,
+				search_exclude_tags_length, facets, num_facets);
+	else
+	    ret = print_count (notmuch, query_str, search_exclude_tags,
+			       search_exclude_tags_length, output,
+			       print_lastmod);
     }
 
-    notmuch_query_destroy (query);
     notmuch_database_destroy (notmuch);
 
-    return 0;
+    return ret;
 }
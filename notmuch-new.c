@@ -718,6 +718,19 @@ count_files (const char *path, int *count, add_files_state_t *state)
     }
 }
 
+/* Return the time at which the (UTC) year 'year' begins. */
+static time_t
+_start_of_year (int year)
+{
+    time_t days = 0;
+    int y;
+
+    for (y = 1970; y < year; y++)
+	days += (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)) ? 366 : 365;
+
+    return days * 24 * 60 * 60;
+}
+
 static void
 upgrade_print_progress (void *closure,
 			double progress)
@@ -838,6 +851,9 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
     int i;
     notmuch_bool_t timer_is_active = FALSE;
     notmuch_bool_t run_hooks = TRUE;
+    unsigned int hot_years;
+    const char **stored_headers;
+    size_t stored_headers_length;
 
     add_files_state.verbose = 0;
     add_files_state.output_is_a_tty = isatty (fileno (stdout));
@@ -862,6 +878,9 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
     add_files_state.new_ignore = notmuch_config_get_new_ignore (config, &add_files_state.new_ignore_length);
     add_files_state.synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
     db_path = notmuch_config_get_database_path (config);
+    hot_years = notmuch_config_get_database_hot_years (config);
+    stored_headers = notmuch_config_get_new_stored_headers (config,
+							    &stored_headers_length);
 
     if (run_hooks) {
 	ret = notmuch_run_hook (db_path, "pre-new");
@@ -882,12 +901,21 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
 	printf ("Found %d total files (that's not much mail).\n", count);
 	if (notmuch_database_create (db_path, &notmuch))
 	    return 1;
+	if (stored_headers)
+	    notmuch_database_set_stored_headers (notmuch, stored_headers,
+						 stored_headers_length);
 	add_files_state.total_files = count;
     } else {
 	if (notmuch_database_open (db_path, NOTMUCH_DATABASE_MODE_READ_WRITE,
 				   &notmuch))
 	    return 1;
 
+	/* Before any upgrade, which stores the headers of existing
+	 * messages. */
+	if (stored_headers)
+	    notmuch_database_set_stored_headers (notmuch, stored_headers,
+						 stored_headers_length);
+
 	if (notmuch_database_needs_upgrade (notmuch)) {
 	    printf ("Welcome to a new version of notmuch! Your database will now be upgraded.\n");
 	    gettimeofday (&add_files_state.tv_start, NULL);
@@ -903,6 +931,11 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
     if (notmuch == NULL)
 	return 1;
 
+    notmuch_database_set_columns (notmuch,
+				  notmuch_config_get_database_columns (config));
+    notmuch_database_set_tag_bitmaps (
+	notmuch, notmuch_config_get_database_tag_bitmaps (config));
+
     /* Setup our handler for SIGINT. We do this after having
      * potentially done a database upgrade we this interrupt handler
      * won't support. */
@@ -970,6 +1003,20 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
 	}
     }
 
+    /* Move the mail older than the configured number of years out of
+     * the database, (including any frozen mail thawed since the last
+     * run). */
+    if (hot_years && ! interrupted) {
+	time_t now = time (NULL);
+	struct tm tm;
+
+	gmtime_r (&now, &tm);
+	ret = notmuch_database_freeze (notmuch,
+				       _start_of_year (tm.tm_year + 1900 -
+						       hot_years + 1),
+				       NULL, NULL);
+    }
+
   DONE:
     talloc_free (add_files_state.removed_files);
     talloc_free (add_files_state.removed_directories);
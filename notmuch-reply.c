@@ -702,6 +702,8 @@ notmuch_reply_command (void *ctx, int argc, char *argv[])
 {
     notmuch_config_t *config;
     notmuch_database_t *notmuch;
+    const char **extra_paths;
+    size_t num_extra_paths;
     notmuch_query_t *query;
     char *query_string;
     int opt_index, ret = 0;
@@ -771,8 +773,10 @@ notmuch_reply_command (void *ctx, int argc, char *argv[])
 	return 1;
     }
 
-    if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
+    extra_paths = notmuch_config_get_database_extra_paths (config,
+							  &num_extra_paths);
+    if (notmuch_database_open_multi (notmuch_config_get_database_path (config),
+				     extra_paths, num_extra_paths, &notmuch))
 	return 1;
 
     query = notmuch_query_create (notmuch, query_string);
@@ -41,6 +41,9 @@ typedef struct search_format {
 			    const int total,
 			    const char *authors,
 			    const char *subject);
+    void (*tag_count) (const void *ctx,
+		       const char *tag,
+		       unsigned int count);
     const char *tag_start;
     const char *tag;
     const char *tag_sep;
@@ -64,11 +67,18 @@ format_thread_text (const void *ctx,
 		    const int total,
 		    const char *authors,
 		    const char *subject);
+
+static void
+format_tag_count_text (const void *ctx,
+		       const char *tag,
+		       unsigned int count);
+
 static const search_format_t format_text = {
     "",
 	"",
 	    format_item_id_text,
 	    format_thread_text,
+	    format_tag_count_text,
 	    " (",
 		"%s", " ",
 	    ")", "\n",
@@ -91,6 +101,11 @@ format_thread_json (const void *ctx,
 		    const char *authors,
 		    const char *subject);
 
+static void
+format_tag_count_json (const void *ctx,
+		       const char *tag,
+		       unsigned int count);
+
 /* Any changes to the JSON format should be reflected in the file
  * devel/schemata. */
 static const search_format_t format_json = {
@@ -98,6 +113,7 @@ static const search_format_t format_json = {
 	"{",
 	    format_item_id_json,
 	    format_thread_json,
+	    format_tag_count_json,
 	    "\"tags\": [",
 		"\"%s\"", ", ",
 	    "]", ",\n",
@@ -195,6 +211,27 @@ format_thread_json (const void *ctx,
     talloc_free (ctx_quote);
 }
 
+static void
+format_tag_count_text (unused (const void *ctx),
+		       const char *tag,
+		       unsigned int count)
+{
+    printf ("%s\t%u", tag, count);
+}
+
+static void
+format_tag_count_json (const void *ctx,
+		       const char *tag,
+		       unsigned int count)
+{
+    void *ctx_quote = talloc_new (ctx);
+
+    printf ("{\"tag\": %s, \"count\": %u}",
+	    json_quote_str (ctx_quote, tag), count);
+
+    talloc_free (ctx_quote);
+}
+
 static int
 do_search_threads (const search_format_t *format,
 		   notmuch_query_t *query,
@@ -210,31 +247,28 @@ do_search_threads (const search_format_t *format,
     int first_thread = 1;
     int i;
 
+    threads = notmuch_query_search_threads (query);
+    if (threads == NULL)
+	return 1;
+
     if (offset < 0) {
-	offset += notmuch_query_count_threads (query);
+	offset += notmuch_threads_count (threads);
 	if (offset < 0)
 	    offset = 0;
     }
 
-    threads = notmuch_query_search_threads (query);
-    if (threads == NULL)
-	return 1;
+    notmuch_threads_skip (threads, offset);
 
     fputs (format->results_start, stdout);
 
     for (i = 0;
-	 notmuch_threads_valid (threads) && (limit < 0 || i < offset + limit);
+	 notmuch_threads_valid (threads) && (limit < 0 || i < limit);
 	 notmuch_threads_move_to_next (threads), i++)
     {
 	int first_tag = 1;
 
 	thread = notmuch_threads_get (threads);
 
-	if (i < offset) {
-	    notmuch_thread_destroy (thread);
-	    continue;
-	}
-
 	if (! first_thread)
 	    fputs (format->item_sep, stdout);
 
@@ -298,7 +332,6 @@ do_search_messages (const search_format_t *format,
     notmuch_messages_t *messages;
     notmuch_filenames_t *filenames;
     int first_message = 1;
-    int i;
 
     if (offset < 0) {
 	offset += notmuch_query_count_messages (query);
@@ -306,19 +339,18 @@ do_search_messages (const search_format_t *format,
 	    offset = 0;
     }
 
+    notmuch_query_set_range (query, offset, limit);
+
     messages = notmuch_query_search_messages (query);
     if (messages == NULL)
 	return 1;
 
     fputs (format->results_start, stdout);
 
-    for (i = 0;
-	 notmuch_messages_valid (messages) && (limit < 0 || i < offset + limit);
-	 notmuch_messages_move_to_next (messages), i++)
+    for (;
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
     {
-	if (i < offset)
-	    continue;
-
 	message = notmuch_messages_get (messages);
 
 	if (output == OUTPUT_FILES) {
@@ -364,7 +396,8 @@ do_search_messages (const search_format_t *format,
 static int
 do_search_tags (notmuch_database_t *notmuch,
 		const search_format_t *format,
-		notmuch_query_t *query)
+		notmuch_query_t *query,
+		notmuch_bool_t counts)
 {
     notmuch_messages_t *messages = NULL;
     notmuch_tags_t *tags;
@@ -374,8 +407,10 @@ do_search_tags (notmuch_database_t *notmuch,
     /* should the following only special case if no excluded terms
      * specified? */
 
-    /* Special-case query of "*" for better performance. */
-    if (strcmp (notmuch_query_get_query_string (query), "*") == 0) {
+    if (counts) {
+	tags = notmuch_query_count_tags (query);
+    } else if (strcmp (notmuch_query_get_query_string (query), "*") == 0) {
+	/* Special-case query of "*" for better performance. */
 	tags = notmuch_database_get_all_tags (notmuch);
     } else {
 	messages = notmuch_query_search_messages (query);
@@ -398,7 +433,10 @@ do_search_tags (notmuch_database_t *notmuch,
 	if (! first_tag)
 	    fputs (format->item_sep, stdout);
 
-	format->item_id (tags, "", tag);
+	if (counts)
+	    format->tag_count (tags, tag, notmuch_tags_get_count (tags));
+	else
+	    format->item_id (tags, "", tag);
 
 	first_tag = 0;
     }
@@ -427,6 +465,8 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
 {
     notmuch_config_t *config;
     notmuch_database_t *notmuch;
+    const char **extra_paths;
+    size_t num_extra_paths;
     notmuch_query_t *query;
     char *query_str;
     notmuch_sort_t sort = NOTMUCH_SORT_NEWEST_FIRST;
@@ -436,6 +476,7 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
     int offset = 0;
     int limit = -1; /* unlimited */
     int exclude = EXCLUDE_TRUE;
+    notmuch_bool_t counts = FALSE;
     unsigned int i;
 
     enum { NOTMUCH_FORMAT_JSON, NOTMUCH_FORMAT_TEXT }
@@ -464,6 +505,7 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
                                   { 0, 0 } } },
 	{ NOTMUCH_OPT_INT, &offset, "offset", 'O', 0 },
 	{ NOTMUCH_OPT_INT, &limit, "limit", 'L', 0  },
+	{ NOTMUCH_OPT_BOOLEAN, &counts, "counts", 'c', 0 },
 	{ 0, 0, 0, 0, 0 }
     };
 
@@ -473,6 +515,11 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
 	return 1;
     }
 
+    if (counts && output != OUTPUT_TAGS) {
+	fprintf (stderr, "Error: notmuch search --counts requires --output=tags.\n");
+	return 1;
+    }
+
     switch (format_sel) {
     case NOTMUCH_FORMAT_TEXT:
 	format = &format_text;
@@ -486,10 +533,17 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
     if (config == NULL)
 	return 1;
 
-    if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
+    extra_paths = notmuch_config_get_database_extra_paths (config,
+							  &num_extra_paths);
+    if (notmuch_database_open_multi (notmuch_config_get_database_path (config),
+				     extra_paths, num_extra_paths, &notmuch))
 	return 1;
 
+    notmuch_database_set_query_cache_size (notmuch,
+	notmuch_config_get_search_query_cache_size (config));
+    notmuch_database_set_search_threads (notmuch,
+	notmuch_config_get_search_threads (config));
+
     query_str = query_string_from_args (notmuch, argc-opt_index, argv+opt_index);
     if (query_str == NULL) {
 	fprintf (stderr, "Out of memory.\n");
@@ -539,7 +593,7 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
 	ret = do_search_messages (format, query, output, offset, limit);
 	break;
     case OUTPUT_TAGS:
-	ret = do_search_tags (notmuch, format, query);
+	ret = do_search_tags (notmuch, format, query, counts);
 	break;
     }
 
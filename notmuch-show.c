@@ -980,6 +980,8 @@ notmuch_show_command (void *ctx, unused (int argc), unused (char *argv[]))
 {
     notmuch_config_t *config;
     notmuch_database_t *notmuch;
+    const char **extra_paths;
+    size_t num_extra_paths;
     notmuch_query_t *query;
     char *query_string;
     int opt_index, ret;
@@ -1081,8 +1083,10 @@ notmuch_show_command (void *ctx, unused (int argc), unused (char *argv[]))
 	return 1;
     }
 
-    if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
+    extra_paths = notmuch_config_get_database_extra_paths (config,
+							  &num_extra_paths);
+    if (notmuch_database_open_multi (notmuch_config_get_database_path (config),
+				     extra_paths, num_extra_paths, &notmuch))
 	return 1;
 
     query = notmuch_query_create (notmuch, query_string);
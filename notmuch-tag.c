@@ -20,6 +20,8 @@
 
 #include "notmuch-client.h"
 
+#include <ctype.h>
+
 static volatile sig_atomic_t interrupted;
 
 static void
@@ -35,148 +37,234 @@ handle_sigint (unused (int sig))
     interrupted = 1;
 }
 
-static char *
-_escape_tag (char *buf, const char *tag)
-{
-    const char *in = tag;
-    char *out = buf;
-    /* Boolean terms surrounded by double quotes can contain any
-     * character.  Double quotes are quoted by doubling them. */
-    *out++ = '"';
-    while (*in) {
-	if (*in == '"')
-	    *out++ = '"';
-	*out++ = *in++;
-    }
-    *out++ = '"';
-    *out = 0;
-    return buf;
-}
+/* The number of messages whose tag changes are committed to the
+ * database together, unless set with --transaction-size. */
+#define NOTMUCH_TAG_TRANSACTION_SIZE 1000
 
+/* The state of the tagging done by one "notmuch tag" command. The
+ * changes are made within atomic sections of at most
+ * transaction_size changed messages each, so that the database
+ * commits the changes of many messages, (and of many lines of a
+ * batch), at once rather than those of each message separately. */
 typedef struct {
-    const char *tag;
-    notmuch_bool_t remove;
-} tag_operation_t;
-
-static char *
-_optimize_tag_query (void *ctx, const char *orig_query_string,
-		     const tag_operation_t *tag_ops)
+    notmuch_database_t *notmuch;
+    notmuch_bool_t synchronize_flags;
+    unsigned int transaction_size;
+    /* The number of messages changed in the current atomic section. */
+    unsigned int pending;
+    /* Whether committing an atomic section has failed. */
+    notmuch_bool_t failed;
+} tag_state_t;
+
+/* Note that a message has been visited, (and changed if 'changed' is
+ * TRUE), and commit the current atomic section once it is full.
+ * Returns FALSE to stop tagging once interrupted, (or if the section
+ * could not be committed). */
+static notmuch_bool_t
+tag_progress (void *closure, notmuch_bool_t changed)
 {
-    /* This is subtler than it looks.  Xapian ignores the '-' operator
-     * at the beginning both queries and parenthesized groups and,
-     * furthermore, the presence of a '-' operator at the beginning of
-     * a group can inhibit parsing of the previous operator.  Hence,
-     * the user-provided query MUST appear first, but it is safe to
-     * parenthesize and the exclusion part of the query must not use
-     * the '-' operator (though the NOT operator is fine). */
-
-    char *escaped, *query_string;
-    const char *join = "";
-    int i;
-    unsigned int max_tag_len = 0;
-
-    /* Don't optimize if there are no tag changes. */
-    if (tag_ops[0].tag == NULL)
-	return talloc_strdup (ctx, orig_query_string);
-
-    /* Allocate a buffer for escaping tags.  This is large enough to
-     * hold a fully escaped tag with every character doubled plus
-     * enclosing quotes and a NUL. */
-    for (i = 0; tag_ops[i].tag; i++)
-	if (strlen (tag_ops[i].tag) > max_tag_len)
-	    max_tag_len = strlen (tag_ops[i].tag);
-    escaped = talloc_array(ctx, char, max_tag_len * 2 + 3);
-    if (!escaped)
-	return NULL;
-
-    /* Build the new query string */
-    if (strcmp (orig_query_string, "*") == 0)
-	query_string = talloc_strdup (ctx, "(");
-    else
-	query_string = talloc_asprintf (ctx, "( %s ) and (", orig_query_string);
-
-    for (i = 0; tag_ops[i].tag && query_string; i++) {
-	query_string = talloc_asprintf_append_buffer (
-	    query_string, "%s%stag:%s", join,
-	    tag_ops[i].remove ? "" : "not ",
-	    _escape_tag (escaped, tag_ops[i].tag));
-	join = " or ";
+    tag_state_t *state = closure;
+
+    if (changed && ++state->pending >= state->transaction_size) {
+	state->pending = 0;
+	if (notmuch_database_end_atomic (state->notmuch) ||
+	    notmuch_database_begin_atomic (state->notmuch))
+	{
+	    fprintf (stderr, "Error: Failed to commit tag changes.\n");
+	    state->failed = TRUE;
+	    return FALSE;
+	}
     }
 
-    if (query_string)
-	query_string = talloc_strdup_append_buffer (query_string, ")");
-
-    talloc_free (escaped);
-    return query_string;
+    return ! interrupted;
 }
 
 /* Tag messages matching 'query_string' according to 'tag_ops', which
  * must be an array of tagging operations terminated with an empty
  * element. */
 static int
-tag_query (void *ctx, notmuch_database_t *notmuch, const char *query_string,
-	   tag_operation_t *tag_ops, notmuch_bool_t synchronize_flags)
+tag_query (tag_state_t *state, const char *query_string,
+	   notmuch_tag_operation_t *tag_ops)
 {
     notmuch_query_t *query;
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
-    int i;
+    notmuch_status_t status;
+    unsigned int num_ops;
 
-    /* Optimize the query so it excludes messages that already have
-     * the specified set of tags. */
-    query_string = _optimize_tag_query (ctx, query_string, tag_ops);
-    if (query_string == NULL) {
+    query = notmuch_query_create (state->notmuch, query_string);
+    if (query == NULL) {
 	fprintf (stderr, "Out of memory.\n");
 	return 1;
     }
 
-    query = notmuch_query_create (notmuch, query_string);
-    if (query == NULL) {
-	fprintf (stderr, "Out of memory.\n");
-	return 1;
+    for (num_ops = 0; tag_ops[num_ops].tag; num_ops++)
+	;
+
+    /* The library skips messages that already have the specified set
+     * of tags. Since the changes are made within our own atomic
+     * section, they are committed by tag_progress. */
+    status = notmuch_query_apply_tags (query, tag_ops, num_ops,
+				       state->synchronize_flags, 0,
+				       tag_progress, state);
+    if (status && status != NOTMUCH_STATUS_XAPIAN_EXCEPTION)
+	fprintf (stderr, "Error applying tags: %s\n",
+		 notmuch_status_to_string (status));
+
+    notmuch_query_destroy (query);
+
+    return status != NOTMUCH_STATUS_SUCCESS || state->failed || interrupted;
+}
+
+/* Decode the %-escapes, (of the form %XX, for a byte with the
+ * hexadecimal value XX), in 'str' in place. Returns FALSE if 'str'
+ * has a malformed escape. */
+static notmuch_bool_t
+decode_tag (char *str)
+{
+    char *in, *out, hex[3];
+
+    for (in = out = str; *in; in++, out++) {
+	if (*in != '%') {
+	    *out = *in;
+	    continue;
+	}
+	if (! isxdigit ((unsigned char) in[1]) ||
+	    ! isxdigit ((unsigned char) in[2]))
+	    return FALSE;
+	hex[0] = in[1];
+	hex[1] = in[2];
+	hex[2] = '\0';
+	*out = strtol (hex, NULL, 16);
+	in += 2;
     }
+    *out = '\0';
 
-    /* tagging is not interested in any special sort order */
-    notmuch_query_set_sort (query, NOTMUCH_SORT_UNSORTED);
+    return TRUE;
+}
 
-    for (messages = notmuch_query_search_messages (query);
-	 notmuch_messages_valid (messages) && !interrupted;
-	 notmuch_messages_move_to_next (messages))
-    {
-	message = notmuch_messages_get (messages);
+/* Parse a line of a batch, of the form
+ *
+ *	+<tag>|-<tag> [...] [--] <search-terms>
+ *
+ * into the array of tag operations 'tag_ops', (which must have room
+ * for one more operation than there are words in the line), and the
+ * query string *query_string, (which points into 'line', as do the
+ * tags). The tags of the line are separated by spaces, so any space
+ * (or '%') within a tag must be given as a %-escape, such as %20.
+ *
+ * Returns a description of the error if the line is malformed, or
+ * NULL otherwise. */
+static const char *
+parse_tag_line (char *line, notmuch_tag_operation_t *tag_ops,
+		char **query_string)
+{
+    char *pos = line, *word;
+    int count = 0;
+
+    while (TRUE) {
+	while (isspace ((unsigned char) *pos))
+	    pos++;
+
+	if (*pos != '+' && *pos != '-')
+	    break;
 
-	notmuch_message_freeze (message);
+	word = pos;
+	while (*pos && ! isspace ((unsigned char) *pos))
+	    pos++;
+	if (*pos)
+	    *pos++ = '\0';
 
-	for (i = 0; tag_ops[i].tag; i++) {
-	    if (tag_ops[i].remove)
-		notmuch_message_remove_tag (message, tag_ops[i].tag);
-	    else
-		notmuch_message_add_tag (message, tag_ops[i].tag);
+	if (strcmp (word, "--") == 0) {
+	    while (isspace ((unsigned char) *pos))
+		pos++;
+	    break;
 	}
 
-	notmuch_message_thaw (message);
+	if (! decode_tag (word + 1))
+	    return "malformed %-escape in tag";
+
+	tag_ops[count].tag = word + 1;
+	tag_ops[count].remove = (word[0] == '-');
+	count++;
+    }
+
+    tag_ops[count].tag = NULL;
+    *query_string = pos;
 
-	if (synchronize_flags)
-	    notmuch_message_tags_to_maildir_flags (message);
+    if (count == 0)
+	return "no tags to add or remove";
+    if (**query_string == '\0')
+	return "no search terms";
 
-	notmuch_message_destroy (message);
+    return NULL;
+}
+
+/* Apply each line of 'input' in turn, reporting the number of any
+ * line which cannot be parsed or fully applied. Blank lines and lines
+ * beginning with '#' are ignored. */
+static int
+tag_batch (void *ctx, tag_state_t *state, FILE *input)
+{
+    notmuch_tag_operation_t *tag_ops;
+    char *line = NULL, *query_string;
+    const char *error;
+    size_t line_size = 0;
+    ssize_t line_len;
+    unsigned int line_number = 0;
+    int ret = 0;
+
+    while (! interrupted && ! state->failed &&
+	   (line_len = getline (&line, &line_size, input)) != -1)
+    {
+	line_number++;
+	chomp_newline (line);
+
+	query_string = line;
+	while (isspace ((unsigned char) *query_string))
+	    query_string++;
+	if (*query_string == '\0' || *query_string == '#')
+	    continue;
+
+	/* A line has at most one tag operation per two characters. */
+	tag_ops = talloc_array (ctx, notmuch_tag_operation_t, line_len / 2 + 2);
+	if (tag_ops == NULL) {
+	    fprintf (stderr, "Out of memory.\n");
+	    ret = 1;
+	    break;
+	}
+
+	error = parse_tag_line (line, tag_ops, &query_string);
+	if (error) {
+	    fprintf (stderr, "Error: line %u: %s\n", line_number, error);
+	    ret = 1;
+	} else if (tag_query (state, query_string, tag_ops)) {
+	    if (! interrupted)
+		fprintf (stderr, "Error: line %u: not fully applied\n",
+			 line_number);
+	    ret = 1;
+	}
+
+	talloc_free (tag_ops);
     }
 
-    notmuch_query_destroy (query);
+    free (line);
 
-    return interrupted;
+    return ret || interrupted;
 }
 
 int
 notmuch_tag_command (void *ctx, int argc, char *argv[])
 {
-    tag_operation_t *tag_ops;
+    notmuch_tag_operation_t *tag_ops = NULL;
     int tag_ops_count = 0;
-    char *query_string;
+    char *query_string = NULL;
     notmuch_config_t *config;
-    notmuch_database_t *notmuch;
+    tag_state_t state;
     struct sigaction action;
-    notmuch_bool_t synchronize_flags;
+    notmuch_bool_t batch = FALSE;
+    const char *input_file_name = NULL;
+    int transaction_size = NOTMUCH_TAG_TRANSACTION_SIZE;
+    FILE *input = stdin;
+    int opt_index;
     int i;
     int ret;
 
@@ -187,42 +275,78 @@ notmuch_tag_command (void *ctx, int argc, char *argv[])
     action.sa_flags = SA_RESTART;
     sigaction (SIGINT, &action, NULL);
 
-    argc--; argv++; /* skip subcommand argument */
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_BOOLEAN, &batch, "batch", 0, 0 },
+	{ NOTMUCH_OPT_STRING, &input_file_name, "input", 'i', 0 },
+	{ NOTMUCH_OPT_INT, &transaction_size, "transaction-size", 't', 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
 
-    /* Array of tagging operations (add or remove), terminated with an
-     * empty element. */
-    tag_ops = talloc_array (ctx, tag_operation_t, argc + 1);
-    if (tag_ops == NULL) {
-	fprintf (stderr, "Out of memory.\n");
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return 1;
+
+    argc -= opt_index;
+    argv += opt_index;
+
+    if (transaction_size < 1) {
+	fprintf (stderr, "Error: --transaction-size must be at least 1.\n");
 	return 1;
     }
 
-    for (i = 0; i < argc; i++) {
-	if (strcmp (argv[i], "--") == 0) {
-	    i++;
-	    break;
+    if (input_file_name)
+	batch = TRUE;
+
+    if (batch) {
+	if (argc) {
+	    fprintf (stderr, "Error: notmuch tag --batch does not accept tags or search terms.\n");
+	    return 1;
 	}
-	if (argv[i][0] == '+' || argv[i][0] == '-') {
-	    tag_ops[tag_ops_count].tag = argv[i] + 1;
-	    tag_ops[tag_ops_count].remove = (argv[i][0] == '-');
-	    tag_ops_count++;
-	} else {
-	    break;
+    } else {
+	/* Array of tagging operations (add or remove), terminated
+	 * with an empty element. */
+	tag_ops = talloc_array (ctx, notmuch_tag_operation_t, argc + 1);
+	if (tag_ops == NULL) {
+	    fprintf (stderr, "Out of memory.\n");
+	    return 1;
 	}
-    }
 
-    tag_ops[tag_ops_count].tag = NULL;
+	for (i = 0; i < argc; i++) {
+	    if (strcmp (argv[i], "--") == 0) {
+		i++;
+		break;
+	    }
+	    if (argv[i][0] == '+' || argv[i][0] == '-') {
+		tag_ops[tag_ops_count].tag = argv[i] + 1;
+		tag_ops[tag_ops_count].remove = (argv[i][0] == '-');
+		tag_ops_count++;
+	    } else {
+		break;
+	    }
+	}
 
-    if (tag_ops_count == 0) {
-	fprintf (stderr, "Error: 'notmuch tag' requires at least one tag to add or remove.\n");
-	return 1;
-    }
+	tag_ops[tag_ops_count].tag = NULL;
 
-    query_string = query_string_from_args (ctx, argc - i, &argv[i]);
+	if (tag_ops_count == 0) {
+	    fprintf (stderr, "Error: 'notmuch tag' requires at least one tag to add or remove.\n");
+	    return 1;
+	}
 
-    if (*query_string == '\0') {
-	fprintf (stderr, "Error: notmuch tag requires at least one search term.\n");
-	return 1;
+	query_string = query_string_from_args (ctx, argc - i, &argv[i]);
+
+	if (*query_string == '\0') {
+	    fprintf (stderr, "Error: notmuch tag requires at least one search term.\n");
+	    return 1;
+	}
+    }
+
+    if (input_file_name) {
+	input = fopen (input_file_name, "r");
+	if (input == NULL) {
+	    fprintf (stderr, "Error opening %s for reading: %s\n",
+		     input_file_name, strerror (errno));
+	    return 1;
+	}
     }
 
     config = notmuch_config_open (ctx, NULL, NULL);
@@ -230,14 +354,32 @@ notmuch_tag_command (void *ctx, int argc, char *argv[])
 	return 1;
 
     if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_WRITE, &notmuch))
+			       NOTMUCH_DATABASE_MODE_READ_WRITE, &state.notmuch))
 	return 1;
 
-    synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
+    state.synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
+    state.transaction_size = transaction_size;
+    state.pending = 0;
+    state.failed = FALSE;
 
-    ret = tag_query (ctx, notmuch, query_string, tag_ops, synchronize_flags);
+    if (notmuch_database_begin_atomic (state.notmuch)) {
+	notmuch_database_destroy (state.notmuch);
+	return 1;
+    }
+
+    if (batch)
+	ret = tag_batch (ctx, &state, input);
+    else
+	ret = tag_query (&state, query_string, tag_ops);
+
+    if (notmuch_database_end_atomic (state.notmuch)) {
+	fprintf (stderr, "Error: Failed to commit tag changes.\n");
+	ret = 1;
+    }
 
-    notmuch_database_destroy (notmuch);
+    notmuch_database_destroy (state.notmuch);
+    if (input != stdin)
+	fclose (input);
 
     return ret;
 }
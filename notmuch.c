@@ -66,7 +66,7 @@ static command_t commands[] = {
       "[options...] <search-terms> [...]",
       "Construct a reply template for a set of messages." },
     { "tag", notmuch_tag_command,
-      "+<tag>|-<tag> [...] [--] <search-terms> [...]" ,
+      "[options...] +<tag>|-<tag> [...] [--] <search-terms> [...]",
       "Add/remove tags for all messages matching the search terms." },
     { "dump", notmuch_dump_command,
       "[<filename>] [--] [<search-terms>]",
@@ -0,0 +1,105 @@
+/* Time thread counts and date-sorted searches of a database with and
+ * without its columnar side index, (which is moved aside for the
+ * second run, so no other notmuch command may run meanwhile).
+ *
+ * Usage: columns-bench <path> <query> */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <talloc.h>
+
+#include <notmuch.h>
+
+static double
+now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Time counting the threads matching 'query_string', and searching
+ * for the first 'limit' of them newest first, each repeated 'runs'
+ * times. */
+static int
+bench (const char *name, const char *path, const char *query_string,
+       unsigned int limit, unsigned int runs)
+{
+    notmuch_database_t *notmuch;
+    notmuch_query_t *query;
+    notmuch_threads_t *results;
+    unsigned int i, count = 0, found = 0;
+    double start, counting, searching;
+
+    if (notmuch_database_open (path, NOTMUCH_DATABASE_MODE_READ_ONLY,
+			       &notmuch))
+	return 1;
+
+    start = now ();
+    for (i = 0; i < runs; i++) {
+	query = notmuch_query_create (notmuch, query_string);
+	if (query == NULL)
+	    return 1;
+	count = notmuch_query_count_threads (query);
+	notmuch_query_destroy (query);
+    }
+    counting = (now () - start) / runs;
+
+    start = now ();
+    for (i = 0; i < runs; i++) {
+	query = notmuch_query_create (notmuch, query_string);
+	if (query == NULL)
+	    return 1;
+	notmuch_query_set_sort (query, NOTMUCH_SORT_NEWEST_FIRST);
+	found = 0;
+	for (results = notmuch_query_search_threads (query);
+	     results && notmuch_threads_valid (results) && found < limit;
+	     notmuch_threads_move_to_next (results))
+	{
+	    found++;
+	}
+	notmuch_query_destroy (query);
+    }
+    searching = (now () - start) / runs;
+
+    printf ("%-8s %9u %7u %8.4f %8.4f\n",
+	    name, count, found, counting, searching);
+
+    notmuch_database_destroy (notmuch);
+
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    char *filename, *aside;
+    int failures = 0;
+
+    if (argc != 3) {
+	fprintf (stderr, "Usage: %s <path> <query>\n", argv[0]);
+	return 1;
+    }
+
+    filename = talloc_asprintf (NULL, "%s/.notmuch/columns", argv[1]);
+    aside = talloc_asprintf (filename, "%s.bench", filename);
+
+    printf ("%-8s %9s %7s %8s %8s\n",
+	    "index", "threads", "shown", "count", "search");
+    failures += bench ("columns", argv[1], argv[2], 50, 5);
+
+    if (rename (filename, aside) == 0) {
+	failures += bench ("none", argv[1], argv[2], 50, 5);
+	rename (aside, filename);
+    } else {
+	fprintf (stderr, "No columns file at %s\n", filename);
+	failures++;
+    }
+
+    talloc_free (filename);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+/* Exercise (with "check" and "ops") or time (with "bench") the doc ID sets
+ * used by the library for match and exclude sets. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "notmuch-private.h"
+
+static unsigned int
+random_doc_id (unsigned int max)
+{
+    return 1 + (unsigned int) (((double) rand () / ((double) RAND_MAX + 1)) * max);
+}
+
+static double
+now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Create a set of 'count' random doc IDs up to 'max', checking every
+ * operation against a plain array of flags. Returns the number of
+ * failures. */
+static int
+check (void *ctx, const char *name, unsigned int count, unsigned int max)
+{
+    notmuch_doc_id_set_t *doc_ids;
+    unsigned int *array, i, doc_id, expected, members = 0;
+    char *reference;
+    int failures = 0;
+
+    array = talloc_array (ctx, unsigned int, count);
+    reference = talloc_zero_array (ctx, char, max + 1);
+
+    for (i = 0; i < count; i++) {
+	array[i] = random_doc_id (max);
+	if (! reference[array[i]])
+	    members++;
+	reference[array[i]] = 1;
+    }
+
+    doc_ids = _notmuch_doc_id_set_create_from_array (ctx, array, count);
+
+    if (_notmuch_doc_id_set_count (doc_ids) != members)
+	failures++;
+
+    /* Remove every third member. */
+    for (i = 0; i < count; i += 3) {
+	_notmuch_doc_id_set_remove (doc_ids, array[i]);
+	if (reference[array[i]])
+	    members--;
+	reference[array[i]] = 0;
+    }
+
+    if (_notmuch_doc_id_set_count (doc_ids) != members)
+	failures++;
+
+    for (i = 1; i <= max; i++) {
+	if ((_notmuch_doc_id_set_contains (doc_ids, i) != 0) != reference[i])
+	    failures++;
+    }
+
+    /* Iteration visits exactly the members, in increasing order. */
+    doc_id = 0;
+    expected = 0;
+    while (_notmuch_doc_id_set_next (doc_ids, &doc_id)) {
+	do
+	    expected++;
+	while (expected <= max && ! reference[expected]);
+	if (doc_id != expected)
+	    failures++;
+    }
+    do
+	expected++;
+    while (expected <= max && ! reference[expected]);
+    if (expected <= max)
+	failures++;
+
+    printf ("%s: %s\n", name, failures ? "FAIL" : "PASS");
+
+    talloc_free (doc_ids);
+    talloc_free (reference);
+    talloc_free (array);
+
+    return failures;
+}
+
+/* Create a set of random doc IDs up to 'max'. */
+static notmuch_doc_id_set_t *
+random_set (void *ctx, unsigned int count, unsigned int max)
+{
+    notmuch_doc_id_set_t *doc_ids;
+    unsigned int i;
+
+    doc_ids = _notmuch_doc_id_set_create (ctx);
+    for (i = 0; i < count; i++)
+	_notmuch_doc_id_set_add (doc_ids, random_doc_id (max));
+
+    return doc_ids;
+}
+
+/* Check the union, intersection and difference of two random sets of
+ * 'count_a' and 'count_b' doc IDs up to 'max', and that each survives
+ * serialisation. Returns the number of failures. */
+static int
+check_ops (void *ctx, const char *name, unsigned int count_a,
+	   unsigned int count_b, unsigned int max)
+{
+    notmuch_doc_id_set_t *a, *b, *sets[4], *copy;
+    unsigned int i, j, members[4];
+    notmuch_bool_t in_a, in_b, expected[4];
+    char *buffer;
+    size_t size;
+    int failures = 0;
+
+    a = random_set (ctx, count_a, max);
+    b = random_set (ctx, count_b, max);
+
+    sets[0] = _notmuch_doc_id_set_union (ctx, a, b);
+    sets[1] = _notmuch_doc_id_set_intersection (ctx, a, b);
+    sets[2] = _notmuch_doc_id_set_difference (ctx, a, b);
+
+    buffer = _notmuch_doc_id_set_serialise (ctx, a, &size);
+    sets[3] = _notmuch_doc_id_set_deserialise (ctx, buffer, size);
+
+    memset (members, 0, sizeof (members));
+    for (i = 1; i <= max; i++) {
+	in_a = _notmuch_doc_id_set_contains (a, i);
+	in_b = _notmuch_doc_id_set_contains (b, i);
+	expected[0] = in_a || in_b;
+	expected[1] = in_a && in_b;
+	expected[2] = in_a && ! in_b;
+	expected[3] = in_a;
+
+	for (j = 0; j < 4; j++) {
+	    if (expected[j])
+		members[j]++;
+	    if (sets[j] &&
+		(_notmuch_doc_id_set_contains (sets[j], i) != 0) != expected[j])
+		failures++;
+	}
+    }
+
+    for (j = 0; j < 4; j++) {
+	if (sets[j] == NULL || _notmuch_doc_id_set_count (sets[j]) != members[j])
+	    failures++;
+    }
+
+    /* A truncated serialisation is rejected. */
+    copy = size ? _notmuch_doc_id_set_deserialise (ctx, buffer, size - 1) : NULL;
+    if (copy)
+	failures++;
+
+    printf ("%s: %s\n", name, failures ? "FAIL" : "PASS");
+
+    for (j = 0; j < 4; j++)
+	talloc_free (sets[j]);
+    talloc_free (buffer);
+    talloc_free (b);
+    talloc_free (a);
+
+    return failures;
+}
+
+/* Time the creation of, lookups in and removal from a set of 'count'
+ * random doc IDs up to 'max', and report its size. */
+static void
+bench (void *ctx, const char *name, unsigned int count, unsigned int max)
+{
+    notmuch_doc_id_set_t *doc_ids;
+    unsigned int *array, i, doc_id, found = 0;
+    double start, create, contains, iterate, remove;
+
+    array = talloc_array (ctx, unsigned int, count);
+    for (i = 0; i < count; i++)
+	array[i] = random_doc_id (max);
+
+    start = now ();
+    doc_ids = _notmuch_doc_id_set_create_from_array (ctx, array, count);
+    create = now () - start;
+
+    start = now ();
+    for (i = 0; i < count; i++)
+	found += _notmuch_doc_id_set_contains (doc_ids, random_doc_id (max));
+    contains = now () - start;
+
+    start = now ();
+    doc_id = 0;
+    while (_notmuch_doc_id_set_next (doc_ids, &doc_id))
+	found++;
+    iterate = now () - start;
+
+    start = now ();
+    for (i = 0; i < count; i++)
+	_notmuch_doc_id_set_remove (doc_ids, array[i]);
+    remove = now () - start;
+
+    /* The lookups are only done for their timing. */
+    (void) found;
+
+    /* For comparison, a plain bitmap needs one bit for each possible
+     * doc ID. */
+    printf ("%-8s %9u %9u %10lu %10u %8.4f %8.4f %8.4f %8.4f\n",
+	    name, count, max,
+	    (unsigned long) talloc_total_size (doc_ids), max / 8,
+	    create, contains, iterate, remove);
+
+    talloc_free (doc_ids);
+    talloc_free (array);
+}
+
+int
+main (int argc, char **argv)
+{
+    void *ctx = talloc_new (NULL);
+    int failures = 0;
+
+    srand (42);
+
+    if (argc > 1 && strcmp (argv[1], "bench") == 0) {
+	printf ("%-8s %9s %9s %10s %10s %8s %8s %8s %8s\n",
+		"set", "members", "max-id", "bytes", "bitmap", "create",
+		"contains", "iterate", "remove");
+	bench (ctx, "sparse", 30, 5000000);
+	bench (ctx, "sparse", 10000, 5000000);
+	bench (ctx, "dense", 1000000, 5000000);
+	bench (ctx, "dense", 4000000, 5000000);
+    } else if (argc > 1 && strcmp (argv[1], "ops") == 0) {
+	failures += check_ops (ctx, "empty", 0, 100, 1000);
+	failures += check_ops (ctx, "sparse", 100, 100, 5000000);
+	failures += check_ops (ctx, "mixed", 200000, 100, 1000000);
+	failures += check_ops (ctx, "dense", 500000, 300000, 1000000);
+    } else {
+	failures += check (ctx, "empty", 0, 1000);
+	failures += check (ctx, "sparse", 100, 5000000);
+	failures += check (ctx, "medium", 20000, 1000000);
+	failures += check (ctx, "dense", 500000, 1000000);
+	failures += check (ctx, "boundaries", 200000, 65536 * 3);
+    }
+
+    talloc_free (ctx);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+/* Time counts and searches of a combined database, (one with cold
+ * shards or extra paths), with increasing numbers of search threads.
+ *
+ * Usage: parallel-search-bench <path> <query> [<extra path>...] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <notmuch.h>
+
+static double
+now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Time a count and a search of the first 'limit' threads matching
+ * 'query_string', each repeated 'runs' times, with 'threads' search
+ * threads. */
+static int
+bench (notmuch_database_t *notmuch, const char *query_string,
+       unsigned int threads, unsigned int limit, unsigned int runs)
+{
+    notmuch_query_t *query;
+    notmuch_threads_t *results;
+    unsigned int i, count = 0, found = 0;
+    double start, counting, searching;
+
+    notmuch_database_set_search_threads (notmuch, threads);
+
+    start = now ();
+    for (i = 0; i < runs; i++) {
+	query = notmuch_query_create (notmuch, query_string);
+	if (query == NULL)
+	    return 1;
+	count = notmuch_query_count_messages (query);
+	notmuch_query_destroy (query);
+    }
+    counting = (now () - start) / runs;
+
+    start = now ();
+    for (i = 0; i < runs; i++) {
+	query = notmuch_query_create (notmuch, query_string);
+	if (query == NULL)
+	    return 1;
+	notmuch_query_set_sort (query, NOTMUCH_SORT_NEWEST_FIRST);
+	found = 0;
+	for (results = notmuch_query_search_threads (query);
+	     results && notmuch_threads_valid (results) && found < limit;
+	     notmuch_threads_move_to_next (results))
+	{
+	    found++;
+	}
+	notmuch_query_destroy (query);
+    }
+    searching = (now () - start) / runs;
+
+    printf ("%7u %9u %7u %8.4f %8.4f\n",
+	    threads, count, found, counting, searching);
+
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    notmuch_database_t *notmuch;
+    static const unsigned int threads[] = { 1, 2, 4, 8 };
+    unsigned int i;
+    int failures = 0;
+
+    if (argc < 3) {
+	fprintf (stderr, "Usage: %s <path> <query> [<extra path>...]\n",
+		 argv[0]);
+	return 1;
+    }
+
+    if (notmuch_database_open_multi (argv[1], (const char **) argv + 3,
+				     argc - 3, &notmuch))
+	return 1;
+
+    printf ("%7s %9s %7s %8s %8s\n",
+	    "threads", "messages", "shown", "count", "search");
+    for (i = 0; i < sizeof (threads) / sizeof (threads[0]); i++)
+	failures += bench (notmuch, argv[2], threads[i], 50, 5);
+
+    notmuch_database_destroy (notmuch);
+
+    return failures ? 1 : 0;
+}